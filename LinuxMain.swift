@@ -0,0 +1,11 @@
+//
+//  LinuxMain.swift
+//  Selfde
+//
+
+import XCTest
+@testable import SelfdeTests
+
+XCTMain([
+    testCase(SelfdeTests.allTests),
+])
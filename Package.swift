@@ -0,0 +1,70 @@
+// swift-tools-version:4.2
+//
+//  Package.swift
+//  Selfde
+//
+// Builds the Linux version of Selfde. Use the Xcode project on OS X.
+
+import PackageDescription
+
+let package = Package(
+    name: "Selfde",
+    products: [
+        .library(name: "Selfde", targets: ["Selfde"]),
+    ],
+    targets: [
+        .target(
+            name: "SelfdeLinuxImpl",
+            path: "Selfde/Linux",
+            // SwiftPM doesn't let two targets share a directory, so the C files that are shared with
+            // the Mach implementation are compiled here through the wrappers that include them.
+            sources: ["linuxControllerImpl.c", "linuxTracerImpl.c", "linuxLivePatchX86_64.c", "linuxCallFrameInfoX86_64.c", "linuxSamplingProfiler.c", "linuxCoreDump.c", "linuxCoverage.c", "linuxDirtyPages.c", "linuxMemorySearch.c", "linuxMemoryChecksum.c", "linuxRegisterInfoX86_64.cpp"],
+            publicHeadersPath: "include"),
+        .target(
+            name: "Selfde",
+            dependencies: ["SelfdeLinuxImpl"],
+            path: "Selfde",
+            exclude: [
+                "Linux",
+                "callFrameInfoX86_64.c",
+                "callFrameInfoX86_64.h",
+                "coreDump.c",
+                "coreDump.h",
+                "coverage.c",
+                "coverage.h",
+                "dirtyPages.c",
+                "dirtyPages.h",
+                "DNBDefs.h",
+                "DNBRegisterInfoX86_64.cpp",
+                "DNBRegisterInfoX86_64.h",
+                "HasAVX.h",
+                "HasAVX.s",
+                "Info.plist",
+                "livePatchX86_64.c",
+                "livePatchX86_64.h",
+                "Selfde.h",
+                "machController.swift",
+                "machControllerImpl.c",
+                "machControllerImpl.h",
+                "machException.swift",
+                "machRegisterSetsX86_64.swift",
+                "machScratchCode.swift",
+                "machThread.swift",
+                "machThreadX86_64.swift",
+                "machUtils.swift",
+                "memoryChecksum.c",
+                "memoryChecksum.h",
+                "memorySearch.c",
+                "memorySearch.h",
+                "samplingProfiler.c",
+                "samplingProfiler.h",
+            ]),
+        .testTarget(
+            name: "SelfdeTests",
+            dependencies: ["Selfde"],
+            path: "SelfdeTests"),
+    ],
+    swiftLanguageVersions: [.v3],
+    cLanguageStandard: .gnu11,
+    cxxLanguageStandard: .gnucxx11
+)
@@ -19,7 +19,11 @@
 #include <stdint.h>
 #include <signal.h>
 #include <stdio.h>
+#if defined (__APPLE__)
 #include <sys/syslimits.h>
+#else
+#include <limits.h>
+#endif
 #include <unistd.h>
 
 #ifdef __cplusplus
@@ -18,12 +18,17 @@
 
 #include <sys/cdefs.h>
 #include <sys/types.h>
+#if defined (__APPLE__)
 #include <sys/sysctl.h>
+#endif
 
 #include "DNBRegisterInfoX86_64.h"
 #include "HasAVX.h"
+#if defined (__APPLE__)
 #include <mach/mach.h>
+#endif
 #include <stdlib.h>
+#include <string.h>
 #include <stddef.h>
 #include <assert.h>
 
@@ -41,6 +46,7 @@ CPUHasAVX() {
     {
         g_has_avx = eAVXNotPresent;
 
+#if defined (__APPLE__)
         // Only xnu-2020 or later has AVX support, any versions before
         // this have a busted thread_get_state RPC where it would truncate
         // the thread state buffer (<rdar://problem/10122874>). So we need to
@@ -68,6 +74,13 @@ CPUHasAVX() {
                 }
             }
         }
+#else
+        // The kernel saves the AVX state in the signal frame when the CPU has it.
+        if (::HasAVX())
+        {
+            g_has_avx = eAVXPresent;
+        }
+#endif
     }
 
     return (g_has_avx == eAVXPresent);
@@ -927,6 +940,96 @@ DNBArchImplX86_64::GetRegisterSetInfo(nub_size_t *num_reg_sets)
         return g_reg_sets_no_avx;
 }
 
+//----------------------------------------------------------------------
+// The layout of the full register context ('g' packet) in the state
+// structures. The context is the registers from the register sets in
+// order, so the neighbouring registers that are also neighbours in the
+// state structures are copied as one span.
+//----------------------------------------------------------------------
+
+struct ContextSpan {
+    uint16_t offset;
+    uint16_t size;
+};
+
+template <typename T, size_t N>
+constexpr size_t countof(const T (&)[N]) { return N; }
+
+static constexpr size_t contextSpansSize(const ContextSpan *spans, size_t count) {
+    return count == 0 ? 0 : spans[0].size + contextSpansSize(spans + 1, count - 1);
+}
+
+#define CONTEXT_SPAN(T, first, last) { uint16_t(offsetof(T, first)), uint16_t(offsetof(T, last) + sizeof(((T *)NULL)->last) - offsetof(T, first)) }
+#define GPR_SPAN(first, last) CONTEXT_SPAN(x86_thread_state64_t, __##first, __##last)
+#define FPU_SPAN(T, first, last) CONTEXT_SPAN(T, __fpu_##first, __fpu_##last)
+#define STMM_SPAN(T, n) { uint16_t(offsetof(T, __fpu_stmm##n)), 10 }
+#define YMM_SPANS(n) FPU_SPAN(x86_avx_state64_t, xmm##n, xmm##n), FPU_SPAN(x86_avx_state64_t, ymmh##n, ymmh##n)
+#define FPU_HEADER_SPANS(T) \
+    FPU_SPAN(T, fcw, ftw), FPU_SPAN(T, fop, cs), FPU_SPAN(T, dp, ds), FPU_SPAN(T, mxcsr, mxcsrmask), \
+    STMM_SPAN(T, 0), STMM_SPAN(T, 1), STMM_SPAN(T, 2), STMM_SPAN(T, 3), \
+    STMM_SPAN(T, 4), STMM_SPAN(T, 5), STMM_SPAN(T, 6), STMM_SPAN(T, 7)
+
+// rax ... gs
+static constexpr ContextSpan k_gpr_context_spans[] = {
+    GPR_SPAN(rax, gs)
+};
+// fcw ... mxcsrmask, stmm0 ... stmm7, xmm0 ... xmm15
+static constexpr ContextSpan k_fpu_no_avx_context_spans[] = {
+    FPU_HEADER_SPANS(x86_float_state64_t),
+    FPU_SPAN(x86_float_state64_t, xmm0, xmm15)
+};
+// fcw ... mxcsrmask, stmm0 ... stmm7, ymm0 ... ymm15
+static constexpr ContextSpan k_fpu_avx_context_spans[] = {
+    FPU_HEADER_SPANS(x86_avx_state64_t),
+    YMM_SPANS(0), YMM_SPANS(1), YMM_SPANS(2), YMM_SPANS(3),
+    YMM_SPANS(4), YMM_SPANS(5), YMM_SPANS(6), YMM_SPANS(7),
+    YMM_SPANS(8), YMM_SPANS(9), YMM_SPANS(10), YMM_SPANS(11),
+    YMM_SPANS(12), YMM_SPANS(13), YMM_SPANS(14), YMM_SPANS(15)
+};
+// trapno:cpu, err, faultvaddr
+static constexpr ContextSpan k_exc_context_spans[] = {
+    CONTEXT_SPAN(x86_exception_state64_t, __trapno, __faultvaddr)
+};
+
+#undef FPU_HEADER_SPANS
+#undef YMM_SPANS
+#undef STMM_SPAN
+#undef FPU_SPAN
+#undef GPR_SPAN
+#undef CONTEXT_SPAN
+
+// The spans have to cover the registers without the gaps in the state structures.
+static_assert(contextSpansSize(k_gpr_context_spans, countof(k_gpr_context_spans)) == (gpr_eax - gpr_rax) * sizeof(uint64_t), "GPR span has a gap");
+static_assert(contextSpansSize(k_fpu_no_avx_context_spans, 4) == 2 + 2 + 1 + 2 + 4 + 2 + 4 + 2 + 4 + 4, "FPU control spans have a gap");
+static_assert(contextSpansSize(k_fpu_no_avx_context_spans, countof(k_fpu_no_avx_context_spans)) == 27 + 8 * 10 + 16 * 16, "XMM span has a gap");
+static_assert(contextSpansSize(k_fpu_avx_context_spans, countof(k_fpu_avx_context_spans)) == 27 + 8 * 10 + 16 * 32, "Invalid YMM spans");
+static_assert(contextSpansSize(k_exc_context_spans, countof(k_exc_context_spans)) == 4 + 4 + 8, "EXC span has a gap");
+
+static constexpr size_t k_no_avx_context_size =
+    contextSpansSize(k_gpr_context_spans, countof(k_gpr_context_spans)) +
+    contextSpansSize(k_fpu_no_avx_context_spans, countof(k_fpu_no_avx_context_spans)) +
+    contextSpansSize(k_exc_context_spans, countof(k_exc_context_spans));
+static constexpr size_t k_avx_context_size =
+    contextSpansSize(k_gpr_context_spans, countof(k_gpr_context_spans)) +
+    contextSpansSize(k_fpu_avx_context_spans, countof(k_fpu_avx_context_spans)) +
+    contextSpansSize(k_exc_context_spans, countof(k_exc_context_spans));
+
+static uint8_t *copyContextSpans(uint8_t *destination, const uint8_t *state, const ContextSpan *spans, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        memcpy(destination, state + spans[i].offset, spans[i].size);
+        destination += spans[i].size;
+    }
+    return destination;
+}
+
+static const uint8_t *fillContextSpans(uint8_t *state, const uint8_t *source, const ContextSpan *spans, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        memcpy(state + spans[i].offset, source, spans[i].size);
+        source += spans[i].size;
+    }
+    return source;
+}
+
 //----------------------------------------------------------------------
 // Custom Selfde interface to the DNB register information.
 //----------------------------------------------------------------------
@@ -1271,78 +1374,69 @@ void getRegisterContextX86_64(const x86_thread_state64_t *state, const x86_float
     assert(fpuState || avxState);
     if (fpuState) { assert(!avxState); }
 
+    const size_t contextSize = fpuState != nullptr ? k_no_avx_context_size : k_avx_context_size;
+    if (*size < contextSize) {
+        assert(false && "Destination context isn't big enough.");
+        *size = 0;
+        return;
+    }
     uint8_t *buffer = destination;
-    size_t freeBufferSize = *size;
-
-#define REGISTER_LOOP(firstRegister, lastRegister, fn, state) \
-        for (uint32_t i = (firstRegister), lastI = (lastRegister); i <= lastI; ++i) { \
-            size_t registerSize = freeBufferSize; \
-            auto result = fn(i, state, buffer, &registerSize); assert(result); \
-            buffer += registerSize; \
-            assert(freeBufferSize >= registerSize); \
-            freeBufferSize -= registerSize; \
-        }
-#define REGISTER_LOOP2(firstRegister, lastRegister, fn, state1, state2) \
-        for (uint32_t i = (firstRegister), lastI = (lastRegister); i <= lastI; ++i) { \
-            size_t registerSize = freeBufferSize; \
-            auto result = fn(i, state1, state2, buffer, &registerSize); assert(result); \
-            buffer += registerSize; \
-            assert(freeBufferSize >= registerSize); \
-            freeBufferSize -= registerSize; \
-        }
-
-    // GPR
-    REGISTER_LOOP(gpr_rax, gpr_eax - 1, getGPRValueX86_64, state)
-    // FPU
-    REGISTER_LOOP2(fpu_fcw, fpu_mxcsrmask, getFPUValueX86_64, fpuState, avxState)
-    REGISTER_LOOP2(fpu_stmm0, fpu_stmm7, getFPUValueX86_64, fpuState, avxState)
+    buffer = copyContextSpans(buffer, reinterpret_cast<const uint8_t *>(state), k_gpr_context_spans, countof(k_gpr_context_spans));
     if (fpuState) {
-        REGISTER_LOOP2(fpu_xmm0, fpu_xmm15, getFPUValueX86_64, fpuState, avxState)
+        buffer = copyContextSpans(buffer, reinterpret_cast<const uint8_t *>(fpuState), k_fpu_no_avx_context_spans, countof(k_fpu_no_avx_context_spans));
     } else {
-        REGISTER_LOOP2(fpu_ymm0, fpu_ymm15, getFPUValueX86_64, fpuState, avxState)
+        buffer = copyContextSpans(buffer, reinterpret_cast<const uint8_t *>(avxState), k_fpu_avx_context_spans, countof(k_fpu_avx_context_spans));
     }
-    // EXC
-    REGISTER_LOOP(0, k_num_exc_regs - 1, getEXCValueX86_64, excState)
-#undef REGISTER_LOOP
-#undef REGISTER_LOOP2
+    buffer = copyContextSpans(buffer, reinterpret_cast<const uint8_t *>(excState), k_exc_context_spans, countof(k_exc_context_spans));
     *size = size_t(buffer - destination);
 }
 
 void setRegisterContextX86_64(x86_thread_state64_t *state, x86_float_state64_t *fpuState, x86_avx_state64_t *avxState, const uint8_t *source, nub_size_t size) {
     assert(fpuState || avxState);
     if (fpuState) { assert(!avxState); }
-    
-    const uint8_t *buffer = source;
-#define REGISTER_LOOP(firstRegister, lastRegister, fn, state, regSize) \
-        for (uint32_t i = (firstRegister), lastI = (lastRegister); i <= lastI; ++i) { \
-            size_t registerSize = regSize; \
-            assert(size >= registerSize); \
-            auto result = fn(i, state, buffer, registerSize); assert(result);\
-            buffer += registerSize; \
-            size -= registerSize; \
-        }
-#define REGISTER_LOOP2(firstRegister, lastRegister, fn, state1, state2, regSize) \
-        for (uint32_t i = (firstRegister), lastI = (lastRegister); i <= lastI; ++i) { \
-            size_t registerSize = regSize; \
-            assert(size >= registerSize); \
-            auto result = fn(i, state1, state2, buffer, registerSize); assert(result);\
-            buffer += registerSize; \
-            size -= registerSize; \
-        }
 
-    // GPR
-    REGISTER_LOOP(gpr_rax, gpr_eax - 1, setGPRValueX86_64, state, sizeof(uint64_t))
-    // FPU
-    REGISTER_LOOP2(fpu_fcw, fpu_mxcsrmask, setFPUValueX86_64, fpuState, avxState, DNBArchImplX86_64::g_fpu_registers_no_avx[i].size)
-    REGISTER_LOOP2(fpu_stmm0, fpu_stmm7, setFPUValueX86_64, fpuState, avxState, 10)
+    // The exception state at the end of the context isn't written back.
+    if (size != (fpuState != nullptr ? k_no_avx_context_size : k_avx_context_size)) {
+        assert(false && "Invalid context size.");
+        return;
+    }
+    const uint8_t *buffer = source;
+    buffer = fillContextSpans(reinterpret_cast<uint8_t *>(state), buffer, k_gpr_context_spans, countof(k_gpr_context_spans));
     if (fpuState) {
-        REGISTER_LOOP2(fpu_xmm0, fpu_xmm15, setFPUValueX86_64, fpuState, avxState, 16)
+        buffer = fillContextSpans(reinterpret_cast<uint8_t *>(fpuState), buffer, k_fpu_no_avx_context_spans, countof(k_fpu_no_avx_context_spans));
     } else {
-        REGISTER_LOOP2(fpu_ymm0, fpu_ymm15, setFPUValueX86_64, fpuState, avxState, 32)
+        buffer = fillContextSpans(reinterpret_cast<uint8_t *>(avxState), buffer, k_fpu_avx_context_spans, countof(k_fpu_avx_context_spans));
+    }
+}
+
+bool setupFunctionCallX86_64(x86_thread_state64_t *state, x86_float_state64_t *fpuState, x86_avx_state64_t *avxState, uint64_t function, uint64_t returnAddress, const uint64_t *integers, size_t integerCount, const uint8_t *vectors, size_t vectorCount) {
+    static const uint32_t integerRegisters[] = { gpr_rdi, gpr_rsi, gpr_rdx, gpr_rcx, gpr_r8, gpr_r9 };
+    if (integerCount > SELFDE_CALL_MAX_INTEGER_ARGUMENTS || vectorCount > SELFDE_CALL_MAX_VECTOR_ARGUMENTS) {
+        return false;
     }
-#undef REGISTER_LOOP
-#undef REGISTER_LOOP2
-    assert(size == sizeof(x86_exception_state64_t));
+    for (size_t i = 0; i < integerCount; ++i) {
+        setGPRValueX86_64(integerRegisters[i], state, reinterpret_cast<const uint8_t *>(&integers[i]), sizeof(uint64_t));
+    }
+    for (size_t i = 0; i < vectorCount; ++i) {
+        setFPUValueX86_64(uint32_t(fpu_xmm0 + i), fpuState, avxState, vectors + i * 16, 16);
+    }
+    // Variadic functions get the number of the used vector registers in AL.
+    state->__rax = vectorCount;
+    // Skip the red zone and align the stack so that it's 16 byte aligned after the return address is popped.
+    uint64_t stackPointer = ((state->__rsp - 128) & ~uint64_t(15)) - sizeof(uint64_t);
+    memcpy(reinterpret_cast<void *>(stackPointer), &returnAddress, sizeof(uint64_t));
+    state->__rsp = stackPointer;
+    state->__rip = function;
+    // Clear the trap flag and the direction flag.
+    state->__rflags &= ~uint64_t(0x500);
+    return true;
+}
+
+void getFunctionCallResultX86_64(const x86_thread_state64_t *state, const x86_float_state64_t *fpuState, const x86_avx_state64_t *avxState, uint64_t *integers, uint8_t *vectors) {
+    integers[0] = state->__rax;
+    integers[1] = state->__rdx;
+    memcpy(vectors, fpuState != nullptr ? &fpuState->__fpu_xmm0 : &avxState->__fpu_xmm0, 16);
+    memcpy(vectors + 16, fpuState != nullptr ? &fpuState->__fpu_xmm1 : &avxState->__fpu_xmm1, 16);
 }
 
 } // end extern "C"
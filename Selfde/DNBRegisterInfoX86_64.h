@@ -7,7 +7,11 @@
 #define DNBRegisterInfoX86_64_hpp
 
 #include "DNBDefs.h"
+#if defined (__APPLE__)
 #include <mach/mach.h>
+#else
+#include "Linux/include/linuxThreadStateX86_64.h"
+#endif
 
 #if defined (__x86_64__)
 
@@ -37,6 +41,16 @@ bool getEXCValueX86_64(uint32_t registerID, const x86_exception_state64_t *state
 
 void getRegisterContextX86_64(const x86_thread_state64_t *state, const x86_float_state64_t *fpuState, const x86_avx_state64_t *avxState, const x86_exception_state64_t *excState, uint8_t *destination, nub_size_t *size);
 void setRegisterContextX86_64(x86_thread_state64_t *state, x86_float_state64_t *fpuState, x86_avx_state64_t *avxState, const uint8_t *source, nub_size_t size);
+
+#define SELFDE_CALL_MAX_INTEGER_ARGUMENTS 6
+#define SELFDE_CALL_MAX_VECTOR_ARGUMENTS 8
+
+// Sets up the registers of a stopped thread for a System V call of the function, with the arguments
+// in the argument registers and the return address pushed below the red zone of the thread's stack.
+// The vectors are 16 bytes each. Returns false when the arguments don't fit into the registers.
+bool setupFunctionCallX86_64(x86_thread_state64_t *state, x86_float_state64_t *fpuState, x86_avx_state64_t *avxState, uint64_t function, uint64_t returnAddress, const uint64_t *integers, size_t integerCount, const uint8_t *vectors, size_t vectorCount);
+// Returns RAX and RDX, and XMM0 and XMM1 as 32 bytes.
+void getFunctionCallResultX86_64(const x86_thread_state64_t *state, const x86_float_state64_t *fpuState, const x86_avx_state64_t *avxState, uint64_t *integers, uint8_t *vectors);
     
 #ifdef __cplusplus
 }
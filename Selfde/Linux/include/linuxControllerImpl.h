@@ -0,0 +1,168 @@
+//
+//  linuxControllerImpl.h
+//  Selfde
+//
+
+#ifndef linuxControllerImpl_h
+#define linuxControllerImpl_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "../../DNBRegisterInfoX86_64.h"
+#include "../../HasAVX.h"
+#include "../../livePatchX86_64.h"
+#include "../../callFrameInfoX86_64.h"
+#include "../../samplingProfiler.h"
+#include "../../coreDump.h"
+#include "../../coverage.h"
+#include "../../dirtyPages.h"
+#include "../../memoryChecksum.h"
+#include "../../memorySearch.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A stop that was caught by one of the signal handlers. The stopped thread is parked
+// inside the signal handler until it's resumed.
+typedef struct SelfdeLinuxStopEvent {
+    pid_t thread;
+    int signalNumber;
+    int signalCode;
+    uint64_t faultAddress;
+} SelfdeLinuxStopEvent;
+
+// What happens to a signal that's caught by the debugger, see QPassSignals and QProgramSignals.
+typedef enum SelfdeLinuxSignalDisposition {
+    SelfdeLinuxSignalStop = 0,
+    // The signal is delivered to the program's handler without a stop.
+    SelfdeLinuxSignalPass,
+    // The signal is ignored and the thread continues. The synchronous faults are never discarded.
+    SelfdeLinuxSignalDiscard
+} SelfdeLinuxSignalDisposition;
+
+#define SELFDE_LINUX_SIGNAL_FILTER_WORDS 2
+
+typedef struct SelfdeLinuxSignalFilter {
+    uint64_t passSignals[SELFDE_LINUX_SIGNAL_FILTER_WORDS];
+    // Every passed signal is delivered unless the program signals were set.
+    uint64_t hasProgramSignals;
+    uint64_t programSignals[SELFDE_LINUX_SIGNAL_FILTER_WORDS];
+} SelfdeLinuxSignalFilter;
+
+// A negative program signal count allows all of the passed signals to be delivered.
+// SIGTRAP is never filtered as the debugger needs it for the breakpoints.
+void selfdeLinuxStoreSignalFilter(SelfdeLinuxSignalFilter *filter, const int *passSignals, int passCount, const int *programSignals, int programCount);
+// A synchronous fault would fault again if it was discarded, as the thread continues at the faulting
+// instruction, so it's passed to the program instead. The faults have a positive signal code, unlike
+// the same signals when they're sent by kill.
+SelfdeLinuxSignalDisposition selfdeLinuxGetSignalDisposition(const SelfdeLinuxSignalFilter *filter, int signalNumber, int signalCode);
+
+// Sets the filter that's used by the signal handlers.
+void selfdeLinuxSetSignalFilter(const int *passSignals, int passCount, const int *programSignals, int programCount);
+
+// Installs the SIGTRAP/SIGSEGV/SIGBUS/SIGILL handlers and the thread stop handler.
+// The calling thread becomes the controller thread which is never stopped.
+int selfdeLinuxInstallHandlers(void);
+void selfdeLinuxRemoveHandlers(void);
+
+// Threads like the debug server's IO thread can't be stopped either.
+void selfdeLinuxIgnoreCurrentThread(void);
+
+pid_t selfdeLinuxGetCurrentThreadID(void);
+
+// Returns the number of threads that can be debugged, storing at most 'capacity' of them.
+int selfdeLinuxGetThreads(pid_t *threads, int capacity);
+bool selfdeLinuxIsThreadAlive(pid_t thread);
+
+// Blocks until a thread traps. Returns false when the handlers were removed.
+bool selfdeLinuxWaitForStop(SelfdeLinuxStopEvent *event);
+
+// Interrupts the thread with a signal and waits until it's parked. Stops caused by this
+// aren't reported by 'selfdeLinuxWaitForStop'.
+int selfdeLinuxStopThread(pid_t thread);
+int selfdeLinuxResumeThread(pid_t thread);
+bool selfdeLinuxIsThreadStopped(pid_t thread);
+bool selfdeLinuxGetLastStop(pid_t thread, SelfdeLinuxStopEvent *event);
+
+// Register access for a stopped thread. The states can be NULL.
+int selfdeLinuxGetThreadState(pid_t thread, x86_thread_state64_t *state, x86_float_state64_t *fpuState, x86_avx_state64_t *avxState, x86_exception_state64_t *excState);
+int selfdeLinuxSetThreadState(pid_t thread, const x86_thread_state64_t *state, const x86_float_state64_t *fpuState, const x86_avx_state64_t *avxState);
+
+int selfdeLinuxReadMemory(uint64_t address, void *destination, size_t size);
+// Reads the memory of another process, like a fork snapshot, with process_vm_readv.
+int selfdeLinuxReadProcessMemory(pid_t process, uint64_t address, void *destination, size_t size);
+int selfdeLinuxWriteMemory(uint64_t address, const void *source, size_t size);
+int selfdeLinuxProtectAll(uint64_t address, size_t size);
+
+uint64_t selfdeLinuxGetRendezvousAddress(void);
+
+// An entry from the dynamic linker's 'link_map' list.
+typedef struct SelfdeLinuxLibrary {
+    uint64_t linkMapAddress;
+    uint64_t loadAddress;
+    uint64_t dynamicSectionAddress;
+    const char *path;
+} SelfdeLinuxLibrary;
+
+// Returns the number of loaded objects, storing at most 'capacity' of them, or -1 when
+// the dynamic linker is modifying the list.
+int selfdeLinuxGetLoadedLibraries(SelfdeLinuxLibrary *libraries, int capacity);
+
+typedef void (*SelfdeLinuxSymbolCallback)(void *context, const char *name, uint64_t address, uint64_t size);
+
+// Calls the callback for the functions and the objects that are defined in a loaded object's
+// dynamic symbol table. Returns 0, or EINVAL when the object doesn't have a symbol table.
+int selfdeLinuxEnumerateSymbols(uint64_t loadAddress, uint64_t dynamicSectionAddress, SelfdeLinuxSymbolCallback callback, void *context);
+
+// The code of a loaded object and its .eh_frame section. The size of the section isn't known,
+// it's terminated by a zero length entry.
+typedef struct SelfdeLinuxUnwindSection {
+    uint64_t codeStart;
+    uint64_t codeEnd;
+    uint64_t ehFrameAddress;
+} SelfdeLinuxUnwindSection;
+
+// Finds the executable segments and the .eh_frame section of a loaded object using its program
+// headers. Returns 0, or EINVAL when the object doesn't have a PT_GNU_EH_FRAME header.
+int selfdeLinuxGetUnwindSection(uint64_t loadAddress, SelfdeLinuxUnwindSection *section);
+
+// Samples the threads that are running with a real-time signal, whose handler walks the frame pointers
+// of the interrupted thread. The callback is called on the profiler's thread when it's created.
+int selfdeLinuxStartProfiling(uint32_t frequency, uint32_t maxFrames, uint32_t stackCapacity, uint32_t frameCapacity, SelfdeProfilerThreadCallback threadStarted, void *context);
+void selfdeLinuxStopProfiling(void);
+// Returns the number of the dropped samples.
+uint64_t selfdeLinuxEnumerateProfile(SelfdeStackCallback callback, void *context);
+
+// The registers of a stopped thread, which go into its NT_PRSTATUS and NT_FPREGSET notes.
+typedef struct SelfdeLinuxCoreThread {
+    pid_t thread;
+    int signalNumber;
+    x86_thread_state64_t state;
+    x86_float_state64_t fpuState;
+} SelfdeLinuxCoreThread;
+
+// Writes an ELF core with the given threads and the readable mappings of a fork snapshot, whose
+// memory is read with process_vm_readv, so the threads of the process can run while it's written.
+// The first thread is selected by the debuggers. The pause isn't measured here.
+int selfdeLinuxWriteCore(int fd, pid_t process, const SelfdeLinuxCoreThread *threads, uint32_t threadCount, uint32_t copyThreadCount, bool elideZeroPages, SelfdeCoreDumpStatistics *statistics);
+
+// The parts of the readable mappings from /proc/self/maps that are inside of the given range, which
+// are returned in a malloc'ed array.
+int selfdeLinuxGetReadableRegions(uint64_t address, uint64_t size, SelfdeMemoryRange **regions, uint32_t *count);
+
+// Forks a child process that keeps a copy-on-write copy of the memory while this process runs on.
+// It has to be called while the other threads are stopped, as only the calling thread is forked
+// and nothing is allocated. The child waits until it's released, and its memory is read with
+// 'selfdeLinuxReadProcessMemory'. Returns -1 on failure.
+pid_t selfdeLinuxForkSnapshot(int *error);
+// Kills and reaps the child.
+void selfdeLinuxReleaseForkSnapshot(pid_t process);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* linuxControllerImpl_h */
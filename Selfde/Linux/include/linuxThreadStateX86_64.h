@@ -0,0 +1,168 @@
+//
+//  linuxThreadStateX86_64.h
+//  Selfde
+//
+
+#ifndef linuxThreadStateX86_64_h
+#define linuxThreadStateX86_64_h
+
+// The register tables in DNBRegisterInfoX86_64.cpp work with the Mach thread states.
+// Linux doesn't have them, so they're defined here with the same field names and layout,
+// and are filled in from the signal's ucontext_t.
+
+#include <stdint.h>
+
+#if defined (__x86_64__)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    uint64_t    __rax;
+    uint64_t    __rbx;
+    uint64_t    __rcx;
+    uint64_t    __rdx;
+    uint64_t    __rdi;
+    uint64_t    __rsi;
+    uint64_t    __rbp;
+    uint64_t    __rsp;
+    uint64_t    __r8;
+    uint64_t    __r9;
+    uint64_t    __r10;
+    uint64_t    __r11;
+    uint64_t    __r12;
+    uint64_t    __r13;
+    uint64_t    __r14;
+    uint64_t    __r15;
+    uint64_t    __rip;
+    uint64_t    __rflags;
+    uint64_t    __cs;
+    uint64_t    __fs;
+    uint64_t    __gs;
+} x86_thread_state64_t;
+
+typedef struct {
+    uint16_t    __invalid   : 1;
+    uint16_t    __denorm    : 1;
+    uint16_t    __zdiv      : 1;
+    uint16_t    __ovrfl     : 1;
+    uint16_t    __undfl     : 1;
+    uint16_t    __precis    : 1;
+    uint16_t    __PAD1      : 2;
+    uint16_t    __pc        : 2;
+    uint16_t    __rc        : 2;
+    uint16_t    __PAD2      : 1;
+    uint16_t    __PAD3      : 3;
+} x86_fp_control_t;
+
+typedef struct {
+    uint16_t    __invalid   : 1;
+    uint16_t    __denorm    : 1;
+    uint16_t    __zdiv      : 1;
+    uint16_t    __ovrfl     : 1;
+    uint16_t    __undfl     : 1;
+    uint16_t    __precis    : 1;
+    uint16_t    __stkflt    : 1;
+    uint16_t    __errsumm   : 1;
+    uint16_t    __c0        : 1;
+    uint16_t    __c1        : 1;
+    uint16_t    __c2        : 1;
+    uint16_t    __tos       : 3;
+    uint16_t    __c3        : 1;
+    uint16_t    __busy      : 1;
+} x86_fp_status_t;
+
+typedef struct {
+    uint8_t     __mmst_reg[10];
+    uint8_t     __mmst_rsrv[6];
+} x86_mmst_reg_t;
+
+typedef struct {
+    uint8_t     __xmm_reg[16];
+} x86_xmm_reg_t;
+
+// The fields from '__fpu_fcw' to '__fpu_rsrv4' match the 512 byte FXSAVE area.
+#define SELFDE_X86_FPU_FIELDS \
+    int32_t             __fpu_reserved[2]; \
+    x86_fp_control_t    __fpu_fcw; \
+    x86_fp_status_t     __fpu_fsw; \
+    uint8_t             __fpu_ftw; \
+    uint8_t             __fpu_rsrv1; \
+    uint16_t            __fpu_fop; \
+    uint32_t            __fpu_ip; \
+    uint16_t            __fpu_cs; \
+    uint16_t            __fpu_rsrv2; \
+    uint32_t            __fpu_dp; \
+    uint16_t            __fpu_ds; \
+    uint16_t            __fpu_rsrv3; \
+    uint32_t            __fpu_mxcsr; \
+    uint32_t            __fpu_mxcsrmask; \
+    x86_mmst_reg_t      __fpu_stmm0; \
+    x86_mmst_reg_t      __fpu_stmm1; \
+    x86_mmst_reg_t      __fpu_stmm2; \
+    x86_mmst_reg_t      __fpu_stmm3; \
+    x86_mmst_reg_t      __fpu_stmm4; \
+    x86_mmst_reg_t      __fpu_stmm5; \
+    x86_mmst_reg_t      __fpu_stmm6; \
+    x86_mmst_reg_t      __fpu_stmm7; \
+    x86_xmm_reg_t       __fpu_xmm0; \
+    x86_xmm_reg_t       __fpu_xmm1; \
+    x86_xmm_reg_t       __fpu_xmm2; \
+    x86_xmm_reg_t       __fpu_xmm3; \
+    x86_xmm_reg_t       __fpu_xmm4; \
+    x86_xmm_reg_t       __fpu_xmm5; \
+    x86_xmm_reg_t       __fpu_xmm6; \
+    x86_xmm_reg_t       __fpu_xmm7; \
+    x86_xmm_reg_t       __fpu_xmm8; \
+    x86_xmm_reg_t       __fpu_xmm9; \
+    x86_xmm_reg_t       __fpu_xmm10; \
+    x86_xmm_reg_t       __fpu_xmm11; \
+    x86_xmm_reg_t       __fpu_xmm12; \
+    x86_xmm_reg_t       __fpu_xmm13; \
+    x86_xmm_reg_t       __fpu_xmm14; \
+    x86_xmm_reg_t       __fpu_xmm15; \
+    uint8_t             __fpu_rsrv4[6*16]; \
+    int32_t             __fpu_reserved1;
+
+typedef struct {
+    SELFDE_X86_FPU_FIELDS
+} x86_float_state64_t;
+
+typedef struct {
+    SELFDE_X86_FPU_FIELDS
+    uint8_t             __avx_reserved1[64];
+    x86_xmm_reg_t       __fpu_ymmh0;
+    x86_xmm_reg_t       __fpu_ymmh1;
+    x86_xmm_reg_t       __fpu_ymmh2;
+    x86_xmm_reg_t       __fpu_ymmh3;
+    x86_xmm_reg_t       __fpu_ymmh4;
+    x86_xmm_reg_t       __fpu_ymmh5;
+    x86_xmm_reg_t       __fpu_ymmh6;
+    x86_xmm_reg_t       __fpu_ymmh7;
+    x86_xmm_reg_t       __fpu_ymmh8;
+    x86_xmm_reg_t       __fpu_ymmh9;
+    x86_xmm_reg_t       __fpu_ymmh10;
+    x86_xmm_reg_t       __fpu_ymmh11;
+    x86_xmm_reg_t       __fpu_ymmh12;
+    x86_xmm_reg_t       __fpu_ymmh13;
+    x86_xmm_reg_t       __fpu_ymmh14;
+    x86_xmm_reg_t       __fpu_ymmh15;
+} x86_avx_state64_t;
+
+#undef SELFDE_X86_FPU_FIELDS
+
+typedef struct {
+    uint16_t    __trapno;
+    uint16_t    __cpu;
+    uint32_t    __err;
+    uint64_t    __faultvaddr;
+} x86_exception_state64_t;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+#endif /* linuxThreadStateX86_64_h */
@@ -0,0 +1,52 @@
+//
+//  linuxTracerImpl.h
+//  Selfde
+//
+
+#ifndef linuxTracerImpl_h
+#define linuxTracerImpl_h
+
+#include "linuxControllerImpl.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A helper process that traces the threads of this process with ptrace.
+// The debugger talks to it through a shared memory channel.
+typedef struct SelfdeLinuxTracer SelfdeLinuxTracer;
+
+// Forks the helper and waits until it has seized all of the threads. The calling
+// thread is ignored, like the controller thread of the signal handlers.
+SelfdeLinuxTracer *selfdeLinuxTracerStart(int *error);
+// Resumes the stopped threads and terminates the helper, which detaches from the threads.
+void selfdeLinuxTracerStop(SelfdeLinuxTracer *tracer);
+
+void selfdeLinuxTracerIgnoreCurrentThread(SelfdeLinuxTracer *tracer);
+int selfdeLinuxTracerGetThreads(SelfdeLinuxTracer *tracer, pid_t *threads, int capacity);
+
+bool selfdeLinuxTracerWaitForStop(SelfdeLinuxTracer *tracer, SelfdeLinuxStopEvent *event);
+int selfdeLinuxTracerStopThread(SelfdeLinuxTracer *tracer, pid_t thread);
+int selfdeLinuxTracerResumeThread(SelfdeLinuxTracer *tracer, pid_t thread);
+bool selfdeLinuxTracerIsThreadStopped(SelfdeLinuxTracer *tracer, pid_t thread);
+bool selfdeLinuxTracerGetLastStop(SelfdeLinuxTracer *tracer, pid_t thread, SelfdeLinuxStopEvent *event);
+
+int selfdeLinuxTracerGetThreadState(SelfdeLinuxTracer *tracer, pid_t thread, x86_thread_state64_t *state, x86_float_state64_t *fpuState, x86_avx_state64_t *avxState, x86_exception_state64_t *excState);
+int selfdeLinuxTracerSetThreadState(SelfdeLinuxTracer *tracer, pid_t thread, const x86_thread_state64_t *state, const x86_float_state64_t *fpuState, const x86_avx_state64_t *avxState);
+
+// The filter is applied by the helper to the SIGSEGV/SIGBUS/SIGILL stops. The signals that
+// aren't caught by the debugger are always delivered.
+void selfdeLinuxTracerSetSignalFilter(SelfdeLinuxTracer *tracer, const int *passSignals, int passCount, const int *programSignals, int programCount);
+
+// DR0-DR7.
+int selfdeLinuxTracerGetDebugRegisters(SelfdeLinuxTracer *tracer, pid_t thread, uint64_t registers[8]);
+int selfdeLinuxTracerSetDebugRegister(SelfdeLinuxTracer *tracer, pid_t thread, int index, uint64_t value);
+
+// Writes into read only memory go through the helper's /proc/pid/mem.
+int selfdeLinuxTracerWriteMemory(SelfdeLinuxTracer *tracer, uint64_t address, const void *source, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* linuxTracerImpl_h */
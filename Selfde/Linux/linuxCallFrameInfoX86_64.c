@@ -0,0 +1,7 @@
+//
+//  linuxCallFrameInfoX86_64.c
+//  Selfde
+//
+
+// The call frame information parser is shared with the Mach implementation.
+#include "../callFrameInfoX86_64.c"
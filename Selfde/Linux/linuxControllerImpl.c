@@ -0,0 +1,1287 @@
+//
+//  linuxControllerImpl.c
+//  Selfde
+//
+
+#define _GNU_SOURCE
+#include "linuxControllerImpl.h"
+#include <cpuid.h>
+#include <dirent.h>
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <link.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/auxv.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/procfs.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#define SELFDE_MAX_THREADS 1024
+#define SELFDE_MAX_IGNORED_THREADS 16
+
+// The real-time signal that's used to stop the other threads.
+#define SELFDE_STOP_SIGNAL (SIGRTMIN + 4)
+// The real-time signal that interrupts the threads that are sampled by the profiler.
+#define SELFDE_PROFILE_SIGNAL (SIGRTMIN + 5)
+
+enum {
+    SelfdeThreadRunning = 0,
+    SelfdeThreadParked = 1
+};
+
+// A thread that has been seen by the signal handlers. The records are claimed with
+// atomic operations as they're created inside the signal handlers.
+typedef struct SelfdeThreadRecord {
+    pid_t thread;
+    // Futex word the parked thread waits on.
+    int state;
+    int stopRequested;
+    // Valid while the thread is parked.
+    ucontext_t *context;
+    SelfdeLinuxStopEvent lastStop;
+} SelfdeThreadRecord;
+
+static SelfdeThreadRecord threadRecords[SELFDE_MAX_THREADS];
+static pid_t ignoredThreads[SELFDE_MAX_IGNORED_THREADS];
+static struct sigaction previousActions[NSIG];
+static int eventPipe[2] = { -1, -1 };
+static bool isInstalled;
+static SelfdeLinuxSignalFilter signalFilter;
+
+static const int trapSignals[] = { SIGTRAP, SIGSEGV, SIGBUS, SIGILL };
+
+static long futex(int *word, int operation, int value, const struct timespec *timeout) {
+    return syscall(SYS_futex, word, operation, value, timeout, NULL, 0);
+}
+
+pid_t selfdeLinuxGetCurrentThreadID(void) {
+    return (pid_t)syscall(SYS_gettid);
+}
+
+// The words of the filter are stored atomically as the filter can be read by the signal handlers,
+// or by the tracer helper, while it's changed.
+static void storeSignalSet(uint64_t *set, const int *signals, int count) {
+    uint64_t words[SELFDE_LINUX_SIGNAL_FILTER_WORDS] = { 0 };
+    for (int i = 0; i < count; ++i) {
+        int signalNumber = signals[i];
+        if (signalNumber > 0 && signalNumber < SELFDE_LINUX_SIGNAL_FILTER_WORDS * 64 && signalNumber != SIGTRAP) {
+            words[signalNumber / 64] |= (uint64_t)1 << (signalNumber % 64);
+        }
+    }
+    for (int i = 0; i < SELFDE_LINUX_SIGNAL_FILTER_WORDS; ++i) {
+        __atomic_store_n(&set[i], words[i], __ATOMIC_RELEASE);
+    }
+}
+
+static bool containsSignal(const uint64_t *set, int signalNumber) {
+    if (signalNumber <= 0 || signalNumber >= SELFDE_LINUX_SIGNAL_FILTER_WORDS * 64) {
+        return false;
+    }
+    return (__atomic_load_n(&set[signalNumber / 64], __ATOMIC_ACQUIRE) >> (signalNumber % 64)) & 1;
+}
+
+void selfdeLinuxStoreSignalFilter(SelfdeLinuxSignalFilter *filter, const int *passSignals, int passCount, const int *programSignals, int programCount) {
+    storeSignalSet(filter->programSignals, programSignals, programCount);
+    __atomic_store_n(&filter->hasProgramSignals, programCount >= 0, __ATOMIC_RELEASE);
+    storeSignalSet(filter->passSignals, passSignals, passCount);
+}
+
+static bool isSynchronousFault(int signalNumber, int signalCode) {
+    switch (signalNumber) {
+    case SIGSEGV:
+    case SIGBUS:
+    case SIGILL:
+    case SIGFPE:
+        return signalCode > 0;
+    default:
+        return false;
+    }
+}
+
+SelfdeLinuxSignalDisposition selfdeLinuxGetSignalDisposition(const SelfdeLinuxSignalFilter *filter, int signalNumber, int signalCode) {
+    if (!containsSignal(filter->passSignals, signalNumber)) {
+        return SelfdeLinuxSignalStop;
+    }
+    if (__atomic_load_n(&filter->hasProgramSignals, __ATOMIC_ACQUIRE) && !containsSignal(filter->programSignals, signalNumber) &&
+        !isSynchronousFault(signalNumber, signalCode)) {
+        return SelfdeLinuxSignalDiscard;
+    }
+    return SelfdeLinuxSignalPass;
+}
+
+void selfdeLinuxSetSignalFilter(const int *passSignals, int passCount, const int *programSignals, int programCount) {
+    selfdeLinuxStoreSignalFilter(&signalFilter, passSignals, passCount, programSignals, programCount);
+}
+
+static bool isIgnoredThread(pid_t thread) {
+    for (int i = 0; i < SELFDE_MAX_IGNORED_THREADS; ++i) {
+        if (__atomic_load_n(&ignoredThreads[i], __ATOMIC_ACQUIRE) == thread) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void selfdeLinuxIgnoreCurrentThread(void) {
+    pid_t thread = selfdeLinuxGetCurrentThreadID();
+    if (isIgnoredThread(thread)) {
+        return;
+    }
+    for (int i = 0; i < SELFDE_MAX_IGNORED_THREADS; ++i) {
+        pid_t expected = 0;
+        if (__atomic_compare_exchange_n(&ignoredThreads[i], &expected, thread, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+            return;
+        }
+    }
+}
+
+static SelfdeThreadRecord *findThreadRecord(pid_t thread, bool create) {
+    for (int i = 0; i < SELFDE_MAX_THREADS; ++i) {
+        if (__atomic_load_n(&threadRecords[i].thread, __ATOMIC_ACQUIRE) == thread) {
+            return &threadRecords[i];
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    for (int i = 0; i < SELFDE_MAX_THREADS; ++i) {
+        pid_t expected = 0;
+        if (__atomic_compare_exchange_n(&threadRecords[i].thread, &expected, thread, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+            return &threadRecords[i];
+        }
+    }
+    return NULL;
+}
+
+// Passes the signal to the handler that was installed before us.
+static void forwardSignal(int signalNumber, siginfo_t *info, void *context) {
+    const struct sigaction *previous = &previousActions[signalNumber];
+    if ((previous->sa_flags & SA_SIGINFO) && previous->sa_sigaction) {
+        previous->sa_sigaction(signalNumber, info, context);
+        return;
+    }
+    if (previous->sa_handler == SIG_IGN) {
+        return;
+    }
+    if (previous->sa_handler != SIG_DFL) {
+        previous->sa_handler(signalNumber);
+        return;
+    }
+    // Faults are raised again when the instruction is restarted, the rest has to be resent.
+    sigaction(signalNumber, previous, NULL);
+    if (signalNumber == SIGTRAP || info->si_code <= 0) {
+        raise(signalNumber);
+    }
+}
+
+// Blocks the current thread inside the signal handler until the controller resumes it.
+// The controller modifies the saved context which is restored when the handler returns.
+static void parkCurrentThread(SelfdeThreadRecord *record, ucontext_t *context, const SelfdeLinuxStopEvent *event, bool report) {
+    record->context = context;
+    record->lastStop = *event;
+    __atomic_store_n(&record->stopRequested, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&record->state, SelfdeThreadParked, __ATOMIC_RELEASE);
+    futex(&record->state, FUTEX_WAKE_PRIVATE, INT_MAX, NULL);
+    if (report) {
+        // Writes that are smaller than PIPE_BUF are atomic.
+        while (write(eventPipe[1], event, sizeof(*event)) < 0 && errno == EINTR) {
+        }
+    }
+    while (__atomic_load_n(&record->state, __ATOMIC_ACQUIRE) == SelfdeThreadParked) {
+        futex(&record->state, FUTEX_WAIT_PRIVATE, SelfdeThreadParked, NULL);
+    }
+}
+
+static void trapHandler(int signalNumber, siginfo_t *info, void *context) {
+    int savedErrno = errno;
+    ucontext_t *threadContext = (ucontext_t *)context;
+    // INT 3 leaves the instruction pointer after the breakpoint.
+    uint64_t breakpointAddress = (uint64_t)threadContext->uc_mcontext.gregs[REG_RIP] - 1;
+    if (signalNumber == SIGTRAP && info->si_code == SI_KERNEL && selfdeLivePatchHandleTrap(breakpointAddress)) {
+        // The INT 3 was only there while the code was patched, run the patched code.
+        threadContext->uc_mcontext.gregs[REG_RIP] = (greg_t)breakpointAddress;
+        errno = savedErrno;
+        return;
+    }
+    if (signalNumber == SIGTRAP && info->si_code == SI_KERNEL && selfdeCoverageHandleTrap(breakpointAddress)) {
+        // The first hit of a coverage site, its byte has been put back.
+        threadContext->uc_mcontext.gregs[REG_RIP] = (greg_t)breakpointAddress;
+        errno = savedErrno;
+        return;
+    }
+    if (signalNumber == SIGSEGV && info->si_code == SEGV_ACCERR && selfdeDirtyPagesHandleFault((uint64_t)(uintptr_t)info->si_addr)) {
+        // The first write to a tracked page in this epoch, the write is retried.
+        errno = savedErrno;
+        return;
+    }
+    switch (selfdeLinuxGetSignalDisposition(&signalFilter, signalNumber, info->si_code)) {
+    case SelfdeLinuxSignalPass:
+        forwardSignal(signalNumber, info, context);
+        errno = savedErrno;
+        return;
+    case SelfdeLinuxSignalDiscard:
+        errno = savedErrno;
+        return;
+    case SelfdeLinuxSignalStop:
+        break;
+    }
+    pid_t thread = selfdeLinuxGetCurrentThreadID();
+    SelfdeThreadRecord *record = NULL;
+    if (__atomic_load_n(&isInstalled, __ATOMIC_ACQUIRE) && !isIgnoredThread(thread)) {
+        record = findThreadRecord(thread, true);
+    }
+    if (!record) {
+        forwardSignal(signalNumber, info, context);
+        errno = savedErrno;
+        return;
+    }
+    SelfdeLinuxStopEvent event = { thread, signalNumber, info->si_code, (uint64_t)(uintptr_t)info->si_addr };
+    parkCurrentThread(record, threadContext, &event, true);
+    errno = savedErrno;
+}
+
+static void stopHandler(int signalNumber, siginfo_t *info, void *context) {
+    (void)signalNumber;
+    int savedErrno = errno;
+    pid_t thread = selfdeLinuxGetCurrentThreadID();
+    SelfdeThreadRecord *record = findThreadRecord(thread, false);
+    // The request might have been satisfied by a trap in the meantime.
+    if (record && __atomic_load_n(&record->stopRequested, __ATOMIC_ACQUIRE)) {
+        SelfdeLinuxStopEvent event = { thread, SIGSTOP, info->si_code, 0 };
+        parkCurrentThread(record, (ucontext_t *)context, &event, false);
+    }
+    errno = savedErrno;
+}
+
+int selfdeLinuxInstallHandlers(void) {
+    if (__atomic_load_n(&isInstalled, __ATOMIC_ACQUIRE)) {
+        return EBUSY;
+    }
+    if (pipe2(eventPipe, O_CLOEXEC) != 0) {
+        return errno;
+    }
+    selfdeLinuxIgnoreCurrentThread();
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = trapHandler;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    // A stop request that arrives while the thread is trapping is handled after it's resumed.
+    sigaddset(&action.sa_mask, SELFDE_STOP_SIGNAL);
+    for (size_t i = 0; i < sizeof(trapSignals) / sizeof(trapSignals[0]); ++i) {
+        if (sigaction(trapSignals[i], &action, &previousActions[trapSignals[i]]) != 0) {
+            return errno;
+        }
+    }
+    action.sa_sigaction = stopHandler;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SELFDE_STOP_SIGNAL, &action, &previousActions[SELFDE_STOP_SIGNAL]) != 0) {
+        return errno;
+    }
+    __atomic_store_n(&isInstalled, true, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void selfdeLinuxRemoveHandlers(void) {
+    if (!__atomic_exchange_n(&isInstalled, false, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+    for (size_t i = 0; i < sizeof(trapSignals) / sizeof(trapSignals[0]); ++i) {
+        sigaction(trapSignals[i], &previousActions[trapSignals[i]], NULL);
+    }
+    for (int i = 0; i < SELFDE_MAX_THREADS; ++i) {
+        pid_t thread = __atomic_load_n(&threadRecords[i].thread, __ATOMIC_ACQUIRE);
+        if (thread != 0) {
+            selfdeLinuxResumeThread(thread);
+        }
+    }
+    // The stop handler stays installed as a stop request might still be in flight.
+    close(eventPipe[1]);
+    close(eventPipe[0]);
+    eventPipe[0] = eventPipe[1] = -1;
+    memset(ignoredThreads, 0, sizeof(ignoredThreads));
+}
+
+bool selfdeLinuxIsThreadAlive(pid_t thread) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/task/%d", (int)thread);
+    return access(path, F_OK) == 0;
+}
+
+int selfdeLinuxGetThreads(pid_t *threads, int capacity) {
+    DIR *directory = opendir("/proc/self/task");
+    if (!directory) {
+        return -1;
+    }
+    int count = 0;
+    struct dirent *entry;
+    while ((entry = readdir(directory)) != NULL) {
+        pid_t thread = (pid_t)strtol(entry->d_name, NULL, 10);
+        if (thread <= 0 || isIgnoredThread(thread)) {
+            continue;
+        }
+        if (count < capacity) {
+            threads[count] = thread;
+        }
+        count += 1;
+    }
+    closedir(directory);
+
+    // Forget the threads that have exited so that their records can be reused.
+    for (int i = 0; i < SELFDE_MAX_THREADS; ++i) {
+        pid_t thread = __atomic_load_n(&threadRecords[i].thread, __ATOMIC_ACQUIRE);
+        if (thread != 0 && __atomic_load_n(&threadRecords[i].state, __ATOMIC_ACQUIRE) == SelfdeThreadRunning && !selfdeLinuxIsThreadAlive(thread)) {
+            __atomic_compare_exchange_n(&threadRecords[i].thread, &thread, 0, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+        }
+    }
+    return count;
+}
+
+bool selfdeLinuxWaitForStop(SelfdeLinuxStopEvent *event) {
+    size_t offset = 0;
+    while (offset < sizeof(*event)) {
+        ssize_t result = read(eventPipe[0], (uint8_t *)event + offset, sizeof(*event) - offset);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            return false;
+        }
+        offset += (size_t)result;
+    }
+    return true;
+}
+
+int selfdeLinuxStopThread(pid_t thread) {
+    if (isIgnoredThread(thread)) {
+        return EINVAL;
+    }
+    SelfdeThreadRecord *record = findThreadRecord(thread, true);
+    if (!record) {
+        return ENOMEM;
+    }
+    if (__atomic_load_n(&record->state, __ATOMIC_ACQUIRE) == SelfdeThreadParked) {
+        return 0;
+    }
+    __atomic_store_n(&record->stopRequested, 1, __ATOMIC_RELEASE);
+    if (syscall(SYS_tgkill, getpid(), thread, SELFDE_STOP_SIGNAL) != 0) {
+        int error = errno;
+        __atomic_store_n(&record->stopRequested, 0, __ATOMIC_RELEASE);
+        return error;
+    }
+    // The thread might have the signal blocked, so don't wait forever.
+    struct timespec timeout = { 1, 0 };
+    while (__atomic_load_n(&record->state, __ATOMIC_ACQUIRE) != SelfdeThreadParked) {
+        if (futex(&record->state, FUTEX_WAIT_PRIVATE, SelfdeThreadRunning, &timeout) != 0 && errno == ETIMEDOUT) {
+            return ETIMEDOUT;
+        }
+    }
+    return 0;
+}
+
+int selfdeLinuxResumeThread(pid_t thread) {
+    SelfdeThreadRecord *record = findThreadRecord(thread, false);
+    if (!record || __atomic_load_n(&record->state, __ATOMIC_ACQUIRE) != SelfdeThreadParked) {
+        return ESRCH;
+    }
+    record->context = NULL;
+    __atomic_store_n(&record->state, SelfdeThreadRunning, __ATOMIC_RELEASE);
+    futex(&record->state, FUTEX_WAKE_PRIVATE, INT_MAX, NULL);
+    return 0;
+}
+
+static SelfdeThreadRecord *findParkedThread(pid_t thread) {
+    SelfdeThreadRecord *record = findThreadRecord(thread, false);
+    if (!record || __atomic_load_n(&record->state, __ATOMIC_ACQUIRE) != SelfdeThreadParked || !record->context) {
+        return NULL;
+    }
+    return record;
+}
+
+bool selfdeLinuxIsThreadStopped(pid_t thread) {
+    return findParkedThread(thread) != NULL;
+}
+
+bool selfdeLinuxGetLastStop(pid_t thread, SelfdeLinuxStopEvent *event) {
+    SelfdeThreadRecord *record = findParkedThread(thread);
+    if (!record) {
+        return false;
+    }
+    *event = record->lastStop;
+    return true;
+}
+
+// The signal frame has the FXSAVE area followed by the XSAVE header and the extended state.
+#define SELFDE_FXSAVE_SIZE 512
+#define SELFDE_XSAVE_YMMH_OFFSET 576
+#define SELFDE_XSAVE_YMMH_SIZE 256
+#define SELFDE_XSTATE_YMM 4
+
+static uint8_t *getYMMHighState(uint8_t *fxsave, bool forWriting) {
+    const struct _fpx_sw_bytes *software = (const struct _fpx_sw_bytes *)(fxsave + 464);
+    if (software->magic1 != FP_XSTATE_MAGIC1 || !(software->xstate_bv & SELFDE_XSTATE_YMM) ||
+        software->xstate_size < SELFDE_XSAVE_YMMH_OFFSET + SELFDE_XSAVE_YMMH_SIZE) {
+        return NULL;
+    }
+    uint64_t *headerFeatures = (uint64_t *)(fxsave + SELFDE_FXSAVE_SIZE);
+    if (forWriting) {
+        *headerFeatures |= SELFDE_XSTATE_YMM;
+    } else if (!(*headerFeatures & SELFDE_XSTATE_YMM)) {
+        // The upper halves are in their initial (zero) state.
+        return NULL;
+    }
+    return fxsave + SELFDE_XSAVE_YMMH_OFFSET;
+}
+
+int selfdeLinuxGetThreadState(pid_t thread, x86_thread_state64_t *state, x86_float_state64_t *fpuState, x86_avx_state64_t *avxState, x86_exception_state64_t *excState) {
+    SelfdeThreadRecord *record = findParkedThread(thread);
+    if (!record) {
+        return ESRCH;
+    }
+    const mcontext_t *machineContext = &record->context->uc_mcontext;
+    const greg_t *registers = machineContext->gregs;
+    if (state) {
+        state->__rax = registers[REG_RAX];
+        state->__rbx = registers[REG_RBX];
+        state->__rcx = registers[REG_RCX];
+        state->__rdx = registers[REG_RDX];
+        state->__rdi = registers[REG_RDI];
+        state->__rsi = registers[REG_RSI];
+        state->__rbp = registers[REG_RBP];
+        state->__rsp = registers[REG_RSP];
+        state->__r8 = registers[REG_R8];
+        state->__r9 = registers[REG_R9];
+        state->__r10 = registers[REG_R10];
+        state->__r11 = registers[REG_R11];
+        state->__r12 = registers[REG_R12];
+        state->__r13 = registers[REG_R13];
+        state->__r14 = registers[REG_R14];
+        state->__r15 = registers[REG_R15];
+        state->__rip = registers[REG_RIP];
+        state->__rflags = registers[REG_EFL];
+        uint64_t segments = registers[REG_CSGSFS];
+        state->__cs = segments & 0xFFFF;
+        state->__gs = (segments >> 16) & 0xFFFF;
+        state->__fs = (segments >> 32) & 0xFFFF;
+    }
+    uint8_t *fxsave = (uint8_t *)machineContext->fpregs;
+    if (fpuState) {
+        memset(fpuState, 0, sizeof(*fpuState));
+        if (fxsave) {
+            memcpy(&fpuState->__fpu_fcw, fxsave, SELFDE_FXSAVE_SIZE);
+        }
+    }
+    if (avxState) {
+        memset(avxState, 0, sizeof(*avxState));
+        if (fxsave) {
+            memcpy(&avxState->__fpu_fcw, fxsave, SELFDE_FXSAVE_SIZE);
+            const uint8_t *ymmh = getYMMHighState(fxsave, false);
+            if (ymmh) {
+                memcpy(&avxState->__fpu_ymmh0, ymmh, SELFDE_XSAVE_YMMH_SIZE);
+            }
+        }
+    }
+    if (excState) {
+        excState->__trapno = (uint16_t)registers[REG_TRAPNO];
+        excState->__cpu = 0;
+        excState->__err = (uint32_t)registers[REG_ERR];
+        excState->__faultvaddr = registers[REG_CR2];
+    }
+    return 0;
+}
+
+int selfdeLinuxSetThreadState(pid_t thread, const x86_thread_state64_t *state, const x86_float_state64_t *fpuState, const x86_avx_state64_t *avxState) {
+    SelfdeThreadRecord *record = findParkedThread(thread);
+    if (!record) {
+        return ESRCH;
+    }
+    mcontext_t *machineContext = &record->context->uc_mcontext;
+    greg_t *registers = machineContext->gregs;
+    if (state) {
+        registers[REG_RAX] = state->__rax;
+        registers[REG_RBX] = state->__rbx;
+        registers[REG_RCX] = state->__rcx;
+        registers[REG_RDX] = state->__rdx;
+        registers[REG_RDI] = state->__rdi;
+        registers[REG_RSI] = state->__rsi;
+        registers[REG_RBP] = state->__rbp;
+        registers[REG_RSP] = state->__rsp;
+        registers[REG_R8] = state->__r8;
+        registers[REG_R9] = state->__r9;
+        registers[REG_R10] = state->__r10;
+        registers[REG_R11] = state->__r11;
+        registers[REG_R12] = state->__r12;
+        registers[REG_R13] = state->__r13;
+        registers[REG_R14] = state->__r14;
+        registers[REG_R15] = state->__r15;
+        registers[REG_RIP] = state->__rip;
+        registers[REG_EFL] = state->__rflags;
+        // NB: The segment registers are left alone, sigreturn won't accept arbitrary selectors.
+    }
+    uint8_t *fxsave = (uint8_t *)machineContext->fpregs;
+    if (!fxsave) {
+        return (fpuState || avxState) ? EINVAL : 0;
+    }
+    if (fpuState) {
+        memcpy(fxsave, &fpuState->__fpu_fcw, SELFDE_FXSAVE_SIZE);
+    }
+    if (avxState) {
+        memcpy(fxsave, &avxState->__fpu_fcw, SELFDE_FXSAVE_SIZE);
+        uint8_t *ymmh = getYMMHighState(fxsave, true);
+        if (ymmh) {
+            memcpy(ymmh, &avxState->__fpu_ymmh0, SELFDE_XSAVE_YMMH_SIZE);
+        }
+    }
+    return 0;
+}
+
+int selfdeLinuxReadMemory(uint64_t address, void *destination, size_t size) {
+    // Unlike a plain copy this fails gracefully when the memory isn't mapped.
+    return selfdeLinuxReadProcessMemory(getpid(), address, destination, size);
+}
+
+int selfdeLinuxReadProcessMemory(pid_t process, uint64_t address, void *destination, size_t size) {
+    struct iovec local = { destination, size };
+    struct iovec remote = { (void *)(uintptr_t)address, size };
+    ssize_t result = process_vm_readv(process, &local, 1, &remote, 1, 0);
+    if (result < 0) {
+        return errno;
+    }
+    return (size_t)result == size ? 0 : EFAULT;
+}
+
+int selfdeLinuxWriteMemory(uint64_t address, const void *source, size_t size) {
+    struct iovec local = { (void *)source, size };
+    struct iovec remote = { (void *)(uintptr_t)address, size };
+    ssize_t result = process_vm_writev(getpid(), &local, 1, &remote, 1, 0);
+    if (result < 0 && errno == EFAULT) {
+        // The tracked pages are write-protected, and they're written like the program would write them.
+        uint64_t pageSize = (uint64_t)sysconf(_SC_PAGESIZE);
+        bool isTracked = false;
+        for (uint64_t page = address & ~(pageSize - 1); page < address + size; page += pageSize) {
+            isTracked = selfdeDirtyPagesHandleFault(page) || isTracked;
+        }
+        if (isTracked) {
+            result = process_vm_writev(getpid(), &local, 1, &remote, 1, 0);
+        }
+    }
+    if (result < 0 && errno == EFAULT) {
+        // The code pages are mapped read only.
+        int error = selfdeLinuxProtectAll(address, size);
+        if (error != 0) {
+            return error;
+        }
+        result = process_vm_writev(getpid(), &local, 1, &remote, 1, 0);
+    }
+    if (result < 0) {
+        return errno;
+    }
+    return (size_t)result == size ? 0 : EFAULT;
+}
+
+int selfdeLinuxProtectAll(uint64_t address, size_t size) {
+    uint64_t pageSize = (uint64_t)sysconf(_SC_PAGESIZE);
+    uint64_t start = address & ~(pageSize - 1);
+    uint64_t end = (address + size + pageSize - 1) & ~(pageSize - 1);
+    if (mprotect((void *)(uintptr_t)start, (size_t)(end - start), PROT_READ | PROT_WRITE | PROT_EXEC) != 0) {
+        return errno;
+    }
+    return 0;
+}
+
+static int findRendezvous(struct dl_phdr_info *info, size_t size, void *data) {
+    (void)size;
+    // The first object is the executable, its DT_DEBUG entry points to the dynamic linker's r_debug.
+    for (ElfW(Half) i = 0; i < info->dlpi_phnum; ++i) {
+        if (info->dlpi_phdr[i].p_type != PT_DYNAMIC) {
+            continue;
+        }
+        for (const ElfW(Dyn) *entry = (const ElfW(Dyn) *)(info->dlpi_addr + info->dlpi_phdr[i].p_vaddr); entry->d_tag != DT_NULL; ++entry) {
+            if (entry->d_tag == DT_DEBUG && entry->d_un.d_ptr != 0) {
+                *(struct r_debug **)data = (struct r_debug *)entry->d_un.d_ptr;
+            }
+        }
+    }
+    return 1;
+}
+
+// '_r_debug' can be a copy that was made when the executable was relocated, so the
+// dynamic linker's structure is found using the executable's dynamic section.
+static struct r_debug *getRendezvous(void) {
+    struct r_debug *rendezvous = NULL;
+    dl_iterate_phdr(findRendezvous, &rendezvous);
+    return rendezvous != NULL ? rendezvous : &_r_debug;
+}
+
+uint64_t selfdeLinuxGetRendezvousAddress(void) {
+    return (uint64_t)(uintptr_t)getRendezvous();
+}
+
+int selfdeLinuxGetLoadedLibraries(SelfdeLinuxLibrary *libraries, int capacity) {
+    struct r_debug *rendezvous = getRendezvous();
+    if (rendezvous->r_state != RT_CONSISTENT) {
+        return -1;
+    }
+    int count = 0;
+    for (struct link_map *map = rendezvous->r_map; map != NULL; map = map->l_next, ++count) {
+        if (count < capacity) {
+            libraries[count].linkMapAddress = (uint64_t)(uintptr_t)map;
+            libraries[count].loadAddress = (uint64_t)map->l_addr;
+            libraries[count].dynamicSectionAddress = (uint64_t)(uintptr_t)map->l_ld;
+            libraries[count].path = map->l_name != NULL ? map->l_name : "";
+        }
+    }
+    return count;
+}
+
+// The dynamic linker relocates the addresses in the dynamic sections of most of the objects,
+// but not the ones in the read-only sections like the vDSO's.
+static uint64_t getDynamicAddress(uint64_t loadAddress, ElfW(Addr) address) {
+    return (uint64_t)address < loadAddress ? loadAddress + (uint64_t)address : (uint64_t)address;
+}
+
+// The number of symbols is the highest symbol index in the GNU hash table's chains.
+static uint32_t getGNUHashSymbolCount(const uint32_t *table) {
+    uint32_t bucketCount = table[0];
+    uint32_t symbolOffset = table[1];
+    uint32_t bloomSize = table[2];
+    const uint32_t *buckets = (const uint32_t *)((const ElfW(Addr) *)(table + 4) + bloomSize);
+    const uint32_t *chains = buckets + bucketCount;
+    uint32_t last = 0;
+    for (uint32_t i = 0; i < bucketCount; ++i) {
+        if (buckets[i] > last) {
+            last = buckets[i];
+        }
+    }
+    if (last < symbolOffset) {
+        return symbolOffset;
+    }
+    while ((chains[last - symbolOffset] & 1) == 0) {
+        ++last;
+    }
+    return last + 1;
+}
+
+int selfdeLinuxEnumerateSymbols(uint64_t loadAddress, uint64_t dynamicSectionAddress, SelfdeLinuxSymbolCallback callback, void *context) {
+    const ElfW(Sym) *symbols = NULL;
+    const char *strings = NULL;
+    uint32_t count = 0;
+    for (const ElfW(Dyn) *entry = (const ElfW(Dyn) *)(uintptr_t)dynamicSectionAddress; entry != NULL && entry->d_tag != DT_NULL; ++entry) {
+        switch (entry->d_tag) {
+        case DT_SYMTAB:
+            symbols = (const ElfW(Sym) *)(uintptr_t)getDynamicAddress(loadAddress, entry->d_un.d_ptr);
+            break;
+        case DT_STRTAB:
+            strings = (const char *)(uintptr_t)getDynamicAddress(loadAddress, entry->d_un.d_ptr);
+            break;
+        case DT_HASH:
+            // The number of chains is the number of symbols.
+            count = ((const uint32_t *)(uintptr_t)getDynamicAddress(loadAddress, entry->d_un.d_ptr))[1];
+            break;
+        case DT_GNU_HASH:
+            if (count == 0) {
+                count = getGNUHashSymbolCount((const uint32_t *)(uintptr_t)getDynamicAddress(loadAddress, entry->d_un.d_ptr));
+            }
+            break;
+        }
+    }
+    if (symbols == NULL || strings == NULL) {
+        return EINVAL;
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+        const ElfW(Sym) *symbol = &symbols[i];
+        unsigned char type = ELF64_ST_TYPE(symbol->st_info);
+        if (symbol->st_shndx == SHN_UNDEF || symbol->st_value == 0 || symbol->st_name == 0 ||
+            (type != STT_FUNC && type != STT_OBJECT && type != STT_GNU_IFUNC)) {
+            continue;
+        }
+        callback(context, strings + symbol->st_name, loadAddress + (uint64_t)symbol->st_value, (uint64_t)symbol->st_size);
+    }
+    return 0;
+}
+
+// The objects are mapped from their first page, except for an executable that isn't position
+// independent, whose program headers are found using the auxiliary vector.
+static const ElfW(Phdr) *getProgramHeaders(uint64_t loadAddress, size_t *count) {
+    if (loadAddress == 0) {
+        *count = (size_t)getauxval(AT_PHNUM);
+        return (const ElfW(Phdr) *)getauxval(AT_PHDR);
+    }
+    const ElfW(Ehdr) *header = (const ElfW(Ehdr) *)(uintptr_t)loadAddress;
+    if (memcmp(header->e_ident, ELFMAG, SELFMAG) != 0) {
+        return NULL;
+    }
+    *count = header->e_phnum;
+    return (const ElfW(Phdr) *)(uintptr_t)(loadAddress + header->e_phoff);
+}
+
+int selfdeLinuxGetUnwindSection(uint64_t loadAddress, SelfdeLinuxUnwindSection *section) {
+    size_t count = 0;
+    const ElfW(Phdr) *headers = getProgramHeaders(loadAddress, &count);
+    if (headers == NULL) {
+        return EINVAL;
+    }
+    const uint8_t *ehFrameHeader = NULL;
+    section->codeStart = UINT64_MAX;
+    section->codeEnd = 0;
+    for (size_t i = 0; i < count; ++i) {
+        uint64_t start = loadAddress + (uint64_t)headers[i].p_vaddr;
+        if (headers[i].p_type == PT_GNU_EH_FRAME) {
+            ehFrameHeader = (const uint8_t *)(uintptr_t)start;
+        } else if (headers[i].p_type == PT_LOAD && (headers[i].p_flags & PF_X)) {
+            if (start < section->codeStart) {
+                section->codeStart = start;
+            }
+            if (start + headers[i].p_memsz > section->codeEnd) {
+                section->codeEnd = start + headers[i].p_memsz;
+            }
+        }
+    }
+    // The header's version is 1, and the .eh_frame pointer is usually a 4 byte PC relative offset.
+    if (ehFrameHeader == NULL || ehFrameHeader[0] != 1 || section->codeStart >= section->codeEnd) {
+        return EINVAL;
+    }
+    const uint8_t *pointer = ehFrameHeader + 4;
+    switch (ehFrameHeader[1]) {
+    case 0x1B: // DW_EH_PE_pcrel | DW_EH_PE_sdata4
+        section->ehFrameAddress = (uint64_t)(uintptr_t)pointer + (uint64_t)(int64_t)*(const int32_t *)pointer;
+        break;
+    case 0x03: // DW_EH_PE_udata4
+        section->ehFrameAddress = *(const uint32_t *)pointer;
+        break;
+    case 0x00: // DW_EH_PE_absptr
+        section->ehFrameAddress = *(const uint64_t *)pointer;
+        break;
+    default:
+        return EINVAL;
+    }
+    return 0;
+}
+
+enum {
+    SelfdeSampleIdle = 0,
+    SelfdeSamplePending,
+    SelfdeSampleWalking,
+    SelfdeSampleDone
+};
+
+static SelfdeSamplingProfiler samplingProfiler = SELFDE_SAMPLING_PROFILER_INITIALIZER;
+static bool isProfileHandlerInstalled;
+
+// The thread that the profiler waits for. Its state is the futex word.
+static struct {
+    pid_t thread;
+    int state;
+    uint32_t frameCount;
+} sampleRequest;
+
+static bool readWordForProfiler(void *context, uint64_t address, uint64_t *value) {
+    (void)context;
+    return selfdeLinuxReadMemory(address, value, sizeof(*value)) == 0;
+}
+
+// A thread that was in a blocking system call is woken up by the signal, and it's going to restart the
+// call or return EINTR from it. It wasn't running, so it's left out of the profile.
+static bool isInterruptedSystemCall(const greg_t *registers) {
+    uint16_t instruction;
+    if (selfdeLinuxReadMemory((uint64_t)registers[REG_RIP], &instruction, sizeof(instruction)) == 0 && instruction == 0x050F) { // syscall
+        return true;
+    }
+    return registers[REG_RAX] == -EINTR && selfdeLinuxReadMemory((uint64_t)registers[REG_RIP] - 2, &instruction, sizeof(instruction)) == 0 && instruction == 0x050F;
+}
+
+static void profileHandler(int signalNumber, siginfo_t *info, void *context) {
+    (void)signalNumber;
+    (void)info;
+    int savedErrno = errno;
+    int expected = SelfdeSamplePending;
+    // A signal that arrives after the profiler has stopped waiting is ignored.
+    if (__atomic_load_n(&sampleRequest.thread, __ATOMIC_ACQUIRE) == selfdeLinuxGetCurrentThreadID() &&
+        __atomic_compare_exchange_n(&sampleRequest.state, &expected, SelfdeSampleWalking, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+        const greg_t *registers = ((ucontext_t *)context)->uc_mcontext.gregs;
+        sampleRequest.frameCount = isInterruptedSystemCall(registers) ? 0 : selfdeWalkFramePointers((uint64_t)registers[REG_RIP], (uint64_t)registers[REG_RSP], (uint64_t)registers[REG_RBP],
+                                                           samplingProfiler.frameBuffer, samplingProfiler.maxFrames, readWordForProfiler, NULL);
+        __atomic_store_n(&sampleRequest.state, SelfdeSampleDone, __ATOMIC_RELEASE);
+        futex(&sampleRequest.state, FUTEX_WAKE_PRIVATE, 1, NULL);
+    }
+    errno = savedErrno;
+}
+
+// The stat files of the threads stay open between the ticks, so that a tick reads the state of each
+// thread without opening its file again. They're only used by the profiler's thread.
+#define THREAD_STAT_FILE_CAPACITY 256
+
+static struct {
+    pid_t thread;
+    int descriptor;
+    uint64_t tick;
+} threadStatFiles[THREAD_STAT_FILE_CAPACITY];
+static uint32_t threadStatFileCount;
+static uint64_t profilerTick;
+
+static int openThreadStatFile(pid_t thread) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/task/%d/stat", (int)thread);
+    return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+static void closeThreadStatFile(uint32_t index) {
+    close(threadStatFiles[index].descriptor);
+    threadStatFiles[index] = threadStatFiles[--threadStatFileCount];
+}
+
+// Closes the files of the threads that weren't seen in the current tick, as they have exited.
+static void closeStaleThreadStatFiles(void) {
+    for (uint32_t i = 0; i < threadStatFileCount;) {
+        if (threadStatFiles[i].tick != profilerTick) {
+            closeThreadStatFile(i);
+        } else {
+            ++i;
+        }
+    }
+}
+
+// A CPU profile only has the threads that are running or are ready to run. The sleeping threads and
+// the threads that are parked by the debugger aren't interrupted.
+static bool isThreadRunnable(pid_t thread) {
+    uint32_t index = 0;
+    while (index < threadStatFileCount && threadStatFiles[index].thread != thread) {
+        ++index;
+    }
+    if (index == threadStatFileCount) {
+        int descriptor = openThreadStatFile(thread);
+        if (descriptor < 0) {
+            return false;
+        }
+        if (threadStatFileCount == THREAD_STAT_FILE_CAPACITY) {
+            close(descriptor);
+            return false;
+        }
+        threadStatFiles[threadStatFileCount].thread = thread;
+        threadStatFiles[threadStatFileCount].descriptor = descriptor;
+        ++threadStatFileCount;
+    }
+    threadStatFiles[index].tick = profilerTick;
+    char buffer[256];
+    ssize_t size = pread(threadStatFiles[index].descriptor, buffer, sizeof(buffer) - 1, 0);
+    if (size <= 0) {
+        // The thread has exited, and its ID might be reused by the next thread.
+        closeThreadStatFile(index);
+        return false;
+    }
+    buffer[size] = '\0';
+    // The state follows the thread's name, which is in parentheses and can contain them.
+    const char *nameEnd = strrchr(buffer, ')');
+    return nameEnd && nameEnd[1] == ' ' && nameEnd[2] == 'R';
+}
+
+static void sampleThreadsWithSignal(void *context, SelfdeSamplingProfiler *profiler) {
+    (void)context;
+    DIR *directory = opendir("/proc/self/task");
+    if (!directory) {
+        return;
+    }
+    ++profilerTick;
+    pid_t currentThread = selfdeLinuxGetCurrentThreadID();
+    struct dirent *entry;
+    while ((entry = readdir(directory)) != NULL) {
+        pid_t thread = (pid_t)strtol(entry->d_name, NULL, 10);
+        if (thread <= 0 || thread == currentThread || isIgnoredThread(thread) || !isThreadRunnable(thread)) {
+            continue;
+        }
+        __atomic_store_n(&sampleRequest.thread, thread, __ATOMIC_RELEASE);
+        __atomic_store_n(&sampleRequest.state, SelfdeSamplePending, __ATOMIC_RELEASE);
+        if (syscall(SYS_tgkill, getpid(), thread, SELFDE_PROFILE_SIGNAL) == 0) {
+            // The thread might have the signal blocked, so the sample is skipped after a while.
+            struct timespec timeout = { 0, 10000000 };
+            while (__atomic_load_n(&sampleRequest.state, __ATOMIC_ACQUIRE) == SelfdeSamplePending) {
+                if (futex(&sampleRequest.state, FUTEX_WAIT_PRIVATE, SelfdeSamplePending, &timeout) != 0 && errno == ETIMEDOUT) {
+                    break;
+                }
+            }
+            int expected = SelfdeSamplePending;
+            if (!__atomic_compare_exchange_n(&sampleRequest.state, &expected, SelfdeSampleIdle, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+                // The handler has started walking the stack, so it's going to finish.
+                int state;
+                while ((state = __atomic_load_n(&sampleRequest.state, __ATOMIC_ACQUIRE)) != SelfdeSampleDone) {
+                    futex(&sampleRequest.state, FUTEX_WAIT_PRIVATE, state, NULL);
+                }
+                selfdeSamplingProfilerRecord(profiler, sampleRequest.frameCount);
+            }
+        }
+        __atomic_store_n(&sampleRequest.state, SelfdeSampleIdle, __ATOMIC_RELEASE);
+        __atomic_store_n(&sampleRequest.thread, 0, __ATOMIC_RELEASE);
+    }
+    closedir(directory);
+    closeStaleThreadStatFiles();
+}
+
+int selfdeLinuxStartProfiling(uint32_t frequency, uint32_t maxFrames, uint32_t stackCapacity, uint32_t frameCapacity, SelfdeProfilerThreadCallback threadStarted, void *context) {
+    // The handler stays installed as a signal might still be in flight after the profiler is stopped.
+    if (!__atomic_load_n(&isProfileHandlerInstalled, __ATOMIC_ACQUIRE)) {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_sigaction = profileHandler;
+        action.sa_flags = SA_SIGINFO | SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        if (sigaction(SELFDE_PROFILE_SIGNAL, &action, NULL) != 0) {
+            return errno;
+        }
+        __atomic_store_n(&isProfileHandlerInstalled, true, __ATOMIC_RELEASE);
+    }
+    return selfdeSamplingProfilerStart(&samplingProfiler, frequency, maxFrames, stackCapacity, frameCapacity, sampleThreadsWithSignal, NULL, threadStarted, context);
+}
+
+void selfdeLinuxStopProfiling(void) {
+    selfdeSamplingProfilerStop(&samplingProfiler);
+    // A tick can't be in progress after the profiler has stopped.
+    while (threadStatFileCount > 0) {
+        closeThreadStatFile(0);
+    }
+}
+
+uint64_t selfdeLinuxEnumerateProfile(SelfdeStackCallback callback, void *context) {
+    return selfdeSamplingProfilerEnumerateStacks(&samplingProfiler, callback, context);
+}
+
+// The context is the process ID of the fork snapshot.
+static bool readCoreMemory(void *context, uint64_t address, void *buffer, size_t size) {
+    return selfdeLinuxReadProcessMemory(*(const pid_t *)context, address, buffer, size) == 0;
+}
+
+static int getCoreRegions(pid_t process, SelfdeCoreRegion **result, uint32_t *count) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/maps", (int)process);
+    FILE *maps = fopen(path, "re");
+    if (!maps) {
+        return errno;
+    }
+    SelfdeCoreRegion *regions = NULL;
+    uint32_t capacity = 0;
+    *count = 0;
+    char *line = NULL;
+    size_t lineCapacity = 0;
+    int error = 0;
+    while (getline(&line, &lineCapacity, maps) > 0) {
+        unsigned long long start, end;
+        char permissions[5];
+        int nameOffset = 0;
+        if (sscanf(line, "%llx-%llx %4s %*s %*s %*s %n", &start, &end, permissions, &nameOffset) != 3 || nameOffset == 0) {
+            continue;
+        }
+        // The vvar pages can't be read, and vsyscall is outside of the address space.
+        const char *name = line + nameOffset;
+        if (permissions[0] != 'r' || strncmp(name, "[vvar", 5) == 0 || strncmp(name, "[vsyscall]", 10) == 0) {
+            continue;
+        }
+        if (*count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            SelfdeCoreRegion *resized = realloc(regions, capacity * sizeof(SelfdeCoreRegion));
+            if (!resized) {
+                error = ENOMEM;
+                break;
+            }
+            regions = resized;
+        }
+        SelfdeCoreRegion *region = &regions[(*count)++];
+        region->address = start;
+        region->size = end - start;
+        region->sourceAddress = start;
+        region->fileOffset = 0;
+        region->protection = PROT_READ | (permissions[1] == 'w' ? PROT_WRITE : 0) | (permissions[2] == 'x' ? PROT_EXEC : 0);
+    }
+    free(line);
+    fclose(maps);
+    if (error != 0) {
+        free(regions);
+        return error;
+    }
+    *result = regions;
+    return 0;
+}
+
+int selfdeLinuxGetReadableRegions(uint64_t address, uint64_t size, SelfdeMemoryRange **regions, uint32_t *count) {
+    SelfdeCoreRegion *mappings = NULL;
+    uint32_t mappingCount = 0;
+    int error = getCoreRegions(getpid(), &mappings, &mappingCount);
+    if (error != 0) {
+        return error;
+    }
+    *regions = malloc((mappingCount > 0 ? mappingCount : 1) * sizeof(SelfdeMemoryRange));
+    *count = 0;
+    if (!*regions) {
+        free(mappings);
+        return ENOMEM;
+    }
+    uint64_t end = address + size < address ? UINT64_MAX : address + size;
+    for (uint32_t i = 0; i < mappingCount; ++i) {
+        uint64_t start = mappings[i].address > address ? mappings[i].address : address;
+        uint64_t mappingEnd = mappings[i].address + mappings[i].size;
+        if (start < end && start < mappingEnd) {
+            SelfdeMemoryRange region = { start, (mappingEnd < end ? mappingEnd : end) - start };
+            (*regions)[(*count)++] = region;
+        }
+    }
+    free(mappings);
+    return 0;
+}
+
+typedef struct NoteBuffer {
+    uint8_t *bytes;
+    size_t size;
+    size_t capacity;
+} NoteBuffer;
+
+static bool appendNote(NoteBuffer *notes, uint32_t type, const void *description, size_t descriptionSize) {
+    // The name and the description are padded to 4 bytes.
+    static const char name[8] = "CORE";
+    size_t paddedSize = (descriptionSize + 3) & ~(size_t)3;
+    size_t noteSize = sizeof(Elf64_Nhdr) + sizeof(name) + paddedSize;
+    if (notes->size + noteSize > notes->capacity) {
+        size_t capacity = (notes->size + noteSize) * 2;
+        uint8_t *resized = realloc(notes->bytes, capacity);
+        if (!resized) {
+            return false;
+        }
+        notes->bytes = resized;
+        notes->capacity = capacity;
+    }
+    Elf64_Nhdr header = { 5, (Elf64_Word)descriptionSize, type };
+    uint8_t *note = notes->bytes + notes->size;
+    memcpy(note, &header, sizeof(header));
+    memcpy(note + sizeof(header), name, sizeof(name));
+    memcpy(note + sizeof(header) + sizeof(name), description, descriptionSize);
+    memset(note + sizeof(header) + sizeof(name) + descriptionSize, 0, paddedSize - descriptionSize);
+    notes->size += noteSize;
+    return true;
+}
+
+// Reads a small file from /proc, returns its size or -1.
+static ssize_t readProcFile(const char *path, void *buffer, size_t size) {
+    int descriptor = open(path, O_RDONLY | O_CLOEXEC);
+    if (descriptor < 0) {
+        return -1;
+    }
+    size_t total = 0;
+    ssize_t result;
+    while (total < size && (result = read(descriptor, (uint8_t *)buffer + total, size - total)) > 0) {
+        total += (size_t)result;
+    }
+    close(descriptor);
+    return (ssize_t)total;
+}
+
+static bool appendProcessNotes(NoteBuffer *notes) {
+    struct elf_prpsinfo info;
+    memset(&info, 0, sizeof(info));
+    info.pr_sname = 'R';
+    info.pr_uid = getuid();
+    info.pr_gid = getgid();
+    info.pr_pid = getpid();
+    info.pr_ppid = getppid();
+    info.pr_pgrp = getpgrp();
+    info.pr_sid = getsid(0);
+    ssize_t size = readProcFile("/proc/self/comm", info.pr_fname, sizeof(info.pr_fname) - 1);
+    if (size > 0 && info.pr_fname[size - 1] == '\n') {
+        info.pr_fname[size - 1] = '\0';
+    }
+    // The arguments are separated by zeros.
+    size = readProcFile("/proc/self/cmdline", info.pr_psargs, sizeof(info.pr_psargs) - 1);
+    for (ssize_t i = 0; i + 1 < size; ++i) {
+        if (info.pr_psargs[i] == '\0') {
+            info.pr_psargs[i] = ' ';
+        }
+    }
+    if (!appendNote(notes, NT_PRPSINFO, &info, sizeof(info))) {
+        return false;
+    }
+    // The debuggers find the executable's program headers and the dynamic linker through the auxiliary vector.
+    uint8_t auxv[4096];
+    size = readProcFile("/proc/self/auxv", auxv, sizeof(auxv));
+    return size <= 0 || appendNote(notes, NT_AUXV, auxv, (size_t)size);
+}
+
+static bool appendThreadNotes(NoteBuffer *notes, const SelfdeLinuxCoreThread *thread) {
+    const x86_thread_state64_t *state = &thread->state;
+    struct user_regs_struct registers;
+    memset(&registers, 0, sizeof(registers));
+    registers.r15 = state->__r15;
+    registers.r14 = state->__r14;
+    registers.r13 = state->__r13;
+    registers.r12 = state->__r12;
+    registers.rbp = state->__rbp;
+    registers.rbx = state->__rbx;
+    registers.r11 = state->__r11;
+    registers.r10 = state->__r10;
+    registers.r9 = state->__r9;
+    registers.r8 = state->__r8;
+    registers.rax = state->__rax;
+    registers.rcx = state->__rcx;
+    registers.rdx = state->__rdx;
+    registers.rsi = state->__rsi;
+    registers.rdi = state->__rdi;
+    registers.orig_rax = (unsigned long long)-1;
+    registers.rip = state->__rip;
+    registers.cs = state->__cs;
+    registers.eflags = state->__rflags;
+    registers.rsp = state->__rsp;
+    registers.ss = 0x2B;
+    registers.fs = state->__fs;
+    registers.gs = state->__gs;
+
+    struct elf_prstatus status;
+    memset(&status, 0, sizeof(status));
+    status.pr_info.si_signo = thread->signalNumber;
+    status.pr_cursig = (short)thread->signalNumber;
+    status.pr_pid = thread->thread;
+    status.pr_ppid = getppid();
+    status.pr_pgrp = getpgrp();
+    status.pr_sid = getsid(0);
+    memcpy(&status.pr_reg, &registers, sizeof(status.pr_reg));
+    status.pr_fpvalid = 1;
+    // The FPU state from '__fpu_fcw' on is the FXSAVE area.
+    struct user_fpregs_struct fpuRegisters;
+    memcpy(&fpuRegisters, &thread->fpuState.__fpu_fcw, sizeof(fpuRegisters));
+    return appendNote(notes, NT_PRSTATUS, &status, sizeof(status)) && appendNote(notes, NT_FPREGSET, &fpuRegisters, sizeof(fpuRegisters));
+}
+
+static Elf64_Word getSegmentFlags(uint32_t protection) {
+    return ((protection & PROT_READ) ? PF_R : 0) | ((protection & PROT_WRITE) ? PF_W : 0) | ((protection & PROT_EXEC) ? PF_X : 0);
+}
+
+int selfdeLinuxWriteCore(int fd, pid_t process, const SelfdeLinuxCoreThread *threads, uint32_t threadCount, uint32_t copyThreadCount, bool elideZeroPages, SelfdeCoreDumpStatistics *statistics) {
+    memset(statistics, 0, sizeof(*statistics));
+    SelfdeCoreRegion *regions = NULL;
+    uint32_t regionCount = 0;
+    int error = getCoreRegions(process, &regions, &regionCount);
+    if (error != 0) {
+        return error;
+    }
+    if (regionCount + 1 >= PN_XNUM) {
+        free(regions);
+        return E2BIG;
+    }
+    NoteBuffer notes = { NULL, 0, 0 };
+    bool hasNotes = appendProcessNotes(&notes);
+    for (uint32_t i = 0; hasNotes && i < threadCount; ++i) {
+        hasNotes = appendThreadNotes(&notes, &threads[i]);
+    }
+    size_t programHeadersSize = (regionCount + 1) * sizeof(Elf64_Phdr);
+    size_t headerSize = sizeof(Elf64_Ehdr) + programHeadersSize + notes.size;
+    uint8_t *header = hasNotes ? calloc(1, headerSize) : NULL;
+    if (!header) {
+        free(notes.bytes);
+        free(regions);
+        return ENOMEM;
+    }
+    uint64_t fileSize = selfdeCoreLayoutRegions(regions, regionCount, headerSize);
+
+    Elf64_Ehdr *elfHeader = (Elf64_Ehdr *)header;
+    memcpy(elfHeader->e_ident, ELFMAG, SELFMAG);
+    elfHeader->e_ident[EI_CLASS] = ELFCLASS64;
+    elfHeader->e_ident[EI_DATA] = ELFDATA2LSB;
+    elfHeader->e_ident[EI_VERSION] = EV_CURRENT;
+    elfHeader->e_ident[EI_OSABI] = ELFOSABI_NONE;
+    elfHeader->e_type = ET_CORE;
+    elfHeader->e_machine = EM_X86_64;
+    elfHeader->e_version = EV_CURRENT;
+    elfHeader->e_phoff = sizeof(Elf64_Ehdr);
+    elfHeader->e_ehsize = sizeof(Elf64_Ehdr);
+    elfHeader->e_phentsize = sizeof(Elf64_Phdr);
+    elfHeader->e_phnum = (Elf64_Half)(regionCount + 1);
+    Elf64_Phdr *programHeaders = (Elf64_Phdr *)(header + sizeof(Elf64_Ehdr));
+    programHeaders[0].p_type = PT_NOTE;
+    programHeaders[0].p_offset = sizeof(Elf64_Ehdr) + programHeadersSize;
+    programHeaders[0].p_filesz = notes.size;
+    programHeaders[0].p_align = 4;
+    memcpy(header + programHeaders[0].p_offset, notes.bytes, notes.size);
+    for (uint32_t i = 0; i < regionCount; ++i) {
+        Elf64_Phdr *segment = &programHeaders[i + 1];
+        segment->p_type = PT_LOAD;
+        segment->p_flags = getSegmentFlags(regions[i].protection);
+        segment->p_offset = regions[i].fileOffset;
+        segment->p_vaddr = regions[i].address;
+        segment->p_filesz = regions[i].size;
+        segment->p_memsz = regions[i].size;
+        segment->p_align = SELFDE_CORE_PAGE_SIZE;
+    }
+
+    // The file has its full size up front, so that the elided pages are holes that read back as zeros.
+    if (ftruncate(fd, (off_t)fileSize) != 0) {
+        error = errno;
+    } else {
+        error = selfdeCoreWrite(fd, header, headerSize, 0);
+    }
+    statistics->threadCount = threadCount;
+    statistics->regionCount = regionCount;
+    if (error == 0) {
+        statistics->writtenBytes = headerSize;
+        error = selfdeCoreWriteRegions(fd, regions, regionCount, copyThreadCount, elideZeroPages, readCoreMemory, &process, statistics);
+    }
+    free(header);
+    free(notes.bytes);
+    free(regions);
+    return error;
+}
+
+int HasAVX(void) {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return 0;
+    }
+    // OSXSAVE and AVX.
+    if ((ecx & 0x18000000) != 0x18000000) {
+        return 0;
+    }
+    uint32_t xcr0, xcr0High;
+    __asm__ volatile(".byte 0x0f, 0x01, 0xd0" : "=a"(xcr0), "=d"(xcr0High) : "c"(0)); // xgetbv
+    // The OS saves both the XMM and the YMM state.
+    return (xcr0 & 0x06) == 0x06;
+}
+
+pid_t selfdeLinuxForkSnapshot(int *error) {
+    pid_t parent = getpid();
+    // fork() would run the atfork handlers and take the malloc locks, which the stopped threads might hold.
+    // The child has no exit signal, so the host's SIGCHLD handler isn't run for it and a reaper that
+    // waits for any child doesn't collect it, as only the waits with __WCLONE see such a child.
+    long child = syscall(SYS_clone, 0, 0, NULL, NULL, 0);
+    if (child < 0) {
+        *error = errno;
+        return -1;
+    }
+    if (child == 0) {
+        // Only the forking thread exists in the child, and it only waits for SIGKILL. It doesn't
+        // touch its memory, so the memory stays the way it was at the fork.
+        sigset_t mask;
+        sigfillset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+        prctl(PR_SET_PDEATHSIG, SIGKILL, 0, 0, 0);
+        if (getppid() != parent) {
+            _exit(0);
+        }
+        while (true) {
+            pause();
+        }
+    }
+    *error = 0;
+    return (pid_t)child;
+}
+
+void selfdeLinuxReleaseForkSnapshot(pid_t process) {
+    kill(process, SIGKILL);
+    while (waitpid(process, NULL, __WCLONE) < 0 && errno == EINTR) {
+    }
+}
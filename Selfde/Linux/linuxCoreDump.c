@@ -0,0 +1,7 @@
+//
+//  linuxCoreDump.c
+//  Selfde
+//
+
+// The region copy is shared with the Mach implementation.
+#include "../coreDump.c"
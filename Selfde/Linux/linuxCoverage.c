@@ -0,0 +1,7 @@
+//
+//  linuxCoverage.c
+//  Selfde
+//
+
+// The coverage sites are shared with the Mach implementation.
+#include "../coverage.c"
@@ -0,0 +1,7 @@
+//
+//  linuxDirtyPages.c
+//  Selfde
+//
+
+// The dirty page tracking is shared with the Mach implementation.
+#include "../dirtyPages.c"
@@ -0,0 +1,7 @@
+//
+//  linuxLivePatchX86_64.c
+//  Selfde
+//
+
+// The live patching is shared with the Mach implementation.
+#include "../livePatchX86_64.c"
@@ -0,0 +1,7 @@
+//
+//  linuxMemoryChecksum.c
+//  Selfde
+//
+
+// The memory checksums are shared with the Mach implementation.
+#include "../memoryChecksum.c"
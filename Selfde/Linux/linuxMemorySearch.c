@@ -0,0 +1,7 @@
+//
+//  linuxMemorySearch.c
+//  Selfde
+//
+
+// The memory search is shared with the Mach implementation.
+#include "../memorySearch.c"
@@ -0,0 +1,7 @@
+//
+//  linuxRegisterInfoX86_64.cpp
+//  Selfde
+//
+
+// The register tables are shared with the Mach implementation.
+#include "../DNBRegisterInfoX86_64.cpp"
@@ -0,0 +1,7 @@
+//
+//  linuxSamplingProfiler.c
+//  Selfde
+//
+
+// The sampling loop and the stack table are shared with the Mach implementation.
+#include "../samplingProfiler.c"
@@ -0,0 +1,944 @@
+//
+//  linuxTracerImpl.c
+//  Selfde
+//
+
+#define _GNU_SOURCE
+#include "linuxTracerImpl.h"
+#include <dirent.h>
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/ptrace.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define SELFDE_TRACER_MAX_THREADS 1024
+#define SELFDE_TRACER_MAX_IGNORED_THREADS 16
+#define SELFDE_TRACER_MAX_EVENTS 256
+#define SELFDE_TRACER_DATA_SIZE 4096
+
+enum {
+    SelfdeHelperStarting = 0,
+    SelfdeHelperAuthorized,
+    SelfdeHelperReady,
+    SelfdeHelperExited
+};
+
+enum {
+    SelfdeTracerStopThread = 1,
+    SelfdeTracerResumeThread,
+    SelfdeTracerGetState,
+    SelfdeTracerSetState,
+    SelfdeTracerGetDebugRegisters,
+    SelfdeTracerSetDebugRegister,
+    SelfdeTracerWriteMemory,
+    SelfdeTracerQuit
+};
+
+// Which states a get/set request transfers.
+enum {
+    SelfdeTracerGPRState = 1,
+    SelfdeTracerFPUState = 2,
+    SelfdeTracerAVXState = 4,
+    SelfdeTracerEXCState = 8
+};
+
+// A thread that the helper has seized. Only the helper writes the records.
+typedef struct SelfdeTracedThread {
+    pid_t thread;
+    int stopped;
+    int interruptRequested;
+    // A PTRACE_INTERRUPT stop that's still pending after the thread stopped for another reason.
+    int staleInterrupt;
+    // The signal that's delivered when the thread is resumed.
+    int pendingSignal;
+    SelfdeLinuxStopEvent lastStop;
+} SelfdeTracedThread;
+
+typedef struct SelfdeTracerStates {
+    uint32_t flags;
+    x86_thread_state64_t state;
+    x86_float_state64_t fpuState;
+    x86_avx_state64_t avxState;
+    x86_exception_state64_t excState;
+} SelfdeTracerStates;
+
+// The memory that's shared between the debugger and the helper.
+// The futex words are waited on by both processes, so they use the shared futex operations.
+typedef struct SelfdeTracerChannel {
+    int helperState;
+    int helperError;
+    // A request is published by incrementing 'requestSequence', and is done when 'replySequence' matches it.
+    int requestSequence;
+    int replySequence;
+    int operation;
+    pid_t thread;
+    uint64_t arguments[2];
+    int result;
+    union {
+        SelfdeTracerStates states;
+        uint64_t debugRegisters[8];
+        uint8_t bytes[SELFDE_TRACER_DATA_SIZE];
+    } data;
+    // The stops that are reported to the debugger.
+    uint32_t eventHead;
+    uint32_t eventTail;
+    SelfdeLinuxStopEvent events[SELFDE_TRACER_MAX_EVENTS];
+    pid_t ignoredThreads[SELFDE_TRACER_MAX_IGNORED_THREADS];
+    SelfdeLinuxSignalFilter signalFilter;
+    SelfdeTracedThread threads[SELFDE_TRACER_MAX_THREADS];
+} SelfdeTracerChannel;
+
+struct SelfdeLinuxTracer {
+    SelfdeTracerChannel *channel;
+    pid_t helper;
+    bool helperExited;
+    // Wakes up the helper when there's a request.
+    int doorbell;
+    pthread_mutex_t requestMutex;
+};
+
+static long futex(int *word, int operation, int value, const struct timespec *timeout) {
+    return syscall(SYS_futex, word, operation, value, timeout, NULL, 0);
+}
+
+static bool isIgnoredThread(SelfdeTracerChannel *channel, pid_t thread) {
+    for (int i = 0; i < SELFDE_TRACER_MAX_IGNORED_THREADS; ++i) {
+        if (__atomic_load_n(&channel->ignoredThreads[i], __ATOMIC_ACQUIRE) == thread) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static SelfdeTracedThread *findTracedThread(SelfdeTracerChannel *channel, pid_t thread, bool create) {
+    SelfdeTracedThread *unused = NULL;
+    for (int i = 0; i < SELFDE_TRACER_MAX_THREADS; ++i) {
+        pid_t recordThread = __atomic_load_n(&channel->threads[i].thread, __ATOMIC_ACQUIRE);
+        if (recordThread == thread) {
+            return &channel->threads[i];
+        }
+        if (recordThread == 0 && !unused) {
+            unused = &channel->threads[i];
+        }
+    }
+    if (!create || !unused) {
+        return NULL;
+    }
+    memset(unused, 0, sizeof(*unused));
+    __atomic_store_n(&unused->thread, thread, __ATOMIC_RELEASE);
+    return unused;
+}
+
+static SelfdeTracedThread *findStoppedThread(SelfdeTracerChannel *channel, pid_t thread) {
+    SelfdeTracedThread *record = findTracedThread(channel, thread, false);
+    if (!record || !__atomic_load_n(&record->stopped, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return record;
+}
+
+//----------------------------------------------------------------------
+// The helper process.
+//----------------------------------------------------------------------
+
+static bool isTrapSignal(int signalNumber) {
+    return signalNumber == SIGTRAP || signalNumber == SIGSEGV || signalNumber == SIGBUS || signalNumber == SIGILL;
+}
+
+static void markStopped(SelfdeTracerChannel *channel, SelfdeTracedThread *record, const SelfdeLinuxStopEvent *event, bool report) {
+    record->lastStop = *event;
+    __atomic_store_n(&record->stopped, 1, __ATOMIC_RELEASE);
+    if (!report) {
+        return;
+    }
+    uint32_t tail = channel->eventTail;
+    if (tail - __atomic_load_n(&channel->eventHead, __ATOMIC_ACQUIRE) >= SELFDE_TRACER_MAX_EVENTS) {
+        // The debugger isn't keeping up, the thread still shows up as stopped.
+        return;
+    }
+    channel->events[tail % SELFDE_TRACER_MAX_EVENTS] = *event;
+    __atomic_store_n(&channel->eventTail, tail + 1, __ATOMIC_RELEASE);
+    futex((int *)&channel->eventTail, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+static void handleWaitStatus(SelfdeTracerChannel *channel, pid_t thread, int status) {
+    SelfdeTracedThread *record = findTracedThread(channel, thread, true);
+    if (!record) {
+        ptrace(PTRACE_CONT, thread, 0, 0);
+        return;
+    }
+    if (WIFEXITED(status) || WIFSIGNALED(status)) {
+        __atomic_store_n(&record->stopped, 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&record->thread, 0, __ATOMIC_RELEASE);
+        return;
+    }
+    if (!WIFSTOPPED(status)) {
+        return;
+    }
+    int signalNumber = WSTOPSIG(status);
+    int event = status >> 16;
+    if (event == PTRACE_EVENT_STOP) {
+        if (record->interruptRequested) {
+            record->interruptRequested = 0;
+            SelfdeLinuxStopEvent stop = { thread, SIGSTOP, 0, 0 };
+            markStopped(channel, record, &stop, false);
+            return;
+        }
+        // New threads, group stops and late interrupts keep running.
+        record->staleInterrupt = 0;
+        ptrace(PTRACE_CONT, thread, 0, 0);
+        return;
+    }
+    if (event != 0) {
+        // PTRACE_EVENT_CLONE, the new thread is attached automatically.
+        ptrace(PTRACE_CONT, thread, 0, 0);
+        return;
+    }
+    // Signal delivery stop.
+    if (isTrapSignal(signalNumber) && !isIgnoredThread(channel, thread)) {
+        siginfo_t info;
+        memset(&info, 0, sizeof(info));
+        ptrace(PTRACE_GETSIGINFO, thread, 0, &info);
+        switch (selfdeLinuxGetSignalDisposition(&channel->signalFilter, signalNumber, info.si_code)) {
+        case SelfdeLinuxSignalPass:
+            ptrace(PTRACE_CONT, thread, 0, signalNumber);
+            return;
+        case SelfdeLinuxSignalDiscard:
+            ptrace(PTRACE_CONT, thread, 0, 0);
+            return;
+        case SelfdeLinuxSignalStop:
+            break;
+        }
+        SelfdeLinuxStopEvent stop = { thread, signalNumber, info.si_code, (uint64_t)(uintptr_t)info.si_addr };
+        // The trap is consumed, like a Mach exception.
+        record->pendingSignal = 0;
+        if (record->interruptRequested) {
+            record->interruptRequested = 0;
+            record->staleInterrupt = 1;
+        }
+        markStopped(channel, record, &stop, true);
+        return;
+    }
+    if (record->interruptRequested) {
+        // The thread is stopped already, so the signal is delivered when it's resumed.
+        record->interruptRequested = 0;
+        record->staleInterrupt = 1;
+        record->pendingSignal = signalNumber;
+        SelfdeLinuxStopEvent stop = { thread, SIGSTOP, 0, 0 };
+        markStopped(channel, record, &stop, false);
+        return;
+    }
+    ptrace(PTRACE_CONT, thread, 0, signalNumber);
+}
+
+static void drainWaitStatuses(SelfdeTracerChannel *channel) {
+    while (true) {
+        int status;
+        pid_t thread = waitpid(-1, &status, __WALL | WNOHANG);
+        if (thread <= 0) {
+            return;
+        }
+        handleWaitStatus(channel, thread, status);
+    }
+}
+
+// Reads the thread IDs of the given process without allocating, as the helper
+// is forked from a multithreaded process.
+static int readThreadIDs(pid_t process, pid_t *threads, int capacity) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/task", (int)process);
+    int directory = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (directory < 0) {
+        return -1;
+    }
+    int count = 0;
+    char buffer[4096];
+    while (true) {
+        long size = syscall(SYS_getdents64, directory, buffer, sizeof(buffer));
+        if (size <= 0) {
+            break;
+        }
+        for (long offset = 0; offset < size;) {
+            struct dirent64 *entry = (struct dirent64 *)(buffer + offset);
+            pid_t thread = (pid_t)strtol(entry->d_name, NULL, 10);
+            if (thread > 0) {
+                if (count < capacity) {
+                    threads[count] = thread;
+                }
+                count += 1;
+            }
+            offset += entry->d_reclen;
+        }
+    }
+    close(directory);
+    return count;
+}
+
+static int seizeThreads(SelfdeTracerChannel *channel, pid_t process) {
+    pid_t threads[SELFDE_TRACER_MAX_THREADS];
+    // New threads of the seized threads are attached with PTRACE_O_TRACECLONE, repeat
+    // until the threads that were created in the meantime are seized as well.
+    bool seizedAny = true;
+    while (seizedAny) {
+        seizedAny = false;
+        int count = readThreadIDs(process, threads, SELFDE_TRACER_MAX_THREADS);
+        if (count < 0) {
+            return errno;
+        }
+        for (int i = 0; i < count && i < SELFDE_TRACER_MAX_THREADS; ++i) {
+            if (findTracedThread(channel, threads[i], false)) {
+                continue;
+            }
+            if (ptrace(PTRACE_SEIZE, threads[i], 0, PTRACE_O_TRACECLONE) != 0) {
+                if (errno == ESRCH) {
+                    continue;
+                }
+                return errno;
+            }
+            findTracedThread(channel, threads[i], true);
+            seizedAny = true;
+        }
+    }
+    return 0;
+}
+
+static int stopTracedThread(SelfdeTracerChannel *channel, pid_t thread) {
+    SelfdeTracedThread *record = findTracedThread(channel, thread, false);
+    if (!record) {
+        return ESRCH;
+    }
+    if (record->stopped) {
+        return 0;
+    }
+    if (ptrace(PTRACE_INTERRUPT, thread, 0, 0) != 0) {
+        return errno;
+    }
+    record->interruptRequested = 1;
+    while (!record->stopped) {
+        int status;
+        pid_t result = waitpid(thread, &status, __WALL);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+        handleWaitStatus(channel, result, status);
+        if (__atomic_load_n(&record->thread, __ATOMIC_ACQUIRE) != thread) {
+            return ESRCH;
+        }
+    }
+    return 0;
+}
+
+static int resumeTracedThread(SelfdeTracerChannel *channel, pid_t thread) {
+    SelfdeTracedThread *record = findStoppedThread(channel, thread);
+    if (!record) {
+        return ESRCH;
+    }
+    __atomic_store_n(&record->stopped, 0, __ATOMIC_RELEASE);
+    int signalNumber = record->pendingSignal;
+    record->pendingSignal = 0;
+    if (ptrace(PTRACE_CONT, thread, 0, signalNumber) != 0) {
+        int error = errno;
+        __atomic_store_n(&record->stopped, 1, __ATOMIC_RELEASE);
+        return error;
+    }
+    return 0;
+}
+
+// The XSAVE area that PTRACE_GETREGSET returns has the same layout as the one in the signal frame.
+#define SELFDE_FXSAVE_SIZE 512
+#define SELFDE_XSAVE_YMMH_OFFSET 576
+#define SELFDE_XSAVE_YMMH_SIZE 256
+#define SELFDE_XSTATE_YMM 4
+
+static uint8_t xsaveBuffer[16384] __attribute__((aligned(64)));
+
+static int getRegisterSet(pid_t thread, int type, void *buffer, size_t *size) {
+    struct iovec vector = { buffer, *size };
+    if (ptrace(PTRACE_GETREGSET, thread, (void *)(uintptr_t)type, &vector) != 0) {
+        return errno;
+    }
+    *size = vector.iov_len;
+    return 0;
+}
+
+static int setRegisterSet(pid_t thread, int type, void *buffer, size_t size) {
+    struct iovec vector = { buffer, size };
+    return ptrace(PTRACE_SETREGSET, thread, (void *)(uintptr_t)type, &vector) == 0 ? 0 : errno;
+}
+
+static uint16_t getTrapNumber(const SelfdeLinuxStopEvent *stop) {
+    // ptrace doesn't have the trap number, so it's derived from the signal.
+    switch (stop->signalNumber) {
+    case SIGTRAP:
+        return stop->signalCode == TRAP_TRACE ? 1 : 3;
+    case SIGSEGV:
+    case SIGBUS:
+        return 14;
+    case SIGILL:
+        return 6;
+    default:
+        return 0;
+    }
+}
+
+static int getTracedThreadState(SelfdeTracedThread *record, SelfdeTracerStates *states) {
+    pid_t thread = record->thread;
+    if (states->flags & SelfdeTracerGPRState) {
+        struct user_regs_struct registers;
+        size_t size = sizeof(registers);
+        int error = getRegisterSet(thread, NT_PRSTATUS, &registers, &size);
+        if (error != 0) {
+            return error;
+        }
+        x86_thread_state64_t *state = &states->state;
+        state->__rax = registers.rax;
+        state->__rbx = registers.rbx;
+        state->__rcx = registers.rcx;
+        state->__rdx = registers.rdx;
+        state->__rdi = registers.rdi;
+        state->__rsi = registers.rsi;
+        state->__rbp = registers.rbp;
+        state->__rsp = registers.rsp;
+        state->__r8 = registers.r8;
+        state->__r9 = registers.r9;
+        state->__r10 = registers.r10;
+        state->__r11 = registers.r11;
+        state->__r12 = registers.r12;
+        state->__r13 = registers.r13;
+        state->__r14 = registers.r14;
+        state->__r15 = registers.r15;
+        state->__rip = registers.rip;
+        state->__rflags = registers.eflags;
+        state->__cs = registers.cs;
+        state->__fs = registers.fs;
+        state->__gs = registers.gs;
+    }
+    if (states->flags & SelfdeTracerFPUState) {
+        memset(&states->fpuState, 0, sizeof(states->fpuState));
+        size_t size = SELFDE_FXSAVE_SIZE;
+        int error = getRegisterSet(thread, NT_PRFPREG, &states->fpuState.__fpu_fcw, &size);
+        if (error != 0) {
+            return error;
+        }
+    }
+    if (states->flags & SelfdeTracerAVXState) {
+        memset(&states->avxState, 0, sizeof(states->avxState));
+        size_t size = sizeof(xsaveBuffer);
+        int error = getRegisterSet(thread, NT_X86_XSTATE, xsaveBuffer, &size);
+        if (error != 0) {
+            return error;
+        }
+        memcpy(&states->avxState.__fpu_fcw, xsaveBuffer, SELFDE_FXSAVE_SIZE);
+        uint64_t features = *(const uint64_t *)(xsaveBuffer + SELFDE_FXSAVE_SIZE);
+        if ((features & SELFDE_XSTATE_YMM) && size >= SELFDE_XSAVE_YMMH_OFFSET + SELFDE_XSAVE_YMMH_SIZE) {
+            memcpy(&states->avxState.__fpu_ymmh0, xsaveBuffer + SELFDE_XSAVE_YMMH_OFFSET, SELFDE_XSAVE_YMMH_SIZE);
+        }
+    }
+    if (states->flags & SelfdeTracerEXCState) {
+        states->excState.__trapno = getTrapNumber(&record->lastStop);
+        states->excState.__cpu = 0;
+        states->excState.__err = 0;
+        states->excState.__faultvaddr = record->lastStop.faultAddress;
+    }
+    return 0;
+}
+
+static int setTracedThreadState(SelfdeTracedThread *record, const SelfdeTracerStates *states) {
+    pid_t thread = record->thread;
+    if (states->flags & SelfdeTracerGPRState) {
+        struct user_regs_struct registers;
+        size_t size = sizeof(registers);
+        int error = getRegisterSet(thread, NT_PRSTATUS, &registers, &size);
+        if (error != 0) {
+            return error;
+        }
+        const x86_thread_state64_t *state = &states->state;
+        registers.rax = state->__rax;
+        registers.rbx = state->__rbx;
+        registers.rcx = state->__rcx;
+        registers.rdx = state->__rdx;
+        registers.rdi = state->__rdi;
+        registers.rsi = state->__rsi;
+        registers.rbp = state->__rbp;
+        registers.rsp = state->__rsp;
+        registers.r8 = state->__r8;
+        registers.r9 = state->__r9;
+        registers.r10 = state->__r10;
+        registers.r11 = state->__r11;
+        registers.r12 = state->__r12;
+        registers.r13 = state->__r13;
+        registers.r14 = state->__r14;
+        registers.r15 = state->__r15;
+        registers.rip = state->__rip;
+        registers.eflags = state->__rflags;
+        // NB: The segment registers are left alone, like in the signal handlers.
+        error = setRegisterSet(thread, NT_PRSTATUS, &registers, sizeof(registers));
+        if (error != 0) {
+            return error;
+        }
+    }
+    if (states->flags & SelfdeTracerFPUState) {
+        int error = setRegisterSet(thread, NT_PRFPREG, (void *)&states->fpuState.__fpu_fcw, SELFDE_FXSAVE_SIZE);
+        if (error != 0) {
+            return error;
+        }
+    }
+    if (states->flags & SelfdeTracerAVXState) {
+        size_t size = sizeof(xsaveBuffer);
+        int error = getRegisterSet(thread, NT_X86_XSTATE, xsaveBuffer, &size);
+        if (error != 0) {
+            return error;
+        }
+        memcpy(xsaveBuffer, &states->avxState.__fpu_fcw, 464);
+        if (size >= SELFDE_XSAVE_YMMH_OFFSET + SELFDE_XSAVE_YMMH_SIZE) {
+            // x87, SSE and AVX are no longer in their initial state.
+            *(uint64_t *)(xsaveBuffer + SELFDE_FXSAVE_SIZE) |= 3 | SELFDE_XSTATE_YMM;
+            memcpy(xsaveBuffer + SELFDE_XSAVE_YMMH_OFFSET, &states->avxState.__fpu_ymmh0, SELFDE_XSAVE_YMMH_SIZE);
+        }
+        error = setRegisterSet(thread, NT_X86_XSTATE, xsaveBuffer, size);
+        if (error != 0) {
+            return error;
+        }
+    }
+    return 0;
+}
+
+static int serveRequest(SelfdeTracerChannel *channel, int memoryDescriptor) {
+    pid_t thread = channel->thread;
+    switch (channel->operation) {
+    case SelfdeTracerStopThread:
+        return stopTracedThread(channel, thread);
+    case SelfdeTracerResumeThread:
+        return resumeTracedThread(channel, thread);
+    case SelfdeTracerGetState:
+    case SelfdeTracerSetState: {
+        SelfdeTracedThread *record = findStoppedThread(channel, thread);
+        if (!record) {
+            return ESRCH;
+        }
+        return channel->operation == SelfdeTracerGetState ? getTracedThreadState(record, &channel->data.states) : setTracedThreadState(record, &channel->data.states);
+    }
+    case SelfdeTracerGetDebugRegisters:
+        for (int i = 0; i < 8; ++i) {
+            errno = 0;
+            long value = ptrace(PTRACE_PEEKUSER, thread, (void *)(offsetof(struct user, u_debugreg) + i * sizeof(long)), 0);
+            if (errno != 0) {
+                return errno;
+            }
+            channel->data.debugRegisters[i] = (uint64_t)value;
+        }
+        return 0;
+    case SelfdeTracerSetDebugRegister:
+        if (channel->arguments[0] >= 8) {
+            return EINVAL;
+        }
+        if (ptrace(PTRACE_POKEUSER, thread, (void *)(offsetof(struct user, u_debugreg) + channel->arguments[0] * sizeof(long)), (void *)(uintptr_t)channel->arguments[1]) != 0) {
+            return errno;
+        }
+        return 0;
+    case SelfdeTracerWriteMemory: {
+        // Writes through /proc/pid/mem ignore the page protections.
+        size_t size = (size_t)channel->arguments[1];
+        if (size > SELFDE_TRACER_DATA_SIZE) {
+            return EINVAL;
+        }
+        ssize_t result = pwrite(memoryDescriptor, channel->data.bytes, size, (off_t)channel->arguments[0]);
+        if (result < 0) {
+            return errno;
+        }
+        return (size_t)result == size ? 0 : EFAULT;
+    }
+    default:
+        return EINVAL;
+    }
+}
+
+static void helperExit(SelfdeTracerChannel *channel, int error) {
+    channel->helperError = error;
+    __atomic_store_n(&channel->helperState, SelfdeHelperExited, __ATOMIC_RELEASE);
+    futex(&channel->helperState, FUTEX_WAKE, INT_MAX, NULL);
+    futex(&channel->replySequence, FUTEX_WAKE, INT_MAX, NULL);
+    futex((int *)&channel->eventTail, FUTEX_WAKE, INT_MAX, NULL);
+    _exit(error == 0 ? 0 : 1);
+}
+
+static void runHelper(SelfdeTracerChannel *channel, int doorbell, pid_t process) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    int signalDescriptor = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+    if (signalDescriptor < 0) {
+        helperExit(channel, errno);
+    }
+
+    // Wait until the process lets us trace it.
+    while (__atomic_load_n(&channel->helperState, __ATOMIC_ACQUIRE) == SelfdeHelperStarting) {
+        struct timespec timeout = { 1, 0 };
+        futex(&channel->helperState, FUTEX_WAIT, SelfdeHelperStarting, &timeout);
+        if (getppid() != process) {
+            helperExit(channel, ESRCH);
+        }
+    }
+    int error = seizeThreads(channel, process);
+    if (error != 0) {
+        helperExit(channel, error);
+    }
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/mem", (int)process);
+    int memoryDescriptor = open(path, O_RDWR | O_CLOEXEC);
+    if (memoryDescriptor < 0) {
+        helperExit(channel, errno);
+    }
+    __atomic_store_n(&channel->helperState, SelfdeHelperReady, __ATOMIC_RELEASE);
+    futex(&channel->helperState, FUTEX_WAKE, INT_MAX, NULL);
+
+    int handledSequence = 0;
+    struct pollfd descriptors[2] = {
+        { doorbell, POLLIN, 0 },
+        { signalDescriptor, POLLIN, 0 }
+    };
+    while (true) {
+        if (getppid() != process) {
+            helperExit(channel, 0);
+        }
+        if (poll(descriptors, 2, 1000) < 0 && errno != EINTR) {
+            helperExit(channel, errno);
+        }
+        if (descriptors[1].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            while (read(signalDescriptor, &info, sizeof(info)) > 0) {
+            }
+        }
+        drainWaitStatuses(channel);
+        if (descriptors[0].revents & POLLIN) {
+            uint64_t value;
+            read(doorbell, &value, sizeof(value));
+        }
+        int sequence = __atomic_load_n(&channel->requestSequence, __ATOMIC_ACQUIRE);
+        if (sequence == handledSequence) {
+            continue;
+        }
+        bool quit = channel->operation == SelfdeTracerQuit;
+        channel->result = quit ? 0 : serveRequest(channel, memoryDescriptor);
+        handledSequence = sequence;
+        __atomic_store_n(&channel->replySequence, sequence, __ATOMIC_RELEASE);
+        futex(&channel->replySequence, FUTEX_WAKE, INT_MAX, NULL);
+        if (quit) {
+            // The threads are detached when the tracer exits.
+            helperExit(channel, 0);
+        }
+    }
+}
+
+//----------------------------------------------------------------------
+// The debugger side.
+//----------------------------------------------------------------------
+
+static bool isHelperAlive(SelfdeLinuxTracer *tracer) {
+    if (tracer->helperExited || __atomic_load_n(&tracer->channel->helperState, __ATOMIC_ACQUIRE) == SelfdeHelperExited) {
+        return false;
+    }
+    int status;
+    if (waitpid(tracer->helper, &status, WNOHANG) == tracer->helper) {
+        tracer->helperExited = true;
+        return false;
+    }
+    return true;
+}
+
+// Sends the request that's in the channel and waits for the reply. The request mutex has to be locked.
+static int performRequest(SelfdeLinuxTracer *tracer, int operation, pid_t thread) {
+    SelfdeTracerChannel *channel = tracer->channel;
+    channel->operation = operation;
+    channel->thread = thread;
+    int sequence = channel->requestSequence + 1;
+    __atomic_store_n(&channel->requestSequence, sequence, __ATOMIC_RELEASE);
+    uint64_t value = 1;
+    if (write(tracer->doorbell, &value, sizeof(value)) < 0) {
+        return errno;
+    }
+    while (__atomic_load_n(&channel->replySequence, __ATOMIC_ACQUIRE) != sequence) {
+        struct timespec timeout = { 1, 0 };
+        futex(&channel->replySequence, FUTEX_WAIT, sequence - 1, &timeout);
+        if (__atomic_load_n(&channel->replySequence, __ATOMIC_ACQUIRE) != sequence && !isHelperAlive(tracer)) {
+            return ECHILD;
+        }
+    }
+    return channel->result;
+}
+
+static void destroyTracer(SelfdeLinuxTracer *tracer) {
+    munmap(tracer->channel, sizeof(SelfdeTracerChannel));
+    close(tracer->doorbell);
+    pthread_mutex_destroy(&tracer->requestMutex);
+    free(tracer);
+}
+
+SelfdeLinuxTracer *selfdeLinuxTracerStart(int *error) {
+    SelfdeLinuxTracer *tracer = calloc(1, sizeof(SelfdeLinuxTracer));
+    if (!tracer) {
+        *error = ENOMEM;
+        return NULL;
+    }
+    tracer->channel = mmap(NULL, sizeof(SelfdeTracerChannel), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (tracer->channel == MAP_FAILED) {
+        *error = errno;
+        free(tracer);
+        return NULL;
+    }
+    tracer->doorbell = eventfd(0, EFD_CLOEXEC);
+    if (tracer->doorbell < 0) {
+        *error = errno;
+        munmap(tracer->channel, sizeof(SelfdeTracerChannel));
+        free(tracer);
+        return NULL;
+    }
+    pthread_mutex_init(&tracer->requestMutex, NULL);
+    selfdeLinuxTracerIgnoreCurrentThread(tracer);
+
+    pid_t process = getpid();
+    pid_t helper = fork();
+    if (helper < 0) {
+        *error = errno;
+        destroyTracer(tracer);
+        return NULL;
+    }
+    if (helper == 0) {
+        runHelper(tracer->channel, tracer->doorbell, process);
+        _exit(0);
+    }
+    tracer->helper = helper;
+
+    // Allow the helper to trace us when Yama restricts ptrace to the ancestors.
+    prctl(PR_SET_PTRACER, helper, 0, 0, 0);
+    SelfdeTracerChannel *channel = tracer->channel;
+    __atomic_store_n(&channel->helperState, SelfdeHelperAuthorized, __ATOMIC_RELEASE);
+    futex(&channel->helperState, FUTEX_WAKE, INT_MAX, NULL);
+    int state;
+    while ((state = __atomic_load_n(&channel->helperState, __ATOMIC_ACQUIRE)) == SelfdeHelperAuthorized) {
+        struct timespec timeout = { 1, 0 };
+        futex(&channel->helperState, FUTEX_WAIT, SelfdeHelperAuthorized, &timeout);
+        if (!isHelperAlive(tracer)) {
+            break;
+        }
+    }
+    if (__atomic_load_n(&channel->helperState, __ATOMIC_ACQUIRE) != SelfdeHelperReady) {
+        *error = channel->helperError != 0 ? channel->helperError : ECHILD;
+        if (!tracer->helperExited) {
+            waitpid(helper, NULL, 0);
+        }
+        destroyTracer(tracer);
+        return NULL;
+    }
+    *error = 0;
+    return tracer;
+}
+
+void selfdeLinuxTracerStop(SelfdeLinuxTracer *tracer) {
+    SelfdeTracerChannel *channel = tracer->channel;
+    pthread_mutex_lock(&tracer->requestMutex);
+    for (int i = 0; i < SELFDE_TRACER_MAX_THREADS; ++i) {
+        pid_t thread = __atomic_load_n(&channel->threads[i].thread, __ATOMIC_ACQUIRE);
+        if (thread != 0 && __atomic_load_n(&channel->threads[i].stopped, __ATOMIC_ACQUIRE)) {
+            performRequest(tracer, SelfdeTracerResumeThread, thread);
+        }
+    }
+    performRequest(tracer, SelfdeTracerQuit, 0);
+    pthread_mutex_unlock(&tracer->requestMutex);
+    if (!tracer->helperExited) {
+        waitpid(tracer->helper, NULL, 0);
+    }
+    destroyTracer(tracer);
+}
+
+void selfdeLinuxTracerIgnoreCurrentThread(SelfdeLinuxTracer *tracer) {
+    pid_t thread = selfdeLinuxGetCurrentThreadID();
+    if (isIgnoredThread(tracer->channel, thread)) {
+        return;
+    }
+    for (int i = 0; i < SELFDE_TRACER_MAX_IGNORED_THREADS; ++i) {
+        pid_t expected = 0;
+        if (__atomic_compare_exchange_n(&tracer->channel->ignoredThreads[i], &expected, thread, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+            return;
+        }
+    }
+}
+
+int selfdeLinuxTracerGetThreads(SelfdeLinuxTracer *tracer, pid_t *threads, int capacity) {
+    pid_t allThreads[SELFDE_TRACER_MAX_THREADS];
+    int count = readThreadIDs(getpid(), allThreads, SELFDE_TRACER_MAX_THREADS);
+    if (count < 0) {
+        return -1;
+    }
+    int result = 0;
+    for (int i = 0; i < count && i < SELFDE_TRACER_MAX_THREADS; ++i) {
+        if (isIgnoredThread(tracer->channel, allThreads[i])) {
+            continue;
+        }
+        if (result < capacity) {
+            threads[result] = allThreads[i];
+        }
+        result += 1;
+    }
+    return result;
+}
+
+bool selfdeLinuxTracerWaitForStop(SelfdeLinuxTracer *tracer, SelfdeLinuxStopEvent *event) {
+    SelfdeTracerChannel *channel = tracer->channel;
+    uint32_t head = channel->eventHead;
+    uint32_t tail;
+    while ((tail = __atomic_load_n(&channel->eventTail, __ATOMIC_ACQUIRE)) == head) {
+        struct timespec timeout = { 1, 0 };
+        futex((int *)&channel->eventTail, FUTEX_WAIT, (int)tail, &timeout);
+        if (__atomic_load_n(&channel->eventTail, __ATOMIC_ACQUIRE) == head && !isHelperAlive(tracer)) {
+            return false;
+        }
+    }
+    *event = channel->events[head % SELFDE_TRACER_MAX_EVENTS];
+    __atomic_store_n(&channel->eventHead, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+int selfdeLinuxTracerStopThread(SelfdeLinuxTracer *tracer, pid_t thread) {
+    if (isIgnoredThread(tracer->channel, thread)) {
+        return EINVAL;
+    }
+    if (selfdeLinuxTracerIsThreadStopped(tracer, thread)) {
+        return 0;
+    }
+    pthread_mutex_lock(&tracer->requestMutex);
+    int result = performRequest(tracer, SelfdeTracerStopThread, thread);
+    pthread_mutex_unlock(&tracer->requestMutex);
+    return result;
+}
+
+int selfdeLinuxTracerResumeThread(SelfdeLinuxTracer *tracer, pid_t thread) {
+    pthread_mutex_lock(&tracer->requestMutex);
+    int result = performRequest(tracer, SelfdeTracerResumeThread, thread);
+    pthread_mutex_unlock(&tracer->requestMutex);
+    return result;
+}
+
+bool selfdeLinuxTracerIsThreadStopped(SelfdeLinuxTracer *tracer, pid_t thread) {
+    return findStoppedThread(tracer->channel, thread) != NULL;
+}
+
+bool selfdeLinuxTracerGetLastStop(SelfdeLinuxTracer *tracer, pid_t thread, SelfdeLinuxStopEvent *event) {
+    SelfdeTracedThread *record = findStoppedThread(tracer->channel, thread);
+    if (!record) {
+        return false;
+    }
+    *event = record->lastStop;
+    return true;
+}
+
+int selfdeLinuxTracerGetThreadState(SelfdeLinuxTracer *tracer, pid_t thread, x86_thread_state64_t *state, x86_float_state64_t *fpuState, x86_avx_state64_t *avxState, x86_exception_state64_t *excState) {
+    pthread_mutex_lock(&tracer->requestMutex);
+    SelfdeTracerStates *states = &tracer->channel->data.states;
+    states->flags = (state ? SelfdeTracerGPRState : 0) | (fpuState ? SelfdeTracerFPUState : 0) |
+        (avxState ? SelfdeTracerAVXState : 0) | (excState ? SelfdeTracerEXCState : 0);
+    int result = performRequest(tracer, SelfdeTracerGetState, thread);
+    if (result == 0) {
+        if (state) {
+            *state = states->state;
+        }
+        if (fpuState) {
+            *fpuState = states->fpuState;
+        }
+        if (avxState) {
+            *avxState = states->avxState;
+        }
+        if (excState) {
+            *excState = states->excState;
+        }
+    }
+    pthread_mutex_unlock(&tracer->requestMutex);
+    return result;
+}
+
+int selfdeLinuxTracerSetThreadState(SelfdeLinuxTracer *tracer, pid_t thread, const x86_thread_state64_t *state, const x86_float_state64_t *fpuState, const x86_avx_state64_t *avxState) {
+    pthread_mutex_lock(&tracer->requestMutex);
+    SelfdeTracerStates *states = &tracer->channel->data.states;
+    states->flags = (state ? SelfdeTracerGPRState : 0) | (fpuState ? SelfdeTracerFPUState : 0) | (avxState ? SelfdeTracerAVXState : 0);
+    if (state) {
+        states->state = *state;
+    }
+    if (fpuState) {
+        states->fpuState = *fpuState;
+    }
+    if (avxState) {
+        states->avxState = *avxState;
+    }
+    int result = performRequest(tracer, SelfdeTracerSetState, thread);
+    pthread_mutex_unlock(&tracer->requestMutex);
+    return result;
+}
+
+void selfdeLinuxTracerSetSignalFilter(SelfdeLinuxTracer *tracer, const int *passSignals, int passCount, const int *programSignals, int programCount) {
+    selfdeLinuxStoreSignalFilter(&tracer->channel->signalFilter, passSignals, passCount, programSignals, programCount);
+}
+
+int selfdeLinuxTracerGetDebugRegisters(SelfdeLinuxTracer *tracer, pid_t thread, uint64_t registers[8]) {
+    pthread_mutex_lock(&tracer->requestMutex);
+    int result = performRequest(tracer, SelfdeTracerGetDebugRegisters, thread);
+    if (result == 0) {
+        memcpy(registers, tracer->channel->data.debugRegisters, sizeof(uint64_t) * 8);
+    }
+    pthread_mutex_unlock(&tracer->requestMutex);
+    return result;
+}
+
+int selfdeLinuxTracerSetDebugRegister(SelfdeLinuxTracer *tracer, pid_t thread, int index, uint64_t value) {
+    pthread_mutex_lock(&tracer->requestMutex);
+    tracer->channel->arguments[0] = (uint64_t)index;
+    tracer->channel->arguments[1] = value;
+    int result = performRequest(tracer, SelfdeTracerSetDebugRegister, thread);
+    pthread_mutex_unlock(&tracer->requestMutex);
+    return result;
+}
+
+int selfdeLinuxTracerWriteMemory(SelfdeLinuxTracer *tracer, uint64_t address, const void *source, size_t size) {
+    // Bulk transfers don't need the helper, process_vm_writev works on our own memory.
+    struct iovec local = { (void *)source, size };
+    struct iovec remote = { (void *)(uintptr_t)address, size };
+    ssize_t written = process_vm_writev(getpid(), &local, 1, &remote, 1, 0);
+    if (written >= 0 && (size_t)written == size) {
+        return 0;
+    }
+    if (written < 0 && errno != EFAULT) {
+        return errno;
+    }
+    pthread_mutex_lock(&tracer->requestMutex);
+    int result = 0;
+    for (size_t offset = 0; offset < size && result == 0; offset += SELFDE_TRACER_DATA_SIZE) {
+        size_t chunkSize = size - offset < SELFDE_TRACER_DATA_SIZE ? size - offset : SELFDE_TRACER_DATA_SIZE;
+        memcpy(tracer->channel->data.bytes, (const uint8_t *)source + offset, chunkSize);
+        tracer->channel->arguments[0] = address + offset;
+        tracer->channel->arguments[1] = chunkSize;
+        result = performRequest(tracer, SelfdeTracerWriteMemory, 0);
+    }
+    pthread_mutex_unlock(&tracer->requestMutex);
+    return result;
+}
@@ -14,3 +14,11 @@ FOUNDATION_EXPORT const unsigned char SelfdeVersionString[];
 // In this header, you should import all the public headers of your framework using statements like #import <Selfde/PublicHeader.h>
 #import "machControllerImpl.h"
 #import "DNBRegisterInfoX86_64.h"
+#import "livePatchX86_64.h"
+#import "callFrameInfoX86_64.h"
+#import "samplingProfiler.h"
+#import "coreDump.h"
+#import "coverage.h"
+#import "dirtyPages.h"
+#import "memoryChecksum.h"
+#import "memorySearch.h"
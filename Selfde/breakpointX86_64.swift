@@ -5,6 +5,10 @@
 
 #if arch(x86_64) || arch(i386)
 
+#if os(Linux)
+import SelfdeLinuxImpl
+#endif
+
 typealias MachineBreakpointState = BreakpointStateX86_64
 
 struct BreakpointStateX86_64 {
@@ -15,21 +19,93 @@ struct BreakpointStateX86_64 {
         self.originalByte = originalByte
     }
 
+    // The breakpoints are patched in with an atomic compare and swap, so the other threads can keep running.
     func restoreOriginalInstruction(at address: Address) {
-        UnsafeMutablePointer<UInt8>(bitPattern: address.bitPattern)!.pointee = originalByte
+        var byte = originalByte
+        var trap = UInt8(0xCC) // INT 3.
+        selfdeLivePatchCode(address.bitPattern64, &trap, &byte, 1)
+    }
+
+    func reinsert(at address: Address) {
+        var byte = originalByte
+        var trap = UInt8(0xCC) // INT 3.
+        selfdeLivePatchCode(address.bitPattern64, &byte, &trap, 1)
+    }
+
+    // Replaces the INT 3 in a copy of the code with the original byte.
+    func restoreOriginalInstruction(in code: inout [UInt8], at offset: Int) {
+        code[offset] = originalByte
     }
 
     static func create(at address: Address) -> (MachineBreakpointState, landingAddress: Address) {
         let bytes = UnsafeMutablePointer<UInt8>(bitPattern: address.bitPattern)!
-        let result = MachineBreakpointState(originalByte: bytes.pointee)
-        bytes.pointee = UInt8(0xCC) // INT 3.
-        return (result, landingAddress: Address(bitPattern: address.bitPattern + 1))
+        var trap = UInt8(0xCC) // INT 3.
+        var originalByte = bytes.pointee
+        // The byte might be patched by another thread in the meantime.
+        while selfdeLivePatchCode(address.bitPattern64, &originalByte, &trap, 1) == SelfdeLivePatchMismatch {
+            originalByte = bytes.pointee
+        }
+        return (MachineBreakpointState(originalByte: originalByte), landingAddress: Address(bitPattern: address.bitPattern + 1))
+    }
+
+    // Replaces the code at the given address without stopping the other threads.
+    // A thread that hits the temporary INT 3 of a patch has to be continued at the
+    // address when 'isTemporaryTrap' returns true.
+    static func patchCode(at address: Address, expected: [UInt8]?, replacement: [UInt8]) throws {
+        guard expected == nil || expected!.count == replacement.count else {
+            throw ControllerError.invalidPatchSize
+        }
+        var replacement = replacement
+        let result: SelfdeLivePatchResult
+        if var expected = expected {
+            result = selfdeLivePatchCode(address.bitPattern64, &expected, &replacement, replacement.count)
+        } else {
+            result = selfdeLivePatchCode(address.bitPattern64, nil, &replacement, replacement.count)
+        }
+        switch result {
+        case SelfdeLivePatchSuccess:
+            return
+        case SelfdeLivePatchMismatch:
+            throw ControllerError.codeMismatch
+        default:
+            throw ControllerError.invalidPatchSize
+        }
+    }
+
+    // Returns true when a thread has hit an INT 3 at the address that was put there by a patch
+    // or that has been removed since. The thread should continue at the address.
+    static func isTemporaryTrap(at address: Address) -> Bool {
+        return selfdeLivePatchHandleTrap(address.bitPattern64)
+    }
+
+    // The code that the called functions return to, it stops the thread like a breakpoint.
+    static var functionCallTrap: [UInt8] {
+        return [0xCC] // INT 3.
     }
 
     // The number of bytes that have to be modified after the address in order to install a breakpoint.
     static var numberOfBytesToPatch: UInt {
         return 1
     }
+
+    // The number of bytes that have to be read to get a complete instruction.
+    static var maximumInstructionLength: Int {
+        return 15
+    }
+
+    // The size of the scratch buffer that's needed to execute a displaced instruction.
+    static var displacedInstructionSize: Int {
+        return maximumRelocatedInstructionSizeX86_64
+    }
+
+    // Returns the code that executes the original instruction at the given scratch address
+    // and then jumps to the instruction that follows it, or nil if it can't be displaced.
+    static func displacedInstruction(_ code: [UInt8], from address: Address, to scratchAddress: Address) -> [UInt8]? {
+        guard let instruction = decodeInstructionX86_64(code) else {
+            return nil
+        }
+        return relocateInstructionX86_64(code, instruction, from: address, to: scratchAddress)
+    }
 }
 
 #endif
@@ -0,0 +1,506 @@
+//
+//  callFrameInfoX86_64.c
+//  Selfde
+//
+// Parses the DWARF call frame information from the loaded .eh_frame sections. Only the rules
+// that the unwinder needs are tracked: the CFA, the caller's RBP and the return address.
+
+#include "callFrameInfoX86_64.h"
+#include <string.h>
+
+enum {
+    DW_EH_PE_absptr = 0x00,
+    DW_EH_PE_uleb128 = 0x01,
+    DW_EH_PE_udata2 = 0x02,
+    DW_EH_PE_udata4 = 0x03,
+    DW_EH_PE_udata8 = 0x04,
+    DW_EH_PE_sleb128 = 0x09,
+    DW_EH_PE_sdata2 = 0x0A,
+    DW_EH_PE_sdata4 = 0x0B,
+    DW_EH_PE_sdata8 = 0x0C,
+    DW_EH_PE_pcrel = 0x10,
+    DW_EH_PE_indirect = 0x80,
+    DW_EH_PE_omit = 0xFF
+};
+
+enum {
+    DW_CFA_nop = 0x00,
+    DW_CFA_set_loc = 0x01,
+    DW_CFA_advance_loc1 = 0x02,
+    DW_CFA_advance_loc2 = 0x03,
+    DW_CFA_advance_loc4 = 0x04,
+    DW_CFA_offset_extended = 0x05,
+    DW_CFA_restore_extended = 0x06,
+    DW_CFA_undefined = 0x07,
+    DW_CFA_same_value = 0x08,
+    DW_CFA_register = 0x09,
+    DW_CFA_remember_state = 0x0A,
+    DW_CFA_restore_state = 0x0B,
+    DW_CFA_def_cfa = 0x0C,
+    DW_CFA_def_cfa_register = 0x0D,
+    DW_CFA_def_cfa_offset = 0x0E,
+    DW_CFA_def_cfa_expression = 0x0F,
+    DW_CFA_expression = 0x10,
+    DW_CFA_offset_extended_sf = 0x11,
+    DW_CFA_def_cfa_sf = 0x12,
+    DW_CFA_def_cfa_offset_sf = 0x13,
+    DW_CFA_val_offset = 0x14,
+    DW_CFA_val_offset_sf = 0x15,
+    DW_CFA_val_expression = 0x16,
+    DW_CFA_GNU_args_size = 0x2E,
+    DW_CFA_GNU_negative_offset_extended = 0x2F,
+    // The high two bits of these opcodes are the opcode, the low six bits are the operand.
+    DW_CFA_advance_loc = 0x40,
+    DW_CFA_offset = 0x80,
+    DW_CFA_restore = 0xC0
+};
+
+#define SELFDE_MAX_REMEMBERED_STATES 8
+
+typedef struct Reader {
+    const uint8_t *position;
+    const uint8_t *end;
+    bool failed;
+} Reader;
+
+static const uint8_t *readBytes(Reader *reader, size_t size) {
+    if (reader->failed || (size_t)(reader->end - reader->position) < size) {
+        reader->failed = true;
+        return NULL;
+    }
+    const uint8_t *bytes = reader->position;
+    reader->position += size;
+    return bytes;
+}
+
+#define DEFINE_READ(name, type) \
+    static type name(Reader *reader) { \
+        type value = 0; \
+        const uint8_t *bytes = readBytes(reader, sizeof(type)); \
+        if (bytes) { \
+            memcpy(&value, bytes, sizeof(type)); \
+        } \
+        return value; \
+    }
+
+DEFINE_READ(readU8, uint8_t)
+DEFINE_READ(readU16, uint16_t)
+DEFINE_READ(readU32, uint32_t)
+DEFINE_READ(readU64, uint64_t)
+DEFINE_READ(readS16, int16_t)
+DEFINE_READ(readS32, int32_t)
+DEFINE_READ(readS64, int64_t)
+
+static uint64_t readULEB128(Reader *reader) {
+    uint64_t result = 0;
+    unsigned shift = 0;
+    uint8_t byte;
+    do {
+        byte = readU8(reader);
+        if (shift < 64) {
+            result |= (uint64_t)(byte & 0x7F) << shift;
+        }
+        shift += 7;
+    } while ((byte & 0x80) && !reader->failed);
+    return result;
+}
+
+static int64_t readSLEB128(Reader *reader) {
+    uint64_t result = 0;
+    unsigned shift = 0;
+    uint8_t byte;
+    do {
+        byte = readU8(reader);
+        if (shift < 64) {
+            result |= (uint64_t)(byte & 0x7F) << shift;
+        }
+        shift += 7;
+    } while ((byte & 0x80) && !reader->failed);
+    if (shift < 64 && (byte & 0x40)) {
+        result |= ~(uint64_t)0 << shift;
+    }
+    return (int64_t)result;
+}
+
+static void skipBytes(Reader *reader, uint64_t size) {
+    readBytes(reader, (size_t)size);
+}
+
+static uint64_t readEncodedPointer(Reader *reader, uint8_t encoding) {
+    if (encoding == DW_EH_PE_omit) {
+        return 0;
+    }
+    uint64_t base = (uint64_t)(uintptr_t)reader->position;
+    uint64_t value;
+    switch (encoding & 0x0F) {
+    case DW_EH_PE_absptr: value = readU64(reader); break;
+    case DW_EH_PE_uleb128: value = readULEB128(reader); break;
+    case DW_EH_PE_udata2: value = readU16(reader); break;
+    case DW_EH_PE_udata4: value = readU32(reader); break;
+    case DW_EH_PE_udata8: value = readU64(reader); break;
+    case DW_EH_PE_sleb128: value = (uint64_t)readSLEB128(reader); break;
+    case DW_EH_PE_sdata2: value = (uint64_t)(int64_t)readS16(reader); break;
+    case DW_EH_PE_sdata4: value = (uint64_t)(int64_t)readS32(reader); break;
+    case DW_EH_PE_sdata8: value = (uint64_t)readS64(reader); break;
+    default:
+        reader->failed = true;
+        return 0;
+    }
+    switch (encoding & 0x70) {
+    case DW_EH_PE_absptr:
+        break;
+    case DW_EH_PE_pcrel:
+        value += base;
+        break;
+    default:
+        // The text, data and function relative encodings aren't used in .eh_frame.
+        reader->failed = true;
+        return 0;
+    }
+    if ((encoding & DW_EH_PE_indirect) && !reader->failed && value != 0) {
+        value = *(const uint64_t *)(uintptr_t)value;
+    }
+    return value;
+}
+
+// Reads the length and the ID of a CIE or of an FDE. 'entry' covers the rest of the entry, and
+// 'idPosition' is where the ID was read from, as the FDE's CIE pointer is relative to it.
+// Returns false for the zero terminator.
+static bool readEntryHeader(Reader *reader, Reader *entry, uint64_t *id, const uint8_t **idPosition) {
+    uint64_t length = readU32(reader);
+    if (length == 0 || reader->failed) {
+        return false;
+    }
+    bool is64Bit = length == 0xFFFFFFFF;
+    if (is64Bit) {
+        length = readU64(reader);
+    }
+    const uint8_t *start = readBytes(reader, (size_t)length);
+    if (!start) {
+        return false;
+    }
+    entry->position = start;
+    entry->end = start + length;
+    entry->failed = false;
+    *idPosition = start;
+    *id = is64Bit ? readU64(entry) : readU32(entry);
+    return !entry->failed;
+}
+
+typedef struct CIE {
+    uint64_t codeAlignment;
+    int64_t dataAlignment;
+    uint64_t returnAddressRegister;
+    uint8_t pointerEncoding;
+    bool hasAugmentationData;
+    bool isSignalFrame;
+    Reader instructions;
+} CIE;
+
+static bool parseCIE(const uint8_t *start, CIE *cie) {
+    Reader reader = { start, (const uint8_t *)UINTPTR_MAX, false };
+    Reader entry;
+    uint64_t id;
+    const uint8_t *idPosition;
+    if (!readEntryHeader(&reader, &entry, &id, &idPosition) || id != 0) {
+        return false;
+    }
+    uint8_t version = readU8(&entry);
+    const char *augmentation = (const char *)entry.position;
+    size_t augmentationLength = strnlen(augmentation, (size_t)(entry.end - entry.position));
+    skipBytes(&entry, augmentationLength + 1);
+    if (augmentation[0] == 'e' && augmentation[1] == 'h') {
+        // The old GCC exception handling data.
+        readU64(&entry);
+    }
+    cie->codeAlignment = readULEB128(&entry);
+    cie->dataAlignment = readSLEB128(&entry);
+    cie->returnAddressRegister = version == 1 ? readU8(&entry) : readULEB128(&entry);
+    cie->pointerEncoding = DW_EH_PE_absptr;
+    cie->hasAugmentationData = augmentation[0] == 'z';
+    cie->isSignalFrame = false;
+    if (cie->hasAugmentationData) {
+        uint64_t size = readULEB128(&entry);
+        const uint8_t *end = entry.position + size;
+        for (const char *c = augmentation + 1; *c != '\0' && !entry.failed; ++c) {
+            switch (*c) {
+            case 'L':
+                readU8(&entry);
+                break;
+            case 'P':
+                readEncodedPointer(&entry, readU8(&entry) & ~DW_EH_PE_indirect);
+                break;
+            case 'R':
+                cie->pointerEncoding = readU8(&entry);
+                break;
+            case 'S':
+                cie->isSignalFrame = true;
+                break;
+            default:
+                // The rest of the augmentation data can be skipped using its size.
+                break;
+            }
+        }
+        if (entry.failed || end > entry.end) {
+            return false;
+        }
+        entry.position = end;
+    }
+    cie->instructions = entry;
+    return !entry.failed;
+}
+
+typedef struct FDE {
+    uint64_t start;
+    uint64_t end;
+    Reader instructions;
+} FDE;
+
+static bool parseFDE(Reader *entry, const CIE *cie, FDE *fde) {
+    fde->start = readEncodedPointer(entry, cie->pointerEncoding);
+    // The range is an absolute value with the same size.
+    fde->end = fde->start + readEncodedPointer(entry, cie->pointerEncoding & 0x0F);
+    if (cie->hasAugmentationData) {
+        skipBytes(entry, readULEB128(entry));
+    }
+    fde->instructions = *entry;
+    return !entry->failed;
+}
+
+bool selfdeUnwindEnumerateFDEsX86_64(uint64_t section, uint64_t size, SelfdeUnwindFDECallback callback, void *context) {
+    const uint8_t *start = (const uint8_t *)(uintptr_t)section;
+    Reader reader = { start, size != 0 ? start + size : (const uint8_t *)UINTPTR_MAX, false };
+    // The FDEs usually share a few CIEs.
+    const uint8_t *lastCIEPosition = NULL;
+    CIE cie;
+    while (reader.position < reader.end) {
+        const uint8_t *entryStart = reader.position;
+        Reader entry;
+        uint64_t id;
+        const uint8_t *idPosition;
+        if (!readEntryHeader(&reader, &entry, &id, &idPosition)) {
+            return !reader.failed;
+        }
+        if (id == 0) {
+            continue;
+        }
+        const uint8_t *ciePosition = idPosition - id;
+        if (ciePosition != lastCIEPosition) {
+            if (!parseCIE(ciePosition, &cie)) {
+                return false;
+            }
+            lastCIEPosition = ciePosition;
+        }
+        FDE fde;
+        if (!parseFDE(&entry, &cie, &fde)) {
+            return false;
+        }
+        if (fde.end > fde.start) {
+            callback(context, fde.start, fde.end, (uint64_t)(uintptr_t)entryStart);
+        }
+    }
+    return true;
+}
+
+typedef enum RegisterRule {
+    RegisterRuleSameValue,
+    RegisterRuleUndefined,
+    RegisterRuleOffset,
+    // Saved in another register or computed by an expression.
+    RegisterRuleUnsupported
+} RegisterRule;
+
+typedef struct UnwindState {
+    uint32_t cfaRegister;
+    int64_t cfaOffset;
+    bool isCFAExpression;
+    RegisterRule framePointerRule;
+    int64_t framePointerOffset;
+    RegisterRule returnAddressRule;
+    int64_t returnAddressOffset;
+} UnwindState;
+
+static void setRule(UnwindState *state, const CIE *cie, uint64_t reg, RegisterRule rule, int64_t offset) {
+    if (reg == SELFDE_DWARF_RBP) {
+        state->framePointerRule = rule;
+        state->framePointerOffset = offset;
+    } else if (reg == cie->returnAddressRegister) {
+        state->returnAddressRule = rule;
+        state->returnAddressOffset = offset;
+    }
+}
+
+static void restoreRule(UnwindState *state, const UnwindState *initialState, const CIE *cie, uint64_t reg) {
+    if (reg == SELFDE_DWARF_RBP) {
+        setRule(state, cie, reg, initialState->framePointerRule, initialState->framePointerOffset);
+    } else if (reg == cie->returnAddressRegister) {
+        setRule(state, cie, reg, initialState->returnAddressRule, initialState->returnAddressOffset);
+    }
+}
+
+// Runs the instructions until the location moves past the address.
+static bool runInstructions(Reader reader, const CIE *cie, uint64_t location, uint64_t address, UnwindState *state, const UnwindState *initialState) {
+    UnwindState rememberedStates[SELFDE_MAX_REMEMBERED_STATES];
+    int rememberedStateCount = 0;
+    while (reader.position < reader.end && !reader.failed) {
+        uint8_t opcode = readU8(&reader);
+        uint8_t operand = opcode & 0x3F;
+        uint64_t reg;
+        uint64_t delta = 0;
+        switch (opcode & 0xC0) {
+        case DW_CFA_advance_loc:
+            delta = operand * cie->codeAlignment;
+            break;
+        case DW_CFA_offset:
+            setRule(state, cie, operand, RegisterRuleOffset, (int64_t)readULEB128(&reader) * cie->dataAlignment);
+            continue;
+        case DW_CFA_restore:
+            restoreRule(state, initialState, cie, operand);
+            continue;
+        default:
+            switch (opcode) {
+            case DW_CFA_nop:
+                continue;
+            case DW_CFA_set_loc: {
+                uint64_t newLocation = readEncodedPointer(&reader, cie->pointerEncoding);
+                if (newLocation > address) {
+                    return !reader.failed;
+                }
+                location = newLocation;
+                continue;
+            }
+            case DW_CFA_advance_loc1:
+                delta = readU8(&reader) * cie->codeAlignment;
+                break;
+            case DW_CFA_advance_loc2:
+                delta = readU16(&reader) * cie->codeAlignment;
+                break;
+            case DW_CFA_advance_loc4:
+                delta = readU32(&reader) * cie->codeAlignment;
+                break;
+            case DW_CFA_offset_extended:
+                reg = readULEB128(&reader);
+                setRule(state, cie, reg, RegisterRuleOffset, (int64_t)readULEB128(&reader) * cie->dataAlignment);
+                continue;
+            case DW_CFA_offset_extended_sf:
+                reg = readULEB128(&reader);
+                setRule(state, cie, reg, RegisterRuleOffset, readSLEB128(&reader) * cie->dataAlignment);
+                continue;
+            case DW_CFA_GNU_negative_offset_extended:
+                reg = readULEB128(&reader);
+                setRule(state, cie, reg, RegisterRuleOffset, -(int64_t)readULEB128(&reader) * cie->dataAlignment);
+                continue;
+            case DW_CFA_restore_extended:
+                restoreRule(state, initialState, cie, readULEB128(&reader));
+                continue;
+            case DW_CFA_undefined:
+                setRule(state, cie, readULEB128(&reader), RegisterRuleUndefined, 0);
+                continue;
+            case DW_CFA_same_value:
+                setRule(state, cie, readULEB128(&reader), RegisterRuleSameValue, 0);
+                continue;
+            case DW_CFA_register:
+                setRule(state, cie, readULEB128(&reader), RegisterRuleUnsupported, 0);
+                readULEB128(&reader);
+                continue;
+            case DW_CFA_val_offset:
+                setRule(state, cie, readULEB128(&reader), RegisterRuleUnsupported, 0);
+                readULEB128(&reader);
+                continue;
+            case DW_CFA_val_offset_sf:
+                setRule(state, cie, readULEB128(&reader), RegisterRuleUnsupported, 0);
+                readSLEB128(&reader);
+                continue;
+            case DW_CFA_expression:
+            case DW_CFA_val_expression:
+                setRule(state, cie, readULEB128(&reader), RegisterRuleUnsupported, 0);
+                skipBytes(&reader, readULEB128(&reader));
+                continue;
+            case DW_CFA_remember_state:
+                if (rememberedStateCount == SELFDE_MAX_REMEMBERED_STATES) {
+                    return false;
+                }
+                rememberedStates[rememberedStateCount++] = *state;
+                continue;
+            case DW_CFA_restore_state:
+                if (rememberedStateCount == 0) {
+                    return false;
+                }
+                *state = rememberedStates[--rememberedStateCount];
+                continue;
+            case DW_CFA_def_cfa:
+                state->cfaRegister = (uint32_t)readULEB128(&reader);
+                state->cfaOffset = (int64_t)readULEB128(&reader);
+                state->isCFAExpression = false;
+                continue;
+            case DW_CFA_def_cfa_sf:
+                state->cfaRegister = (uint32_t)readULEB128(&reader);
+                state->cfaOffset = readSLEB128(&reader) * cie->dataAlignment;
+                state->isCFAExpression = false;
+                continue;
+            case DW_CFA_def_cfa_register:
+                state->cfaRegister = (uint32_t)readULEB128(&reader);
+                continue;
+            case DW_CFA_def_cfa_offset:
+                state->cfaOffset = (int64_t)readULEB128(&reader);
+                continue;
+            case DW_CFA_def_cfa_offset_sf:
+                state->cfaOffset = readSLEB128(&reader) * cie->dataAlignment;
+                continue;
+            case DW_CFA_def_cfa_expression:
+                state->isCFAExpression = true;
+                skipBytes(&reader, readULEB128(&reader));
+                continue;
+            case DW_CFA_GNU_args_size:
+                readULEB128(&reader);
+                continue;
+            default:
+                return false;
+            }
+        }
+        if (location + delta > address) {
+            break;
+        }
+        location += delta;
+    }
+    return !reader.failed;
+}
+
+bool selfdeUnwindGetRowX86_64(uint64_t fde, uint64_t address, SelfdeUnwindRowX86_64 *row) {
+    Reader reader = { (const uint8_t *)(uintptr_t)fde, (const uint8_t *)UINTPTR_MAX, false };
+    Reader entry;
+    uint64_t id;
+    const uint8_t *idPosition;
+    if (!readEntryHeader(&reader, &entry, &id, &idPosition) || id == 0) {
+        return false;
+    }
+    CIE cie;
+    FDE parsedFDE;
+    if (!parseCIE(idPosition - id, &cie) || !parseFDE(&entry, &cie, &parsedFDE)) {
+        return false;
+    }
+    if (address < parsedFDE.start || address >= parsedFDE.end) {
+        return false;
+    }
+    UnwindState initialState = { SELFDE_DWARF_RSP, 0, false, RegisterRuleSameValue, 0, RegisterRuleUndefined, 0 };
+    if (!runInstructions(cie.instructions, &cie, parsedFDE.start, UINT64_MAX, &initialState, &initialState)) {
+        return false;
+    }
+    UnwindState state = initialState;
+    if (!runInstructions(parsedFDE.instructions, &cie, parsedFDE.start, address, &state, &initialState)) {
+        return false;
+    }
+    if (state.isCFAExpression || (state.cfaRegister != SELFDE_DWARF_RSP && state.cfaRegister != SELFDE_DWARF_RBP) ||
+        state.framePointerRule == RegisterRuleUnsupported || state.returnAddressRule == RegisterRuleUnsupported ||
+        state.returnAddressRule == RegisterRuleSameValue) {
+        return false;
+    }
+    row->cfaRegister = state.cfaRegister;
+    row->cfaOffset = state.cfaOffset;
+    row->isFramePointerSaved = state.framePointerRule == RegisterRuleOffset;
+    row->framePointerOffset = state.framePointerOffset;
+    row->returnAddressOffset = state.returnAddressOffset;
+    row->isSignalFrame = cie.isSignalFrame;
+    row->isOutermostFrame = state.returnAddressRule == RegisterRuleUndefined;
+    return true;
+}
@@ -0,0 +1,50 @@
+//
+//  callFrameInfoX86_64.h
+//  Selfde
+//
+
+#ifndef callFrameInfoX86_64_h
+#define callFrameInfoX86_64_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The DWARF numbers of the registers that the unwinder tracks.
+#define SELFDE_DWARF_RBP 6
+#define SELFDE_DWARF_RSP 7
+
+// A row of the call frame information table: how the caller's frame is found at an address.
+typedef struct SelfdeUnwindRowX86_64 {
+    // The canonical frame address is the value of this register plus the offset.
+    uint32_t cfaRegister;
+    int64_t cfaOffset;
+    // The caller's RBP and the return address are saved at these offsets from the CFA.
+    bool isFramePointerSaved;
+    int64_t framePointerOffset;
+    int64_t returnAddressOffset;
+    // The frame was interrupted by a signal, so its address isn't a return address.
+    bool isSignalFrame;
+    // The return address is undefined in the outermost frame of a thread.
+    bool isOutermostFrame;
+} SelfdeUnwindRowX86_64;
+
+typedef void (*SelfdeUnwindFDECallback)(void *context, uint64_t start, uint64_t end, uint64_t fde);
+
+// Calls the callback with the address range of every FDE in a loaded .eh_frame section. When the
+// size is zero the section is read until its zero terminator. Returns false when the section is malformed.
+bool selfdeUnwindEnumerateFDEsX86_64(uint64_t section, uint64_t size, SelfdeUnwindFDECallback callback, void *context);
+
+// Runs the call frame instructions of the FDE's CIE and of the FDE up to the address. Returns false
+// when the CFA or the return address isn't saved at an offset from RSP or RBP.
+bool selfdeUnwindGetRowX86_64(uint64_t fde, uint64_t address, SelfdeUnwindRowX86_64 *row);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* callFrameInfoX86_64_h */
@@ -11,6 +11,37 @@ private func throwIfNeeded(posixError error: Int32) throws {
     }
 }
 
+/// A mutex.
+final class Mutex {
+    private let mutex = UnsafeMutablePointer<pthread_mutex_t>.allocate(capacity: 1)
+
+    init() throws {
+        try throwIfNeeded(posixError: pthread_mutex_init(mutex, nil))
+    }
+
+    deinit {
+        pthread_mutex_destroy(mutex)
+        mutex.deinitialize()
+        mutex.deallocate(capacity: 1)
+    }
+
+    func lock() {
+        pthread_mutex_lock(mutex)
+    }
+
+    func unlock() {
+        pthread_mutex_unlock(mutex)
+    }
+
+    func withLock<T>(_ body: () throws -> T) rethrows -> T {
+        lock()
+        defer {
+            unlock()
+        }
+        return try body()
+    }
+}
+
 /// A condition variabel.
 final class Condition {
     let mutex = UnsafeMutablePointer<pthread_mutex_t>.allocate(capacity: 1)
@@ -8,6 +8,7 @@ import Foundation
 public enum ControllerError: Error {
     case threadLaunchFailure
     case machKernelError(code: Int, message: String)
+    case systemError(code: Int, message: String)
     case invalidBreakpoint
     case invalidRunState
     case invalidRegisterID
@@ -15,13 +16,31 @@ public enum ControllerError: Error {
     case registerBufferIsTooSmall
     case invalidAllocation
     case invalidAddress
+    case scratchMemoryUnavailable
+    case codeMismatch
+    case invalidPatchSize
+    case invalidCallArguments
+    case callInterrupted
+    case invalidProfilingOptions
 }
 
 public enum ControllerEvent {
     case caughtException(Exception)
     case interrupted
+    /// A releasing breakpoint was hit, and the thread has already continued past it.
+    case releasedStop(ThreadStopSnapshot)
 }
 
+/// Tells the controller what a thread does after a breakpoint's action has run.
+public enum BreakpointActionResult {
+    /// The thread continues past the breakpoint without waking up the controller.
+    case `continue`
+    /// The breakpoint hit is reported by `waitForEvent`.
+    case stop
+}
+
+#if os(OSX)
+
 /// Launches the controller thread.
 public func runSelfdeController(_ client: @escaping (Controller) -> (), errorCallback: @escaping (Error) -> ()) {
     assert(Foundation.Thread.isMainThread)
@@ -58,3 +77,5 @@ public func runSelfdeController(_ client: @escaping (Controller) -> (), errorCal
         errorCallback(ControllerError.threadLaunchFailure)
     }
 }
+
+#endif
@@ -37,6 +37,25 @@ public extension Address {
 
 #endif
 
+// A half-open range of addresses [start, end).
+public struct AddressRange: Equatable {
+    public let start: Address
+    public let end: Address
+
+    public init(start: Address, end: Address) {
+        self.start = start
+        self.end = end
+    }
+
+    public func contains(_ address: Address) -> Bool {
+        return address.bitPattern >= start.bitPattern && address.bitPattern < end.bitPattern
+    }
+}
+
+public func == (lhs: AddressRange, rhs: AddressRange) -> Bool {
+    return lhs.start == rhs.start && lhs.end == rhs.end
+}
+
 public struct Breakpoint {
     // Breakpoint's address.
     public let address: Address
@@ -68,3 +87,92 @@ public enum RunState {
 public enum MemoryReadResult {
     case bytes(UnsafeBufferPointer<UInt8>)
 }
+
+// The result registers of a function call.
+public struct FunctionCallResult {
+    // RAX and RDX.
+    public let integerValues: [UInt64]
+    // XMM0 and XMM1, 16 bytes each.
+    public let vectorValues: [[UInt8]]
+
+    public init(integerValues: [UInt64], vectorValues: [[UInt8]]) {
+        self.integerValues = integerValues
+        self.vectorValues = vectorValues
+    }
+}
+
+// A segment of a loaded Mach-O image, with the values from its load command.
+public struct LoadedSegment {
+    public let name: String
+    public let address: UInt64
+    public let size: UInt64
+    public let fileOffset: UInt64
+    public let fileSize: UInt64
+    public let maxProtection: Int32
+
+    public init(name: String, address: UInt64, size: UInt64, fileOffset: UInt64, fileSize: UInt64, maxProtection: Int32) {
+        self.name = name
+        self.address = address
+        self.size = size
+        self.fileOffset = fileOffset
+        self.fileSize = fileSize
+        self.maxProtection = maxProtection
+    }
+}
+
+// The header fields of a loaded Mach-O image.
+public struct LoadedImageHeader {
+    public let magic: UInt32
+    public let cpuType: Int32
+    public let cpuSubType: Int32
+    public let fileType: UInt32
+    public let flags: UInt32
+
+    public init(magic: UInt32, cpuType: Int32, cpuSubType: Int32, fileType: UInt32, flags: UInt32) {
+        self.magic = magic
+        self.cpuType = cpuType
+        self.cpuSubType = cpuSubType
+        self.fileType = fileType
+        self.flags = flags
+    }
+}
+
+// A loaded executable or shared library.
+public struct LoadedLibrary {
+    public let path: String
+    // The address of the Mach-O header, or the load bias of an ELF object.
+    public let loadAddress: Address
+    // Mach-O images.
+    public let modificationDate: UInt64
+    public let uuid: [UInt8]?
+    public let header: LoadedImageHeader?
+    public let segments: [LoadedSegment]
+    // ELF objects: the addresses of the 'link_map' entry and of the dynamic section.
+    public let linkMapAddress: Address?
+    public let dynamicSectionAddress: Address?
+
+    public init(path: String, loadAddress: Address, modificationDate: UInt64 = 0, uuid: [UInt8]? = nil, header: LoadedImageHeader? = nil, segments: [LoadedSegment] = [], linkMapAddress: Address? = nil, dynamicSectionAddress: Address? = nil) {
+        self.path = path
+        self.loadAddress = loadAddress
+        self.modificationDate = modificationDate
+        self.uuid = uuid
+        self.header = header
+        self.segments = segments
+        self.linkMapAddress = linkMapAddress
+        self.dynamicSectionAddress = dynamicSectionAddress
+    }
+}
+
+// A function or an object from a loaded library's symbol table.
+public struct Symbol {
+    public let name: String
+    public let address: Address
+    // Zero when the symbol table doesn't have the size.
+    public let size: UInt64
+
+    public init(name: String, address: Address, size: UInt64 = 0) {
+        self.name = name
+        self.address = address
+        self.size = size
+    }
+}
@@ -0,0 +1,190 @@
+//
+//  coreDump.c
+//  Selfde
+//
+// Copies the memory regions into a core file. The regions are split into chunks that the copy
+// threads take in turn, so that a large heap region is written by all of them.
+
+#include "coreDump.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CHUNK_SIZE (1024 * 1024)
+#define MAX_COPY_THREADS 32
+
+int selfdeCoreWrite(int fd, const void *buffer, size_t size, uint64_t offset) {
+    const uint8_t *bytes = buffer;
+    while (size > 0) {
+        ssize_t written = pwrite(fd, bytes, size, (off_t)offset);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+        bytes += written;
+        size -= (size_t)written;
+        offset += (uint64_t)written;
+    }
+    return 0;
+}
+
+uint64_t selfdeCoreLayoutRegions(SelfdeCoreRegion *regions, uint32_t regionCount, uint64_t headerSize) {
+    uint64_t offset = (headerSize + SELFDE_CORE_PAGE_SIZE - 1) & ~(uint64_t)(SELFDE_CORE_PAGE_SIZE - 1);
+    for (uint32_t i = 0; i < regionCount; ++i) {
+        regions[i].fileOffset = offset;
+        offset += regions[i].size;
+    }
+    return offset;
+}
+
+typedef struct CopyJob {
+    int fd;
+    const SelfdeCoreRegion *regions;
+    uint32_t regionCount;
+    // The number of the chunks before every region, and the total at the end.
+    uint64_t *chunkStarts;
+    bool elideZeroPages;
+    SelfdeCoreReadFunction read;
+    void *context;
+    uint64_t nextChunk;
+    int error;
+    uint64_t writtenBytes;
+    uint64_t elidedBytes;
+    uint64_t unreadableBytes;
+} CopyJob;
+
+static bool isZeroPage(const uint8_t *page) {
+    const uint64_t *words = (const uint64_t *)page;
+    uint64_t value = 0;
+    for (size_t i = 0; i < SELFDE_CORE_PAGE_SIZE / sizeof(uint64_t); ++i) {
+        value |= words[i];
+    }
+    return value == 0;
+}
+
+// Writes the runs of the pages that aren't all zeros. The zero pages that were read are counted as
+// elided, and the ones that couldn't be read are counted as unreadable by the caller.
+static int writeNonZeroPages(CopyJob *job, const uint8_t *buffer, size_t size, const bool *unreadablePages, uint64_t offset, uint64_t *written, uint64_t *elided) {
+    size_t runStart = 0;
+    for (size_t pageOffset = 0; pageOffset <= size; pageOffset += SELFDE_CORE_PAGE_SIZE) {
+        bool isEnd = pageOffset == size;
+        if (!isEnd && !isZeroPage(buffer + pageOffset)) {
+            continue;
+        }
+        if (!isEnd && !unreadablePages[pageOffset / SELFDE_CORE_PAGE_SIZE]) {
+            *elided += SELFDE_CORE_PAGE_SIZE;
+        }
+        if (pageOffset > runStart) {
+            int error = selfdeCoreWrite(job->fd, buffer + runStart, pageOffset - runStart, offset + runStart);
+            if (error != 0) {
+                return error;
+            }
+            *written += pageOffset - runStart;
+        }
+        runStart = pageOffset + SELFDE_CORE_PAGE_SIZE;
+    }
+    return 0;
+}
+
+static int copyChunk(CopyJob *job, uint8_t *buffer, const SelfdeCoreRegion *region, uint64_t regionOffset, size_t size) {
+    uint64_t written = 0;
+    uint64_t elided = 0;
+    uint64_t unreadable = 0;
+    bool unreadablePages[CHUNK_SIZE / SELFDE_CORE_PAGE_SIZE] = { false };
+    bool isRead = region->sourceAddress != 0 && job->read(job->context, region->sourceAddress + regionOffset, buffer, size);
+    if (!isRead) {
+        // The readable pages of the chunk are kept, and the others are left as zeros.
+        for (size_t pageOffset = 0; pageOffset < size; pageOffset += SELFDE_CORE_PAGE_SIZE) {
+            if (region->sourceAddress == 0 || !job->read(job->context, region->sourceAddress + regionOffset + pageOffset, buffer + pageOffset, SELFDE_CORE_PAGE_SIZE)) {
+                memset(buffer + pageOffset, 0, SELFDE_CORE_PAGE_SIZE);
+                unreadablePages[pageOffset / SELFDE_CORE_PAGE_SIZE] = true;
+                unreadable += SELFDE_CORE_PAGE_SIZE;
+            }
+        }
+    }
+    int error;
+    if (job->elideZeroPages) {
+        error = writeNonZeroPages(job, buffer, size, unreadablePages, region->fileOffset + regionOffset, &written, &elided);
+    } else {
+        error = selfdeCoreWrite(job->fd, buffer, size, region->fileOffset + regionOffset);
+        written = error == 0 ? size : 0;
+    }
+    __atomic_fetch_add(&job->writtenBytes, written, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&job->elidedBytes, elided, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&job->unreadableBytes, unreadable, __ATOMIC_RELAXED);
+    return error;
+}
+
+static void *copyThreadMain(void *argument) {
+    CopyJob *job = argument;
+    uint8_t *buffer = malloc(CHUNK_SIZE);
+    if (!buffer) {
+        int expected = 0;
+        __atomic_compare_exchange_n(&job->error, &expected, ENOMEM, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    uint64_t chunkCount = job->chunkStarts[job->regionCount];
+    uint32_t regionIndex = 0;
+    while (__atomic_load_n(&job->error, __ATOMIC_RELAXED) == 0) {
+        uint64_t chunk = __atomic_fetch_add(&job->nextChunk, 1, __ATOMIC_RELAXED);
+        if (chunk >= chunkCount) {
+            break;
+        }
+        // The chunks are taken in order, so the region is found by moving forward.
+        while (job->chunkStarts[regionIndex + 1] <= chunk) {
+            regionIndex++;
+        }
+        const SelfdeCoreRegion *region = &job->regions[regionIndex];
+        uint64_t regionOffset = (chunk - job->chunkStarts[regionIndex]) * CHUNK_SIZE;
+        uint64_t remaining = region->size - regionOffset;
+        int error = copyChunk(job, buffer, region, regionOffset, remaining < CHUNK_SIZE ? (size_t)remaining : CHUNK_SIZE);
+        if (error != 0) {
+            int expected = 0;
+            __atomic_compare_exchange_n(&job->error, &expected, error, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        }
+    }
+    free(buffer);
+    return NULL;
+}
+
+int selfdeCoreWriteRegions(int fd, const SelfdeCoreRegion *regions, uint32_t regionCount, uint32_t threadCount, bool elideZeroPages, SelfdeCoreReadFunction read, void *context, SelfdeCoreDumpStatistics *statistics) {
+    CopyJob job;
+    memset(&job, 0, sizeof(job));
+    job.fd = fd;
+    job.regions = regions;
+    job.regionCount = regionCount;
+    job.elideZeroPages = elideZeroPages;
+    job.read = read;
+    job.context = context;
+    job.chunkStarts = malloc(((size_t)regionCount + 1) * sizeof(uint64_t));
+    if (!job.chunkStarts) {
+        return ENOMEM;
+    }
+    job.chunkStarts[0] = 0;
+    for (uint32_t i = 0; i < regionCount; ++i) {
+        job.chunkStarts[i + 1] = job.chunkStarts[i] + (regions[i].size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    }
+
+    pthread_t threads[MAX_COPY_THREADS];
+    uint32_t startedThreads = 0;
+    if (threadCount > MAX_COPY_THREADS) {
+        threadCount = MAX_COPY_THREADS;
+    }
+    // The calling thread copies as well.
+    while (startedThreads + 1 < threadCount && pthread_create(&threads[startedThreads], NULL, copyThreadMain, &job) == 0) {
+        startedThreads++;
+    }
+    copyThreadMain(&job);
+    for (uint32_t i = 0; i < startedThreads; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    free(job.chunkStarts);
+    statistics->writtenBytes += job.writtenBytes;
+    statistics->elidedBytes += job.elidedBytes;
+    statistics->unreadableBytes += job.unreadableBytes;
+    return job.error;
+}
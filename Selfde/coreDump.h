@@ -0,0 +1,63 @@
+//
+//  coreDump.h
+//  Selfde
+//
+
+#ifndef coreDump_h
+#define coreDump_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SELFDE_CORE_PAGE_SIZE 4096
+
+// A memory region of the process and its place in the core file.
+typedef struct SelfdeCoreRegion {
+    uint64_t address;
+    uint64_t size;
+    // Where the contents are read from. It's a copy-on-write snapshot of the region when the
+    // platform can make one, and 0 when the region couldn't be read.
+    uint64_t sourceAddress;
+    uint64_t fileOffset;
+    // PROT_READ, PROT_WRITE and PROT_EXEC.
+    uint32_t protection;
+} SelfdeCoreRegion;
+
+typedef struct SelfdeCoreDumpStatistics {
+    uint32_t threadCount;
+    uint32_t regionCount;
+    // The time for which the threads of the process were stopped by the dump.
+    uint64_t pauseNanoseconds;
+    uint64_t writtenBytes;
+    // The zero pages that were left as holes in the file.
+    uint64_t elidedBytes;
+    // The pages that couldn't be read are left as zeros.
+    uint64_t unreadableBytes;
+} SelfdeCoreDumpStatistics;
+
+// Reads the memory without faulting, returns false when a part of it can't be read.
+typedef bool (*SelfdeCoreReadFunction)(void *context, uint64_t address, void *buffer, size_t size);
+
+// Assigns the page aligned file offsets to the regions after a header of the given size.
+// Returns the size of the core file.
+uint64_t selfdeCoreLayoutRegions(SelfdeCoreRegion *regions, uint32_t regionCount, uint64_t headerSize);
+
+// Copies the regions into the file in large chunks, which are shared out between 'threadCount'
+// threads and written with pwrite. When the zero pages are elided they aren't written, and the
+// file has to be extended to its full size beforehand so that they read back as zeros.
+// Returns the errno of the first write that failed.
+int selfdeCoreWriteRegions(int fd, const SelfdeCoreRegion *regions, uint32_t regionCount, uint32_t threadCount, bool elideZeroPages, SelfdeCoreReadFunction read, void *context, SelfdeCoreDumpStatistics *statistics);
+
+// Writes the whole buffer at the offset, returns the errno on failure.
+int selfdeCoreWrite(int fd, const void *buffer, size_t size, uint64_t offset);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* coreDump_h */
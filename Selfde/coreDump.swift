@@ -0,0 +1,80 @@
+//
+//  coreDump.swift
+//  Selfde
+//
+
+#if os(Linux)
+import Glibc
+import SelfdeLinuxImpl
+#else
+import Darwin
+#endif
+import Dispatch
+
+public struct CoreDumpOptions {
+    /// The number of the threads that copy the memory into the file.
+    public var copyThreadCount: Int
+    /// The pages that are all zeros aren't written, so they're holes in a sparse file.
+    public var elideZeroPages: Bool
+
+    public init(copyThreadCount: Int = 4, elideZeroPages: Bool = true) {
+        self.copyThreadCount = copyThreadCount
+        self.elideZeroPages = elideZeroPages
+    }
+}
+
+/// What was written to a core file, and how long the process was stopped for.
+public struct CoreDumpStatistics {
+    public let threadCount: Int
+    public let regionCount: Int
+    /// The time for which the threads were stopped by the dump, in nanoseconds.
+    public let pauseDuration: UInt64
+    /// The time that the whole dump took, in nanoseconds.
+    public let totalDuration: UInt64
+    public let writtenBytes: UInt64
+    public let elidedBytes: UInt64
+    /// The memory that couldn't be read is stored as zeros.
+    public let unreadableBytes: UInt64
+
+    public init(threadCount: Int, regionCount: Int, pauseDuration: UInt64, totalDuration: UInt64, writtenBytes: UInt64, elidedBytes: UInt64 = 0, unreadableBytes: UInt64 = 0) {
+        self.threadCount = threadCount
+        self.regionCount = regionCount
+        self.pauseDuration = pauseDuration
+        self.totalDuration = totalDuration
+        self.writtenBytes = writtenBytes
+        self.elidedBytes = elidedBytes
+        self.unreadableBytes = unreadableBytes
+    }
+
+    init(_ statistics: SelfdeCoreDumpStatistics, totalDuration: UInt64) {
+        self.init(threadCount: Int(statistics.threadCount), regionCount: Int(statistics.regionCount), pauseDuration: statistics.pauseNanoseconds, totalDuration: totalDuration, writtenBytes: statistics.writtenBytes, elidedBytes: statistics.elidedBytes, unreadableBytes: statistics.unreadableBytes)
+    }
+}
+
+extension CoreDumpOptions {
+    var copyThreads: UInt32 {
+        return UInt32(min(max(copyThreadCount, 1), 32))
+    }
+}
+
+func currentUptimeNanoseconds() -> UInt64 {
+    return DispatchTime.now().uptimeNanoseconds
+}
+
+/// Creates the core file and lets the writer fill it in. The writer returns an errno.
+func writeCoreFile(at path: String, write: (Int32, inout SelfdeCoreDumpStatistics) -> Int32) throws -> SelfdeCoreDumpStatistics {
+    let descriptor = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0o600)
+    guard descriptor >= 0 else {
+        let error = errno
+        throw ControllerError.systemError(code: Int(error), message: String(cString: strerror(error)))
+    }
+    defer {
+        close(descriptor)
+    }
+    var statistics = SelfdeCoreDumpStatistics()
+    let error = write(descriptor, &statistics)
+    guard error == 0 else {
+        throw ControllerError.systemError(code: Int(error), message: String(cString: strerror(error)))
+    }
+    return statistics
+}
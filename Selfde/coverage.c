@@ -0,0 +1,301 @@
+//
+//  coverage.c
+//  Selfde
+//
+// The coverage sites are kept in an array that's sorted by their addresses, so that the trap handlers
+// can find a site with a binary search and without taking locks, whatever the number of the sites.
+// A site is installed once, and the first thread that hits it sets its bit and puts back its byte.
+
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+#include "coverage.h"
+#include "livePatchX86_64.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define SELFDE_INT3 0xCC
+
+enum {
+    // Not installed yet, or skipped by the install.
+    SiteIdle = 0,
+    SiteInstalled,
+    // The original byte is being put back.
+    SiteRestoring,
+    SiteRestored
+};
+
+typedef struct CoverageSite {
+    uint64_t address;
+    // The bit of the site.
+    uint32_t index;
+    uint8_t originalByte;
+    uint8_t state;
+} CoverageSite;
+
+typedef struct CoverageTable {
+    CoverageSite *sites;
+    uint32_t siteCount;
+    uint64_t *words;
+    bool isInstalled;
+} CoverageTable;
+
+static pthread_mutex_t coverageMutex = PTHREAD_MUTEX_INITIALIZER;
+static CoverageTable *currentTable;
+// The trap handlers that might still be using a table that's being replaced.
+static int activeHandlers;
+
+static int compareSites(const void *lhs, const void *rhs) {
+    uint64_t a = ((const CoverageSite *)lhs)->address;
+    uint64_t b = ((const CoverageSite *)rhs)->address;
+    return a < b ? -1 : (a > b ? 1 : 0);
+}
+
+static CoverageSite *findSite(CoverageTable *table, uint64_t address) {
+    uint32_t low = 0;
+    uint32_t high = table->siteCount;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        uint64_t siteAddress = table->sites[middle].address;
+        if (siteAddress == address) {
+            return &table->sites[middle];
+        }
+        if (siteAddress < address) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return NULL;
+}
+
+static void markSite(CoverageTable *table, const CoverageSite *site) {
+    __atomic_fetch_or(&table->words[site->index / 64], (uint64_t)1 << (site->index % 64), __ATOMIC_RELAXED);
+}
+
+static bool compareAndSwapByte(uint64_t address, uint8_t expected, uint8_t replacement) {
+    return __atomic_compare_exchange_n((uint8_t *)(uintptr_t)address, &expected, replacement, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+// Puts back the original byte of an installed site. Only the one that moves the site out of the installed
+// state writes the byte, and the others wait for it so that they never see the INT 3 of the site afterwards.
+static bool restoreSite(CoverageSite *site) {
+    uint8_t state = SiteInstalled;
+    if (__atomic_compare_exchange_n(&site->state, &state, SiteRestoring, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        compareAndSwapByte(site->address, SELFDE_INT3, site->originalByte);
+        __atomic_store_n(&site->state, SiteRestored, __ATOMIC_RELEASE);
+        return true;
+    }
+    while (__atomic_load_n(&site->state, __ATOMIC_ACQUIRE) == SiteRestoring) {
+        sched_yield();
+    }
+    return false;
+}
+
+static CoverageTable *acquireTable(void) {
+    __atomic_add_fetch(&activeHandlers, 1, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&currentTable, __ATOMIC_SEQ_CST);
+}
+
+static void releaseTable(void) {
+    __atomic_sub_fetch(&activeHandlers, 1, __ATOMIC_SEQ_CST);
+}
+
+static void destroyCurrentTable(void) {
+    CoverageTable *table = __atomic_exchange_n(&currentTable, NULL, __ATOMIC_SEQ_CST);
+    if (!table) {
+        return;
+    }
+    while (__atomic_load_n(&activeHandlers, __ATOMIC_SEQ_CST) != 0) {
+        sched_yield();
+    }
+    free(table->sites);
+    free(table->words);
+    free(table);
+}
+
+int selfdeCoverageStart(const uint64_t *addresses, uint32_t count) {
+    pthread_mutex_lock(&coverageMutex);
+    if (currentTable && currentTable->isInstalled) {
+        pthread_mutex_unlock(&coverageMutex);
+        return EBUSY;
+    }
+    destroyCurrentTable();
+    CoverageTable *table = calloc(1, sizeof(CoverageTable));
+    CoverageSite *sites = malloc((count > 0 ? count : 1) * sizeof(CoverageSite));
+    uint64_t *words = calloc(count / 64 + 1, sizeof(uint64_t));
+    if (!table || !sites || !words) {
+        free(table);
+        free(sites);
+        free(words);
+        pthread_mutex_unlock(&coverageMutex);
+        return ENOMEM;
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+        sites[i].address = addresses[i];
+        sites[i].index = i;
+        sites[i].originalByte = 0;
+        sites[i].state = SiteIdle;
+    }
+    qsort(sites, count, sizeof(CoverageSite), compareSites);
+    for (uint32_t i = 1; i < count; ++i) {
+        if (sites[i].address == sites[i - 1].address) {
+            free(table);
+            free(sites);
+            free(words);
+            pthread_mutex_unlock(&coverageMutex);
+            return EINVAL;
+        }
+    }
+    table->sites = sites;
+    table->siteCount = count;
+    table->words = words;
+    __atomic_store_n(&currentTable, table, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&coverageMutex);
+    return 0;
+}
+
+// Makes the pages of the sites writable, one call for every run of adjacent pages. When a run can't be
+// made writable its pages are tried one at a time, and the sites on the pages that fail are skipped.
+static void protectSites(CoverageTable *table, SelfdeCoverageProtectFunction protect, void *context, bool *isWritable) {
+    uint64_t pageSize = (uint64_t)sysconf(_SC_PAGESIZE);
+    uint32_t runStart = 0;
+    while (runStart < table->siteCount) {
+        uint64_t firstPage = table->sites[runStart].address & ~(pageSize - 1);
+        uint64_t lastPage = firstPage;
+        uint32_t runEnd = runStart + 1;
+        while (runEnd < table->siteCount) {
+            uint64_t page = table->sites[runEnd].address & ~(pageSize - 1);
+            if (page > lastPage + pageSize) {
+                break;
+            }
+            lastPage = page;
+            runEnd++;
+        }
+        // An instruction's first byte never crosses into the next page, so that's all that's patched.
+        bool isRunWritable = protect(context, firstPage, lastPage - firstPage + pageSize) == 0;
+        uint64_t checkedPage = 0;
+        bool isPageWritable = isRunWritable;
+        for (uint32_t i = runStart; i < runEnd; ++i) {
+            uint64_t page = table->sites[i].address & ~(pageSize - 1);
+            if (!isRunWritable && page != checkedPage) {
+                checkedPage = page;
+                isPageWritable = protect(context, page, pageSize) == 0;
+            }
+            isWritable[i] = isPageWritable;
+        }
+        runStart = runEnd;
+    }
+}
+
+int selfdeCoverageInstall(SelfdeCoverageProtectFunction protect, void *context, uint32_t *installedCount) {
+    pthread_mutex_lock(&coverageMutex);
+    CoverageTable *table = currentTable;
+    if (!table || table->isInstalled) {
+        pthread_mutex_unlock(&coverageMutex);
+        return table ? EBUSY : EINVAL;
+    }
+    bool *isWritable = malloc((table->siteCount > 0 ? table->siteCount : 1) * sizeof(bool));
+    if (!isWritable) {
+        pthread_mutex_unlock(&coverageMutex);
+        return ENOMEM;
+    }
+    protectSites(table, protect, context, isWritable);
+    uint32_t installed = 0;
+    for (uint32_t i = 0; i < table->siteCount; ++i) {
+        CoverageSite *site = &table->sites[i];
+        if (!isWritable[i] || __atomic_load_n(&site->state, __ATOMIC_ACQUIRE) != SiteIdle) {
+            continue;
+        }
+        uint8_t originalByte = *(volatile const uint8_t *)(uintptr_t)site->address;
+        if (originalByte == SELFDE_INT3) {
+            continue;
+        }
+        site->originalByte = originalByte;
+        // The site is installed before its INT 3 can be hit.
+        __atomic_store_n(&site->state, SiteInstalled, __ATOMIC_RELEASE);
+        if (!compareAndSwapByte(site->address, originalByte, SELFDE_INT3)) {
+            __atomic_store_n(&site->state, SiteIdle, __ATOMIC_RELEASE);
+            continue;
+        }
+        installed++;
+    }
+    free(isWritable);
+    table->isInstalled = true;
+    // The INT 3s are written without a serialization each, until now the threads might run the old code.
+    selfdeLivePatchSerializeAllThreads();
+    pthread_mutex_unlock(&coverageMutex);
+    *installedCount = installed;
+    return 0;
+}
+
+void selfdeCoverageStop(void) {
+    pthread_mutex_lock(&coverageMutex);
+    CoverageTable *table = currentTable;
+    if (table && table->isInstalled) {
+        for (uint32_t i = 0; i < table->siteCount; ++i) {
+            restoreSite(&table->sites[i]);
+        }
+        table->isInstalled = false;
+        selfdeLivePatchSerializeAllThreads();
+    }
+    pthread_mutex_unlock(&coverageMutex);
+}
+
+bool selfdeCoverageHandleTrap(uint64_t address) {
+    CoverageTable *table = acquireTable();
+    CoverageSite *site = table ? findSite(table, address) : NULL;
+    bool isHandled = false;
+    if (site) {
+        // The byte is put back without serializing the other threads. The ones that still see the
+        // INT 3 trap into this function, which lets them continue once the byte has been replaced.
+        restoreSite(site);
+        uint8_t state = __atomic_load_n(&site->state, __ATOMIC_ACQUIRE);
+        isHandled = state == SiteRestored && *(volatile const uint8_t *)(uintptr_t)address != SELFDE_INT3;
+        if (isHandled) {
+            markSite(table, site);
+        }
+    }
+    releaseTable();
+    return isHandled;
+}
+
+void selfdeCoverageReleaseSite(uint64_t address) {
+    CoverageTable *table = acquireTable();
+    CoverageSite *site = table ? findSite(table, address) : NULL;
+    if (site) {
+        uint8_t state = SiteIdle;
+        // A site that wasn't installed yet is never installed.
+        if (!__atomic_compare_exchange_n(&site->state, &state, SiteRestored, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            restoreSite(site);
+            selfdeLivePatchSerializeAllThreads();
+        }
+    }
+    releaseTable();
+}
+
+void selfdeCoverageMarkHit(uint64_t address) {
+    CoverageTable *table = acquireTable();
+    CoverageSite *site = table ? findSite(table, address) : NULL;
+    if (site) {
+        markSite(table, site);
+    }
+    releaseTable();
+}
+
+uint32_t selfdeCoverageCopyBitmap(uint64_t *words, uint32_t wordCapacity) {
+    CoverageTable *table = acquireTable();
+    uint32_t siteCount = 0;
+    if (table) {
+        siteCount = table->siteCount;
+        uint32_t wordCount = (siteCount + 63) / 64;
+        for (uint32_t i = 0; i < wordCount && i < wordCapacity; ++i) {
+            words[i] = __atomic_load_n(&table->words[i], __ATOMIC_RELAXED);
+        }
+    }
+    releaseTable();
+    return siteCount;
+}
@@ -0,0 +1,52 @@
+//
+//  coverage.h
+//  Selfde
+//
+
+#ifndef coverage_h
+#define coverage_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Makes the code in the given range writable, returns an errno.
+typedef int (*SelfdeCoverageProtectFunction)(void *context, uint64_t address, uint64_t size);
+
+// Creates the sites of a new coverage run, one for every basic block address. The bit of a site in
+// the coverage bitmap is its index in the given list. The previous run has to be stopped, and its
+// bitmap is dropped. Returns EBUSY while a run is installed and EINVAL for a duplicate address.
+int selfdeCoverageStart(const uint64_t *addresses, uint32_t count);
+
+// Puts a one-shot INT 3 over the first byte of every site that wasn't released. The pages of the sites are
+// made writable first, and the sites on the pages that can't be are skipped, as are the sites that already
+// have an INT 3. Returns the number of the sites that were installed in 'installedCount'.
+int selfdeCoverageInstall(SelfdeCoverageProtectFunction protect, void *context, uint32_t *installedCount);
+
+// Removes the INT 3s of the sites that haven't been hit. The bitmap can still be read.
+void selfdeCoverageStop(void);
+
+// Returns true when the INT 3 at the given address that was hit by a thread belongs to a coverage site.
+// The site's bit is set and its original byte is put back on the first hit, after which the thread can
+// continue at the address. Can be called from a signal handler or an exception handler.
+bool selfdeCoverageHandleTrap(uint64_t address);
+
+// Removes the INT 3 of the site at the given address, so that a breakpoint can be put there.
+// Its bit is set by selfdeCoverageMarkHit when the breakpoint is hit.
+void selfdeCoverageReleaseSite(uint64_t address);
+
+// Sets the bit of the site at the given address.
+void selfdeCoverageMarkHit(uint64_t address);
+
+// Copies the bitmap of the current run, site i is bit i % 64 of word i / 64. Returns the number of the sites.
+uint32_t selfdeCoverageCopyBitmap(uint64_t *words, uint32_t wordCapacity);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* coverage_h */
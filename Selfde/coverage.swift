@@ -0,0 +1,72 @@
+//
+//  coverage.swift
+//  Selfde
+//
+
+#if os(Linux)
+import Glibc
+import SelfdeLinuxImpl
+#else
+import Darwin
+#endif
+
+/// Which of the basic blocks of a coverage run have been executed. The blocks are numbered by their
+/// position in the list of addresses that the run was started with.
+public struct CoverageMap {
+    public let siteCount: Int
+    /// Block i is bit i % 64 of word i / 64.
+    public let words: [UInt64]
+
+    public init(siteCount: Int, words: [UInt64]) {
+        self.siteCount = siteCount
+        self.words = words
+    }
+
+    public func isCovered(_ index: Int) -> Bool {
+        return words[index / 64] & (UInt64(1) << UInt64(index % 64)) != 0
+    }
+
+    public var coveredCount: Int {
+        return words.reduce(0) { count, word in
+            var word = word
+            var bits = 0
+            while word != 0 {
+                word &= word - 1
+                bits += 1
+            }
+            return count + bits
+        }
+    }
+
+    /// The bitmap with block i in bit i % 8 of byte i / 8.
+    public var bytes: [UInt8] {
+        return (0..<(siteCount + 7) / 8).map { i in
+            return UInt8(truncatingBitPattern: words[i / 8] >> UInt64((i % 8) * 8))
+        }
+    }
+}
+
+/// Creates the coverage sites and puts an INT 3 on every one of them but the addresses that have breakpoints,
+/// whose bits are set by the breakpoint hits. Returns the number of the installed sites.
+func installCoverageSites(_ addresses: [Address], breakpoints: [Address], protect: SelfdeCoverageProtectFunction) throws -> Int {
+    try handleCoverageError(selfdeCoverageStart(addresses.map { $0.bitPattern64 }, UInt32(addresses.count)))
+    for address in breakpoints {
+        selfdeCoverageReleaseSite(address.bitPattern64)
+    }
+    var installedCount: UInt32 = 0
+    try handleCoverageError(selfdeCoverageInstall(protect, nil, &installedCount))
+    return Int(installedCount)
+}
+
+func readCoverageMap() -> CoverageMap {
+    let siteCount = Int(selfdeCoverageCopyBitmap(nil, 0))
+    var words = [UInt64](repeating: 0, count: (siteCount + 63) / 64)
+    _ = selfdeCoverageCopyBitmap(&words, UInt32(words.count))
+    return CoverageMap(siteCount: siteCount, words: words)
+}
+
+private func handleCoverageError(_ error: Int32) throws {
+    guard error == 0 else {
+        throw ControllerError.systemError(code: Int(error), message: String(cString: strerror(error)))
+    }
+}
@@ -51,7 +51,9 @@ enum ResponseResult {
 }
 
 struct DebugServerState {
-    let debugger: Debugger
+    let processDebugger: Debugger
+    // Serves the stops that were released until the process is resumed or interrupted.
+    var releasedStops: ReleasedStopsDebugger?
     var registerState: DebuggerRegisterState
     fileprivate var processID: Int?
 
@@ -80,12 +82,36 @@ struct DebugServerState {
     fileprivate var noAckMode = false
     // Can commands like 'g' include the thread id?
     fileprivate var threadSuffixSupported = false
+    // The encoding of the register values in 'g', 'G', 'p' and 'P' packets.
+    var registerValueEncoding = RegisterValueEncoding.hex
     fileprivate var listThreadsInStopReply = false
+    // In non-stop mode only the threads that have stopped are halted.
+    fileprivate var nonStopMode = false
+    fileprivate var stoppedThreads: [ThreadID] = []
+    // Stop replies that haven't been acknowledged with 'vStopped' yet. The first one has already been sent.
+    fileprivate var pendingStopReplies: [ThreadID] = []
+    // The loaded libraries that were reported, and the last 'qXfer:libraries-svr4' document.
+    var libraryList = LoadedLibraryList()
+    var libraryListDocument: (annex: String, bytes: [UInt8])?
+    // Built by the first symbol lookup.
+    var symbolIndex: SymbolIndex?
+    // The last 'qXfer:profile' document.
+    var profileDocument: (annex: String, bytes: [UInt8])?
+    // The basic blocks of the next coverage run, and the last 'qXfer:coverage' bitmap.
+    var coverageSites: [Address] = []
+    var coverageDocument: [UInt8]?
 
     private(set) weak var logger: DebugServerLogger?
 
+    var debugger: Debugger {
+        if let releasedStops = releasedStops {
+            return releasedStops
+        }
+        return processDebugger
+    }
+
     init(debugger: Debugger, logger: DebugServerLogger?) {
-        self.debugger = debugger
+        processDebugger = debugger
         self.registerState = DebuggerRegisterState(debugger: debugger)
         self.logger = logger
     }
@@ -100,6 +126,14 @@ extension PacketParser {
     }
 }
 
+// Returns nil when the end of the range doesn't fit in the address space, as the ranges are exclusive.
+func makeAddressRange(address: UInt, length: UInt) -> AddressRange? {
+    guard Int(exactly: length) != nil, length <= UInt.max - address else {
+        return nil
+    }
+    return AddressRange(start: Address(bitPattern: address), end: Address(bitPattern: address + length))
+}
+
 extension DebugServerState {
     // Extracts the 'thread:NNN' suffix or returns the current thread ID.
     mutating func extractThreadID(_ payload: String) -> ThreadID? {
@@ -112,11 +146,213 @@ extension DebugServerState {
         var parser = PacketParser(payload: payload, offset: range.upperBound)
         return parser.consumeThreadID()
     }
+
+    // Extracts the ';thread:NNN' suffix that follows the parsed contents or returns the current thread ID.
+    // The binary values can contain anything, so the suffix isn't searched for.
+    mutating func extractThreadID(_ parser: inout PacketParser) -> ThreadID? {
+        guard threadSuffixSupported else {
+            return currentThreadID
+        }
+        guard parser.consumeIfPresent(";") else {
+            return nil
+        }
+        for c in "thread:".unicodeScalars {
+            guard parser.consumeIfPresent(c) else {
+                return nil
+            }
+        }
+        return parser.consumeThreadID()
+    }
+
+    // Responds with a register value in the negotiated encoding.
+    func registerValueResponse(_ value: ArraySlice<UInt8>) -> ResponseResult {
+        switch registerValueEncoding {
+        case .hex:
+            return .response(value.hexString)
+        case .binary:
+            return .binaryResponse(registerValueEncoding.encode(value))
+        }
+    }
 }
 
 // packet '?'
 private func handleHaltReasonQuery(_ server: inout DebugServerState, payload: String) -> ResponseResult {
-    return .threadStopReply
+    guard server.nonStopMode else {
+        return .threadStopReply
+    }
+    // Report all of the stopped threads, the rest of them are fetched with 'vStopped'.
+    server.pendingStopReplies = server.stoppedThreads
+    guard let threadID = server.pendingStopReplies.first else {
+        return .ok
+    }
+    return .stopReplyForThread(threadID)
+}
+
+// vStopped acknowledges a stop reply in non-stop mode.
+private func handleVStopped(_ server: inout DebugServerState, payload: String) -> ResponseResult {
+    guard !server.pendingStopReplies.isEmpty else {
+        return .ok
+    }
+    server.pendingStopReplies.removeFirst()
+    guard let threadID = server.pendingStopReplies.first else {
+        return .ok
+    }
+    return .stopReplyForThread(threadID)
+}
+
+// QNonStop:0/1
+private func handleQNonStop(_ server: inout DebugServerState, payload: String) -> ResponseResult {
+    var parser = PacketParser(payload: payload, offset: "QNonStop:".characters.count)
+    guard let value = parser.consumeUInt(), value <= 1 else {
+        return .invalid("Invalid non-stop mode")
+    }
+    do {
+        try server.debugger.setNonStopMode(value == 1)
+    } catch {
+        return .error(.e01)
+    }
+    server.nonStopMode = value == 1
+    server.pendingStopReplies = []
+    return .ok
+}
+
+// Parses the 'sig;sig;...' list of the QPassSignals and QProgramSignals packets.
+private func parseSignalList(_ payload: String, prefix: String) -> [Int32]? {
+    var parser = PacketParser(payload: payload, offset: prefix.characters.count)
+    var signals = [Int32]()
+    while parser.hasContents {
+        guard let signal = parser.consumeHexUInt(), signal <= 0xFF else {
+            return nil
+        }
+        signals.append(Int32(signal))
+        guard parser.consumeIfPresent(";") || !parser.hasContents else {
+            return nil
+        }
+    }
+    return signals
+}
+
+// QPassSignals:sig;sig;... sets the signals that are passed to the program without a stop.
+private func handleQPassSignals(_ server: inout DebugServerState, payload: String) -> ResponseResult {
+    guard let signals = parseSignalList(payload, prefix: "QPassSignals:") else {
+        return .invalid("Invalid signal list")
+    }
+    do {
+        try server.debugger.setPassSignals(signals)
+    } catch {
+        return .error(.e01)
+    }
+    return .ok
+}
+
+// QProgramSignals:sig;sig;... sets the signals that can be delivered to the program.
+private func handleQProgramSignals(_ server: inout DebugServerState, payload: String) -> ResponseResult {
+    guard let signals = parseSignalList(payload, prefix: "QProgramSignals:") else {
+        return .invalid("Invalid signal list")
+    }
+    do {
+        try server.debugger.setProgramSignals(signals)
+    } catch {
+        return .error(.e01)
+    }
+    return .ok
+}
+
+// qCallFunction:addr;int,int,...;vector,vector,... calls a function on the current thread.
+// The integers are big endian hex numbers and the vectors are 16 hex encoded bytes. The reply
+// has the result registers, 'rax:NN;rdx:NN;xmm0:BYTES;xmm1:BYTES;'.
+private func handleQCallFunction(_ server: inout DebugServerState, payload: String) -> ResponseResult {
+    let fields = payload.characters.dropFirst("qCallFunction:".characters.count).split(separator: ";", omittingEmptySubsequences: false).map { String($0) }
+    guard fields.count >= 3 else {
+        return .invalid("Missing function call arguments")
+    }
+    var parser = PacketParser(payload: fields[0])
+    guard let address = parser.consumeAddress(), !parser.hasContents else {
+        return .invalid("Invalid function address")
+    }
+    var integerArguments = [UInt64]()
+    for field in fields[1].characters.split(separator: ",") {
+        var parser = PacketParser(payload: String(field))
+        guard let value = parser.consumeHexUInt64(), !parser.hasContents else {
+            return .invalid("Invalid integer argument")
+        }
+        integerArguments.append(value)
+    }
+    var vectorArguments = [[UInt8]]()
+    for field in fields[2].characters.split(separator: ",") {
+        var parser = PacketParser(payload: String(field))
+        guard let bytes = parser.readHexBytes(), bytes.count == 16 else {
+            return .invalid("Invalid vector argument")
+        }
+        vectorArguments.append(bytes)
+    }
+    guard let threadID = server.extractThreadID(payload) else {
+        return .invalid("No thread specified")
+    }
+    do {
+        let result = try server.debugger.callFunction(address, threadID: threadID, integerArguments: integerArguments, vectorArguments: vectorArguments)
+        var response = ""
+        for (name, value) in zip(["rax", "rdx"], result.integerValues) {
+            response += "\(name):\(String(value, radix: 16, uppercase: false));"
+        }
+        for (name, bytes) in zip(["xmm0", "xmm1"], result.vectorValues) {
+            response += "\(name):\(bytes.hexString);"
+        }
+        return .response(response)
+    } catch {
+        return .error(.e01)
+    }
+}
+
+// qSaveCore;path-hint:HEX;elide-zero-pages:0/1;copy-threads:HEX
+// Writes a core file of the process, the fields are optional. The reply has the path of the core, and
+// for how long the process was paused: 'core-path:HEX;pause-ns:HEX;written:HEX;elided:HEX;unreadable:HEX;'.
+private func handleQSaveCore(_ server: inout DebugServerState, payload: String) -> ResponseResult {
+    let fields = payload.components(separatedBy: ";")
+    guard fields[0] == "qSaveCore" else {
+        return .unimplemented
+    }
+    var path = NSTemporaryDirectory() + "core.\(getpid())"
+    var options = CoreDumpOptions()
+    for field in fields.dropFirst() where !field.isEmpty {
+        let pair = field.components(separatedBy: ":")
+        guard pair.count == 2 else {
+            return .invalid("Invalid core dump option")
+        }
+        var parser = PacketParser(payload: pair[1])
+        switch pair[0] {
+        case "path-hint":
+            guard let bytes = parser.readHexBytes(), let hint = String(bytes: bytes, encoding: .utf8), !hint.isEmpty else {
+                return .invalid("Invalid core path")
+            }
+            path = hint
+        case "elide-zero-pages":
+            guard let value = parser.consumeUInt(), value <= 1, !parser.hasContents else {
+                return .invalid("Invalid core dump option")
+            }
+            options.elideZeroPages = value == 1
+        case "copy-threads":
+            guard let value = parser.consumeHexUInt(), value > 0, !parser.hasContents else {
+                return .invalid("Invalid core dump option")
+            }
+            options.copyThreadCount = Int(value)
+        default:
+            return .invalid("Unknown core dump option")
+        }
+    }
+    let statistics: CoreDumpStatistics
+    do {
+        statistics = try server.debugger.writeCore(to: path, options: options)
+    } catch DebuggerError.unsupported {
+        return .unimplemented
+    } catch {
+        return .error(.e01)
+    }
+    var response = "core-path:\(Array(path.utf8).hexString);"
+    for (name, value) in [("pause-ns", statistics.pauseDuration), ("written", statistics.writtenBytes), ("elided", statistics.elidedBytes), ("unreadable", statistics.unreadableBytes)] {
+        response += "\(name):\(String(value, radix: 16, uppercase: false));"
+    }
+    return .response(response)
 }
 
 private func handleK(_ server: inout DebugServerState, payload: String) -> ResponseResult {
@@ -372,10 +608,42 @@ private func handleQThreadStopInfo(_ server: inout DebugServerState, payload: St
     return .stopReplyForThread(threadID)
 }
 
+// jBacktrace:{"threads":[tid,...],"max_frames":N}
+// Replies with the frames of the stopped threads in one packet, so that the client doesn't have to
+// read the stacks and the unwind information. All of the threads are unwound when the list is missing.
+// The JSON is binary escaped in both directions.
+private func handleJBacktrace(_ server: inout DebugServerState, payload: String) -> ResponseResult {
+    let arguments = payload.unicodeScalars.dropFirst("jBacktrace:".unicodeScalars.count).map { UInt8(truncatingBitPattern: $0.value) }.decodedBinaryData
+    guard let json = (try? JSONSerialization.jsonObject(with: Data(bytes: arguments), options: [])) as? [String: Any] else {
+        return .invalid("Invalid JSON arguments")
+    }
+    let threadIDs = (json["threads"] as? [Any]).map { $0.flatMap { ($0 as? NSNumber).map { ThreadID($0.uint64Value) } } } ?? server.debugger.threads
+    let maxFrames = (json["max_frames"] as? NSNumber)?.intValue ?? 256
+    let backtraces: [[Address]]
+    do {
+        backtraces = try server.debugger.getBacktraces(threadIDs, maxFrames: maxFrames)
+    } catch DebuggerError.unsupported {
+        return .unimplemented
+    } catch {
+        return .error(.e01)
+    }
+    guard backtraces.count == threadIDs.count else {
+        return .error(.e01)
+    }
+    var result = "["
+    for (i, threadID) in threadIDs.enumerated() {
+        if i > 0 { result += "," }
+        result += "{\"tid\":\(threadID),\"frames\":[" + backtraces[i].map { "\($0.bitPattern)" }.joined(separator: ",") + "]}"
+    }
+    result += "]"
+    return .binaryResponse(Array(result.utf8).encodedBinaryData)
+}
+
 // vCont?
 private func handleVContQuery(_ server: inout DebugServerState, payload: String) -> ResponseResult {
-    // Support 'c' (continue) and 's' (step)
-    return .response("vCont;c;s")
+    // Support 'c' (continue), 's' (step), 't' (stop) in the non-stop mode, 'r' (range step) and
+    // 'f' (step out, a Selfde extension) when the debugger can do it.
+    return .response("vCont;c;s" + (server.nonStopMode ? ";t" : "") + ";r" + (server.debugger.supportsStepOut ? ";f" : ""))
 }
 
 // vCont
@@ -390,18 +658,30 @@ private func handleVCont(_ server: inout DebugServerState, payload: String) -> R
     var defaultAction: ThreadResumeAction?
     while parser.consumeIfPresent(";") {
         let action: ThreadResumeAction
+        var range: AddressRange?
         switch parser.consumeCharacter() {
         case "c"?:
             action = .continue
         case "s"?:
             action = .step
+        case "t"? where server.nonStopMode:
+            action = .stop
+        case "r"?:
+            // r start,end
+            guard let start = parser.consumeAddress(), parser.consumeComma(), let end = parser.consumeAddress() else {
+                return .invalid("Invalid range")
+            }
+            action = .rangeStep
+            range = AddressRange(start: start, end: end)
+        case "f"? where server.debugger.supportsStepOut:
+            action = .stepOut
         default:
             return .invalid("Unsupported vCont action")
         }
         if parser.consumeIfPresent(":") {
             switch parser.parseThreadReference() {
             case .some(let thread):
-                actions.append(ThreadResumeEntry(thread: thread, action: action, address: .none))
+                actions.append(ThreadResumeEntry(thread: thread, action: action, address: .none, range: range))
             case .none(let parseResult):
                 return parseResult
             }
@@ -409,6 +689,9 @@ private func handleVCont(_ server: inout DebugServerState, payload: String) -> R
             guard defaultAction == nil else {
                 return .invalid("Default action is specified more than once")
             }
+            guard range == nil && action != .stepOut else {
+                return .invalid("Stepping action requires a thread")
+            }
             defaultAction = action
         }
     }
@@ -416,7 +699,8 @@ private func handleVCont(_ server: inout DebugServerState, payload: String) -> R
         return .invalid("No action specified")
     }
     // The response will be the stopped/exited message.
-    return .resume(actions: actions, defaultAction: defaultAction ?? .stop)
+    // Threads without an action keep running in non-stop mode.
+    return .resume(actions: actions, defaultAction: defaultAction ?? (server.nonStopMode ? .none : .stop))
 }
 
 // c [addr]
@@ -512,8 +796,14 @@ private func handleQSymbol(_ server: inout DebugServerState, payload: String) ->
 }
 
 private func handleQSupported(_ server: inout DebugServerState, payload: String) -> ResponseResult {
-    // Don't care about the payload here.
-    return .response("PacketSize=20000;qEcho+")
+    // The binary register values are used only when the client asks for them.
+    let clientFeatures = payload.components(separatedBy: ":").dropFirst().joined(separator: ":").components(separatedBy: ";")
+    server.registerValueEncoding = clientFeatures.contains("binary-registers+") ? .binary : .hex
+    var features = "PacketSize=20000;qEcho+;QNonStop+;QPassSignals+;QProgramSignals+;qCallFunction+;binary-registers+;qSymbolLookup+;qAddressLookup+;jBacktrace+;QStartProfiling+;qXfer:profile:read+;qSaveCore+;QStartCoverage+;qXfer:coverage:read+;QStartDirtyPageTracking+;qSearchMemory+;qMemoryDigests+"
+    #if os(Linux)
+        features += ";qXfer:libraries-svr4:read+"
+    #endif
+    return .response(features)
 }
 
 // This will enabled thread suffix for the 'g', 'G', 'p', and 'P' commands.
@@ -548,6 +838,9 @@ private func getHostProcessInfo(isHostInfo: Bool = true) -> String {
             result.write("watchpoint_exceptions_received:after;")
         }
         result.write("vendor:apple;")
+    #elseif os(Linux)
+        result.write("ostype:linux;")
+        result.write("vendor:unknown;")
     #endif
     result.write("endian:little;") // FIXME: Any big endian targets?
     if isHostInfo {
@@ -559,33 +852,40 @@ private func getHostProcessInfo(isHostInfo: Bool = true) -> String {
 }
 
 private func getCPUType(isHostInfo: Bool) -> (Int, Int)? {
-    var type: UInt32 = 0
-    var subtype: UInt32 = 0
-    var is64BitCapable: UInt32 = 0
-    var err: Int32 = withUnsafeMutablePointer(to: &type) {
-        var size = MemoryLayout<UInt32>.size
-        return sysctlbyname("hw.cputype", $0, &size, nil, 0)
-    }
-    err |= withUnsafeMutablePointer(to: &subtype) {
-        var size = MemoryLayout<UInt32>.size
-        return sysctlbyname("hw.cpusubtype", $0, &size, nil, 0)
-    }
-    if isHostInfo {
-        // Host info decides on the 64 bit based on the hardware capability.
-        err |= withUnsafeMutablePointer(to: &is64BitCapable) {
+    #if os(OSX)
+        var type: UInt32 = 0
+        var subtype: UInt32 = 0
+        var is64BitCapable: UInt32 = 0
+        var err: Int32 = withUnsafeMutablePointer(to: &type) {
             var size = MemoryLayout<UInt32>.size
-            return sysctlbyname("hw.cpu64bit_capable", $0, &size, nil, 0)
+            return sysctlbyname("hw.cputype", $0, &size, nil, 0)
         }
-        if is64BitCapable != 0 {
-            type |= UInt32(CPU_ARCH_ABI64)
+        err |= withUnsafeMutablePointer(to: &subtype) {
+            var size = MemoryLayout<UInt32>.size
+            return sysctlbyname("hw.cpusubtype", $0, &size, nil, 0)
         }
-    } else {
-        // Process info decides on the 64 bit based on the target architecture, since we're debugging self.
-        #if arch(x86_64) || arch(arm64)
-            type |= UInt32(CPU_ARCH_ABI64)
-        #endif
-    }
-    return err == 0 ? (Int(type), Int(subtype)) : nil
+        if isHostInfo {
+            // Host info decides on the 64 bit based on the hardware capability.
+            err |= withUnsafeMutablePointer(to: &is64BitCapable) {
+                var size = MemoryLayout<UInt32>.size
+                return sysctlbyname("hw.cpu64bit_capable", $0, &size, nil, 0)
+            }
+            if is64BitCapable != 0 {
+                type |= UInt32(CPU_ARCH_ABI64)
+            }
+        } else {
+            // Process info decides on the 64 bit based on the target architecture, since we're debugging self.
+            #if arch(x86_64) || arch(arm64)
+                type |= UInt32(CPU_ARCH_ABI64)
+            #endif
+        }
+        return err == 0 ? (Int(type), Int(subtype)) : nil
+    #elseif arch(x86_64)
+        // Linux doesn't have the Mach CPU types, but LLDB expects them: CPU_TYPE_X86_64, CPU_SUBTYPE_X86_64_ALL.
+        return (0x01000007, 3)
+    #else
+        return nil
+    #endif
 }
 
 // Returns process information.
@@ -596,25 +896,39 @@ private func handleQProcessInfo(_ server: inout DebugServerState, payload: Strin
     }
     result += "pid:\(String(processID, radix: 16, uppercase: false));"
 
-    var processInfoRequest = [CTL_KERN, KERN_PROC, KERN_PROC_PID, Int32(processID)]
-    var processInfo = kinfo_proc()
-    var processInfoSize = MemoryLayout<kinfo_proc>.size
-    if processInfoRequest.withUnsafeMutableBufferPointer({ (requestPtr: inout UnsafeMutableBufferPointer<Int32>) in
-        withUnsafeMutablePointer(to: &processInfo) { infoPtr in
-            sysctl(requestPtr.baseAddress, 4, infoPtr, &processInfoSize, nil, 0)
-        }
-    }) == 0 && processInfoSize > 0 {
-        func hex(_ i: UInt32) -> String {
-            return String(Int(i), radix: 16, uppercase: false)
+    #if os(OSX)
+        var processInfoRequest = [CTL_KERN, KERN_PROC, KERN_PROC_PID, Int32(processID)]
+        var processInfo = kinfo_proc()
+        var processInfoSize = MemoryLayout<kinfo_proc>.size
+        if processInfoRequest.withUnsafeMutableBufferPointer({ (requestPtr: inout UnsafeMutableBufferPointer<Int32>) in
+            withUnsafeMutablePointer(to: &processInfo) { infoPtr in
+                sysctl(requestPtr.baseAddress, 4, infoPtr, &processInfoSize, nil, 0)
+            }
+        }) == 0 && processInfoSize > 0 {
+            func hex(_ i: UInt32) -> String {
+                return String(Int(i), radix: 16, uppercase: false)
+            }
+            result += "parent-pid:\(String(Int(processInfo.kp_eproc.e_ppid), radix: 16, uppercase: false));"
+            result += "real-uid:\(hex(processInfo.kp_eproc.e_pcred.p_ruid));"
+            result += "real-gid:\(hex(processInfo.kp_eproc.e_pcred.p_rgid));"
+            result += "effective-uid:\(hex(processInfo.kp_eproc.e_ucred.cr_uid));"
+            if processInfo.kp_eproc.e_ucred.cr_ngroups > 0 {
+                result += "effective-gid:\(hex(processInfo.kp_eproc.e_ucred.cr_groups.0));"
+            }
         }
-        result += "parent-pid:\(String(Int(processInfo.kp_eproc.e_ppid), radix: 16, uppercase: false));"
-        result += "real-uid:\(hex(processInfo.kp_eproc.e_pcred.p_ruid));"
-        result += "real-gid:\(hex(processInfo.kp_eproc.e_pcred.p_rgid));"
-        result += "effective-uid:\(hex(processInfo.kp_eproc.e_ucred.cr_uid));"
-        if processInfo.kp_eproc.e_ucred.cr_ngroups > 0 {
-            result += "effective-gid:\(hex(processInfo.kp_eproc.e_ucred.cr_groups.0));"
+    #else
+        // Only the current process can be debugged.
+        if processID == Int(getpid()) {
+            func hex(_ i: UInt32) -> String {
+                return String(Int(i), radix: 16, uppercase: false)
+            }
+            result += "parent-pid:\(String(Int(getppid()), radix: 16, uppercase: false));"
+            result += "real-uid:\(hex(getuid()));"
+            result += "real-gid:\(hex(getgid()));"
+            result += "effective-uid:\(hex(geteuid()));"
+            result += "effective-gid:\(hex(getegid()));"
         }
-    }
+    #endif
     result += getHostProcessInfo(isHostInfo: false)
     return .response(result)
 }
@@ -646,13 +960,29 @@ private func handleVAttach(_ server: inout DebugServerState, payload: String) ->
 // GDB protocol reference:    https://sourceware.org/gdb/onlinedocs/gdb/Remote-Protocol.html
 // LLDB extensions reference: <LLDB repository>/docs/lldb-gdb-remote.txt
 public class DebugServer {
+    // The packets that don't modify the process or resume it.
+    private static let observerPackets: Set<String> = [
+        "?", "m", "x", "p", "g", "H", "qC", "T", "qThreadStopInfo", "jBacktrace:", "qRegisterInfo", "qShlibInfoAddr",
+        "jGetLoadedDynamicLibrariesInfos:", "qXfer:libraries-svr4:read:", "qSymbolLookup:", "qAddressLookup:", "qSymbol:", "qXfer:profile:read:",
+        "qXfer:coverage:read:", "qDirtyPages:", "qSearch:memory:", "qSearchMemory:", "qCRC:", "qMemoryDigests:", "qSupported", "qHostInfo", "qProcessInfo", "QThreadSuffixSupported", "QListThreadsInStopReply", "QStartNoAckMode", "qEcho:"
+    ]
     private var state: DebugServerState
     private let writer: RemoteDebuggingWriter
     private var handlers: [(String, (inout DebugServerState, String) -> ResponseResult)]
+    // An observer can only read the state of the process, and it's notified about the stops.
+    let isObserver: Bool
+    // The state that's shared with the other sessions, dropped when the process is resumed.
+    private let snapshot: DebuggerSnapshot?
 
-    public init(debugger: Debugger, writer: RemoteDebuggingWriter, logger: DebugServerLogger? = nil) {
-        state = DebugServerState(debugger: debugger, logger: logger)
+    public convenience init(debugger: Debugger, writer: RemoteDebuggingWriter, logger: DebugServerLogger? = nil) {
+        self.init(debugger: debugger, writer: writer, logger: logger, isObserver: false, snapshot: nil)
+    }
+
+    init(debugger: Debugger, writer: RemoteDebuggingWriter, logger: DebugServerLogger?, isObserver: Bool, snapshot: DebuggerSnapshot?) {
+        state = DebugServerState(debugger: snapshot ?? debugger, logger: logger)
         self.writer = writer
+        self.isObserver = isObserver
+        self.snapshot = snapshot
         handlers = []
         handlers = [
             ("?", handleHaltReasonQuery),
@@ -669,21 +999,47 @@ public class DebugServer {
             ("Z0", handleZ),
             ("vCont?", handleVContQuery),
             ("vCont", handleVCont),
+            ("vStopped", handleVStopped),
             ("vAttach;", handleVAttach),
             ("H", handleSetCurrentThread),
+            ("qCallFunction:", handleQCallFunction),
+            ("qSaveCore", handleQSaveCore),
+            ("qCRC:", handleQCRC),
             ("qC", handleCurrentThreadQuery),
             ("T", handleThreadStatus),
             ("_M", handleAllocate),
             ("_m", handleDeallocate),
             ("qThreadStopInfo", handleQThreadStopInfo),
+            ("jBacktrace:", handleJBacktrace),
             ("qRegisterInfo", handleQRegisterInfo),
             ("qShlibInfoAddr", handleQShlibInfoAddr),
+            ("jGetLoadedDynamicLibrariesInfos:", handleJGetLoadedDynamicLibrariesInfos),
+            ("qXfer:libraries-svr4:read:", handleQXferLibrariesSVR4Read),
+            ("qSymbolLookup:", handleQSymbolLookup),
+            ("qAddressLookup:", handleQAddressLookup),
             ("qSymbol:", handleQSymbol),
+            ("QStartProfiling:", handleQStartProfiling),
+            ("QStopProfiling", handleQStopProfiling),
+            ("qXfer:profile:read:", handleQXferProfileRead),
+            ("QCoverageSites:", handleQCoverageSites),
+            ("QStartCoverage", handleQStartCoverage),
+            ("QStopCoverage", handleQStopCoverage),
+            ("qXfer:coverage:read:", handleQXferCoverageRead),
+            ("QStartDirtyPageTracking:", handleQStartDirtyPageTracking),
+            ("QStopDirtyPageTracking", handleQStopDirtyPageTracking),
+            ("qDirtyPageEpoch", handleQDirtyPageEpoch),
+            ("qDirtyPages:", handleQDirtyPages),
+            ("qSearch:memory:", handleQSearchMemoryGDB),
+            ("qSearchMemory:", handleQSearchMemory),
+            ("qMemoryDigests:", handleQMemoryDigests),
             ("qSupported", handleQSupported),
             ("qHostInfo", handleQHostInfo),
             ("qProcessInfo", handleQProcessInfo),
             ("QThreadSuffixSupported", handleQThreadSuffixSupported),
             ("QListThreadsInStopReply", handleQListThreadsInStopReply),
+            ("QNonStop:", handleQNonStop),
+            ("QPassSignals:", handleQPassSignals),
+            ("QProgramSignals:", handleQProgramSignals),
             ("QSaveRegisterState", handleQSaveRegisterState),
             ("QRestoreRegisterState:", handleQRestoreRegisterState),
             ("QStartNoAckMode", { [unowned self] server, payload in
@@ -705,6 +1061,10 @@ public class DebugServer {
     func handlePacketPayload(_ payload: String) -> ResponseResult {
         for handler in handlers {
             if payload.hasPrefix(handler.0) {
+                guard !isObserver || DebugServer.observerPackets.contains(handler.0) else {
+                    state.logger?.log("An observer can't send '\(handler.0)' packets")
+                    return .error(.e01)
+                }
                 return handler.1(&state, payload)
             }
         }
@@ -715,6 +1075,9 @@ public class DebugServer {
         guard let first = payload.first, first == UInt8(ascii: "X") else {
             return .unimplemented
         }
+        guard !isObserver else {
+            return .error(.e01)
+        }
         return handleBinaryMemoryWrite(&state, payload: payload)
     }
 
@@ -838,6 +1201,17 @@ public class DebugServer {
         state.logger?.debugServerDidSendBinaryPacket(payload[0..<payload.count])
     }
 
+    // Notifications are never acknowledged and always have a checksum.
+    private func sendNotification(_ payload: String) throws {
+        var output = [UInt8]()
+        output.append(UInt8(ascii: "%"))
+        output.append(contentsOf: payload.utf8)
+        let checksum = output[1..<output.count].checksum
+        output.append(contentsOf: "#\([checksum].hexString)".utf8)
+        try writer.write(data: output[0..<output.count])
+        state.logger?.debugServerDidSendPacket(payload)
+    }
+
     private func sendACK() throws {
         let data = [UInt8(ascii: "+")]
         try writer.write(data: data[0..<data.count])
@@ -881,6 +1255,10 @@ public class DebugServer {
                     continue
                 case .interrupt:
                     state.logger?.debugServerDidReceivePacket("<Interrupt>")
+                    guard !isObserver else {
+                        continue
+                    }
+                    state.releasedStops = nil
                     try state.debugger.interruptExecution()
                     response = .threadStopReply
                 case .invalidPacket, .invalidChecksum:
@@ -889,6 +1267,12 @@ public class DebugServer {
                 }
                 switch response {
                 case .resume(let actions, let defaultAction):
+                    if state.nonStopMode {
+                        // The threads keep running, so the stops are reported with notifications later.
+                        try sendResponse(.ok)
+                        let resumedThreads = extractResumeActionsForThreads(state.stoppedThreads, primaryThread: state.debugger.primaryThreadID, entries: actions, defaultAction: defaultAction).filter { $0.1 != .none && $0.1 != .stop }.map { $0.0 }
+                        state.stoppedThreads = state.stoppedThreads.filter { !resumedThreads.contains($0) }
+                    }
                     // Save the next packets if there are any (unlikely).
                     let remainingPackets = packets[(i+1)..<packets.count]
                     if !remainingPackets.isEmpty {
@@ -901,6 +1285,8 @@ public class DebugServer {
                         }
                         savedPackets = Array(remainingPackets)
                     }
+                    snapshot?.invalidate(isStopped: false)
+                    state.releasedStops = nil
                     return .resumeThreads(actions: actions, defaultAction: defaultAction)
                 case .exit(let response?):
                     state.debugger.detach()
@@ -918,9 +1304,71 @@ public class DebugServer {
     }
 
     public func sendStopReply() throws {
+        state.releasedStops = nil
         return try sendResponse(.threadStopReply)
     }
 
+    /// Has the client enabled the non-stop mode?
+    public var isNonStopMode: Bool {
+        return state.nonStopMode
+    }
+
+    /// Reports that the given thread has stopped. In non-stop mode the stop is sent as an asynchronous
+    /// '%Stop' notification, or queued until the client acknowledges the previous one with 'vStopped'.
+    /// An observer always gets a notification.
+    /// This has to be called on the same thread that processes the packets.
+    public func sendStopNotificationForThread(_ threadID: ThreadID) throws {
+        // The released threads in non-stop mode are served until the client resumes something.
+        if !state.nonStopMode {
+            state.releasedStops = nil
+        }
+        try sendStopNotification(threadID)
+    }
+
+    private func sendStopNotification(_ threadID: ThreadID) throws {
+        // The observers don't acknowledge the stops.
+        if isObserver {
+            guard case .response(let reply) = handleStopReplyForThread(threadID) else {
+                return
+            }
+            return try sendNotification("Stop:" + reply)
+        }
+        guard state.nonStopMode else {
+            state.currentThread = .id(threadID)
+            return try sendResponse(.stopReplyForThread(threadID))
+        }
+        if !state.stoppedThreads.contains(threadID) {
+            state.stoppedThreads.append(threadID)
+        }
+        state.pendingStopReplies.append(threadID)
+        guard state.pendingStopReplies.count == 1 else {
+            return
+        }
+        guard case .response(let reply) = handleStopReplyForThread(threadID) else {
+            state.logger?.log("Failed to create a stop notification for thread \(threadID)")
+            return
+        }
+        try sendNotification("Stop:" + reply)
+    }
+
+    /// Reports a stop that was released with `Debugger.releaseStop`. The registers, the stop info and
+    /// the stack window of the thread are served from the snapshot until the process is resumed or
+    /// interrupted, and the other requests go to the running process.
+    /// The stop is only reported in non-stop mode, because an all-stop client would assume that the
+    /// running threads are stopped.
+    public func sendStopNotificationForReleasedStop(_ stop: ThreadStopSnapshot) throws {
+        guard state.nonStopMode || isObserver else {
+            state.logger?.log("Dropped a released stop of thread \(stop.threadID) in all-stop mode")
+            return
+        }
+        if let releasedStops = state.releasedStops {
+            releasedStops.add(stop)
+        } else {
+            state.releasedStops = ReleasedStopsDebugger(debugger: state.processDebugger, stop: stop)
+        }
+        try sendStopNotification(stop.threadID)
+    }
+
     public func sendExitReply() throws {
         return try sendResponse(.response("X00"))
     }
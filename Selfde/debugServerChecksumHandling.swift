@@ -0,0 +1,60 @@
+//
+//  debugServerChecksumHandling.swift
+//  Selfde
+//
+// Checksums the memory in the process, so that a client can verify it against an image with
+// a few bytes of traffic for every block instead of reading it.
+
+import Foundation
+
+// The most blocks that 'qMemoryDigests' can reply with.
+private let maxDigestBlocks = 8192
+
+// qCRC:ADDRESS,LENGTH
+// Replies with 'C' and the CRC-32 that GDB uses for 'compare-sections', or with an error when
+// a part of the range can't be read.
+func handleQCRC(_ server: inout DebugServerState, payload: String) -> ResponseResult {
+    var parser = PacketParser(payload: payload, offset: "qCRC:".characters.count)
+    guard let address = parser.consumeHexUInt(), parser.consumeComma(), let length = parser.consumeHexUInt(), !parser.hasContents,
+        let range = makeAddressRange(address: address, length: length) else {
+        return .invalid("Invalid address range")
+    }
+    do {
+        let crc = try server.debugger.computeCRC32(range)
+        return .response("C" + String(crc, radix: 16))
+    } catch DebuggerError.unsupported {
+        return .unimplemented
+    } catch {
+        return .error(.e01)
+    }
+}
+
+// qMemoryDigests:ADDRESS,LENGTH,BLOCKSIZE
+// Replies with the CRC-32C of every block of the range as 8 hex digits, separated by commas. The last
+// block can be shorter, and the blocks that can't be read are 'x'. A client localizes the blocks that
+// don't match its image and reads only those.
+func handleQMemoryDigests(_ server: inout DebugServerState, payload: String) -> ResponseResult {
+    var parser = PacketParser(payload: payload, offset: "qMemoryDigests:".characters.count)
+    guard let address = parser.consumeHexUInt(), parser.consumeComma(), let length = parser.consumeHexUInt(), parser.consumeComma(),
+        let blockSize = parser.consumeHexUInt().flatMap({ Int(exactly: $0) }), blockSize > 0, !parser.hasContents,
+        let range = makeAddressRange(address: address, length: length) else {
+        return .invalid("Invalid digest range")
+    }
+    guard length / UInt(blockSize) < UInt(maxDigestBlocks) else {
+        return .invalid("Too many blocks")
+    }
+    do {
+        let digests = try server.debugger.computeMemoryDigests(range, blockSize: blockSize)
+        return .response(digests.map { digest -> String in
+            guard let digest = digest else {
+                return "x"
+            }
+            let hex = String(digest, radix: 16)
+            return String(repeating: "0", count: 8 - hex.characters.count) + hex
+        }.joined(separator: ","))
+    } catch DebuggerError.unsupported {
+        return .unimplemented
+    } catch {
+        return .error(.e01)
+    }
+}
@@ -0,0 +1,84 @@
+//
+//  debugServerCoverageHandling.swift
+//  Selfde
+//
+// Controls the coverage runs. The basic block addresses don't fit into one packet, so they're
+// collected by 'QCoverageSites' before the run is started, and the bitmap is read in chunks.
+
+import Foundation
+
+// QCoverageSites:ADDRESS,ADDRESS,...
+// Appends the basic block addresses of the next coverage run, the first one is block 0.
+func handleQCoverageSites(_ server: inout DebugServerState, payload: String) -> ResponseResult {
+    var parser = PacketParser(payload: payload, offset: "QCoverageSites:".characters.count)
+    var addresses = [Address]()
+    repeat {
+        guard let address = parser.consumeHexUInt() else {
+            return .invalid("Invalid coverage site address")
+        }
+        addresses.append(Address(bitPattern: address))
+    } while parser.consumeComma()
+    guard !parser.hasContents else {
+        return .invalid("Invalid coverage site address")
+    }
+    server.coverageSites += addresses
+    return .ok
+}
+
+// QStartCoverage
+// Installs the collected blocks, which are cleared afterwards. The bitmap of the previous run is dropped.
+func handleQStartCoverage(_ server: inout DebugServerState, payload: String) -> ResponseResult {
+    guard !server.coverageSites.isEmpty else {
+        return .error(.e01)
+    }
+    do {
+        _ = try server.debugger.startCoverage(server.coverageSites)
+    } catch DebuggerError.unsupported {
+        return .unimplemented
+    } catch {
+        return .error(.e01)
+    }
+    server.coverageSites = []
+    server.coverageDocument = nil
+    return .ok
+}
+
+// QStopCoverage
+// Removes the INT 3s of the blocks that haven't run. The bitmap can still be read.
+func handleQStopCoverage(_ server: inout DebugServerState, payload: String) -> ResponseResult {
+    do {
+        try server.debugger.stopCoverage()
+    } catch DebuggerError.unsupported {
+        return .unimplemented
+    } catch {
+        return .error(.e01)
+    }
+    return .ok
+}
+
+// qXfer:coverage:read::offset,length
+// The bitmap has block i in bit i % 8 of byte i / 8. It's read when the first chunk is requested,
+// so it can be read while the run is installed.
+func handleQXferCoverageRead(_ server: inout DebugServerState, payload: String) -> ResponseResult {
+    var parser = PacketParser(payload: payload, offset: "qXfer:coverage:read:".characters.count)
+    guard parser.consumeIfPresent(":"), let offset = parser.consumeHexUInt().flatMap({ Int(exactly: $0) }), parser.consumeComma(),
+        let length = parser.consumeHexUInt().flatMap({ Int(exactly: $0) }) else {
+        return .invalid("Invalid offset and length")
+    }
+    if offset == 0 || server.coverageDocument == nil {
+        do {
+            server.coverageDocument = try server.debugger.getCoverage().bytes
+        } catch DebuggerError.unsupported {
+            return .unimplemented
+        } catch {
+            return .error(.e01)
+        }
+    }
+    let document = server.coverageDocument!
+    guard offset < document.count else {
+        return .binaryResponse(Array("l".utf8))
+    }
+    let end = min(offset + length, document.count)
+    let marker = end < document.count ? UInt8(ascii: "m") : UInt8(ascii: "l")
+    return .binaryResponse([marker] + document[offset..<end].encodedBinaryData)
+}
@@ -0,0 +1,75 @@
+//
+//  debugServerDirtyPageHandling.swift
+//  Selfde
+//
+// Tracks the pages that the program writes, so that a client that keeps a copy of the memory only
+// has to read the pages that were written since its last copy.
+
+import Foundation
+
+// QStartDirtyPageTracking:ADDRESS,SIZE;ADDRESS,SIZE;...
+// Starts tracking the given ranges in epoch 1.
+func handleQStartDirtyPageTracking(_ server: inout DebugServerState, payload: String) -> ResponseResult {
+    var parser = PacketParser(payload: payload, offset: "QStartDirtyPageTracking:".characters.count)
+    var ranges = [AddressRange]()
+    repeat {
+        guard let address = parser.consumeHexUInt(), parser.consumeComma(), let size = parser.consumeHexUInt(), size > 0 else {
+            return .invalid("Invalid address range")
+        }
+        ranges.append(AddressRange(start: Address(bitPattern: address), end: Address(bitPattern: address &+ size)))
+    } while parser.consumeIfPresent(";")
+    guard !parser.hasContents else {
+        return .invalid("Invalid address range")
+    }
+    do {
+        _ = try server.debugger.startDirtyPageTracking(ranges)
+    } catch DebuggerError.unsupported {
+        return .unimplemented
+    } catch {
+        return .error(.e01)
+    }
+    return .ok
+}
+
+// QStopDirtyPageTracking
+func handleQStopDirtyPageTracking(_ server: inout DebugServerState, payload: String) -> ResponseResult {
+    do {
+        try server.debugger.stopDirtyPageTracking()
+    } catch DebuggerError.unsupported {
+        return .unimplemented
+    } catch {
+        return .error(.e01)
+    }
+    return .ok
+}
+
+// qDirtyPageEpoch
+// Ends the current epoch and replies with the number of the new one in hex.
+func handleQDirtyPageEpoch(_ server: inout DebugServerState, payload: String) -> ResponseResult {
+    do {
+        return .response(String(try server.debugger.advanceDirtyPageEpoch(), radix: 16))
+    } catch DebuggerError.unsupported {
+        return .unimplemented
+    } catch {
+        return .error(.e01)
+    }
+}
+
+// qDirtyPages:ADDRESS,SIZE,EPOCH
+// Replies with the binary bitmap of the pages of the range that were written since the epoch began. The first
+// page is the one that contains the address, and page i is bit i % 8 of byte i / 8. Epoch 0 has every page.
+func handleQDirtyPages(_ server: inout DebugServerState, payload: String) -> ResponseResult {
+    var parser = PacketParser(payload: payload, offset: "qDirtyPages:".characters.count)
+    guard let address = parser.consumeHexUInt(), parser.consumeComma(), let size = parser.consumeHexUInt(), size > 0, parser.consumeComma(),
+        let epoch = parser.consumeHexUInt().flatMap({ Int(exactly: $0) }), !parser.hasContents else {
+        return .invalid("Invalid address range and epoch")
+    }
+    let range = AddressRange(start: Address(bitPattern: address), end: Address(bitPattern: address &+ size))
+    do {
+        return .binaryResponse(try server.debugger.getDirtyPages(range, since: epoch).bytes.encodedBinaryData)
+    } catch DebuggerError.unsupported {
+        return .unimplemented
+    } catch {
+        return .error(.e01)
+    }
+}
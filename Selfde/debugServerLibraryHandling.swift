@@ -0,0 +1,306 @@
+//
+//  debugServerLibraryHandling.swift
+//  Selfde
+//
+// Serves the list of the loaded libraries in one reply, so that the client doesn't
+// have to walk the dynamic linker's structures with memory reads. The symbols of the
+// libraries are looked up in-process as well.
+
+import Foundation
+
+// Tracks the loaded libraries between the queries. Every query that sees a change in the
+// list starts a new generation, and the clients can ask for the changes since a generation.
+// Only the latest unloaded libraries are kept, and the older generations get the full list.
+struct LoadedLibraryList {
+    private static let maxUnloadedLibraries = 1024
+
+    private(set) var generation: UInt = 0
+    private(set) var libraries: [LoadedLibrary] = []
+    // The generation in which the libraries were first seen.
+    private var loadGenerations: [Address: UInt] = [:]
+    private var unloadedLibraries: [(LoadedLibrary, UInt)] = []
+    // The changes after this generation are known.
+    private var oldestTrackedGeneration: UInt = 0
+
+    // The link map entry identifies an ELF object, the header identifies a Mach-O image.
+    private static func key(_ library: LoadedLibrary) -> Address {
+        return library.linkMapAddress ?? library.loadAddress
+    }
+
+    mutating func update(_ libraries: [LoadedLibrary]) {
+        let keys = Set(libraries.map { LoadedLibraryList.key($0) })
+        let unloaded = self.libraries.filter { !keys.contains(LoadedLibraryList.key($0)) }
+        let loaded = libraries.filter { loadGenerations[LoadedLibraryList.key($0)] == nil }
+        if !unloaded.isEmpty || !loaded.isEmpty {
+            generation += 1
+            for library in unloaded {
+                loadGenerations[LoadedLibraryList.key(library)] = nil
+                unloadedLibraries.append((library, generation))
+            }
+            for library in loaded {
+                loadGenerations[LoadedLibraryList.key(library)] = generation
+            }
+            if unloadedLibraries.count > LoadedLibraryList.maxUnloadedLibraries {
+                let prunedCount = unloadedLibraries.count - LoadedLibraryList.maxUnloadedLibraries
+                oldestTrackedGeneration = unloadedLibraries[prunedCount - 1].1
+                unloadedLibraries.removeFirst(prunedCount)
+            }
+        }
+        self.libraries = libraries
+    }
+
+    func tracksChanges(after generation: UInt) -> Bool {
+        return generation >= oldestTrackedGeneration
+    }
+
+    func librariesLoaded(after generation: UInt) -> [LoadedLibrary] {
+        return libraries.filter { (loadGenerations[LoadedLibraryList.key($0)] ?? 0) > generation }
+    }
+
+    func librariesUnloaded(after generation: UInt) -> [LoadedLibrary] {
+        return unloadedLibraries.filter { $0.1 > generation }.map { $0.0 }
+    }
+}
+
+extension DebugServerState {
+    mutating func updateLoadedLibraries() -> ResponseResult? {
+        do {
+            libraryList.update(try debugger.getLoadedLibraries())
+            return nil
+        } catch DebuggerError.unsupported {
+            return .unimplemented
+        } catch {
+            return .error(.e44)
+        }
+    }
+}
+
+private extension String {
+    var escapedJSONString: String {
+        var result = ""
+        for scalar in unicodeScalars {
+            switch scalar {
+            case "\"": result += "\\\""
+            case "\\": result += "\\\\"
+            case "\n": result += "\\n"
+            case "\r": result += "\\r"
+            case "\t": result += "\\t"
+            case _ where scalar.value < 0x20:
+                result += "\\u00" + [UInt8(scalar.value)].hexString
+            default:
+                result.unicodeScalars.append(scalar)
+            }
+        }
+        return result
+    }
+
+    var escapedXMLString: String {
+        var result = ""
+        for scalar in unicodeScalars {
+            switch scalar {
+            case "&": result += "&amp;"
+            case "<": result += "&lt;"
+            case ">": result += "&gt;"
+            case "\"": result += "&quot;"
+            case "'": result += "&apos;"
+            default:
+                result.unicodeScalars.append(scalar)
+            }
+        }
+        return result
+    }
+}
+
+private func getUUIDString(_ uuid: [UInt8]) -> String {
+    let hex = uuid.hexString.uppercased()
+    var result = ""
+    for (i, c) in hex.characters.enumerated() {
+        if i == 8 || i == 12 || i == 16 || i == 20 {
+            result += "-"
+        }
+        result.append(c)
+    }
+    return result
+}
+
+private func getImageJSON(_ library: LoadedLibrary) -> String {
+    var result = "{\"load_address\":\(library.loadAddress.bitPattern),\"mod_date\":\(library.modificationDate),\"pathname\":\"\(library.path.escapedJSONString)\""
+    if let uuid = library.uuid {
+        result += ",\"uuid\":\"\(getUUIDString(uuid))\""
+    }
+    if let header = library.header {
+        result += ",\"mach_header\":{\"magic\":\(header.magic),\"cputype\":\(header.cpuType),\"cpusubtype\":\(header.cpuSubType),\"filetype\":\(header.fileType),\"flags\":\(header.flags)}"
+        result += ",\"segments\":["
+        for (i, segment) in library.segments.enumerated() {
+            if i > 0 { result += "," }
+            result += "{\"name\":\"\(segment.name.escapedJSONString)\",\"vmaddr\":\(segment.address),\"vmsize\":\(segment.size),\"fileoff\":\(segment.fileOffset),\"filesize\":\(segment.fileSize),\"maxprot\":\(segment.maxProtection)}"
+        }
+        result += "]"
+    }
+    result += "}"
+    return result
+}
+
+// jGetLoadedDynamicLibrariesInfos:{"fetch_all_solibs":true}
+// jGetLoadedDynamicLibrariesInfos:{"solib_addresses":[addr,addr,...]}
+// jGetLoadedDynamicLibrariesInfos:{"fetch_all_solibs":true,"changed_since_generation":N}
+// The JSON arguments and the reply use the binary encoding. The reply includes the current generation,
+// and the incremental queries also list the load addresses of the libraries that were unloaded.
+// A query for a generation whose unloaded libraries were dropped gets all of the libraries.
+func handleJGetLoadedDynamicLibrariesInfos(_ server: inout DebugServerState, payload: String) -> ResponseResult {
+    let prefix = "jGetLoadedDynamicLibrariesInfos:"
+    let arguments = payload.unicodeScalars.dropFirst(prefix.unicodeScalars.count).map { UInt8(truncatingBitPattern: $0.value) }.decodedBinaryData
+    guard let json = (try? JSONSerialization.jsonObject(with: Data(bytes: arguments), options: [])) as? [String: Any] else {
+        return .invalid("Invalid JSON arguments")
+    }
+    if let error = server.updateLoadedLibraries() {
+        return error
+    }
+    var libraries = server.libraryList.libraries
+    var unloadedLibraries: [LoadedLibrary]? = nil
+    if let addresses = json["solib_addresses"] as? [Any] {
+        let set = Set(addresses.flatMap { ($0 as? NSNumber).map { Address(bitPattern: $0.uintValue) } })
+        libraries = libraries.filter { set.contains($0.loadAddress) }
+    } else if let generation = (json["changed_since_generation"] as? NSNumber)?.uintValue, server.libraryList.tracksChanges(after: generation) {
+        libraries = server.libraryList.librariesLoaded(after: generation)
+        unloadedLibraries = server.libraryList.librariesUnloaded(after: generation)
+    }
+    var result = "{\"images\":["
+    for (i, library) in libraries.enumerated() {
+        if i > 0 { result += "," }
+        result += getImageJSON(library)
+    }
+    result += "],\"generation\":\(server.libraryList.generation)"
+    if let unloadedLibraries = unloadedLibraries {
+        result += ",\"unloaded_images\":[" + unloadedLibraries.map { "\($0.loadAddress.bitPattern)" }.joined(separator: ",") + "]"
+    }
+    result += "}"
+    return .binaryResponse(Array(result.utf8).encodedBinaryData)
+}
+
+private func getLibrariesSVR4Document(_ libraryList: LoadedLibraryList, changedSinceGeneration generation: UInt?) -> [UInt8] {
+    // The first entry is the executable.
+    let mainLinkMap = libraryList.libraries.first?.linkMapAddress
+    var result = "<library-list-svr4 version=\"1.0\""
+    if let mainLinkMap = mainLinkMap {
+        result += " main-lm=\"0x\(mainLinkMap.bigEndianHexString)\""
+    }
+    if generation != nil {
+        result += " generation=\"\(libraryList.generation)\""
+    }
+    result += ">"
+    let trackedGeneration = generation.flatMap { libraryList.tracksChanges(after: $0) ? $0 : nil }
+    let libraries = trackedGeneration.map { libraryList.librariesLoaded(after: $0) } ?? libraryList.libraries
+    for library in libraries {
+        guard let linkMap = library.linkMapAddress, linkMap != mainLinkMap else {
+            continue
+        }
+        result += "<library name=\"\(library.path.escapedXMLString)\" lm=\"0x\(linkMap.bigEndianHexString)\" l_addr=\"0x\(library.loadAddress.bigEndianHexString)\" l_ld=\"0x\((library.dynamicSectionAddress ?? Address(bitPattern: 0)).bigEndianHexString)\"/>"
+    }
+    for library in trackedGeneration.map({ libraryList.librariesUnloaded(after: $0) }) ?? [] {
+        if let linkMap = library.linkMapAddress {
+            result += "<unloaded lm=\"0x\(linkMap.bigEndianHexString)\"/>"
+        }
+    }
+    result += "</library-list-svr4>"
+    return Array(result.utf8)
+}
+
+// qXfer:libraries-svr4:read:annex:offset,length
+// The annex can be 'changed-since-generation=N', in which case only the libraries that were
+// loaded after that generation are listed, and the unloaded ones are listed as '<unloaded lm=.../>'.
+func handleQXferLibrariesSVR4Read(_ server: inout DebugServerState, payload: String) -> ResponseResult {
+    var parser = PacketParser(payload: payload, offset: "qXfer:libraries-svr4:read:".characters.count)
+    var annex = ""
+    while let c = parser.consumeCharacter(), c != ":" {
+        annex.unicodeScalars.append(c)
+    }
+    guard let offset = parser.consumeHexUInt().flatMap({ Int(exactly: $0) }), parser.consumeComma(),
+        let length = parser.consumeHexUInt().flatMap({ Int(exactly: $0) }) else {
+        return .invalid("Invalid offset and length")
+    }
+    var generation: UInt? = nil
+    if !annex.isEmpty {
+        let annexPrefix = "changed-since-generation="
+        guard annex.hasPrefix(annexPrefix), let value = UInt(annex.substring(from: annex.index(annex.startIndex, offsetBy: annexPrefix.characters.count))) else {
+            return .error(.e01)
+        }
+        generation = value
+    }
+    // The document is created once for the reads of its chunks.
+    if offset == 0 || server.libraryListDocument?.annex != annex {
+        if let error = server.updateLoadedLibraries() {
+            return error
+        }
+        server.libraryListDocument = (annex, getLibrariesSVR4Document(server.libraryList, changedSinceGeneration: generation))
+    }
+    let document = server.libraryListDocument!.bytes
+    guard offset < document.count else {
+        return .binaryResponse(Array("l".utf8))
+    }
+    let end = min(offset + length, document.count)
+    let marker = end < document.count ? UInt8(ascii: "m") : UInt8(ascii: "l")
+    return .binaryResponse([marker] + document[offset..<end].encodedBinaryData)
+}
+
+extension DebugServerState {
+    // The index is built on the first lookup, and again after the library list has changed.
+    mutating func updateSymbolIndex() -> ResponseResult? {
+        if let error = updateLoadedLibraries() {
+            return error
+        }
+        if let index = symbolIndex, index.generation == libraryList.generation {
+            return nil
+        }
+        let debugger = self.debugger
+        symbolIndex = SymbolIndex(libraries: libraryList.libraries, generation: libraryList.generation) {
+            try debugger.getSymbols(in: $0)
+        }
+        return nil
+    }
+}
+
+// qSymbolLookup:hexname;hexname;...
+// Replies with the addresses of the symbols separated by ';', the unknown symbols have empty entries.
+func handleQSymbolLookup(_ server: inout DebugServerState, payload: String) -> ResponseResult {
+    let prefix = "qSymbolLookup:"
+    var names = [String]()
+    for item in payload.substring(from: payload.index(payload.startIndex, offsetBy: prefix.characters.count)).components(separatedBy: ";") {
+        var parser = PacketParser(payload: item)
+        guard let bytes = parser.readHexBytes(), !bytes.isEmpty, let name = String(bytes: bytes, encoding: .utf8) else {
+            return .invalid("Invalid symbol name")
+        }
+        names.append(name)
+    }
+    if let error = server.updateSymbolIndex() {
+        return error
+    }
+    let index = server.symbolIndex!
+    return .response(names.map { index.lookup($0)?.bigEndianHexString ?? "" }.joined(separator: ";"))
+}
+
+// qAddressLookup:addr,addr,...
+// Replies with 'hexname:offset' for every address separated by ';', the unknown addresses have empty entries.
+func handleQAddressLookup(_ server: inout DebugServerState, payload: String) -> ResponseResult {
+    var parser = PacketParser(payload: payload, offset: "qAddressLookup:".characters.count)
+    var addresses = [Address]()
+    repeat {
+        guard let address = parser.consumeAddress() else {
+            return .invalid("Invalid address")
+        }
+        addresses.append(address)
+    } while parser.consumeComma()
+    guard !parser.hasContents else {
+        return .invalid("Invalid address list")
+    }
+    if let error = server.updateSymbolIndex() {
+        return error
+    }
+    let index = server.symbolIndex!
+    return .response(addresses.map { address -> String in
+        guard let symbol = index.lookup(address) else {
+            return ""
+        }
+        return "\(Array(symbol.name.utf8).hexString):\(String(symbol.offset, radix: 16, uppercase: false))"
+    }.joined(separator: ";"))
+}
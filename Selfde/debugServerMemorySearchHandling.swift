@@ -0,0 +1,112 @@
+//
+//  debugServerMemorySearchHandling.swift
+//  Selfde
+//
+// Searches the memory in the process, so that only the addresses of the matches are sent to the client.
+
+import Foundation
+
+// The most matches that 'qSearchMemory' can reply with.
+private let maxSearchMatches = 4096
+
+// The bytes of a 'qSearch:memory' packet before its binary pattern.
+private func getSearchPacketHeader(_ payload: String) -> [UInt8] {
+    var header = [UInt8]()
+    var separatorCount = 0
+    for scalar in payload.unicodeScalars {
+        header.append(UInt8(truncatingBitPattern: scalar.value))
+        if scalar == ";" {
+            separatorCount += 1
+            if separatorCount == 2 {
+                break
+            }
+        }
+    }
+    return header
+}
+
+// Does the match follow the header of the packet, like the copies of the packet in the server's buffers?
+private func isPacketCopy(_ server: DebugServerState, match: Address, header: [UInt8]) -> Bool {
+    guard match.bitPattern >= UInt(header.count),
+        let result = try? server.debugger.readMemory(Address(bitPattern: match.bitPattern - UInt(header.count)), size: header.count),
+        case .bytes(let bytes) = result else {
+        return false
+    }
+    return bytes.elementsEqual(header)
+}
+
+// qSearch:memory:ADDRESS;LENGTH;PATTERN
+// The GDB packet with a binary pattern. Replies with '0' when there are no matches, or with '1,ADDRESS' of the first one.
+// The pattern is still in the buffers that the packet went through, right after its header, so those matches are skipped.
+func handleQSearchMemoryGDB(_ server: inout DebugServerState, payload: String) -> ResponseResult {
+    var parser = PacketParser(payload: payload, offset: "qSearch:memory:".characters.count)
+    guard let address = parser.consumeHexUInt(), parser.consumeIfPresent(";"), let length = parser.consumeHexUInt(), parser.consumeIfPresent(";"),
+        let pattern = parser.readBinaryBytes(), !pattern.isEmpty else {
+        return .invalid("Invalid search")
+    }
+    guard var range = makeAddressRange(address: address, length: length) else {
+        return .invalid("Invalid address range")
+    }
+    let header = getSearchPacketHeader(payload)
+    do {
+        while true {
+            guard let match = try server.debugger.searchMemory(range, pattern: pattern, mask: nil, maxMatches: 1).first else {
+                return .response("0")
+            }
+            guard isPacketCopy(server, match: match, header: header) else {
+                return .response("1,\(match.bigEndianHexString)")
+            }
+            range = AddressRange(start: Address(bitPattern: match.bitPattern + 1), end: range.end)
+        }
+    } catch DebuggerError.unsupported {
+        return .unimplemented
+    } catch {
+        return .error(.e01)
+    }
+}
+
+// qSearchMemory:ADDRESS,LENGTH[,MAXMATCHES]:PATTERN[:MASK]
+// The hex pattern can have a mask of the same length, and a byte matches when (byte & mask) == (pattern & mask).
+// Replies with '0' when there are no matches, or with '1,ADDRESS,ADDRESS,...' of the first ones in ascending order,
+// one by default. A client that wants the rest searches again after the last one.
+func handleQSearchMemory(_ server: inout DebugServerState, payload: String) -> ResponseResult {
+    let fields = payload.components(separatedBy: ":")
+    guard fields.count == 3 || fields.count == 4 else {
+        return .invalid("Invalid search")
+    }
+    var parser = PacketParser(payload: fields[1])
+    guard let address = parser.consumeHexUInt(), parser.consumeComma(), let length = parser.consumeHexUInt(),
+        let range = makeAddressRange(address: address, length: length) else {
+        return .invalid("Invalid address range")
+    }
+    var maxMatches = 1
+    if parser.consumeComma() {
+        guard let value = parser.consumeHexUInt().flatMap({ Int(exactly: $0) }), value > 0, value <= maxSearchMatches else {
+            return .invalid("Invalid match count")
+        }
+        maxMatches = value
+    }
+    var patternParser = PacketParser(payload: fields[2])
+    guard !parser.hasContents, let pattern = patternParser.readHexBytes(), !pattern.isEmpty else {
+        return .invalid("Invalid pattern")
+    }
+    var mask: [UInt8]?
+    if fields.count == 4 {
+        var maskParser = PacketParser(payload: fields[3])
+        guard let value = maskParser.readHexBytes(), value.count == pattern.count else {
+            return .invalid("Invalid mask")
+        }
+        mask = value
+    }
+    do {
+        let matches = try server.debugger.searchMemory(range, pattern: pattern, mask: mask, maxMatches: maxMatches)
+        guard !matches.isEmpty else {
+            return .response("0")
+        }
+        return .response((["1"] + matches.map { $0.bigEndianHexString }).joined(separator: ","))
+    } catch DebuggerError.unsupported {
+        return .unimplemented
+    } catch {
+        return .error(.e01)
+    }
+}
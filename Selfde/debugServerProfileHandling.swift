@@ -0,0 +1,92 @@
+//
+//  debugServerProfileHandling.swift
+//  Selfde
+//
+// Controls the sampling profiler, and serves the sampled stacks symbolicated in-process,
+// either in the folded format of the flame graph tools or in pprof's format.
+
+import Foundation
+
+// QStartProfiling:frequency:HEX;max-frames:HEX;
+// Both of the fields are optional. The profile of the previous run is dropped.
+func handleQStartProfiling(_ server: inout DebugServerState, payload: String) -> ResponseResult {
+    var frequency = 100
+    var maxFrames = 128
+    let fields = payload.substring(from: payload.index(payload.startIndex, offsetBy: "QStartProfiling:".characters.count)).components(separatedBy: ";")
+    for field in fields where !field.isEmpty {
+        let pair = field.components(separatedBy: ":")
+        guard pair.count == 2, let value = Int(pair[1], radix: 16) else {
+            return .invalid("Invalid profiling option")
+        }
+        switch pair[0] {
+        case "frequency":
+            frequency = value
+        case "max-frames":
+            maxFrames = value
+        default:
+            return .invalid("Unknown profiling option")
+        }
+    }
+    do {
+        try server.debugger.startProfiling(frequency: frequency, maxFrames: maxFrames)
+    } catch DebuggerError.unsupported {
+        return .unimplemented
+    } catch {
+        return .error(.e01)
+    }
+    server.profileDocument = nil
+    return .ok
+}
+
+// QStopProfiling
+// The profile can still be read after the profiler is stopped.
+func handleQStopProfiling(_ server: inout DebugServerState, payload: String) -> ResponseResult {
+    do {
+        try server.debugger.stopProfiling()
+    } catch DebuggerError.unsupported {
+        return .unimplemented
+    } catch {
+        return .error(.e01)
+    }
+    return .ok
+}
+
+// qXfer:profile:read:annex:offset,length
+// The annex is 'folded' or 'pprof'. The profile is read when the first chunk is requested,
+// so it can be read while the profiler is running.
+func handleQXferProfileRead(_ server: inout DebugServerState, payload: String) -> ResponseResult {
+    var parser = PacketParser(payload: payload, offset: "qXfer:profile:read:".characters.count)
+    var annex = ""
+    while let c = parser.consumeCharacter(), c != ":" {
+        annex.unicodeScalars.append(c)
+    }
+    guard let offset = parser.consumeHexUInt().flatMap({ Int(exactly: $0) }), parser.consumeComma(),
+        let length = parser.consumeHexUInt().flatMap({ Int(exactly: $0) }) else {
+        return .invalid("Invalid offset and length")
+    }
+    guard annex == "folded" || annex == "pprof" else {
+        return .error(.e01)
+    }
+    if offset == 0 || server.profileDocument?.annex != annex {
+        let profile: StackProfile
+        do {
+            profile = try server.debugger.getProfile()
+        } catch DebuggerError.unsupported {
+            return .unimplemented
+        } catch {
+            return .error(.e01)
+        }
+        // The frames are shown as addresses when the symbols aren't available.
+        let index = server.updateSymbolIndex() == nil ? server.symbolIndex : nil
+        let symbolicate: (Address) -> String? = { index?.lookup($0)?.name }
+        let bytes = annex == "folded" ? Array(profile.foldedStacks(symbolicate: symbolicate).utf8) : profile.pprofData(symbolicate: symbolicate)
+        server.profileDocument = (annex, bytes)
+    }
+    let document = server.profileDocument!.bytes
+    guard offset < document.count else {
+        return .binaryResponse(Array("l".utf8))
+    }
+    let end = min(offset + length, document.count)
+    let marker = end < document.count ? UInt8(ascii: "m") : UInt8(ascii: "l")
+    return .binaryResponse([marker] + document[offset..<end].encodedBinaryData)
+}
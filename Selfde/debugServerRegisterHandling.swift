@@ -4,6 +4,10 @@
 //
 // Based on RNBRemote.cpp register info initialization and handling code.
 
+#if os(Linux)
+import SelfdeLinuxImpl
+#endif
+
 private struct RegisterMapEntry {
     let debugServerRegisterNumber: Int
     let offset: Int
@@ -101,6 +105,27 @@ private func getRegisterEntries(_ registerSets: [DNBRegisterSetInfo]) -> [Regist
     }
 }
 
+// The register tables don't change while the process runs, so they're built only once
+// and they're shared by all of the debug servers.
+private let registerSetTable = getRegisterSets()
+private let registerMapTable = getRegisterEntries(registerSetTable)
+// The GPR registers that aren't contained in other registers are expedited in the stop replies.
+// FIXME: Make this better.
+private let expeditedRegisterTable = registerMapTable.filter { $0.info.set == 1 && $0.info.value_regs == nil }
+
+// The bytes of a register in the register context, which is laid out like the value of the 'g' packet.
+func getRegisterContextRange(registerID: UInt32, registerSetID: UInt32) -> CountableRange<Int>? {
+    return registerMapTable.first(where: { $0.info.reg == registerID && $0.info.set == registerSetID }).map {
+        $0.offset..<($0.offset + Int($0.info.size))
+    }
+}
+
+func getGenericRegisterContextRange(_ generic: Int32) -> CountableRange<Int>? {
+    return registerMapTable.first(where: { Int32(bitPattern: $0.info.reg_generic) == generic && $0.info.value_regs == nil }).map {
+        $0.offset..<($0.offset + Int($0.info.size))
+    }
+}
+
 struct DebuggerRegisterState {
     fileprivate let registerSets: [DNBRegisterSetInfo]
     fileprivate let registers: [RegisterMapEntry]
@@ -109,21 +134,17 @@ struct DebuggerRegisterState {
     fileprivate var saveRegisterID: UInt = 1
 
     init(debugger: Debugger) {
-        registerSets = getRegisterSets()
-        registers = getRegisterEntries(registerSets)
+        registerSets = registerSetTable
+        registers = registerMapTable
         valueStorage = [UInt8](repeating: 0, count: debugger.registerContextSize)
     }
 
     mutating func emitThreadStopInfoRegistersForThread(_ threadID: ThreadID, debugger: Debugger, dest: inout String) throws {
-        for register in registers {
-            // Only emit the GPR registers that aren't contained in other registers.
-            // FIXME: Make this better.
-            if register.info.set == 1 && register.info.value_regs == nil {
-                assert(register.debugServerRegisterNumber <= Int(UInt8.max))
-                let number = [UInt8(truncatingBitPattern: register.debugServerRegisterNumber)]
-                let bytes = try debugger.getRegisterValueForThread(threadID, registerID: register.info.reg, registerSetID: register.info.set, dest: &valueStorage)
-                dest += "\(number.hexString):\(bytes.hexString);"
-            }
+        for register in expeditedRegisterTable {
+            assert(register.debugServerRegisterNumber <= Int(UInt8.max))
+            let number = [UInt8(truncatingBitPattern: register.debugServerRegisterNumber)]
+            let bytes = try debugger.getRegisterValueForThread(threadID, registerID: register.info.reg, registerSetID: register.info.set, dest: &valueStorage)
+            dest += "\(number.hexString):\(bytes.hexString);"
         }
     }
 }
@@ -247,7 +268,7 @@ func handleRegisterRead(_ server: inout DebugServerState, payload: String) -> Re
     do {
         let bytes = try server.debugger.getRegisterValueForThread(threadID, registerID: register.info.reg, registerSetID: register.info.set, dest: &server.registerState.valueStorage)
         assert(bytes.count == Int(register.info.size))
-        return .response(bytes.hexString)
+        return server.registerValueResponse(bytes)
     } catch {
         // FIXME: Is this a good behaviour? (DebugServer tries to report really empty registers)
         return .error(.e32)
@@ -270,11 +291,27 @@ func handleRegisterWrite(_ server: inout DebugServerState, payload: String) -> R
     let register = server.registerState.registers[registerID]
     assert(register.info.reg != INVALID_NUB_REGNUM)
     assert(register.info.set != INVALID_NUB_REGNUM)
-    guard let value = parser.readHexBytes(size: Int(register.info.size)) else {
-        return .invalid("Invalid register value")
-    }
-    guard let threadID = server.extractThreadID(payload) else {
-        return .invalid("No thread specified")
+    let value: [UInt8]
+    let threadID: ThreadID
+    switch server.registerValueEncoding {
+    case .hex:
+        guard let hexValue = parser.readHexBytes(size: Int(register.info.size)) else {
+            return .invalid("Invalid register value")
+        }
+        guard let id = server.extractThreadID(payload) else {
+            return .invalid("No thread specified")
+        }
+        value = hexValue
+        threadID = id
+    case .binary:
+        guard let binaryValue = parser.readBinaryBytes(size: Int(register.info.size)) else {
+            return .invalid("Invalid register value")
+        }
+        guard let id = server.extractThreadID(&parser) else {
+            return .invalid("No thread specified")
+        }
+        value = binaryValue
+        threadID = id
     }
     do {
         try server.debugger.setRegisterValueForThread(threadID, registerID: register.info.reg, registerSetID: register.info.set, source: value[0..<value.count])
@@ -292,7 +329,7 @@ func handleGPRegistersRead(_ server: inout DebugServerState, payload: String) ->
     do {
         let bytes = try server.debugger.getRegisterContextForThread(threadID, dest: &server.registerState.valueStorage)
         assert(bytes.count == server.debugger.registerContextSize)
-        return .response(bytes.hexString)
+        return server.registerValueResponse(bytes)
     } catch {
         return .error(.e74)
     }
@@ -301,11 +338,27 @@ func handleGPRegistersRead(_ server: inout DebugServerState, payload: String) ->
 // G context-value
 func handleGPRegistersWrite(_ server: inout DebugServerState, payload: String) -> ResponseResult {
     var parser = PacketParser(payload: payload, offset: 1)
-    guard let value = parser.readHexBytes(size: server.debugger.registerContextSize) else {
-        return .invalid("Invalid register context value")
-    }
-    guard let threadID = server.extractThreadID(payload) else {
-        return .invalid("No thread specified")
+    let value: [UInt8]
+    let threadID: ThreadID
+    switch server.registerValueEncoding {
+    case .hex:
+        guard let hexValue = parser.readHexBytes(size: server.debugger.registerContextSize) else {
+            return .invalid("Invalid register context value")
+        }
+        guard let id = server.extractThreadID(payload) else {
+            return .invalid("No thread specified")
+        }
+        value = hexValue
+        threadID = id
+    case .binary:
+        guard let binaryValue = parser.readBinaryBytes(size: server.debugger.registerContextSize) else {
+            return .invalid("Invalid register context value")
+        }
+        guard let id = server.extractThreadID(&parser) else {
+            return .invalid("No thread specified")
+        }
+        value = binaryValue
+        threadID = id
     }
     do {
         try server.debugger.setRegisterContextForThread(threadID, source: value[0..<value.count])
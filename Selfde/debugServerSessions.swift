@@ -0,0 +1,82 @@
+//
+//  debugServerSessions.swift
+//  Selfde
+//
+
+/// Serves several clients that are attached to the process at the same time. One of them controls
+/// the process, and the others are observers that can read the memory and the registers and that
+/// are notified about the stops. Every session has its own protocol settings, like the no-ack mode,
+/// but the state of the stopped process is read once for all of them.
+///
+/// The sessions have to be served on the thread that uses the debugger.
+public final class DebugServerSessions {
+    private let snapshot: DebuggerSnapshot
+    private weak var logger: DebugServerLogger?
+    public private(set) var controllingSession: DebugServer?
+    public private(set) var observerSessions: [DebugServer] = []
+
+    public init(debugger: Debugger, logger: DebugServerLogger? = nil) {
+        snapshot = DebuggerSnapshot(debugger: debugger)
+        self.logger = logger
+    }
+
+    /// Returns nil when another client already controls the process.
+    public func addControllingSession(writer: RemoteDebuggingWriter) -> DebugServer? {
+        guard controllingSession == nil else {
+            return nil
+        }
+        let session = DebugServer(debugger: snapshot.debugger, writer: writer, logger: logger, isObserver: false, snapshot: snapshot)
+        controllingSession = session
+        return session
+    }
+
+    public func addObserverSession(writer: RemoteDebuggingWriter) -> DebugServer {
+        let session = DebugServer(debugger: snapshot.debugger, writer: writer, logger: logger, isObserver: true, snapshot: snapshot)
+        observerSessions.append(session)
+        return session
+    }
+
+    public func removeSession(_ session: DebugServer) {
+        if controllingSession === session {
+            controllingSession = nil
+        }
+        observerSessions = observerSessions.filter { $0 !== session }
+    }
+
+    /// Reports a stop to all of the sessions. It has to be called whenever the process stops, as
+    /// the state that was read before the stop is dropped.
+    public func sendStopNotificationForThread(_ threadID: ThreadID) throws {
+        snapshot.invalidate(isStopped: true)
+        for observer in observerSessions {
+            // An observer that went away shouldn't keep the stop from the others.
+            do {
+                try observer.sendStopNotificationForThread(threadID)
+            } catch {
+                logger?.log("Failed to notify an observer about a stop: \(error)")
+            }
+        }
+        try controllingSession?.sendStopNotificationForThread(threadID)
+    }
+
+    /// Reports a stop that was released with `Debugger.releaseStop` to all of the sessions. The controlling
+    /// session only reports it in non-stop mode.
+    public func sendStopNotificationForReleasedStop(_ stop: ThreadStopSnapshot) throws {
+        // The thread of a released stop keeps running.
+        snapshot.invalidate(isStopped: false)
+        for observer in observerSessions {
+            do {
+                try observer.sendStopNotificationForReleasedStop(stop)
+            } catch {
+                logger?.log("Failed to notify an observer about a stop: \(error)")
+            }
+        }
+        try controllingSession?.sendStopNotificationForReleasedStop(stop)
+    }
+
+    public func sendExitReply() throws {
+        for observer in observerSessions {
+            _ = try? observer.sendExitReply()
+        }
+        try controllingSession?.sendExitReply()
+    }
+}
@@ -14,12 +14,25 @@ public enum ThreadResumeAction: Int {
     case stop
     case `continue`
     case step
+    // Keep stepping while the instruction pointer is inside the entry's range.
+    case rangeStep
+    // Run until the current function returns to its caller.
+    case stepOut
 }
 
 public struct ThreadResumeEntry {
     public let thread: ThreadReference
     public let action: ThreadResumeAction
     public let address: Address?
+    // The stepping range for the 'rangeStep' action.
+    public let range: AddressRange?
+
+    public init(thread: ThreadReference, action: ThreadResumeAction, address: Address?, range: AddressRange? = nil) {
+        self.thread = thread
+        self.action = action
+        self.address = address
+        self.range = range
+    }
 }
 
 public enum ProcessResumeAction {
@@ -48,14 +61,27 @@ public struct ThreadStopInfo {
     }
 }
 
+public enum DebuggerError: Error {
+    case unsupported
+}
+
 public protocol Debugger: class {
     var registerContextSize: Int { get }
+    // Can the threads be resumed with the 'stepOut' action?
+    var supportsStepOut: Bool { get }
 
     var primaryThreadID: ThreadID { get }
     var threads: [ThreadID] { get }
 
     func attach(_ processID: Int) throws
     func getSharedLibraryInfoAddress() throws -> Address
+    // The loaded executable and shared libraries, read from the dynamic linker's image list.
+    func getLoadedLibraries() throws -> [LoadedLibrary]
+    // The symbols that are defined in a loaded library. Can be called from multiple threads at once.
+    func getSymbols(in library: LoadedLibrary) throws -> [Symbol]
+    // The instruction pointers of the stopped threads' frames, innermost first, unwound in-process.
+    // The threads that aren't stopped have empty backtraces.
+    func getBacktraces(_ threadIDs: [ThreadID], maxFrames: Int) throws -> [[Address]]
 
     func interruptExecution() throws
 
@@ -81,4 +107,149 @@ public protocol Debugger: class {
 
     func readMemory(_ address: Address, size: Int) throws -> MemoryReadResult
     func writeMemory(_ address: Address, bytes: [UInt8]) throws
+
+    // Non-stop mode: a stop only halts the thread that has stopped, and the threads are resumed individually.
+    func setNonStopMode(_ enabled: Bool) throws
+
+    // QPassSignals: the signals that are delivered to the program without a stop.
+    func setPassSignals(_ signals: [Int32]) throws
+    // QProgramSignals: the signals that can be delivered to the program, the other passed signals are discarded.
+    func setProgramSignals(_ signals: [Int32]) throws
+
+    // Calls the function on a stopped thread with the System V integer and 16 byte vector arguments.
+    // The thread's registers are restored after the call. The stops that are caught during the call are reported
+    // afterwards, and a thread that stops inside the function is left there and fails the call.
+    func callFunction(_ address: Address, threadID: ThreadID, integerArguments: [UInt64], vectorArguments: [[UInt8]]) throws -> FunctionCallResult
+
+    // Samples the stacks of the running threads in the background. Starting the profiler drops the previous profile.
+    func startProfiling(frequency: Int, maxFrames: Int) throws
+    func stopProfiling() throws
+    // The stacks that were sampled since the profiler was started, can be read while it's running.
+    func getProfile() throws -> StackProfile
+
+    // Writes a core file of the process with its threads and readable memory.
+    func writeCore(to path: String, options: CoreDumpOptions) throws -> CoreDumpStatistics
+
+    // Copies the registers and the stack window of a stopped thread and lets the stopped threads continue.
+    // The thread steps past the breakpoint that it has stopped at, and the breakpoint stays installed.
+    // A debug server only reports the released stops in non-stop mode.
+    func releaseStop(_ threadID: ThreadID, stackWindowSize: Int) throws -> ThreadStopSnapshot
+
+    // Puts a one-shot INT 3 on every basic block. The first hit of a block sets its bit in the coverage map and
+    // removes its INT 3 without stopping the thread. Returns the number of the installed blocks.
+    func startCoverage(_ addresses: [Address]) throws -> Int
+    // Removes the INT 3s of the blocks that haven't run, the coverage map can still be read.
+    func stopCoverage() throws
+    func getCoverage() throws -> CoverageMap
+
+    // Tracks the writes to the given ranges in epochs, starting with epoch 1. Starting the tracking ends the previous one.
+    func startDirtyPageTracking(_ ranges: [AddressRange]) throws -> DirtyPageTrackingMethod
+    func stopDirtyPageTracking() throws
+    // Ends the current epoch and returns the number of the new one.
+    func advanceDirtyPageEpoch() throws -> Int
+    // The pages of the range that were written since the given epoch began. The pages that aren't tracked are dirty.
+    func getDirtyPages(_ range: AddressRange, since epoch: Int) throws -> DirtyPageMap
+
+    // Returns the lowest addresses in the range at which the pattern occurs, skipping the memory that can't be read.
+    // A byte matches when (byte & mask) == (pattern & mask).
+    func searchMemory(_ range: AddressRange, pattern: [UInt8], mask: [UInt8]?, maxMatches: Int) throws -> [Address]
+
+    // The CRC-32 of GDB's qCRC packet, fails when a part of the range can't be read.
+    func computeCRC32(_ range: AddressRange) throws -> UInt32
+    // The CRC-32C of every block of the range, the last block can be shorter. The digests of the blocks that can't be read are nil.
+    func computeMemoryDigests(_ range: AddressRange, blockSize: Int) throws -> [UInt32?]
+}
+
+public extension Debugger {
+    public var supportsStepOut: Bool {
+        return false
+    }
+
+    public func getLoadedLibraries() throws -> [LoadedLibrary] {
+        throw DebuggerError.unsupported
+    }
+
+    public func getSymbols(in library: LoadedLibrary) throws -> [Symbol] {
+        throw DebuggerError.unsupported
+    }
+
+    public func getBacktraces(_ threadIDs: [ThreadID], maxFrames: Int) throws -> [[Address]] {
+        throw DebuggerError.unsupported
+    }
+
+    public func setNonStopMode(_ enabled: Bool) throws {
+        throw DebuggerError.unsupported
+    }
+
+    public func setPassSignals(_ signals: [Int32]) throws {
+        throw DebuggerError.unsupported
+    }
+
+    public func setProgramSignals(_ signals: [Int32]) throws {
+        throw DebuggerError.unsupported
+    }
+
+    public func callFunction(_ address: Address, threadID: ThreadID, integerArguments: [UInt64], vectorArguments: [[UInt8]]) throws -> FunctionCallResult {
+        throw DebuggerError.unsupported
+    }
+
+    public func startProfiling(frequency: Int, maxFrames: Int) throws {
+        throw DebuggerError.unsupported
+    }
+
+    public func stopProfiling() throws {
+        throw DebuggerError.unsupported
+    }
+
+    public func getProfile() throws -> StackProfile {
+        throw DebuggerError.unsupported
+    }
+
+    public func writeCore(to path: String, options: CoreDumpOptions) throws -> CoreDumpStatistics {
+        throw DebuggerError.unsupported
+    }
+
+    public func releaseStop(_ threadID: ThreadID, stackWindowSize: Int) throws -> ThreadStopSnapshot {
+        throw DebuggerError.unsupported
+    }
+
+    public func startCoverage(_ addresses: [Address]) throws -> Int {
+        throw DebuggerError.unsupported
+    }
+
+    public func stopCoverage() throws {
+        throw DebuggerError.unsupported
+    }
+
+    public func getCoverage() throws -> CoverageMap {
+        throw DebuggerError.unsupported
+    }
+
+    public func startDirtyPageTracking(_ ranges: [AddressRange]) throws -> DirtyPageTrackingMethod {
+        throw DebuggerError.unsupported
+    }
+
+    public func stopDirtyPageTracking() throws {
+        throw DebuggerError.unsupported
+    }
+
+    public func advanceDirtyPageEpoch() throws -> Int {
+        throw DebuggerError.unsupported
+    }
+
+    public func getDirtyPages(_ range: AddressRange, since epoch: Int) throws -> DirtyPageMap {
+        throw DebuggerError.unsupported
+    }
+
+    public func searchMemory(_ range: AddressRange, pattern: [UInt8], mask: [UInt8]?, maxMatches: Int) throws -> [Address] {
+        throw DebuggerError.unsupported
+    }
+
+    public func computeCRC32(_ range: AddressRange) throws -> UInt32 {
+        throw DebuggerError.unsupported
+    }
+
+    public func computeMemoryDigests(_ range: AddressRange, blockSize: Int) throws -> [UInt32?] {
+        throw DebuggerError.unsupported
+    }
 }
@@ -0,0 +1,368 @@
+//
+//  debuggerSnapshot.swift
+//  Selfde
+//
+
+/// Forwards the calls to a debugger and caches the state of the stopped process, so that the
+/// clients of a debug server that read the same registers and memory share the kernel calls.
+///
+/// The snapshot is dropped when the process is resumed or interrupted, and when it's modified
+/// through the snapshot. Nothing is cached until the process is known to be stopped, or in
+/// non-stop mode, as the other threads keep running.
+final class DebuggerSnapshot: Debugger {
+    private static let pageSize = 4096
+
+    let debugger: Debugger
+    private var isNonStopMode = false
+    // All of the threads are stopped, so the state doesn't change until the process is resumed.
+    private var isStopped = false
+    private var threadList: [ThreadID]?
+    private var stopInfos: [ThreadID: ThreadStopInfo] = [:]
+    private var instructionPointers: [ThreadID: Address] = [:]
+    // Keyed by the register set ID and the register ID.
+    private var registerValues: [ThreadID: [UInt64: [UInt8]]] = [:]
+    private var registerContexts: [ThreadID: [UInt8]] = [:]
+    private var backtraces: [ThreadID: (maxFrames: Int, frames: [Address])] = [:]
+    private var loadedLibraries: [LoadedLibrary]?
+    private var memoryPages: [UInt: [UInt8]] = [:]
+    // The memory that's returned by 'readMemory' is valid until the next read.
+    private var readBuffer: UnsafeMutablePointer<UInt8>?
+    private var readBufferCapacity = 0
+
+    init(debugger: Debugger) {
+        self.debugger = debugger
+    }
+
+    deinit {
+        readBuffer?.deallocate(capacity: readBufferCapacity)
+    }
+
+    /// Drops the cached state and records whether all of the threads are stopped. Has to be called
+    /// when the process is resumed or stops.
+    func invalidate(isStopped: Bool) {
+        invalidate()
+        self.isStopped = isStopped
+    }
+
+    private var canCache: Bool {
+        return isStopped && !isNonStopMode
+    }
+
+    private func invalidate() {
+        threadList = nil
+        stopInfos.removeAll()
+        instructionPointers.removeAll()
+        registerValues.removeAll()
+        registerContexts.removeAll()
+        backtraces.removeAll()
+        loadedLibraries = nil
+        memoryPages.removeAll()
+    }
+
+    private func invalidateRegisters(_ threadID: ThreadID) {
+        instructionPointers[threadID] = nil
+        registerValues[threadID] = nil
+        registerContexts[threadID] = nil
+        backtraces[threadID] = nil
+    }
+
+    var registerContextSize: Int {
+        return debugger.registerContextSize
+    }
+
+    var supportsStepOut: Bool {
+        return debugger.supportsStepOut
+    }
+
+    var primaryThreadID: ThreadID {
+        return debugger.primaryThreadID
+    }
+
+    var threads: [ThreadID] {
+        if let threads = threadList {
+            return threads
+        }
+        let threads = debugger.threads
+        if canCache {
+            threadList = threads
+        }
+        return threads
+    }
+
+    func attach(_ processID: Int) throws {
+        invalidate(isStopped: false)
+        try debugger.attach(processID)
+        isStopped = true
+    }
+
+    func getSharedLibraryInfoAddress() throws -> Address {
+        return try debugger.getSharedLibraryInfoAddress()
+    }
+
+    func getLoadedLibraries() throws -> [LoadedLibrary] {
+        if let libraries = loadedLibraries {
+            return libraries
+        }
+        let libraries = try debugger.getLoadedLibraries()
+        if canCache {
+            loadedLibraries = libraries
+        }
+        return libraries
+    }
+
+    func getSymbols(in library: LoadedLibrary) throws -> [Symbol] {
+        return try debugger.getSymbols(in: library)
+    }
+
+    func getBacktraces(_ threadIDs: [ThreadID], maxFrames: Int) throws -> [[Address]] {
+        guard canCache else {
+            return try debugger.getBacktraces(threadIDs, maxFrames: maxFrames)
+        }
+        // A cached backtrace can be used when it was unwound further, or when it has ended before its limit.
+        let missingThreadIDs = threadIDs.filter { threadID in
+            guard let backtrace = backtraces[threadID] else {
+                return true
+            }
+            return backtrace.maxFrames < maxFrames && backtrace.frames.count == backtrace.maxFrames
+        }
+        if !missingThreadIDs.isEmpty {
+            let result = try debugger.getBacktraces(missingThreadIDs, maxFrames: maxFrames)
+            for (threadID, frames) in zip(missingThreadIDs, result) {
+                backtraces[threadID] = (maxFrames, frames)
+            }
+        }
+        return threadIDs.map { Array(backtraces[$0]!.frames.prefix(maxFrames)) }
+    }
+
+    func interruptExecution() throws {
+        invalidate(isStopped: false)
+        try debugger.interruptExecution()
+        isStopped = true
+    }
+
+    func detach() {
+        invalidate(isStopped: false)
+        debugger.detach()
+    }
+
+    func getStopInfoForThread(_ threadID: ThreadID) throws -> ThreadStopInfo {
+        if let info = stopInfos[threadID] {
+            return info
+        }
+        let info = try debugger.getStopInfoForThread(threadID)
+        if canCache {
+            stopInfos[threadID] = info
+        }
+        return info
+    }
+
+    func isThreadAlive(_ threadID: ThreadID) throws -> Bool {
+        return try debugger.isThreadAlive(threadID)
+    }
+
+    func setBreakpoint(_ address: Address, byteSize: Int) throws {
+        memoryPages.removeAll()
+        try debugger.setBreakpoint(address, byteSize: byteSize)
+    }
+
+    func removeBreakpoint(_ address: Address) throws {
+        memoryPages.removeAll()
+        try debugger.removeBreakpoint(address)
+    }
+
+    func getIPRegisterValueForThread(_ threadID: ThreadID) throws -> Address {
+        if let address = instructionPointers[threadID] {
+            return address
+        }
+        let address = try debugger.getIPRegisterValueForThread(threadID)
+        if canCache {
+            instructionPointers[threadID] = address
+        }
+        return address
+    }
+
+    func getRegisterValueForThread(_ threadID: ThreadID, registerID: UInt32, registerSetID: UInt32, dest: inout [UInt8]) throws -> ArraySlice<UInt8> {
+        let key = UInt64(registerSetID) << 32 | UInt64(registerID)
+        if let value = registerValues[threadID]?[key] {
+            guard dest.count >= value.count else {
+                throw ControllerError.registerBufferIsTooSmall
+            }
+            dest.replaceSubrange(0..<value.count, with: value)
+            return dest[0..<value.count]
+        }
+        let value = try debugger.getRegisterValueForThread(threadID, registerID: registerID, registerSetID: registerSetID, dest: &dest)
+        if canCache {
+            var values = registerValues[threadID] ?? [:]
+            values[key] = Array(value)
+            registerValues[threadID] = values
+        }
+        return value
+    }
+
+    func setRegisterValueForThread(_ threadID: ThreadID, registerID: UInt32, registerSetID: UInt32, source: ArraySlice<UInt8>) throws {
+        invalidateRegisters(threadID)
+        try debugger.setRegisterValueForThread(threadID, registerID: registerID, registerSetID: registerSetID, source: source)
+    }
+
+    func getRegisterContextForThread(_ threadID: ThreadID, dest: inout [UInt8]) throws -> ArraySlice<UInt8> {
+        if let context = registerContexts[threadID] {
+            guard dest.count >= context.count else {
+                throw ControllerError.registerBufferIsTooSmall
+            }
+            dest.replaceSubrange(0..<context.count, with: context)
+            return dest[0..<context.count]
+        }
+        let context = try debugger.getRegisterContextForThread(threadID, dest: &dest)
+        if canCache {
+            registerContexts[threadID] = Array(context)
+        }
+        return context
+    }
+
+    func setRegisterContextForThread(_ threadID: ThreadID, source: ArraySlice<UInt8>) throws {
+        invalidateRegisters(threadID)
+        try debugger.setRegisterContextForThread(threadID, source: source)
+    }
+
+    func allocate(_ size: Int, permissions: MemoryPermissions) throws -> Address {
+        return try debugger.allocate(size, permissions: permissions)
+    }
+
+    func deallocate(_ address: Address) throws {
+        memoryPages.removeAll()
+        try debugger.deallocate(address)
+    }
+
+    private func getMemoryPage(_ pageAddress: UInt) throws -> [UInt8] {
+        if let page = memoryPages[pageAddress] {
+            return page
+        }
+        guard case .bytes(let bytes) = try debugger.readMemory(Address(bitPattern: pageAddress), size: DebuggerSnapshot.pageSize),
+            bytes.count == DebuggerSnapshot.pageSize else {
+            throw ControllerError.invalidAddress
+        }
+        let page = Array(bytes)
+        memoryPages[pageAddress] = page
+        return page
+    }
+
+    // The memory is cached a page at a time, as the memory is mapped in pages and a read of the
+    // whole page fails only when the requested part of it would have failed as well.
+    func readMemory(_ address: Address, size: Int) throws -> MemoryReadResult {
+        guard canCache, size > 0 else {
+            return try debugger.readMemory(address, size: size)
+        }
+        if readBufferCapacity < size {
+            readBuffer?.deallocate(capacity: readBufferCapacity)
+            readBuffer = UnsafeMutablePointer<UInt8>.allocate(capacity: size)
+            readBufferCapacity = size
+        }
+        guard let buffer = readBuffer else {
+            return .bytes(UnsafeBufferPointer(start: nil, count: 0))
+        }
+        let pageSize = UInt(DebuggerSnapshot.pageSize)
+        let start = address.bitPattern
+        var offset = 0
+        while offset < size {
+            let current = start &+ UInt(offset)
+            let pageAddress = current & ~(pageSize - 1)
+            let page = try getMemoryPage(pageAddress)
+            let pageOffset = Int(current - pageAddress)
+            let count = min(size - offset, DebuggerSnapshot.pageSize - pageOffset)
+            for i in 0..<count {
+                buffer[offset + i] = page[pageOffset + i]
+            }
+            offset += count
+        }
+        return .bytes(UnsafeBufferPointer(start: buffer, count: size))
+    }
+
+    func writeMemory(_ address: Address, bytes: [UInt8]) throws {
+        memoryPages.removeAll()
+        backtraces.removeAll()
+        try debugger.writeMemory(address, bytes: bytes)
+    }
+
+    func setNonStopMode(_ enabled: Bool) throws {
+        try debugger.setNonStopMode(enabled)
+        isNonStopMode = enabled
+        invalidate()
+    }
+
+    func setPassSignals(_ signals: [Int32]) throws {
+        try debugger.setPassSignals(signals)
+    }
+
+    func setProgramSignals(_ signals: [Int32]) throws {
+        try debugger.setProgramSignals(signals)
+    }
+
+    func callFunction(_ address: Address, threadID: ThreadID, integerArguments: [UInt64], vectorArguments: [[UInt8]]) throws -> FunctionCallResult {
+        invalidate()
+        return try debugger.callFunction(address, threadID: threadID, integerArguments: integerArguments, vectorArguments: vectorArguments)
+    }
+
+    func startProfiling(frequency: Int, maxFrames: Int) throws {
+        try debugger.startProfiling(frequency: frequency, maxFrames: maxFrames)
+    }
+
+    func stopProfiling() throws {
+        try debugger.stopProfiling()
+    }
+
+    func getProfile() throws -> StackProfile {
+        return try debugger.getProfile()
+    }
+
+    func writeCore(to path: String, options: CoreDumpOptions) throws -> CoreDumpStatistics {
+        return try debugger.writeCore(to: path, options: options)
+    }
+
+    func releaseStop(_ threadID: ThreadID, stackWindowSize: Int) throws -> ThreadStopSnapshot {
+        // The released thread keeps running.
+        invalidate(isStopped: false)
+        return try debugger.releaseStop(threadID, stackWindowSize: stackWindowSize)
+    }
+
+    func startCoverage(_ addresses: [Address]) throws -> Int {
+        invalidate()
+        return try debugger.startCoverage(addresses)
+    }
+
+    func stopCoverage() throws {
+        invalidate()
+        try debugger.stopCoverage()
+    }
+
+    func getCoverage() throws -> CoverageMap {
+        return try debugger.getCoverage()
+    }
+
+    func startDirtyPageTracking(_ ranges: [AddressRange]) throws -> DirtyPageTrackingMethod {
+        return try debugger.startDirtyPageTracking(ranges)
+    }
+
+    func stopDirtyPageTracking() throws {
+        try debugger.stopDirtyPageTracking()
+    }
+
+    func advanceDirtyPageEpoch() throws -> Int {
+        return try debugger.advanceDirtyPageEpoch()
+    }
+
+    func getDirtyPages(_ range: AddressRange, since epoch: Int) throws -> DirtyPageMap {
+        return try debugger.getDirtyPages(range, since: epoch)
+    }
+
+    func searchMemory(_ range: AddressRange, pattern: [UInt8], mask: [UInt8]?, maxMatches: Int) throws -> [Address] {
+        return try debugger.searchMemory(range, pattern: pattern, mask: mask, maxMatches: maxMatches)
+    }
+
+    func computeCRC32(_ range: AddressRange) throws -> UInt32 {
+        return try debugger.computeCRC32(range)
+    }
+
+    func computeMemoryDigests(_ range: AddressRange, blockSize: Int) throws -> [UInt32?] {
+        return try debugger.computeMemoryDigests(range, blockSize: blockSize)
+    }
+}
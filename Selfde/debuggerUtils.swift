@@ -4,25 +4,25 @@
 //
 
 // Processes the debugger resume commands and extracts concrete actions for all of the given threads.
-public func extractResumeActionsForThreads(_ threads: [ThreadID], primaryThread: ThreadID, entries: [ThreadResumeEntry], defaultAction: ThreadResumeAction) -> [(ThreadID, ThreadResumeAction, Address?)] {
-    var results = [ThreadID: (ThreadID, ThreadResumeAction, Address?)]()
+public func extractResumeActionsForThreads(_ threads: [ThreadID], primaryThread: ThreadID, entries: [ThreadResumeEntry], defaultAction: ThreadResumeAction) -> [(ThreadID, ThreadResumeAction, Address?, AddressRange?)] {
+    var results = [ThreadID: (ThreadID, ThreadResumeAction, Address?, AddressRange?)]()
     for entry in entries {
         switch entry.thread {
         case .id(let threadID):
-             results[threadID] = (threadID, entry.action, entry.address)
+             results[threadID] = (threadID, entry.action, entry.address, entry.range)
         case .any:
             let threadID = primaryThread
             guard results[threadID] == nil else { continue }
-            results[threadID] = (threadID, entry.action, entry.address)
+            results[threadID] = (threadID, entry.action, entry.address, entry.range)
         case .all:
             for threadID in threads {
-                results[threadID] = (threadID, entry.action, entry.address)
+                results[threadID] = (threadID, entry.action, entry.address, entry.range)
             }
         }
     }
     for threadID in threads {
         guard results[threadID] == nil else { continue }
-        results[threadID] = (threadID, defaultAction, nil)
+        results[threadID] = (threadID, defaultAction, nil, nil)
     }
     return Array(results.values)
 }
@@ -0,0 +1,358 @@
+//
+//  dirtyPages.c
+//  Selfde
+//
+// Every tracked page has the number of the last epoch in which it was written. With the soft-dirty
+// bits the numbers are updated from /proc/self/pagemap when an epoch ends, and with the write protection
+// they're updated by the fault handler, which lifts the protection of the page until the epoch ends.
+
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+#include "dirtyPages.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// The pagemap entries that are read at once.
+#define PAGEMAP_CHUNK 512
+#define SOFT_DIRTY_BIT ((uint64_t)1 << 55)
+
+typedef struct TrackedRange {
+    uint64_t start;
+    uint64_t end;
+    uint32_t *stamps;
+} TrackedRange;
+
+typedef struct DirtyPageTracker {
+    // Sorted by their addresses, and they don't overlap.
+    TrackedRange *ranges;
+    uint32_t rangeCount;
+    SelfdeDirtyPageMethod method;
+    uint64_t pageSize;
+    uint32_t epoch;
+    // Odd while the pages are being protected for the next epoch.
+    uint32_t sequence;
+    bool isStopped;
+    int pagemap;
+    int clearRefs;
+} DirtyPageTracker;
+
+static pthread_mutex_t trackerMutex = PTHREAD_MUTEX_INITIALIZER;
+static DirtyPageTracker *currentTracker;
+// The fault handlers that might still be using a tracker that's being replaced.
+static int activeHandlers;
+
+static int compareRanges(const void *lhs, const void *rhs) {
+    uint64_t a = ((const TrackedRange *)lhs)->start;
+    uint64_t b = ((const TrackedRange *)rhs)->start;
+    return a < b ? -1 : (a > b ? 1 : 0);
+}
+
+static TrackedRange *findRange(DirtyPageTracker *tracker, uint64_t address) {
+    uint32_t low = 0;
+    uint32_t high = tracker->rangeCount;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        TrackedRange *range = &tracker->ranges[middle];
+        if (address < range->start) {
+            high = middle;
+        } else if (address >= range->end) {
+            low = middle + 1;
+        } else {
+            return range;
+        }
+    }
+    return NULL;
+}
+
+static int protectRanges(DirtyPageTracker *tracker, int protection) {
+    for (uint32_t i = 0; i < tracker->rangeCount; ++i) {
+        TrackedRange *range = &tracker->ranges[i];
+        if (mprotect((void *)(uintptr_t)range->start, (size_t)(range->end - range->start), protection) != 0) {
+            return errno;
+        }
+    }
+    return 0;
+}
+
+static void destroyTracker(DirtyPageTracker *tracker) {
+    for (uint32_t i = 0; i < tracker->rangeCount; ++i) {
+        free(tracker->ranges[i].stamps);
+    }
+    if (tracker->pagemap >= 0) {
+        close(tracker->pagemap);
+    }
+    if (tracker->clearRefs >= 0) {
+        close(tracker->clearRefs);
+    }
+    free(tracker->ranges);
+    free(tracker);
+}
+
+static void destroyCurrentTracker(void) {
+    DirtyPageTracker *tracker = __atomic_exchange_n(&currentTracker, NULL, __ATOMIC_SEQ_CST);
+    if (!tracker) {
+        return;
+    }
+    while (__atomic_load_n(&activeHandlers, __ATOMIC_SEQ_CST) != 0) {
+        sched_yield();
+    }
+    destroyTracker(tracker);
+}
+
+static bool readPagemap(DirtyPageTracker *tracker, uint64_t address, uint64_t count, uint64_t *entries) {
+    size_t size = (size_t)count * sizeof(uint64_t);
+    return pread(tracker->pagemap, entries, size, (off_t)(address / tracker->pageSize * sizeof(uint64_t))) == (ssize_t)size;
+}
+
+#if defined(__linux__)
+
+static int clearSoftDirtyBits(DirtyPageTracker *tracker) {
+    while (pwrite(tracker->clearRefs, "4", 1, 0) < 0) {
+        if (errno != EINTR) {
+            return errno;
+        }
+    }
+    return 0;
+}
+
+// The kernels without CONFIG_MEM_SOFT_DIRTY accept the clear request, but never set the bits.
+static bool isSoftDirtySupported(DirtyPageTracker *tracker) {
+    tracker->pagemap = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+    tracker->clearRefs = open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+    if (tracker->pagemap < 0 || tracker->clearRefs < 0) {
+        return false;
+    }
+    void *memory = mmap(NULL, (size_t)tracker->pageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        return false;
+    }
+    volatile uint8_t *page = memory;
+    page[0] = 1;
+    bool isSupported = false;
+    uint64_t entry;
+    if (clearSoftDirtyBits(tracker) == 0 && readPagemap(tracker, (uint64_t)(uintptr_t)memory, 1, &entry) && !(entry & SOFT_DIRTY_BIT)) {
+        page[0] = 2;
+        isSupported = readPagemap(tracker, (uint64_t)(uintptr_t)memory, 1, &entry) && (entry & SOFT_DIRTY_BIT);
+    }
+    munmap(memory, (size_t)tracker->pageSize);
+    return isSupported;
+}
+
+// Stamps the pages that are soft-dirty with the current epoch.
+static int foldSoftDirtyBits(DirtyPageTracker *tracker) {
+    uint64_t entries[PAGEMAP_CHUNK];
+    for (uint32_t i = 0; i < tracker->rangeCount; ++i) {
+        TrackedRange *range = &tracker->ranges[i];
+        uint64_t pageCount = (range->end - range->start) / tracker->pageSize;
+        for (uint64_t chunk = 0; chunk < pageCount; chunk += PAGEMAP_CHUNK) {
+            uint64_t count = pageCount - chunk < PAGEMAP_CHUNK ? pageCount - chunk : PAGEMAP_CHUNK;
+            if (!readPagemap(tracker, range->start + chunk * tracker->pageSize, count, entries)) {
+                return errno != 0 ? errno : EIO;
+            }
+            for (uint64_t j = 0; j < count; ++j) {
+                if (entries[j] & SOFT_DIRTY_BIT) {
+                    range->stamps[chunk + j] = tracker->epoch;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+#else
+
+static bool isSoftDirtySupported(DirtyPageTracker *tracker) {
+    return false;
+}
+
+static int clearSoftDirtyBits(DirtyPageTracker *tracker) {
+    return ENOTSUP;
+}
+
+static int foldSoftDirtyBits(DirtyPageTracker *tracker) {
+    return ENOTSUP;
+}
+
+#endif
+
+int selfdeDirtyPagesStart(const SelfdeDirtyPageRange *ranges, uint32_t count, bool allowWriteProtection, SelfdeDirtyPageMethod *method) {
+    if (count == 0) {
+        return EINVAL;
+    }
+    DirtyPageTracker *tracker = calloc(1, sizeof(DirtyPageTracker));
+    if (!tracker) {
+        return ENOMEM;
+    }
+    tracker->pagemap = -1;
+    tracker->clearRefs = -1;
+    tracker->pageSize = (uint64_t)sysconf(_SC_PAGESIZE);
+    tracker->epoch = 1;
+    tracker->ranges = calloc(count, sizeof(TrackedRange));
+    if (!tracker->ranges) {
+        destroyTracker(tracker);
+        return ENOMEM;
+    }
+    tracker->rangeCount = count;
+    for (uint32_t i = 0; i < count; ++i) {
+        TrackedRange *range = &tracker->ranges[i];
+        range->start = ranges[i].address & ~(tracker->pageSize - 1);
+        range->end = (ranges[i].address + ranges[i].size + tracker->pageSize - 1) & ~(tracker->pageSize - 1);
+        range->stamps = range->end > range->start ? calloc((size_t)((range->end - range->start) / tracker->pageSize), sizeof(uint32_t)) : NULL;
+        if (!range->stamps) {
+            destroyTracker(tracker);
+            return range->end > range->start ? ENOMEM : EINVAL;
+        }
+    }
+    qsort(tracker->ranges, count, sizeof(TrackedRange), compareRanges);
+    for (uint32_t i = 1; i < count; ++i) {
+        if (tracker->ranges[i].start < tracker->ranges[i - 1].end) {
+            destroyTracker(tracker);
+            return EINVAL;
+        }
+    }
+
+    pthread_mutex_lock(&trackerMutex);
+    if (currentTracker && !currentTracker->isStopped) {
+        pthread_mutex_unlock(&trackerMutex);
+        destroyTracker(tracker);
+        return EBUSY;
+    }
+    destroyCurrentTracker();
+    int error = 0;
+    if (isSoftDirtySupported(tracker)) {
+        // The pages that were written before the start belong to epoch 0.
+        error = clearSoftDirtyBits(tracker);
+        tracker->method = SelfdeDirtyPageSoftDirty;
+    } else if (allowWriteProtection) {
+        tracker->method = SelfdeDirtyPageWriteProtection;
+        // The tracker is published first, as the pages can be written as soon as they're protected.
+        __atomic_store_n(&currentTracker, tracker, __ATOMIC_SEQ_CST);
+        error = protectRanges(tracker, PROT_READ);
+        if (error != 0) {
+            protectRanges(tracker, PROT_READ | PROT_WRITE);
+            tracker->isStopped = true;
+        }
+    } else {
+        error = ENOTSUP;
+    }
+    if (error == 0) {
+        __atomic_store_n(&currentTracker, tracker, __ATOMIC_SEQ_CST);
+        *method = tracker->method;
+    } else if (currentTracker != tracker) {
+        destroyTracker(tracker);
+    }
+    pthread_mutex_unlock(&trackerMutex);
+    return error;
+}
+
+void selfdeDirtyPagesStop(void) {
+    pthread_mutex_lock(&trackerMutex);
+    DirtyPageTracker *tracker = currentTracker;
+    // The tracker is kept until the next start, as a thread that has hit a protected page might still be
+    // on its way to the fault handler.
+    if (tracker && !tracker->isStopped) {
+        if (tracker->method == SelfdeDirtyPageWriteProtection) {
+            protectRanges(tracker, PROT_READ | PROT_WRITE);
+        }
+        __atomic_store_n(&tracker->isStopped, true, __ATOMIC_SEQ_CST);
+    }
+    pthread_mutex_unlock(&trackerMutex);
+}
+
+int selfdeDirtyPagesAdvanceEpoch(uint32_t *epoch) {
+    pthread_mutex_lock(&trackerMutex);
+    DirtyPageTracker *tracker = currentTracker;
+    int error = 0;
+    if (!tracker || tracker->isStopped) {
+        error = EINVAL;
+    } else if (tracker->method == SelfdeDirtyPageSoftDirty) {
+        error = foldSoftDirtyBits(tracker);
+        if (error == 0) {
+            error = clearSoftDirtyBits(tracker);
+        }
+        if (error == 0) {
+            *epoch = __atomic_add_fetch(&tracker->epoch, 1, __ATOMIC_SEQ_CST);
+        }
+    } else {
+        // The fault handlers wait until the pages are protected and the epoch is advanced.
+        __atomic_add_fetch(&tracker->sequence, 1, __ATOMIC_SEQ_CST);
+        error = protectRanges(tracker, PROT_READ);
+        if (error == 0) {
+            *epoch = __atomic_add_fetch(&tracker->epoch, 1, __ATOMIC_SEQ_CST);
+        }
+        __atomic_add_fetch(&tracker->sequence, 1, __ATOMIC_SEQ_CST);
+    }
+    pthread_mutex_unlock(&trackerMutex);
+    return error;
+}
+
+int selfdeDirtyPagesGet(uint64_t address, uint64_t size, uint32_t sinceEpoch, uint8_t *bitmap) {
+    pthread_mutex_lock(&trackerMutex);
+    DirtyPageTracker *tracker = currentTracker;
+    if (!tracker || tracker->isStopped || sinceEpoch > tracker->epoch) {
+        pthread_mutex_unlock(&trackerMutex);
+        return EINVAL;
+    }
+    uint64_t start = address & ~(tracker->pageSize - 1);
+    uint64_t end = (address + size + tracker->pageSize - 1) & ~(tracker->pageSize - 1);
+    uint64_t pageCount = (end - start) / tracker->pageSize;
+    memset(bitmap, 0, (size_t)((pageCount + 7) / 8));
+    uint64_t entries[PAGEMAP_CHUNK];
+    for (uint64_t chunk = 0; chunk < pageCount; chunk += PAGEMAP_CHUNK) {
+        uint64_t count = pageCount - chunk < PAGEMAP_CHUNK ? pageCount - chunk : PAGEMAP_CHUNK;
+        uint64_t chunkStart = start + chunk * tracker->pageSize;
+        // The pages that are soft-dirty now were written in the current epoch.
+        bool hasEntries = tracker->method == SelfdeDirtyPageSoftDirty && readPagemap(tracker, chunkStart, count, entries);
+        for (uint64_t i = 0; i < count; ++i) {
+            uint64_t page = chunkStart + i * tracker->pageSize;
+            TrackedRange *range = findRange(tracker, page);
+            bool isDirty = !range || sinceEpoch == 0;
+            if (!isDirty) {
+                uint32_t stamp = __atomic_load_n(&range->stamps[(page - range->start) / tracker->pageSize], __ATOMIC_RELAXED);
+                isDirty = stamp >= sinceEpoch;
+                if (tracker->method == SelfdeDirtyPageSoftDirty) {
+                    isDirty = isDirty || !hasEntries || (entries[i] & SOFT_DIRTY_BIT);
+                }
+            }
+            if (isDirty) {
+                bitmap[(chunk + i) / 8] |= (uint8_t)(1 << ((chunk + i) % 8));
+            }
+        }
+    }
+    pthread_mutex_unlock(&trackerMutex);
+    return 0;
+}
+
+bool selfdeDirtyPagesHandleFault(uint64_t address) {
+    __atomic_add_fetch(&activeHandlers, 1, __ATOMIC_SEQ_CST);
+    DirtyPageTracker *tracker = __atomic_load_n(&currentTracker, __ATOMIC_SEQ_CST);
+    bool isHandled = false;
+    if (tracker && tracker->method == SelfdeDirtyPageWriteProtection) {
+        TrackedRange *range = findRange(tracker, address);
+        if (range && __atomic_load_n(&tracker->isStopped, __ATOMIC_SEQ_CST)) {
+            // The protection was lifted after the thread faulted.
+            isHandled = true;
+        } else if (range) {
+            uint64_t page = address & ~(tracker->pageSize - 1);
+            // The page is unprotected again when the epoch has ended in the meantime, as it might have been
+            // protected for the next epoch before it was made writable here. The write lands in the new epoch.
+            uint32_t sequence;
+            do {
+                while ((sequence = __atomic_load_n(&tracker->sequence, __ATOMIC_SEQ_CST)) & 1) {
+                    sched_yield();
+                }
+                __atomic_store_n(&range->stamps[(page - range->start) / tracker->pageSize], __atomic_load_n(&tracker->epoch, __ATOMIC_SEQ_CST), __ATOMIC_RELAXED);
+                isHandled = mprotect((void *)(uintptr_t)page, (size_t)tracker->pageSize, PROT_READ | PROT_WRITE) == 0;
+            } while (isHandled && __atomic_load_n(&tracker->sequence, __ATOMIC_SEQ_CST) != sequence);
+        }
+    }
+    __atomic_sub_fetch(&activeHandlers, 1, __ATOMIC_SEQ_CST);
+    return isHandled;
+}
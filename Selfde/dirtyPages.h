@@ -0,0 +1,58 @@
+//
+//  dirtyPages.h
+//  Selfde
+//
+
+#ifndef dirtyPages_h
+#define dirtyPages_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum SelfdeDirtyPageMethod {
+    // The soft-dirty bits of /proc/self/pagemap, which are cleared through /proc/self/clear_refs.
+    SelfdeDirtyPageSoftDirty = 0,
+    // The pages are made read-only, and the first write to a page in an epoch is caught by the fault handler.
+    SelfdeDirtyPageWriteProtection
+} SelfdeDirtyPageMethod;
+
+typedef struct SelfdeDirtyPageRange {
+    uint64_t address;
+    uint64_t size;
+} SelfdeDirtyPageRange;
+
+// Starts tracking the writes to the pages of the given ranges, which have to be readable and writable
+// data. The tracking starts with epoch 1. The soft-dirty bits are used when the kernel supports them,
+// and the write protection otherwise when it's allowed. A write-protected page that's written by the
+// kernel, like a read(2) buffer, fails the system call with EFAULT instead of faulting, so the write
+// protection is only suitable for the memory that's only written by the program itself.
+// Returns ENOTSUP when neither of the methods can be used.
+int selfdeDirtyPagesStart(const SelfdeDirtyPageRange *ranges, uint32_t count, bool allowWriteProtection, SelfdeDirtyPageMethod *method);
+
+// Stops the tracking and makes the pages writable again.
+void selfdeDirtyPagesStop(void);
+
+// Ends the current epoch and returns the number of the new one. The writes that race with the
+// switch might be counted in the previous epoch, so the threads should be stopped for exact results.
+int selfdeDirtyPagesAdvanceEpoch(uint32_t *epoch);
+
+// Sets the bits of the pages between the page aligned address and size that were written since the
+// given epoch began, page i is bit i % 8 of byte i / 8. The pages that aren't tracked are dirty, as
+// are all of the pages since epoch 0. Returns EINVAL for an epoch that hasn't begun yet.
+int selfdeDirtyPagesGet(uint64_t address, uint64_t size, uint32_t sinceEpoch, uint8_t *bitmap);
+
+// Returns true when the write fault at the given address is the first write to a write-protected
+// page in the current epoch, and the page has been made writable. Can be called from a signal handler
+// or an exception handler.
+bool selfdeDirtyPagesHandleFault(uint64_t address);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* dirtyPages_h */
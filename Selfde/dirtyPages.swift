@@ -0,0 +1,79 @@
+//
+//  dirtyPages.swift
+//  Selfde
+//
+
+#if os(Linux)
+import Glibc
+import SelfdeLinuxImpl
+#else
+import Darwin
+#endif
+
+public enum DirtyPageTrackingMethod {
+    /// The kernel's soft-dirty bits, the writes aren't interrupted.
+    case softDirty
+    /// The tracked pages are write-protected, and the first write to a page in an epoch faults.
+    case writeProtection
+}
+
+/// The pages of a range that were written since an epoch began.
+public struct DirtyPageMap {
+    /// The first page of the range.
+    public let address: Address
+    public let pageSize: Int
+    public let pageCount: Int
+    /// Page i is bit i % 8 of byte i / 8.
+    public let bytes: [UInt8]
+
+    public init(address: Address, pageSize: Int, pageCount: Int, bytes: [UInt8]) {
+        self.address = address
+        self.pageSize = pageSize
+        self.pageCount = pageCount
+        self.bytes = bytes
+    }
+
+    public func isDirty(_ index: Int) -> Bool {
+        return bytes[index / 8] & (UInt8(1) << UInt8(index % 8)) != 0
+    }
+
+    public var dirtyPages: [Address] {
+        return (0..<pageCount).filter(isDirty).map { Address(bitPattern: address.bitPattern + UInt($0 * pageSize)) }
+    }
+}
+
+/// Starts tracking the writes to the given readable and writable ranges. The write protection is used
+/// only when the kernel has no soft-dirty bits and it's allowed.
+func startTrackingDirtyPages(_ ranges: [AddressRange], allowWriteProtection: Bool) throws -> DirtyPageTrackingMethod {
+    let trackedRanges = ranges.map { SelfdeDirtyPageRange(address: $0.start.bitPattern64, size: $0.end.bitPattern64 &- $0.start.bitPattern64) }
+    var method = SelfdeDirtyPageSoftDirty
+    try handleDirtyPageError(selfdeDirtyPagesStart(trackedRanges, UInt32(trackedRanges.count), allowWriteProtection, &method))
+    return method == SelfdeDirtyPageSoftDirty ? .softDirty : .writeProtection
+}
+
+func advanceTrackedDirtyPageEpoch() throws -> Int {
+    var epoch: UInt32 = 0
+    try handleDirtyPageError(selfdeDirtyPagesAdvanceEpoch(&epoch))
+    return Int(epoch)
+}
+
+func readDirtyPageMap(_ range: AddressRange, since epoch: Int) throws -> DirtyPageMap {
+    guard let sinceEpoch = UInt32(exactly: epoch), range.end.bitPattern > range.start.bitPattern else {
+        throw ControllerError.systemError(code: Int(EINVAL), message: String(cString: strerror(EINVAL)))
+    }
+    let pageSize = Int(getpagesize())
+    let start = range.start.bitPattern & ~UInt(pageSize - 1)
+    let pageCount = Int((range.end.bitPattern - start + UInt(pageSize - 1)) / UInt(pageSize))
+    var bytes = [UInt8](repeating: 0, count: (pageCount + 7) / 8)
+    try handleDirtyPageError(selfdeDirtyPagesGet(UInt64(start), UInt64(range.end.bitPattern - start), sinceEpoch, &bytes))
+    return DirtyPageMap(address: Address(bitPattern: start), pageSize: pageSize, pageCount: pageCount, bytes: bytes)
+}
+
+private func handleDirtyPageError(_ error: Int32) throws {
+    if error == ENOTSUP {
+        throw DebuggerError.unsupported
+    }
+    guard error == 0 else {
+        throw ControllerError.systemError(code: Int(error), message: String(cString: strerror(error)))
+    }
+}
@@ -0,0 +1,115 @@
+//
+//  displacedStepX86_64.swift
+//  Selfde
+//
+// Displaced stepping executes a copy of the instruction that's covered by a breakpoint
+// from a scratch buffer, which allows the thread to move past the breakpoint without
+// removing it from memory.
+
+#if arch(x86_64) || arch(i386)
+
+private func appendLittleEndian(_ value: UInt64, size: Int, to code: inout [UInt8]) {
+    for i in 0..<size {
+        code.append(UInt8(truncatingBitPattern: value >> UInt64(i * 8)))
+    }
+}
+
+// jmp [rip + 0]; .quad target
+private func appendAbsoluteJump(to target: UInt64, code: inout [UInt8]) {
+    code.append(contentsOf: [0xFF, 0x25, 0x00, 0x00, 0x00, 0x00])
+    appendLittleEndian(target, size: 8, to: &code)
+}
+
+private let absoluteJumpSize = 14
+
+private func readSignExtended(_ bytes: [UInt8], offset: Int, size: Int) -> Int64 {
+    var value: UInt64 = 0
+    for i in 0..<size {
+        value |= UInt64(bytes[offset + i]) << UInt64(i * 8)
+    }
+    let shift = UInt64(64 - size * 8)
+    return Int64(bitPattern: value << shift) >> Int64(shift)
+}
+
+// Copies the instruction that will be placed at the given address, adjusting the RIP-relative
+// displacement so that it still refers to the same memory.
+private func copyInstruction(_ bytes: [UInt8], _ instruction: InstructionX86_64, from address: UInt64, to newAddress: UInt64, code: inout [UInt8]) -> Bool {
+    let copy = bytes.prefix(instruction.length)
+    guard let offset = instruction.ripRelativeDisplacementOffset else {
+        code.append(contentsOf: copy)
+        return true
+    }
+    let displacement = readSignExtended(bytes, offset: offset, size: 4)
+    let adjusted = displacement &+ Int64(bitPattern: address &- newAddress)
+    guard adjusted >= Int64(Int32.min) && adjusted <= Int64(Int32.max) else {
+        return false
+    }
+    code.append(contentsOf: copy.prefix(offset))
+    appendLittleEndian(UInt64(bitPattern: adjusted), size: 4, to: &code)
+    code.append(contentsOf: copy.suffix(from: offset + 4))
+    return true
+}
+
+/// Returns the code that has the same effect as the given instruction at `address` when it's executed
+/// at `scratchAddress`, followed by a jump back to the next original instruction.
+/// Returns nil when the instruction can't be relocated to the given scratch address.
+func relocateInstructionX86_64(_ bytes: [UInt8], _ instruction: InstructionX86_64, from address: Address, to scratchAddress: Address) -> [UInt8]? {
+    guard instruction.isRelocatable else {
+        return nil
+    }
+    let source = address.bitPattern64
+    let scratch = scratchAddress.bitPattern64
+    let nextInstruction = source &+ UInt64(instruction.length)
+    var code: [UInt8] = []
+    if let kind = instruction.branchKind {
+        let displacement = readSignExtended(bytes, offset: instruction.branchDisplacementOffset, size: instruction.branchDisplacementSize)
+        let target = UInt64(bitPattern: Int64(bitPattern: nextInstruction) &+ displacement)
+        switch kind {
+        case .jump:
+            appendAbsoluteJump(to: target, code: &code)
+        case .call:
+            // push [rip + 6]; jmp [rip + 8]; .quad return address; .quad target
+            code.append(contentsOf: [0xFF, 0x35, 0x06, 0x00, 0x00, 0x00])
+            code.append(contentsOf: [0xFF, 0x25, 0x08, 0x00, 0x00, 0x00])
+            appendLittleEndian(nextInstruction, size: 8, to: &code)
+            appendLittleEndian(target, size: 8, to: &code)
+        case .conditional:
+            // The branch skips the jump to the next instruction and lands on the jump to the target.
+            code.append(contentsOf: bytes.prefix(instruction.branchDisplacementOffset))
+            appendLittleEndian(UInt64(absoluteJumpSize), size: instruction.branchDisplacementSize, to: &code)
+            appendAbsoluteJump(to: nextInstruction, code: &code)
+            appendAbsoluteJump(to: target, code: &code)
+        }
+        return code
+    }
+    if instruction.isIndirectCall {
+        // The return address has to be pushed manually, which changes the stack pointer.
+        guard !instruction.usesStackPointerOperand else {
+            return nil
+        }
+        // push [rip + length]; jmp r/m; .quad return address
+        code.append(contentsOf: [0xFF, 0x35])
+        appendLittleEndian(UInt64(instruction.length), size: 4, to: &code)
+        var jump = Array(bytes.prefix(instruction.length))
+        guard let modRMOffset = instruction.modRMOffset else {
+            return nil
+        }
+        // FF /2 (call) becomes FF /4 (jmp).
+        jump[modRMOffset] = (jump[modRMOffset] & 0xC7) | (4 << 3)
+        guard copyInstruction(jump, instruction, from: source, to: scratch &+ 6, code: &code) else {
+            return nil
+        }
+        appendLittleEndian(nextInstruction, size: 8, to: &code)
+        return code
+    }
+    guard copyInstruction(bytes, instruction, from: source, to: scratch, code: &code) else {
+        return nil
+    }
+    appendAbsoluteJump(to: nextInstruction, code: &code)
+    return code
+}
+
+/// The maximum size of the code that's produced by `relocateInstructionX86_64`.
+let maximumRelocatedInstructionSizeX86_64 = 64
+
+#endif
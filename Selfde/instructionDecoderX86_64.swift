@@ -0,0 +1,354 @@
+//
+//  instructionDecoderX86_64.swift
+//  Selfde
+//
+// A length decoder for x86_64 instructions. It only extracts the information that's
+// needed to move an instruction to a different address.
+
+#if arch(x86_64) || arch(i386)
+
+// The kind of a branch that's relative to the instruction pointer.
+enum RelativeBranchKindX86_64 {
+    case jump
+    case call
+    case conditional
+}
+
+struct InstructionX86_64 {
+    // The length of the instruction in bytes.
+    let length: Int
+    // The offset of the ModRM byte, if the instruction has one.
+    let modRMOffset: Int?
+    // The offset of the 32 bit displacement when the memory operand is RIP-relative.
+    let ripRelativeDisplacementOffset: Int?
+    // Relative branches (jmp, call, jcc, loop, jrcxz).
+    let branchKind: RelativeBranchKindX86_64?
+    let branchDisplacementOffset: Int
+    let branchDisplacementSize: Int
+    // Indirect near call through a register or memory (FF /2).
+    let isIndirectCall: Bool
+    // Near return (C3, C2 iw).
+    let isReturn: Bool
+    // Does the ModRM operand refer to the stack pointer register?
+    let usesStackPointerOperand: Bool
+    // Instructions like the far call (FF /3) can't be executed from a different address.
+    let isRelocatable: Bool
+}
+
+private enum ImmediateKind {
+    case none
+    case byte
+    case word
+    case dword
+    case wordOrDword            // iz
+    case wordDwordOrQword       // iv, only used by 'mov r, imm'.
+    case memoryOffset           // moffs
+    case enter                  // iw, ib
+    case group3                 // F6 /0 and /1 have an immediate.
+}
+
+private func oneByteOpcodeIsInvalid(_ opcode: UInt8) -> Bool {
+    switch opcode {
+    case 0x06, 0x07, 0x0E, 0x16, 0x17, 0x1E, 0x1F, 0x27, 0x2F, 0x37, 0x3F, 0x60, 0x61, 0x82, 0x9A, 0xCE, 0xD4, 0xD5, 0xD6, 0xEA:
+        return true
+    default:
+        return false
+    }
+}
+
+private func oneByteOpcodeHasModRM(_ opcode: UInt8) -> Bool {
+    switch opcode {
+    case 0x00...0x03, 0x08...0x0B, 0x10...0x13, 0x18...0x1B, 0x20...0x23, 0x28...0x2B, 0x30...0x33, 0x38...0x3B,
+         0x63, 0x69, 0x6B, 0x80...0x8F, 0xC0, 0xC1, 0xC6, 0xC7, 0xD0...0xD3, 0xD8...0xDF, 0xF6, 0xF7, 0xFE, 0xFF:
+        return true
+    default:
+        return false
+    }
+}
+
+private func oneByteOpcodeImmediate(_ opcode: UInt8) -> ImmediateKind {
+    switch opcode {
+    case 0x04, 0x0C, 0x14, 0x1C, 0x24, 0x2C, 0x34, 0x3C, 0x6A, 0x6B, 0x70...0x7F, 0x80, 0x83, 0xA8, 0xB0...0xB7,
+         0xC0, 0xC1, 0xC6, 0xCD, 0xE0...0xE7, 0xEB:
+        return .byte
+    case 0x05, 0x0D, 0x15, 0x1D, 0x25, 0x2D, 0x35, 0x3D, 0x68, 0x69, 0x81, 0xA9, 0xC7:
+        return .wordOrDword
+    case 0xE8, 0xE9:
+        // The operand size prefix is ignored by near branches in 64 bit mode.
+        return .dword
+    case 0xB8...0xBF:
+        return .wordDwordOrQword
+    case 0xA0...0xA3:
+        return .memoryOffset
+    case 0xC2, 0xCA:
+        return .word
+    case 0xC8:
+        return .enter
+    case 0xF6, 0xF7:
+        return .group3
+    default:
+        return .none
+    }
+}
+
+private func twoByteOpcodeIsInvalid(_ opcode: UInt8) -> Bool {
+    switch opcode {
+    case 0x04, 0x0A, 0x0C, 0x24...0x27, 0x36, 0x39, 0x3B...0x3F, 0x7A, 0x7B, 0xA6, 0xA7:
+        return true
+    default:
+        return false
+    }
+}
+
+private func twoByteOpcodeHasModRM(_ opcode: UInt8) -> Bool {
+    switch opcode {
+    case 0x05...0x09, 0x0B, 0x0E, 0x30...0x35, 0x37, 0x77, 0x80...0x8F, 0xA0...0xA2, 0xA8...0xAA, 0xC8...0xCF:
+        return false
+    default:
+        return true
+    }
+}
+
+private func twoByteOpcodeImmediate(_ opcode: UInt8) -> ImmediateKind {
+    switch opcode {
+    case 0x0F, 0x70...0x73, 0xA4, 0xAC, 0xBA, 0xC2, 0xC4...0xC6:
+        return .byte
+    case 0x80...0x8F:
+        return .dword
+    default:
+        return .none
+    }
+}
+
+// Immediates for the opcode maps that are used by VEX, EVEX and XOP encoded instructions.
+private func extendedOpcodeImmediate(map: UInt8, opcode: UInt8) -> ImmediateKind {
+    switch map {
+    case 1:
+        switch opcode {
+        case 0x70...0x73, 0xC2, 0xC4...0xC6:
+            return .byte
+        default:
+            return .none
+        }
+    case 3, 8:
+        return .byte
+    case 0xA:
+        return .dword
+    default:
+        return .none
+    }
+}
+
+private let maximumInstructionLengthX86_64 = 15
+
+/// Decodes the instruction at the start of the given bytes.
+/// Returns nil when the bytes don't contain a complete valid instruction.
+func decodeInstructionX86_64(_ bytes: [UInt8]) -> InstructionX86_64? {
+    var i = 0
+    func next() -> UInt8? {
+        guard i < bytes.count && i < maximumInstructionLengthX86_64 else {
+            return nil
+        }
+        let result = bytes[i]
+        i += 1
+        return result
+    }
+
+    // Prefixes.
+    var hasOperandSizePrefix = false
+    var hasAddressSizePrefix = false
+    var rex: UInt8 = 0
+    var opcode: UInt8
+    prefixLoop: while true {
+        guard let byte = next() else {
+            return nil
+        }
+        switch byte {
+        case 0x66:
+            hasOperandSizePrefix = true
+            rex = 0
+        case 0x67:
+            hasAddressSizePrefix = true
+            rex = 0
+        case 0xF0, 0xF2, 0xF3, 0x2E, 0x36, 0x3E, 0x26, 0x64, 0x65:
+            rex = 0
+        case 0x40...0x4F:
+            // REX is only meaningful when it's the last prefix.
+            rex = byte
+        default:
+            opcode = byte
+            break prefixLoop
+        }
+    }
+    let rexW = (rex & 0x08) != 0
+
+    // Opcode.
+    var map: UInt8 = 0 // 0: one byte, 1: 0F, 2: 0F 38, 3: 0F 3A, 8-A: XOP.
+    var hasModRM: Bool
+    var immediate: ImmediateKind
+    var isExtendedEncoding = false
+    switch opcode {
+    case 0xC4, 0xC5, 0x62:
+        guard rex == 0 else {
+            return nil
+        }
+        if opcode == 0xC5 {
+            guard next() != nil else { return nil }
+            map = 1
+        } else if opcode == 0xC4 {
+            guard let b1 = next(), next() != nil else { return nil }
+            map = b1 & 0x1F
+        } else {
+            guard let p0 = next(), next() != nil, next() != nil else { return nil }
+            map = p0 & 0x03
+        }
+        guard map >= 1 && map <= 3, let op = next() else {
+            return nil
+        }
+        opcode = op
+        isExtendedEncoding = true
+    case 0x8F:
+        // POP r/m when ModRM.reg is 0, XOP otherwise.
+        guard i < bytes.count else { return nil }
+        if (bytes[i] & 0x38) != 0 {
+            guard let b1 = next(), next() != nil, let op = next() else { return nil }
+            map = b1 & 0x1F
+            guard map >= 8 && map <= 0xA else {
+                return nil
+            }
+            opcode = op
+            isExtendedEncoding = true
+        }
+    case 0x0F:
+        guard let op = next() else { return nil }
+        map = 1
+        opcode = op
+        if op == 0x38 || op == 0x3A {
+            guard let op3 = next() else { return nil }
+            map = op == 0x38 ? 2 : 3
+            opcode = op3
+        }
+    default:
+        break
+    }
+
+    if isExtendedEncoding {
+        hasModRM = !(map == 1 && opcode == 0x77) // vzeroupper/vzeroall
+        immediate = extendedOpcodeImmediate(map: map, opcode: opcode)
+    } else {
+        switch map {
+        case 0:
+            guard !oneByteOpcodeIsInvalid(opcode) else { return nil }
+            hasModRM = oneByteOpcodeHasModRM(opcode)
+            immediate = oneByteOpcodeImmediate(opcode)
+        case 1:
+            guard !twoByteOpcodeIsInvalid(opcode) else { return nil }
+            hasModRM = twoByteOpcodeHasModRM(opcode)
+            immediate = twoByteOpcodeImmediate(opcode)
+        case 2:
+            hasModRM = true
+            immediate = .none
+        default:
+            hasModRM = true
+            immediate = .byte
+        }
+    }
+
+    // ModRM, SIB and displacement.
+    var modRMOffset: Int?
+    var modRMReg: UInt8 = 0
+    var ripRelativeDisplacementOffset: Int?
+    var usesStackPointerOperand = false
+    if hasModRM {
+        modRMOffset = i
+        guard let modRM = next() else { return nil }
+        let mod = modRM >> 6
+        let rm = modRM & 7
+        modRMReg = (modRM >> 3) & 7
+        var displacementSize = 0
+        if mod == 3 {
+            usesStackPointerOperand = rm == 4 && (rex & 0x01) == 0
+        } else {
+            if rm == 4 {
+                guard let sib = next() else { return nil }
+                let base = sib & 7
+                usesStackPointerOperand = base == 4 && (rex & 0x01) == 0
+                if mod == 0 && base == 5 {
+                    displacementSize = 4
+                }
+            } else if mod == 0 && rm == 5 {
+                ripRelativeDisplacementOffset = i
+                displacementSize = 4
+            }
+            if mod == 1 {
+                displacementSize = 1
+            } else if mod == 2 {
+                displacementSize = 4
+            }
+        }
+        i += displacementSize
+    }
+
+    // Immediate.
+    let immediateSize: Int
+    switch immediate {
+    case .none:
+        immediateSize = 0
+    case .byte:
+        immediateSize = 1
+    case .word:
+        immediateSize = 2
+    case .dword:
+        immediateSize = 4
+    case .wordOrDword:
+        immediateSize = hasOperandSizePrefix ? 2 : 4
+    case .wordDwordOrQword:
+        immediateSize = rexW ? 8 : (hasOperandSizePrefix ? 2 : 4)
+    case .memoryOffset:
+        immediateSize = hasAddressSizePrefix ? 4 : 8
+    case .enter:
+        immediateSize = 3
+    case .group3:
+        if modRMReg <= 1 {
+            immediateSize = opcode == 0xF6 ? 1 : (hasOperandSizePrefix ? 2 : 4)
+        } else {
+            immediateSize = 0
+        }
+    }
+    let immediateOffset = i
+    i += immediateSize
+    guard i <= bytes.count && i <= maximumInstructionLengthX86_64 else {
+        return nil
+    }
+
+    // Relative branches.
+    var branchKind: RelativeBranchKindX86_64?
+    var isIndirectCall = false
+    var isReturn = false
+    var isRelocatable = true
+    if !isExtendedEncoding {
+        switch (map, opcode) {
+        case (0, 0x70...0x7F), (0, 0xE0...0xE3), (1, 0x80...0x8F):
+            branchKind = .conditional
+        case (0, 0xEB), (0, 0xE9):
+            branchKind = .jump
+        case (0, 0xE8):
+            branchKind = .call
+        case (0, 0xC2), (0, 0xC3):
+            isReturn = true
+        case (0, 0xFF):
+            if modRMReg == 2 {
+                isIndirectCall = true
+            } else if modRMReg == 3 {
+                // Far calls push the code segment as well.
+                isRelocatable = false
+            }
+        default:
+            break
+        }
+    }
+
+    return InstructionX86_64(length: i, modRMOffset: modRMOffset, ripRelativeDisplacementOffset: ripRelativeDisplacementOffset, branchKind: branchKind, branchDisplacementOffset: branchKind != nil ? immediateOffset : 0, branchDisplacementSize: branchKind != nil ? immediateSize : 0, isIndirectCall: isIndirectCall, isReturn: isReturn, usesStackPointerOperand: usesStackPointerOperand, isRelocatable: isRelocatable)
+}
+
+#endif
@@ -0,0 +1,736 @@
+//
+//  linuxDebugger.swift
+//  Selfde
+//
+
+#if os(Linux) && arch(x86_64)
+
+import Glibc
+import SelfdeLinuxImpl
+
+// SIGTRAP codes.
+private let breakpointTrapCode: Int32 = 0x80 // SI_KERNEL, INT 3.
+private let traceTrapCode: Int32 = 2 // TRAP_TRACE, single step.
+
+/// The way the Linux debugger stops the threads.
+public enum LinuxDebuggerMode {
+    /// A thread that traps is parked inside the SIGTRAP/SIGSEGV/SIGBUS/SIGILL handler, and its
+    /// registers are accessed in the ucontext_t of that handler. The other threads are stopped
+    /// by sending them a real-time signal with tgkill, and their handler parks them in the same way.
+    case signalHandlers
+    /// A forked helper process seizes the threads with ptrace and stops them with PTRACE_INTERRUPT.
+    /// The signal handlers of the process are left alone, and the debug registers are available.
+    /// Requires a kernel that allows the process to be traced by its child.
+    case tracer
+}
+
+/// Implements the debugger for the current process on Linux.
+/// The debugger has to be used on the thread that has created it, as that thread is never stopped.
+public final class LinuxDebugger: Debugger {
+    private let backend: LinuxDebuggerBackend
+    private struct BreakpointState {
+        let machineState: MachineBreakpointState
+        var counter: Int
+    }
+    private var breakpoints: [Address: BreakpointState] = [:]
+    // The copies of the instructions under the breakpoints that the released threads step through.
+    // They're never freed, as a released thread might still be running the copy.
+    private var displacedInstructions: [Address: Address] = [:]
+    private let memoryArena: MemoryArena
+    private var steppingRanges: [ThreadID: AddressRange] = [:]
+    private var stoppedThreadID: ThreadID?
+    // The stops that were caught during a function call, reported by the next 'waitForStop'.
+    private var pendingStops: [SelfdeLinuxStopEvent] = []
+    private var nonStopMode = false
+    private var passSignals: [Int32] = []
+    private var programSignals: [Int32]?
+    // The called functions return to the trap.
+    private var functionCallTrap: Address?
+    // The memory that's returned by 'readMemory' is valid until the next read.
+    private var readBuffer: UnsafeMutablePointer<UInt8>?
+    private var readBufferCapacity = 0
+    private let unwinder = Unwinder()
+    private var samplingInterval: UInt64 = 0
+    // The write faults of the tracked pages are only handled by the signal handlers.
+    private let allowsDirtyPageWriteProtection: Bool
+
+    public init(mode: LinuxDebuggerMode = .signalHandlers) throws {
+        allowsDirtyPageWriteProtection = mode == .signalHandlers
+        switch mode {
+        case .signalHandlers:
+            backend = try LinuxSignalBackend()
+        case .tracer:
+            backend = try LinuxTracerBackend()
+        }
+        memoryArena = MemoryArena(pageSize: Int(getpagesize()), allocatePages: { size, permissions in
+            guard let pointer = mmap(nil, size, getProtection(permissions), MAP_PRIVATE | MAP_ANONYMOUS, -1, 0),
+                pointer != UnsafeMutableRawPointer(bitPattern: -1) else {
+                try handleSystemError(errno)
+                throw ControllerError.invalidAllocation
+            }
+            return Address(bitPattern: UInt(bitPattern: pointer))
+        }, deallocatePages: { address, size in
+            guard munmap(UnsafeMutableRawPointer(bitPattern: address.bitPattern), size) == 0 else {
+                try handleSystemError(errno)
+                return
+            }
+        }, protectPages: { address, size, permissions in
+            guard mprotect(UnsafeMutableRawPointer(bitPattern: address.bitPattern), size, getProtection(permissions)) == 0 else {
+                try handleSystemError(errno)
+                return
+            }
+        })
+    }
+
+    deinit {
+        selfdeLinuxStopProfiling()
+        detach()
+        readBuffer?.deallocate(capacity: readBufferCapacity)
+    }
+
+    /// Threads that serve the debugger, like the one that reads the remote debugging packets, can't be stopped.
+    public func ignoreCurrentThread() {
+        backend.ignoreCurrentThread()
+    }
+
+    private func getThread(_ threadID: ThreadID) -> LinuxThreadX86_64 {
+        return LinuxThreadX86_64(backend: backend, thread: pid_t(truncatingBitPattern: threadID))
+    }
+
+    private var preferredThreadID: ThreadID? {
+        let threads = self.threads
+        let mainThreadID = ThreadID(getpid())
+        return threads.contains(mainThreadID) ? mainThreadID : threads.first
+    }
+
+    private func stopAllThreads() throws {
+        for threadID in threads {
+            let error = backend.stopThread(pid_t(truncatingBitPattern: threadID))
+            // The thread might have exited in the meantime.
+            if error != 0 && error != ESRCH {
+                try handleSystemError(error)
+            }
+        }
+    }
+
+    /// Applies the resume actions to the stopped threads and lets them run.
+    public func resume(actions: [ThreadResumeEntry], defaultAction: ThreadResumeAction) throws {
+        let stoppedThreads = threads.filter { backend.isThreadStopped(pid_t(truncatingBitPattern: $0)) }
+        let resumeActions = extractResumeActionsForThreads(stoppedThreads, primaryThread: primaryThreadID, entries: actions, defaultAction: defaultAction)
+        // Don't resume anything when one of the actions can't be done.
+        guard !resumeActions.contains(where: { $0.1 == .stepOut }) else {
+            throw DebuggerError.unsupported
+        }
+        // The threads whose stops haven't been reported yet stay stopped.
+        let pendingThreadIDs = pendingStops.map { ThreadID($0.thread) }
+        for (threadID, action, address, range) in resumeActions where !pendingThreadIDs.contains(threadID) {
+            let thread = getThread(threadID)
+            if let address = address {
+                try thread.setInstructionPointer(address)
+            }
+            switch action {
+            case .none, .stop, .stepOut:
+                continue
+            case .continue:
+                break
+            case .step:
+                try thread.setHardwareSingleStep(true)
+            case .rangeStep:
+                steppingRanges[threadID] = range
+                try thread.setHardwareSingleStep(true)
+            }
+            try handleSystemError(backend.resumeThread(thread.thread))
+        }
+    }
+
+    /// Blocks until a thread stops and returns it. Unless the non-stop mode is enabled,
+    /// the rest of the threads are stopped as well.
+    public func waitForStop() throws -> ThreadID {
+        while true {
+            var event = SelfdeLinuxStopEvent()
+            if !pendingStops.isEmpty {
+                event = pendingStops.removeFirst()
+            } else {
+                guard backend.waitForStop(&event) else {
+                    throw ControllerError.invalidRunState
+                }
+                if try handleStop(event) {
+                    continue
+                }
+            }
+            if !nonStopMode {
+                try stopAllThreads()
+            }
+            let threadID = ThreadID(event.thread)
+            stoppedThreadID = threadID
+            return threadID
+        }
+    }
+
+    // Returns true when the stop was consumed and the thread was resumed.
+    private func handleStop(_ event: SelfdeLinuxStopEvent) throws -> Bool {
+        let threadID = ThreadID(event.thread)
+        let thread = getThread(threadID)
+        guard event.signalNumber == SIGTRAP else {
+            steppingRanges[threadID] = nil
+            return false
+        }
+        if event.signalCode == breakpointTrapCode {
+            // INT 3 leaves the instruction pointer after the breakpoint.
+            let address = Address(bitPattern: try thread.getInstructionPointer().bitPattern &- 1)
+            if breakpoints[address] != nil {
+                try thread.setInstructionPointer(address)
+                selfdeCoverageMarkHit(address.bitPattern64)
+            } else if MachineBreakpointState.isTemporaryTrap(at: address) || selfdeCoverageHandleTrap(address.bitPattern64) {
+                // The INT 3 was only there while the code was patched, or it was a coverage site that
+                // the signal handlers don't see in the tracer mode.
+                try thread.setInstructionPointer(address)
+                try handleSystemError(backend.resumeThread(thread.thread))
+                return true
+            }
+            steppingRanges[threadID] = nil
+            return false
+        }
+        guard event.signalCode == traceTrapCode else {
+            return false
+        }
+        try thread.setHardwareSingleStep(false)
+        if let range = steppingRanges[threadID] {
+            if range.contains(try thread.getInstructionPointer()) {
+                try thread.setHardwareSingleStep(true)
+                try handleSystemError(backend.resumeThread(thread.thread))
+                return true
+            }
+            steppingRanges[threadID] = nil
+        }
+        return false
+    }
+
+    // Debugger protocol implementation.
+
+    public var registerContextSize: Int {
+        return LinuxThreadX86_64.registerContextSize
+    }
+
+    public var primaryThreadID: ThreadID {
+        return stoppedThreadID ?? ThreadID(getpid())
+    }
+
+    public var threads: [ThreadID] {
+        var buffer = [pid_t](repeating: 0, count: 64)
+        while true {
+            let count = Int(backend.getThreads(&buffer, capacity: Int32(buffer.count)))
+            guard count > buffer.count else {
+                return buffer.prefix(max(count, 0)).map { ThreadID($0) }
+            }
+            buffer = [pid_t](repeating: 0, count: count)
+        }
+    }
+
+    public func attach(_ processID: Int) throws {
+        // This is an in-process debugger.
+        guard processID == Int(getpid()) else {
+            throw DebuggerError.unsupported
+        }
+        try interruptExecution()
+    }
+
+    public func getSharedLibraryInfoAddress() throws -> Address {
+        return Address(bitPattern64: selfdeLinuxGetRendezvousAddress())
+    }
+
+    public func getLoadedLibraries() throws -> [LoadedLibrary] {
+        var buffer = [SelfdeLinuxLibrary](repeating: SelfdeLinuxLibrary(), count: 256)
+        while true {
+            let count = Int(selfdeLinuxGetLoadedLibraries(&buffer, Int32(buffer.count)))
+            guard count >= 0 else {
+                // The dynamic linker is loading or unloading an object.
+                throw ControllerError.invalidRunState
+            }
+            if count <= buffer.count {
+                return buffer.prefix(count).map {
+                    LoadedLibrary(path: String(cString: $0.path), loadAddress: Address(bitPattern64: $0.loadAddress), linkMapAddress: Address(bitPattern64: $0.linkMapAddress), dynamicSectionAddress: Address(bitPattern64: $0.dynamicSectionAddress))
+                }
+            }
+            buffer = [SelfdeLinuxLibrary](repeating: SelfdeLinuxLibrary(), count: count)
+        }
+    }
+
+    public func getSymbols(in library: LoadedLibrary) throws -> [Symbol] {
+        guard let dynamicSection = library.dynamicSectionAddress else {
+            throw ControllerError.invalidAddress
+        }
+        let collector = SymbolCollector()
+        let error = selfdeLinuxEnumerateSymbols(library.loadAddress.bitPattern64, dynamicSection.bitPattern64, { context, name, address, size in
+            let collector = Unmanaged<SymbolCollector>.fromOpaque(context!).takeUnretainedValue()
+            collector.symbols.append(Symbol(name: String(cString: name!), address: Address(bitPattern64: address), size: size))
+        }, Unmanaged.passUnretained(collector).toOpaque())
+        try handleSystemError(error)
+        return collector.symbols
+    }
+
+    public func getBacktraces(_ threadIDs: [ThreadID], maxFrames: Int) throws -> [[Address]] {
+        // The images that were loaded since the last backtrace are added once for all of the threads.
+        if let libraries = try? getLoadedLibraries() {
+            unwinder.update(libraries: libraries, getSection: getUnwindSection)
+        }
+        return threadIDs.map { threadID -> [Address] in
+            // The threads that are running in non-stop mode can't be unwound.
+            guard let registers = try? getThread(threadID).getUnwindRegisters() else {
+                return []
+            }
+            return unwinder.backtrace(from: registers, maxFrames: maxFrames, readWord: readWord)
+        }
+    }
+
+    public func interruptExecution() throws {
+        try stopAllThreads()
+        stoppedThreadID = preferredThreadID
+    }
+
+    public func detach() {
+        selfdeCoverageStop()
+        selfdeDirtyPagesStop()
+        for (address, breakpoint) in breakpoints {
+            breakpoint.machineState.restoreOriginalInstruction(at: address)
+        }
+        breakpoints.removeAll()
+        steppingRanges.removeAll()
+        pendingStops.removeAll()
+        for threadID in threads {
+            let thread = getThread(threadID)
+            _ = try? thread.setHardwareSingleStep(false)
+            _ = backend.resumeThread(thread.thread)
+        }
+        stoppedThreadID = nil
+    }
+
+    public func getStopInfoForThread(_ threadID: ThreadID) throws -> ThreadStopInfo {
+        var event = SelfdeLinuxStopEvent()
+        guard backend.getLastStop(pid_t(truncatingBitPattern: threadID), event: &event) else {
+            throw ControllerError.invalidRunState
+        }
+        return ThreadStopInfo(signalNumber: UInt8(truncatingBitPattern: event.signalNumber), dispatchQueueAddress: nil, machInfo: nil)
+    }
+
+    public func isThreadAlive(_ threadID: ThreadID) throws -> Bool {
+        return selfdeLinuxIsThreadAlive(pid_t(truncatingBitPattern: threadID))
+    }
+
+    public func setBreakpoint(_ address: Address, byteSize: Int) throws {
+        if var breakpoint = breakpoints[address] {
+            breakpoint.counter += 1
+            breakpoints[address] = breakpoint
+            return
+        }
+        // Make sure we can write to the address.
+        try handleSystemError(selfdeLinuxProtectAll(address.bitPattern64, Int(MachineBreakpointState.numberOfBytesToPatch)))
+        selfdeCoverageReleaseSite(address.bitPattern64)
+        let (machineState, _) = MachineBreakpointState.create(at: address)
+        breakpoints[address] = BreakpointState(machineState: machineState, counter: 1)
+    }
+
+    public func removeBreakpoint(_ address: Address) throws {
+        guard var breakpoint = breakpoints[address] else {
+            throw ControllerError.invalidBreakpoint
+        }
+        breakpoint.counter -= 1
+        guard breakpoint.counter < 1 else {
+            breakpoints[address] = breakpoint
+            return
+        }
+        breakpoint.machineState.restoreOriginalInstruction(at: address)
+        breakpoints[address] = nil
+    }
+
+    /// Replaces the code at the given address while the other threads keep running.
+    /// The code is only replaced when it still contains the expected bytes.
+    public func patchCode(at address: Address, expected: [UInt8]?, replacement: [UInt8]) throws {
+        try handleSystemError(selfdeLinuxProtectAll(address.bitPattern64, replacement.count))
+        try MachineBreakpointState.patchCode(at: address, expected: expected, replacement: replacement)
+        let patchedRange = AddressRange(start: Address(bitPattern: address.bitPattern &- UInt(MachineBreakpointState.maximumInstructionLength)), end: Address(bitPattern: address.bitPattern &+ UInt(replacement.count)))
+        for instruction in displacedInstructions.keys where patchedRange.contains(instruction) {
+            displacedInstructions[instruction] = nil
+        }
+    }
+
+    public func getIPRegisterValueForThread(_ threadID: ThreadID) throws -> Address {
+        return try getThread(threadID).getInstructionPointer()
+    }
+
+    public func getRegisterValueForThread(_ threadID: ThreadID, registerID: UInt32, registerSetID: UInt32, dest: inout [UInt8]) throws -> ArraySlice<UInt8> {
+        return try getThread(threadID).getRegisterValue(registerID, setID: registerSetID, dest: &dest)
+    }
+
+    public func setRegisterValueForThread(_ threadID: ThreadID, registerID: UInt32, registerSetID: UInt32, source: ArraySlice<UInt8>) throws {
+        try getThread(threadID).setRegisterValue(registerID, setID: registerSetID, source: source)
+    }
+
+    public func getRegisterContextForThread(_ threadID: ThreadID, dest: inout [UInt8]) throws -> ArraySlice<UInt8> {
+        return try getThread(threadID).getRegisterContext(&dest)
+    }
+
+    public func setRegisterContextForThread(_ threadID: ThreadID, source: ArraySlice<UInt8>) throws {
+        try getThread(threadID).setRegisterContext(source)
+    }
+
+    /// Allocates memory from the pooled pages with the same permissions. The freed memory is
+    /// reused, so the repeated allocations of small blocks don't reach the kernel.
+    public func allocate(_ size: Int, permissions: MemoryPermissions) throws -> Address {
+        return try memoryArena.allocate(size, permissions: permissions)
+    }
+
+    /// Returns read-only executable memory with the given code. The memory of an identical blob
+    /// is reused, and it has to be deallocated once for each returned address.
+    public func allocateCode(_ bytes: [UInt8]) throws -> Address {
+        return try memoryArena.allocateCode(bytes)
+    }
+
+    public func deallocate(_ address: Address) throws {
+        try memoryArena.deallocate(address)
+    }
+
+    public func readMemory(_ address: Address, size: Int) throws -> MemoryReadResult {
+        if readBufferCapacity < size {
+            readBuffer?.deallocate(capacity: readBufferCapacity)
+            readBuffer = UnsafeMutablePointer<UInt8>.allocate(capacity: size)
+            readBufferCapacity = size
+        }
+        guard let buffer = readBuffer else {
+            return .bytes(UnsafeBufferPointer(start: nil, count: 0))
+        }
+        try handleSystemError(selfdeLinuxReadMemory(address.bitPattern64, buffer, size))
+        return .bytes(UnsafeBufferPointer(start: buffer, count: size))
+    }
+
+    public func writeMemory(_ address: Address, bytes: [UInt8]) throws {
+        try handleSystemError(backend.writeMemory(address.bitPattern64, bytes: bytes, size: bytes.count))
+    }
+
+    public func setNonStopMode(_ enabled: Bool) throws {
+        nonStopMode = enabled
+    }
+
+    /// The signals are filtered in the signal handlers or in the tracer helper, so a passed
+    /// signal never wakes up the debugger. Only SIGSEGV, SIGBUS and SIGILL can be filtered.
+    public func setPassSignals(_ signals: [Int32]) throws {
+        passSignals = signals
+        backend.setSignalFilter(passSignals: passSignals, programSignals: programSignals)
+    }
+
+    public func setProgramSignals(_ signals: [Int32]) throws {
+        programSignals = signals
+        backend.setSignalFilter(passSignals: passSignals, programSignals: programSignals)
+    }
+
+    /// Runs the function on a stopped thread until it returns to a trap, after which the thread's registers
+    /// are restored. Only the given thread is resumed. The stops of the other threads that are caught before
+    /// the function returns stay stopped, and they're reported by the next `waitForStop`. When the given thread
+    /// stops somewhere else, the call fails with `callInterrupted` and the thread is left in the function,
+    /// with its stop reported by the next `waitForStop`.
+    public func callFunction(_ address: Address, threadID: ThreadID, integerArguments: [UInt64], vectorArguments: [[UInt8]]) throws -> FunctionCallResult {
+        let thread = getThread(threadID)
+        guard backend.isThreadStopped(thread.thread) else {
+            throw ControllerError.invalidRunState
+        }
+        let trap = try getFunctionCallTrap()
+        var context = [UInt8](repeating: 0, count: registerContextSize)
+        let savedContext = try thread.getRegisterContext(&context)
+        var isReturning = true
+        defer {
+            if isReturning {
+                _ = try? thread.setRegisterContext(savedContext)
+            }
+        }
+        try thread.setUpFunctionCall(address, returnAddress: trap, integerArguments: integerArguments, vectorArguments: vectorArguments)
+        try handleSystemError(backend.resumeThread(thread.thread))
+        while true {
+            var event = SelfdeLinuxStopEvent()
+            guard backend.waitForStop(&event) else {
+                throw ControllerError.invalidRunState
+            }
+            if try handleStop(event) {
+                continue
+            }
+            guard event.thread == thread.thread else {
+                pendingStops.append(event)
+                continue
+            }
+            let returnAddress = Address(bitPattern: trap.bitPattern + UInt(MachineBreakpointState.functionCallTrap.count))
+            guard event.signalNumber == SIGTRAP && event.signalCode == breakpointTrapCode, try thread.getInstructionPointer() == returnAddress else {
+                // The function might hold locks, so it isn't unwound.
+                isReturning = false
+                pendingStops.append(event)
+                throw ControllerError.callInterrupted
+            }
+            return try thread.getFunctionCallResult()
+        }
+    }
+
+    private func getFunctionCallTrap() throws -> Address {
+        if let trap = functionCallTrap {
+            return trap
+        }
+        let trap = try allocate(Int(getpagesize()), permissions: [.read, .write, .execute])
+        MachineBreakpointState.functionCallTrap.withUnsafeBufferPointer { bytes in
+            _ = memcpy(UnsafeMutableRawPointer(bitPattern: trap.bitPattern), bytes.baseAddress, bytes.count)
+        }
+        functionCallTrap = trap
+        return trap
+    }
+
+    /// Samples the threads that are running by sending them a signal, whose handler walks their frame pointers.
+    /// The profiler's thread is ignored by the debugger.
+    public func startProfiling(frequency: Int, maxFrames: Int) throws {
+        let options = try ProfilerOptions(frequency: frequency, maxFrames: maxFrames)
+        let error = selfdeLinuxStartProfiling(options.frequency, options.maxFrames, options.stackCapacity, options.frameCapacity, { context in
+            Unmanaged<LinuxDebugger>.fromOpaque(context!).takeUnretainedValue().ignoreCurrentThread()
+        }, Unmanaged.passUnretained(self).toOpaque())
+        try handleSystemError(error)
+        samplingInterval = options.samplingInterval
+    }
+
+    public func stopProfiling() throws {
+        selfdeLinuxStopProfiling()
+    }
+
+    public func getProfile() throws -> StackProfile {
+        return StackProfile(samplingInterval: samplingInterval) { selfdeLinuxEnumerateProfile($0, $1) }
+    }
+
+    /// Installs the coverage sites while the threads keep running. A site's first hit is handled by the
+    /// SIGTRAP handler, or by `waitForStop` in the tracer mode. The addresses that have breakpoints are
+    /// covered by the hits of the breakpoints.
+    public func startCoverage(_ addresses: [Address]) throws -> Int {
+        return try installCoverageSites(addresses, breakpoints: Array(breakpoints.keys)) { _, address, size in
+            return selfdeLinuxProtectAll(address, Int(size))
+        }
+    }
+
+    public func stopCoverage() throws {
+        selfdeCoverageStop()
+    }
+
+    public func getCoverage() throws -> CoverageMap {
+        return readCoverageMap()
+    }
+
+    /// Uses the soft-dirty bits when the kernel has them. Otherwise the pages are write-protected and their
+    /// first writes in an epoch are handled by the SIGSEGV handler, which isn't there in the tracer mode.
+    public func startDirtyPageTracking(_ ranges: [AddressRange]) throws -> DirtyPageTrackingMethod {
+        return try startTrackingDirtyPages(ranges, allowWriteProtection: allowsDirtyPageWriteProtection)
+    }
+
+    public func stopDirtyPageTracking() throws {
+        selfdeDirtyPagesStop()
+    }
+
+    public func advanceDirtyPageEpoch() throws -> Int {
+        return try advanceTrackedDirtyPageEpoch()
+    }
+
+    public func getDirtyPages(_ range: AddressRange, since epoch: Int) throws -> DirtyPageMap {
+        return try readDirtyPageMap(range, since: epoch)
+    }
+
+    /// Searches the readable mappings in the range with a thread for every processor. The memory is copied
+    /// a chunk at a time with process_vm_readv, so a mapping that goes away during the search is skipped.
+    public func searchMemory(_ range: AddressRange, pattern: [UInt8], mask: [UInt8]?, maxMatches: Int) throws -> [Address] {
+        var regions: UnsafeMutablePointer<SelfdeMemoryRange>?
+        var regionCount: UInt32 = 0
+        try handleSystemError(selfdeLinuxGetReadableRegions(range.start.bitPattern64, range.end.bitPattern64 &- range.start.bitPattern64, &regions, &regionCount))
+        defer {
+            free(regions)
+        }
+        return try searchMemoryRegions(UnsafeBufferPointer(start: regions, count: Int(regionCount)), pattern: pattern, mask: mask, maxMatches: maxMatches, read: readMemoryChunk)
+    }
+
+    /// Computes the CRC-32 of GDB's qCRC packet over the range, with a thread for every processor.
+    public func computeCRC32(_ range: AddressRange) throws -> UInt32 {
+        return try computeMemoryCRC32(range, read: readMemoryChunk)
+    }
+
+    /// Computes the CRC-32C of every block of the range, with a thread for every processor.
+    public func computeMemoryDigests(_ range: AddressRange, blockSize: Int) throws -> [UInt32?] {
+        return try digestMemoryBlocks(range, blockSize: blockSize, read: readMemoryChunk)
+    }
+
+    /// Writes an ELF core of the process. The memory is copied from a fork of the process, so the threads
+    /// that were running are only stopped while their registers are read and the process is forked.
+    public func writeCore(to path: String, options: CoreDumpOptions) throws -> CoreDumpStatistics {
+        let start = currentUptimeNanoseconds()
+        let forked = try forkProcess(readingLibraries: false)
+        let pauseDuration = currentUptimeNanoseconds() - start
+        defer {
+            selfdeLinuxReleaseForkSnapshot(forked.process)
+        }
+        // The thread that has stopped comes first, as the debuggers select the first thread of a core.
+        var snapshotThreads = forked.threads
+        if let threadID = stoppedThreadID ?? preferredThreadID, let index = snapshotThreads.index(where: { ThreadID($0.thread) == threadID }) {
+            snapshotThreads.insert(snapshotThreads.remove(at: index), at: 0)
+        }
+        let coreThreads = snapshotThreads.map { SelfdeLinuxCoreThread(thread: $0.thread, signalNumber: $0.stopEvent.signalNumber, state: $0.state, fpuState: $0.fpuState) }
+        var statistics = try writeCoreFile(at: path) { descriptor, statistics in
+            return selfdeLinuxWriteCore(descriptor, forked.process, coreThreads, UInt32(coreThreads.count), options.copyThreads, options.elideZeroPages, &statistics)
+        }
+        statistics.pauseNanoseconds = pauseDuration
+        return CoreDumpStatistics(statistics, totalDuration: currentUptimeNanoseconds() - start)
+    }
+
+    /// Forks a frozen copy of the process that can be served by a debug server while the process runs on.
+    /// The threads are stopped only while their registers are read and the process is forked, and
+    /// the ones that were running are resumed before this returns.
+    public func createForkSnapshot() throws -> LinuxForkSnapshot {
+        let start = currentUptimeNanoseconds()
+        let sharedLibraryInfoAddress = try getSharedLibraryInfoAddress()
+        let forked = try forkProcess(readingLibraries: true)
+        let threadIDs = forked.threads.map { ThreadID($0.thread) }
+        let primaryThreadID = stoppedThreadID.flatMap { threadIDs.contains($0) ? $0 : nil } ?? preferredThreadID ?? ThreadID(getpid())
+        return LinuxForkSnapshot(debugger: self, process: forked.process, threads: forked.threads, primaryThreadID: primaryThreadID, libraries: forked.libraries, sharedLibraryInfoAddress: sharedLibraryInfoAddress, pauseDuration: currentUptimeNanoseconds() - start)
+    }
+
+    // Stops all of the threads, reads their registers and forks the process. The threads that were
+    // running are resumed before this returns.
+    private func forkProcess(readingLibraries: Bool) throws -> (process: pid_t, threads: [LinuxThreadSnapshot], libraries: [LoadedLibrary]?) {
+        let runningThreads = threads.filter { !backend.isThreadStopped(pid_t(truncatingBitPattern: $0)) }
+        var snapshotThreads = [LinuxThreadSnapshot]()
+        var libraries: [LoadedLibrary]?
+        var process: pid_t = -1
+        do {
+            defer {
+                for threadID in runningThreads {
+                    _ = backend.resumeThread(pid_t(truncatingBitPattern: threadID))
+                }
+            }
+            try stopAllThreads()
+            // Only the forking thread exists in the child, so the registers are read beforehand.
+            for threadID in threads {
+                let thread = pid_t(truncatingBitPattern: threadID)
+                var event = SelfdeLinuxStopEvent()
+                if runningThreads.contains(threadID) || !backend.getLastStop(thread, event: &event) {
+                    event = SelfdeLinuxStopEvent(thread: thread, signalNumber: SIGSTOP, signalCode: 0, faultAddress: 0)
+                }
+                var state = GPRState()
+                var fpuState = FPUState()
+                var avxState = AVXState()
+                var excState = EXCState()
+                try handleSystemError(backend.getThreadState(thread, state: &state, fpuState: &fpuState, avxState: &avxState, excState: &excState))
+                snapshotThreads.append(LinuxThreadSnapshot(thread: thread, stopEvent: event, state: state, fpuState: fpuState, avxState: avxState, excState: excState))
+            }
+            if readingLibraries {
+                libraries = try? getLoadedLibraries()
+            }
+            var error: Int32 = 0
+            process = selfdeLinuxForkSnapshot(&error)
+            try handleSystemError(error)
+        }
+        return (process, snapshotThreads, libraries)
+    }
+
+    /// Copies the registers and the stack window of a stopped thread and resumes it right away, so that
+    /// a debug server can serve the stop while the thread runs on. In all-stop mode the other stopped
+    /// threads are resumed as well.
+    ///
+    /// A thread that has stopped at a breakpoint runs a copy of the original instruction and continues
+    /// after it, so the breakpoint stays in place for the other threads. Throws `unsupported` when the
+    /// instruction can't be moved, and the stop can be reported in the usual way then.
+    public func releaseStop(_ threadID: ThreadID, stackWindowSize: Int) throws -> ThreadStopSnapshot {
+        let thread = getThread(threadID)
+        guard backend.isThreadStopped(thread.thread) else {
+            throw ControllerError.invalidRunState
+        }
+        let instructionPointer = try thread.getInstructionPointer()
+        var displacedInstruction: Address?
+        if breakpoints[instructionPointer] != nil {
+            displacedInstruction = try getDisplacedInstruction(at: instructionPointer)
+        }
+        var context = [UInt8](repeating: 0, count: registerContextSize)
+        let registerContext = Array(try thread.getRegisterContext(&context))
+        let window = ThreadStopSnapshot.readStackWindow(stackPointer: try thread.getStackPointer(), windowSize: stackWindowSize, pageSize: Int(getpagesize())) { address, count in
+            var bytes = [UInt8](repeating: 0, count: count)
+            return selfdeLinuxReadMemory(address.bitPattern64, &bytes, count) == 0 ? bytes : []
+        }
+        let snapshot = ThreadStopSnapshot(threadID: threadID, stopInfo: try getStopInfoForThread(threadID), registerContext: registerContext, instructionPointer: instructionPointer, stackAddress: window.address, stack: window.bytes)
+        try resume(actions: [ThreadResumeEntry(thread: .id(threadID), action: .continue, address: displacedInstruction)], defaultAction: nonStopMode ? .none : .continue)
+        return snapshot
+    }
+
+    private func getDisplacedInstruction(at address: Address) throws -> Address {
+        if let instruction = displacedInstructions[address] {
+            return instruction
+        }
+        var code = [UInt8](repeating: 0, count: MachineBreakpointState.maximumInstructionLength)
+        if selfdeLinuxReadMemory(address.bitPattern64, &code, code.count) != 0 {
+            // The instruction might end right before an unmapped page.
+            let pageSize = UInt(getpagesize())
+            code.removeSubrange(min(code.count, Int(pageSize - address.bitPattern % pageSize))..<code.count)
+            try handleSystemError(selfdeLinuxReadMemory(address.bitPattern64, &code, code.count))
+        }
+        for offset in 0..<code.count {
+            breakpoints[Address(bitPattern: address.bitPattern + UInt(offset))]?.machineState.restoreOriginalInstruction(in: &code, at: offset)
+        }
+        // The relocated instruction is written before its pages are made executable.
+        let slot = try memoryArena.allocateCode(size: MachineBreakpointState.displacedInstructionSize) { slot -> [UInt8] in
+            guard let displaced = MachineBreakpointState.displacedInstruction(code, from: address, to: slot) else {
+                throw DebuggerError.unsupported
+            }
+            return displaced
+        }
+        displacedInstructions[address] = slot
+        return slot
+    }
+
+    // Debug registers.
+
+    /// Returns DR0-DR7 of the given thread. Only available in the tracer mode.
+    public func getDebugRegistersForThread(_ threadID: ThreadID) throws -> [UInt64] {
+        return try backend.getDebugRegisters(pid_t(truncatingBitPattern: threadID))
+    }
+
+    /// Sets one of DR0-DR7 of the given thread. Only available in the tracer mode.
+    public func setDebugRegisterForThread(_ threadID: ThreadID, index: Int, value: UInt64) throws {
+        guard index >= 0 && index < 8 else {
+            throw ControllerError.invalidRegisterID
+        }
+        try backend.setDebugRegister(pid_t(truncatingBitPattern: threadID), index: index, value: value)
+    }
+}
+
+private final class SymbolCollector {
+    var symbols: [Symbol] = []
+}
+
+func getUnwindSection(_ library: LoadedLibrary) -> UnwindSection? {
+    var section = SelfdeLinuxUnwindSection()
+    guard selfdeLinuxGetUnwindSection(library.loadAddress.bitPattern64, &section) == 0 else {
+        return nil
+    }
+    return UnwindSection(codeStart: UInt(section.codeStart), codeEnd: UInt(section.codeEnd), ehFrameAddress: UInt(section.ehFrameAddress), ehFrameSize: 0)
+}
+
+// Copies the memory with process_vm_readv, so the memory that goes away while it's read can't fault.
+private let readMemoryChunk: SelfdeMemoryReadFunction = { _, address, buffer, size in
+    return selfdeLinuxReadMemory(address, buffer, size) == 0
+}
+
+// The stack of a stopped thread might be corrupted, so it's read without faulting.
+private func readWord(_ address: UInt) -> UInt? {
+    var value: UInt = 0
+    return selfdeLinuxReadMemory(UInt64(address), &value, MemoryLayout<UInt>.size) == 0 ? value : nil
+}
+
+private func getProtection(_ permissions: MemoryPermissions) -> Int32 {
+    var protection: Int32 = PROT_NONE
+    if permissions.contains(.read) {
+        protection |= PROT_READ
+    }
+    if permissions.contains(.write) {
+        protection |= PROT_WRITE
+    }
+    if permissions.contains(.execute) {
+        protection |= PROT_EXEC
+    }
+    return protection
+}
+
+#endif
@@ -0,0 +1,171 @@
+//
+//  linuxDebuggerBackend.swift
+//  Selfde
+//
+
+#if os(Linux) && arch(x86_64)
+
+import SelfdeLinuxImpl
+
+/// The way the Linux debugger stops the threads of this process and accesses their registers.
+protocol LinuxDebuggerBackend: class {
+    func ignoreCurrentThread()
+    func getThreads(_ threads: UnsafeMutablePointer<pid_t>, capacity: Int32) -> Int32
+
+    func waitForStop(_ event: inout SelfdeLinuxStopEvent) -> Bool
+    func stopThread(_ thread: pid_t) -> Int32
+    func resumeThread(_ thread: pid_t) -> Int32
+    func isThreadStopped(_ thread: pid_t) -> Bool
+    func getLastStop(_ thread: pid_t, event: inout SelfdeLinuxStopEvent) -> Bool
+
+    func getThreadState(_ thread: pid_t, state: UnsafeMutablePointer<GPRState>?, fpuState: UnsafeMutablePointer<FPUState>?, avxState: UnsafeMutablePointer<AVXState>?, excState: UnsafeMutablePointer<EXCState>?) -> Int32
+    func setThreadState(_ thread: pid_t, state: UnsafePointer<GPRState>?, fpuState: UnsafePointer<FPUState>?, avxState: UnsafePointer<AVXState>?) -> Int32
+
+    // The program signals are nil when every passed signal can be delivered.
+    func setSignalFilter(passSignals: [Int32], programSignals: [Int32]?)
+
+    func getDebugRegisters(_ thread: pid_t) throws -> [UInt64]
+    func setDebugRegister(_ thread: pid_t, index: Int, value: UInt64) throws
+
+    func writeMemory(_ address: UInt64, bytes: UnsafeRawPointer, size: Int) -> Int32
+}
+
+/// Parks the threads inside of the signal handlers.
+final class LinuxSignalBackend: LinuxDebuggerBackend {
+    init() throws {
+        try handleSystemError(selfdeLinuxInstallHandlers())
+    }
+
+    deinit {
+        selfdeLinuxRemoveHandlers()
+    }
+
+    func ignoreCurrentThread() {
+        selfdeLinuxIgnoreCurrentThread()
+    }
+
+    func getThreads(_ threads: UnsafeMutablePointer<pid_t>, capacity: Int32) -> Int32 {
+        return selfdeLinuxGetThreads(threads, capacity)
+    }
+
+    func waitForStop(_ event: inout SelfdeLinuxStopEvent) -> Bool {
+        return selfdeLinuxWaitForStop(&event)
+    }
+
+    func stopThread(_ thread: pid_t) -> Int32 {
+        return selfdeLinuxStopThread(thread)
+    }
+
+    func resumeThread(_ thread: pid_t) -> Int32 {
+        return selfdeLinuxResumeThread(thread)
+    }
+
+    func isThreadStopped(_ thread: pid_t) -> Bool {
+        return selfdeLinuxIsThreadStopped(thread)
+    }
+
+    func getLastStop(_ thread: pid_t, event: inout SelfdeLinuxStopEvent) -> Bool {
+        return selfdeLinuxGetLastStop(thread, &event)
+    }
+
+    func getThreadState(_ thread: pid_t, state: UnsafeMutablePointer<GPRState>?, fpuState: UnsafeMutablePointer<FPUState>?, avxState: UnsafeMutablePointer<AVXState>?, excState: UnsafeMutablePointer<EXCState>?) -> Int32 {
+        return selfdeLinuxGetThreadState(thread, state, fpuState, avxState, excState)
+    }
+
+    func setThreadState(_ thread: pid_t, state: UnsafePointer<GPRState>?, fpuState: UnsafePointer<FPUState>?, avxState: UnsafePointer<AVXState>?) -> Int32 {
+        return selfdeLinuxSetThreadState(thread, state, fpuState, avxState)
+    }
+
+    func setSignalFilter(passSignals: [Int32], programSignals: [Int32]?) {
+        let programSignalCount = programSignals.map { Int32($0.count) } ?? -1
+        selfdeLinuxSetSignalFilter(passSignals, Int32(passSignals.count), programSignals ?? [], programSignalCount)
+    }
+
+    func getDebugRegisters(_ thread: pid_t) throws -> [UInt64] {
+        // The debug registers can only be accessed by a tracer.
+        throw DebuggerError.unsupported
+    }
+
+    func setDebugRegister(_ thread: pid_t, index: Int, value: UInt64) throws {
+        throw DebuggerError.unsupported
+    }
+
+    func writeMemory(_ address: UInt64, bytes: UnsafeRawPointer, size: Int) -> Int32 {
+        return selfdeLinuxWriteMemory(address, bytes, size)
+    }
+}
+
+/// Lets a forked helper process trace the threads with ptrace.
+final class LinuxTracerBackend: LinuxDebuggerBackend {
+    private let tracer: OpaquePointer
+
+    init() throws {
+        var error: Int32 = 0
+        guard let tracer = selfdeLinuxTracerStart(&error) else {
+            try handleSystemError(error)
+            throw ControllerError.invalidRunState
+        }
+        self.tracer = tracer
+    }
+
+    deinit {
+        selfdeLinuxTracerStop(tracer)
+    }
+
+    func ignoreCurrentThread() {
+        selfdeLinuxTracerIgnoreCurrentThread(tracer)
+    }
+
+    func getThreads(_ threads: UnsafeMutablePointer<pid_t>, capacity: Int32) -> Int32 {
+        return selfdeLinuxTracerGetThreads(tracer, threads, capacity)
+    }
+
+    func waitForStop(_ event: inout SelfdeLinuxStopEvent) -> Bool {
+        return selfdeLinuxTracerWaitForStop(tracer, &event)
+    }
+
+    func stopThread(_ thread: pid_t) -> Int32 {
+        return selfdeLinuxTracerStopThread(tracer, thread)
+    }
+
+    func resumeThread(_ thread: pid_t) -> Int32 {
+        return selfdeLinuxTracerResumeThread(tracer, thread)
+    }
+
+    func isThreadStopped(_ thread: pid_t) -> Bool {
+        return selfdeLinuxTracerIsThreadStopped(tracer, thread)
+    }
+
+    func getLastStop(_ thread: pid_t, event: inout SelfdeLinuxStopEvent) -> Bool {
+        return selfdeLinuxTracerGetLastStop(tracer, thread, &event)
+    }
+
+    func getThreadState(_ thread: pid_t, state: UnsafeMutablePointer<GPRState>?, fpuState: UnsafeMutablePointer<FPUState>?, avxState: UnsafeMutablePointer<AVXState>?, excState: UnsafeMutablePointer<EXCState>?) -> Int32 {
+        return selfdeLinuxTracerGetThreadState(tracer, thread, state, fpuState, avxState, excState)
+    }
+
+    func setThreadState(_ thread: pid_t, state: UnsafePointer<GPRState>?, fpuState: UnsafePointer<FPUState>?, avxState: UnsafePointer<AVXState>?) -> Int32 {
+        return selfdeLinuxTracerSetThreadState(tracer, thread, state, fpuState, avxState)
+    }
+
+    func setSignalFilter(passSignals: [Int32], programSignals: [Int32]?) {
+        let programSignalCount = programSignals.map { Int32($0.count) } ?? -1
+        selfdeLinuxTracerSetSignalFilter(tracer, passSignals, Int32(passSignals.count), programSignals ?? [], programSignalCount)
+    }
+
+    func getDebugRegisters(_ thread: pid_t) throws -> [UInt64] {
+        var registers = [UInt64](repeating: 0, count: 8)
+        try handleSystemError(selfdeLinuxTracerGetDebugRegisters(tracer, thread, &registers))
+        return registers
+    }
+
+    func setDebugRegister(_ thread: pid_t, index: Int, value: UInt64) throws {
+        try handleSystemError(selfdeLinuxTracerSetDebugRegister(tracer, thread, Int32(index), value))
+    }
+
+    func writeMemory(_ address: UInt64, bytes: UnsafeRawPointer, size: Int) -> Int32 {
+        return selfdeLinuxTracerWriteMemory(tracer, address, bytes, size)
+    }
+}
+
+#endif
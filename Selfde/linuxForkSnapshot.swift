@@ -0,0 +1,298 @@
+//
+//  linuxForkSnapshot.swift
+//  Selfde
+//
+
+#if os(Linux) && arch(x86_64)
+
+import Glibc
+import SelfdeLinuxImpl
+
+/// The registers and the stop of a thread, read before the process was forked.
+struct LinuxThreadSnapshot {
+    let thread: pid_t
+    let stopEvent: SelfdeLinuxStopEvent
+    let state: GPRState
+    let fpuState: FPUState
+    let avxState: AVXState
+    let excState: EXCState
+}
+
+/// A frozen copy of the process that a debug server can serve while the process keeps running.
+/// It's created by `LinuxDebugger.createForkSnapshot`, so the process is only paused for as long as
+/// it takes to read the registers of its threads and to fork it.
+///
+/// The memory is read from a forked child that keeps the copy-on-write pages of the process, and
+/// the registers are the ones that were read before the fork, as only the forking thread exists
+/// in the child. The snapshot can't be resumed or modified, and the client's resume requests are
+/// returned by the debug server like usual, which is when the caller can end the session.
+///
+/// The shared mappings aren't copied by the fork, so they show their current contents. The symbols
+/// and the unwind tables are read from the libraries that are still loaded in the process.
+public final class LinuxForkSnapshot: Debugger {
+    private let debugger: LinuxDebugger
+    private var process: pid_t
+    private let threadStates: LinuxSnapshotThreadStates
+    private let threadIDs: [ThreadID]
+    private let libraries: [LoadedLibrary]?
+    private let sharedLibraryInfoAddress: Address
+    private let unwinder = Unwinder()
+    // The memory that's returned by 'readMemory' is valid until the next read.
+    private var readBuffer: UnsafeMutablePointer<UInt8>?
+    private var readBufferCapacity = 0
+
+    public let primaryThreadID: ThreadID
+    /// For how long the threads of the process were stopped while the snapshot was taken, in nanoseconds.
+    public let pauseDuration: UInt64
+
+    init(debugger: LinuxDebugger, process: pid_t, threads: [LinuxThreadSnapshot], primaryThreadID: ThreadID, libraries: [LoadedLibrary]?, sharedLibraryInfoAddress: Address, pauseDuration: UInt64) {
+        self.debugger = debugger
+        self.process = process
+        threadStates = LinuxSnapshotThreadStates(threads: threads)
+        threadIDs = threads.map { ThreadID($0.thread) }
+        self.primaryThreadID = primaryThreadID
+        self.libraries = libraries
+        self.sharedLibraryInfoAddress = sharedLibraryInfoAddress
+        self.pauseDuration = pauseDuration
+    }
+
+    deinit {
+        release()
+        readBuffer?.deallocate(capacity: readBufferCapacity)
+    }
+
+    /// The process ID of the forked child.
+    public var processID: Int {
+        return Int(process)
+    }
+
+    /// Kills the forked child. The memory can't be read after this.
+    public func release() {
+        guard process > 0 else {
+            return
+        }
+        selfdeLinuxReleaseForkSnapshot(process)
+        process = 0
+    }
+
+    private func getThread(_ threadID: ThreadID) throws -> LinuxThreadX86_64 {
+        guard threadIDs.contains(threadID) else {
+            throw ControllerError.invalidRunState
+        }
+        return LinuxThreadX86_64(backend: threadStates, thread: pid_t(truncatingBitPattern: threadID))
+    }
+
+    // The libraries that were loaded at the fork, and that haven't been unloaded since.
+    private func getLiveLibraries() throws -> [LoadedLibrary] {
+        let liveLibraries = try debugger.getLoadedLibraries()
+        return try getLoadedLibraries().filter { library in
+            liveLibraries.contains { $0.loadAddress == library.loadAddress && $0.path == library.path }
+        }
+    }
+
+    private func readWord(_ address: UInt) -> UInt? {
+        var value: UInt = 0
+        return selfdeLinuxReadProcessMemory(process, UInt64(address), &value, MemoryLayout<UInt>.size) == 0 ? value : nil
+    }
+
+    // Debugger protocol implementation.
+
+    public var registerContextSize: Int {
+        return LinuxThreadX86_64.registerContextSize
+    }
+
+    public var threads: [ThreadID] {
+        return threadIDs
+    }
+
+    public func attach(_ processID: Int) throws {
+        throw DebuggerError.unsupported
+    }
+
+    public func getSharedLibraryInfoAddress() throws -> Address {
+        return sharedLibraryInfoAddress
+    }
+
+    public func getLoadedLibraries() throws -> [LoadedLibrary] {
+        guard let libraries = libraries else {
+            // The dynamic linker was modifying the list at the fork.
+            throw ControllerError.invalidRunState
+        }
+        return libraries
+    }
+
+    public func getSymbols(in library: LoadedLibrary) throws -> [Symbol] {
+        guard try getLiveLibraries().contains(where: { $0.loadAddress == library.loadAddress }) else {
+            throw ControllerError.invalidAddress
+        }
+        return try debugger.getSymbols(in: library)
+    }
+
+    public func getBacktraces(_ threadIDs: [ThreadID], maxFrames: Int) throws -> [[Address]] {
+        if let libraries = try? getLiveLibraries() {
+            unwinder.update(libraries: libraries, getSection: getUnwindSection)
+        }
+        return threadIDs.map { threadID -> [Address] in
+            guard let registers = try? getThread(threadID).getUnwindRegisters() else {
+                return []
+            }
+            return unwinder.backtrace(from: registers, maxFrames: maxFrames, readWord: readWord)
+        }
+    }
+
+    public func interruptExecution() throws {
+        // The snapshot never runs.
+    }
+
+    public func detach() {
+        release()
+    }
+
+    public func getStopInfoForThread(_ threadID: ThreadID) throws -> ThreadStopInfo {
+        var event = SelfdeLinuxStopEvent()
+        guard threadStates.getLastStop(pid_t(truncatingBitPattern: threadID), event: &event) else {
+            throw ControllerError.invalidRunState
+        }
+        return ThreadStopInfo(signalNumber: UInt8(truncatingBitPattern: event.signalNumber), dispatchQueueAddress: nil, machInfo: nil)
+    }
+
+    public func isThreadAlive(_ threadID: ThreadID) throws -> Bool {
+        return threadIDs.contains(threadID)
+    }
+
+    public func setBreakpoint(_ address: Address, byteSize: Int) throws {
+        throw DebuggerError.unsupported
+    }
+
+    public func removeBreakpoint(_ address: Address) throws {
+        throw DebuggerError.unsupported
+    }
+
+    public func getIPRegisterValueForThread(_ threadID: ThreadID) throws -> Address {
+        return try getThread(threadID).getInstructionPointer()
+    }
+
+    public func getRegisterValueForThread(_ threadID: ThreadID, registerID: UInt32, registerSetID: UInt32, dest: inout [UInt8]) throws -> ArraySlice<UInt8> {
+        return try getThread(threadID).getRegisterValue(registerID, setID: registerSetID, dest: &dest)
+    }
+
+    public func setRegisterValueForThread(_ threadID: ThreadID, registerID: UInt32, registerSetID: UInt32, source: ArraySlice<UInt8>) throws {
+        throw DebuggerError.unsupported
+    }
+
+    public func getRegisterContextForThread(_ threadID: ThreadID, dest: inout [UInt8]) throws -> ArraySlice<UInt8> {
+        return try getThread(threadID).getRegisterContext(&dest)
+    }
+
+    public func setRegisterContextForThread(_ threadID: ThreadID, source: ArraySlice<UInt8>) throws {
+        throw DebuggerError.unsupported
+    }
+
+    public func allocate(_ size: Int, permissions: MemoryPermissions) throws -> Address {
+        throw DebuggerError.unsupported
+    }
+
+    public func deallocate(_ address: Address) throws {
+        throw DebuggerError.unsupported
+    }
+
+    public func readMemory(_ address: Address, size: Int) throws -> MemoryReadResult {
+        guard process > 0 else {
+            throw ControllerError.invalidRunState
+        }
+        if readBufferCapacity < size {
+            readBuffer?.deallocate(capacity: readBufferCapacity)
+            readBuffer = UnsafeMutablePointer<UInt8>.allocate(capacity: size)
+            readBufferCapacity = size
+        }
+        guard let buffer = readBuffer else {
+            return .bytes(UnsafeBufferPointer(start: nil, count: 0))
+        }
+        try handleSystemError(selfdeLinuxReadProcessMemory(process, address.bitPattern64, buffer, size))
+        return .bytes(UnsafeBufferPointer(start: buffer, count: size))
+    }
+
+    public func writeMemory(_ address: Address, bytes: [UInt8]) throws {
+        throw DebuggerError.unsupported
+    }
+}
+
+/// Serves the registers that were read before the fork to `LinuxThreadX86_64`. The threads are
+/// always stopped, and nothing can be modified.
+private final class LinuxSnapshotThreadStates: LinuxDebuggerBackend {
+    private let threads: [pid_t: LinuxThreadSnapshot]
+
+    init(threads: [LinuxThreadSnapshot]) {
+        var threadsByID: [pid_t: LinuxThreadSnapshot] = [:]
+        for thread in threads {
+            threadsByID[thread.thread] = thread
+        }
+        self.threads = threadsByID
+    }
+
+    func ignoreCurrentThread() {
+    }
+
+    func getThreads(_ threads: UnsafeMutablePointer<pid_t>, capacity: Int32) -> Int32 {
+        for (i, thread) in self.threads.keys.sorted().prefix(Int(capacity)).enumerated() {
+            threads[i] = thread
+        }
+        return Int32(self.threads.count)
+    }
+
+    func waitForStop(_ event: inout SelfdeLinuxStopEvent) -> Bool {
+        return false
+    }
+
+    func stopThread(_ thread: pid_t) -> Int32 {
+        return threads[thread] != nil ? 0 : ESRCH
+    }
+
+    func resumeThread(_ thread: pid_t) -> Int32 {
+        return EPERM
+    }
+
+    func isThreadStopped(_ thread: pid_t) -> Bool {
+        return threads[thread] != nil
+    }
+
+    func getLastStop(_ thread: pid_t, event: inout SelfdeLinuxStopEvent) -> Bool {
+        guard let snapshot = threads[thread] else {
+            return false
+        }
+        event = snapshot.stopEvent
+        return true
+    }
+
+    func getThreadState(_ thread: pid_t, state: UnsafeMutablePointer<GPRState>?, fpuState: UnsafeMutablePointer<FPUState>?, avxState: UnsafeMutablePointer<AVXState>?, excState: UnsafeMutablePointer<EXCState>?) -> Int32 {
+        guard let snapshot = threads[thread] else {
+            return ESRCH
+        }
+        state?.pointee = snapshot.state
+        fpuState?.pointee = snapshot.fpuState
+        avxState?.pointee = snapshot.avxState
+        excState?.pointee = snapshot.excState
+        return 0
+    }
+
+    func setThreadState(_ thread: pid_t, state: UnsafePointer<GPRState>?, fpuState: UnsafePointer<FPUState>?, avxState: UnsafePointer<AVXState>?) -> Int32 {
+        return EPERM
+    }
+
+    func setSignalFilter(passSignals: [Int32], programSignals: [Int32]?) {
+    }
+
+    func getDebugRegisters(_ thread: pid_t) throws -> [UInt64] {
+        throw DebuggerError.unsupported
+    }
+
+    func setDebugRegister(_ thread: pid_t, index: Int, value: UInt64) throws {
+        throw DebuggerError.unsupported
+    }
+
+    func writeMemory(_ address: UInt64, bytes: UnsafeRawPointer, size: Int) -> Int32 {
+        return EPERM
+    }
+}
+
+#endif
@@ -0,0 +1,235 @@
+//
+//  linuxThreadX86_64.swift
+//  Selfde
+//
+
+#if os(Linux) && arch(x86_64)
+
+import SelfdeLinuxImpl
+
+typealias GPRState = x86_thread_state64_t
+typealias FPUState = x86_float_state64_t
+typealias AVXState = x86_avx_state64_t
+typealias EXCState = x86_exception_state64_t
+
+private let hasAVX = CPUHasAVX()
+
+// Register access for a thread that's stopped by the debugger backend.
+// The states use the Mach layouts so that the DNB register tables can be reused.
+struct LinuxThreadX86_64 {
+    let backend: LinuxDebuggerBackend
+    let thread: pid_t
+
+    private func getGPRState() throws -> GPRState {
+        var state = GPRState()
+        try handleSystemError(backend.getThreadState(thread, state: &state, fpuState: nil, avxState: nil, excState: nil))
+        return state
+    }
+
+    private func setGPRState(_ state: inout GPRState) throws {
+        try handleSystemError(backend.setThreadState(thread, state: &state, fpuState: nil, avxState: nil))
+    }
+
+    private func getFPUState() throws -> FPUState {
+        var state = FPUState()
+        try handleSystemError(backend.getThreadState(thread, state: nil, fpuState: &state, avxState: nil, excState: nil))
+        return state
+    }
+
+    private func setFPUState(_ state: inout FPUState) throws {
+        try handleSystemError(backend.setThreadState(thread, state: nil, fpuState: &state, avxState: nil))
+    }
+
+    private func getAVXState() throws -> AVXState {
+        var state = AVXState()
+        try handleSystemError(backend.getThreadState(thread, state: nil, fpuState: nil, avxState: &state, excState: nil))
+        return state
+    }
+
+    private func setAVXState(_ state: inout AVXState) throws {
+        try handleSystemError(backend.setThreadState(thread, state: nil, fpuState: nil, avxState: &state))
+    }
+
+    private func getEXCState() throws -> EXCState {
+        var state = EXCState()
+        try handleSystemError(backend.getThreadState(thread, state: nil, fpuState: nil, avxState: nil, excState: &state))
+        return state
+    }
+
+    func setHardwareSingleStep(_ enabled: Bool) throws {
+        var state = try getGPRState()
+        let traceBit: UInt64 = 0x100
+        if (enabled) {
+            state.__rflags |= traceBit
+        } else {
+            state.__rflags &= ~traceBit
+        }
+        try setGPRState(&state)
+    }
+
+    func isHardwareSingleStepEnabled() throws -> Bool {
+        return (try getGPRState().__rflags & 0x100) != 0
+    }
+
+    func getInstructionPointer() throws -> Address {
+        return Address(bitPattern64: try getGPRState().__rip)
+    }
+
+    func setInstructionPointer(_ address: Address) throws {
+        var state = try getGPRState()
+        state.__rip = address.bitPattern64
+        try setGPRState(&state)
+    }
+
+    func getStackPointer() throws -> Address {
+        return Address(bitPattern64: try getGPRState().__rsp)
+    }
+
+    func getUnwindRegisters() throws -> UnwindRegisters {
+        let state = try getGPRState()
+        return UnwindRegisters(instructionPointer: UInt(state.__rip), stackPointer: UInt(state.__rsp), framePointer: UInt(state.__rbp))
+    }
+
+    // Points the thread at the function with the arguments in the System V argument registers.
+    func setUpFunctionCall(_ function: Address, returnAddress: Address, integerArguments: [UInt64], vectorArguments: [[UInt8]]) throws {
+        guard !vectorArguments.contains(where: { $0.count != 16 }) else {
+            throw ControllerError.invalidCallArguments
+        }
+        let vectors = vectorArguments.flatMap { $0 }
+        var state = try getGPRState()
+        if hasAVX {
+            var avxState = try getAVXState()
+            guard setupFunctionCallX86_64(&state, nil, &avxState, function.bitPattern64, returnAddress.bitPattern64, integerArguments, integerArguments.count, vectors, vectorArguments.count) else {
+                throw ControllerError.invalidCallArguments
+            }
+            try setAVXState(&avxState)
+        } else {
+            var fpuState = try getFPUState()
+            guard setupFunctionCallX86_64(&state, &fpuState, nil, function.bitPattern64, returnAddress.bitPattern64, integerArguments, integerArguments.count, vectors, vectorArguments.count) else {
+                throw ControllerError.invalidCallArguments
+            }
+            try setFPUState(&fpuState)
+        }
+        try setGPRState(&state)
+    }
+
+    func getFunctionCallResult() throws -> FunctionCallResult {
+        var state = try getGPRState()
+        var integers = [UInt64](repeating: 0, count: 2)
+        var vectors = [UInt8](repeating: 0, count: 32)
+        if hasAVX {
+            var avxState = try getAVXState()
+            getFunctionCallResultX86_64(&state, nil, &avxState, &integers, &vectors)
+        } else {
+            var fpuState = try getFPUState()
+            getFunctionCallResultX86_64(&state, &fpuState, nil, &integers, &vectors)
+        }
+        return FunctionCallResult(integerValues: integers, vectorValues: [Array(vectors[0..<16]), Array(vectors[16..<32])])
+    }
+
+    func getRegisterValue(_ id: UInt32, setID: UInt32, dest: inout [UInt8]) throws -> ArraySlice<UInt8> {
+        precondition(dest.count >= 32)
+        var size = dest.count
+        let result: Bool
+        switch getRegisterSetKindX86_64(setID) {
+        case GPRKindX86_64:
+            var state = try getGPRState()
+            result = dest.withUnsafeMutableBufferPointer { getGPRValueX86_64(id, &state, $0.baseAddress, &size) }
+        case FPUKindX86_64:
+            if hasAVX {
+                var state = try getAVXState()
+                result = dest.withUnsafeMutableBufferPointer { getFPUValueX86_64(id, /*fpuState:*/ nil, /*avxState:*/ &state, $0.baseAddress, &size) }
+            } else {
+                var state = try getFPUState()
+                result = dest.withUnsafeMutableBufferPointer { getFPUValueX86_64(id, /*fpuState:*/ &state, /*avxState:*/ nil, $0.baseAddress, &size) }
+            }
+        case EXCKindX86_64:
+            var state = try getEXCState()
+            result = dest.withUnsafeMutableBufferPointer { getEXCValueX86_64(id, &state, $0.baseAddress, &size) }
+        default:
+            throw ControllerError.invalidRegisterSetID
+        }
+        guard result else {
+            throw ControllerError.invalidRegisterID
+        }
+        return dest.prefix(size)
+    }
+
+    func setRegisterValue(_ id: UInt32, setID: UInt32, source: ArraySlice<UInt8>) throws {
+        switch getRegisterSetKindX86_64(setID) {
+        case GPRKindX86_64:
+            var state = try getGPRState()
+            guard source.withUnsafeBufferPointer({ setGPRValueX86_64(id, &state, $0.baseAddress, source.count) }) else {
+                throw ControllerError.invalidRegisterID
+            }
+            try setGPRState(&state)
+        case FPUKindX86_64:
+            if hasAVX {
+                var state = try getAVXState()
+                guard source.withUnsafeBufferPointer({ setFPUValueX86_64(id, /*fpuState:*/ nil, /*avxState:*/ &state, $0.baseAddress, source.count) }) else {
+                    throw ControllerError.invalidRegisterID
+                }
+                try setAVXState(&state)
+            } else {
+                var state = try getFPUState()
+                guard source.withUnsafeBufferPointer({ setFPUValueX86_64(id, /*fpuState:*/ &state, /*avxState:*/ nil, $0.baseAddress, source.count) }) else {
+                    throw ControllerError.invalidRegisterID
+                }
+                try setFPUState(&state)
+            }
+        default:
+            // NB: The EXC state is get only.
+            throw ControllerError.invalidRegisterSetID
+        }
+    }
+
+    static let registerContextSize: Int = {
+        var state = GPRState()
+        var fpuState = FPUState()
+        var avxState = AVXState()
+        var excState = EXCState()
+        var dest = [UInt8](repeating: 0, count: 2048)
+        var size = dest.count
+        dest.withUnsafeMutableBufferPointer { ptr in
+            if hasAVX {
+                getRegisterContextX86_64(&state, nil, &avxState, &excState, ptr.baseAddress, &size)
+            } else {
+                getRegisterContextX86_64(&state, &fpuState, nil, &excState, ptr.baseAddress, &size)
+            }
+        }
+        return size
+    }()
+
+    func getRegisterContext(_ dest: inout [UInt8]) throws -> ArraySlice<UInt8> {
+        precondition(dest.count >= LinuxThreadX86_64.registerContextSize)
+        var size = dest.count
+        var state = try getGPRState()
+        var excState = try getEXCState()
+        if hasAVX {
+            var avxState = try getAVXState()
+            dest.withUnsafeMutableBufferPointer { getRegisterContextX86_64(&state, nil, &avxState, &excState, $0.baseAddress, &size) }
+        } else {
+            var fpuState = try getFPUState()
+            dest.withUnsafeMutableBufferPointer { getRegisterContextX86_64(&state, &fpuState, nil, &excState, $0.baseAddress, &size) }
+        }
+        return dest.prefix(size)
+    }
+
+    func setRegisterContext(_ source: ArraySlice<UInt8>) throws {
+        precondition(source.count == LinuxThreadX86_64.registerContextSize)
+        var state = try getGPRState()
+        if hasAVX {
+            var avxState = try getAVXState()
+            source.withUnsafeBufferPointer { setRegisterContextX86_64(&state, nil, &avxState, $0.baseAddress, source.count) }
+            try setAVXState(&avxState)
+        } else {
+            var fpuState = try getFPUState()
+            source.withUnsafeBufferPointer { setRegisterContextX86_64(&state, &fpuState, nil, $0.baseAddress, source.count) }
+            try setFPUState(&fpuState)
+        }
+        try setGPRState(&state)
+        // NB: The EXC state is get only.
+    }
+}
+
+#endif
@@ -0,0 +1,17 @@
+//
+//  linuxUtils.swift
+//  Selfde
+//
+
+#if os(Linux)
+
+import Glibc
+
+func handleSystemError(_ error: Int32) throws {
+    guard error != 0 else {
+        return
+    }
+    throw ControllerError.systemError(code: Int(error), message: String(cString: strerror(error)))
+}
+
+#endif
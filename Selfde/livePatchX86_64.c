@@ -0,0 +1,239 @@
+//
+//  livePatchX86_64.c
+//  Selfde
+//
+
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+#include "livePatchX86_64.h"
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <linux/membarrier.h>
+#include <sys/syscall.h>
+#endif
+
+#define SELFDE_INT3 0xCC
+
+// The number of removed INT 3s that are remembered. The threads that hit one of them before it was
+// removed handle their trap long before that many others are removed.
+#define REMOVED_TRAP_COUNT 256
+
+// Straddling patches are done one at a time, so there's only one site with a temporary INT 3.
+static pthread_mutex_t patchMutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t siteInProgress;
+// The addresses of the INT 3s that were replaced by patches, in a ring that's indexed by the
+// generation, which is the number of INT 3s that were removed so far.
+static pthread_mutex_t removedTrapsMutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t removedTraps[REMOVED_TRAP_COUNT];
+static uint64_t removedTrapGeneration;
+
+// Remembers the INT 3s that are about to be replaced by other bytes. They're recorded before
+// they're replaced, so a thread that hit one of them always finds it.
+static void recordRemovedTraps(uint64_t address, const uint8_t *current, const uint8_t *replacement, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        if (current[i] == SELFDE_INT3 && replacement[i] != SELFDE_INT3) {
+            pthread_mutex_lock(&removedTrapsMutex);
+            uint64_t generation = __atomic_load_n(&removedTrapGeneration, __ATOMIC_RELAXED);
+            __atomic_store_n(&removedTraps[generation % REMOVED_TRAP_COUNT], address + i, __ATOMIC_RELEASE);
+            __atomic_store_n(&removedTrapGeneration, generation + 1, __ATOMIC_RELEASE);
+            pthread_mutex_unlock(&removedTrapsMutex);
+        }
+    }
+}
+
+static bool isRemovedTrap(uint64_t address) {
+    uint64_t generation = __atomic_load_n(&removedTrapGeneration, __ATOMIC_ACQUIRE);
+    uint64_t count = generation < REMOVED_TRAP_COUNT ? generation : REMOVED_TRAP_COUNT;
+    // The most recently removed INT 3s first.
+    for (uint64_t i = 1; i <= count; ++i) {
+        if (__atomic_load_n(&removedTraps[(generation - i) % REMOVED_TRAP_COUNT], __ATOMIC_ACQUIRE) == address) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Replaces bytes that lie within one aligned 8 byte word. Aligned 8 byte stores are atomic
+// with respect to instruction fetches, so other threads see either the old or the new code.
+static bool compareAndSwapBytes(uint64_t address, const uint8_t *expected, const uint8_t *replacement, size_t size) {
+    uint64_t *word = (uint64_t *)(uintptr_t)(address & ~(uint64_t)7);
+    size_t offset = (size_t)(address & 7);
+    uint64_t current = __atomic_load_n(word, __ATOMIC_ACQUIRE);
+    while (true) {
+        uint64_t desired = current;
+        uint8_t *bytes = (uint8_t *)&desired;
+        if (expected && memcmp(bytes + offset, expected, size) != 0) {
+            return false;
+        }
+        recordRemovedTraps(address, bytes + offset, replacement, size);
+        memcpy(bytes + offset, replacement, size);
+        if (desired == current) {
+            return true;
+        }
+        if (__atomic_compare_exchange_n(word, &current, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_ACQUIRE)) {
+            return true;
+        }
+    }
+}
+
+static void serializeCurrentThread(void) {
+    uint32_t eax = 0, ebx, ecx = 0, edx;
+    __asm__ __volatile__("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx) : : "memory");
+}
+
+// Changing the protection of a page that's in the TLB interrupts every core that runs one of
+// our threads, and returning from the interrupt is serializing.
+static void interruptAllThreads(void) {
+    static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    static volatile int *page;
+    pthread_mutex_lock(&mutex);
+    size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    if (!page) {
+        void *memory = mmap(NULL, pageSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        page = memory == MAP_FAILED ? NULL : (volatile int *)memory;
+    }
+    if (page) {
+        mprotect((void *)page, pageSize, PROT_READ | PROT_WRITE);
+        *page += 1;
+        mprotect((void *)page, pageSize, PROT_NONE);
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+#if defined(__linux__)
+
+enum {
+    SelfdeBarrierUnknown = 0,
+    SelfdeBarrierSyncCore,
+    SelfdeBarrierExpedited,
+    SelfdeBarrierUnavailable
+};
+
+static int barrierKind = SelfdeBarrierUnknown;
+
+static int registerBarrier(void) {
+#ifdef MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_SYNC_CORE
+    if (syscall(SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_SYNC_CORE, 0) == 0) {
+        return SelfdeBarrierSyncCore;
+    }
+#endif
+#ifdef MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED
+    if (syscall(SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0) == 0) {
+        return SelfdeBarrierExpedited;
+    }
+#endif
+    return SelfdeBarrierUnavailable;
+}
+
+#endif
+
+void selfdeLivePatchSerializeAllThreads(void) {
+    serializeCurrentThread();
+#if defined(__linux__)
+    int kind = __atomic_load_n(&barrierKind, __ATOMIC_ACQUIRE);
+    if (kind == SelfdeBarrierUnknown) {
+        kind = registerBarrier();
+        __atomic_store_n(&barrierKind, kind, __ATOMIC_RELEASE);
+    }
+    switch (kind) {
+#ifdef MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE
+    case SelfdeBarrierSyncCore:
+        if (syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE, 0) == 0) {
+            return;
+        }
+        break;
+#endif
+#ifdef MEMBARRIER_CMD_PRIVATE_EXPEDITED
+    case SelfdeBarrierExpedited:
+        // The barrier interrupts the other cores, which serializes them on x86.
+        if (syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0) == 0) {
+            return;
+        }
+        break;
+#endif
+    default:
+        break;
+    }
+#endif
+    interruptAllThreads();
+}
+
+// Puts an INT 3 over the first byte, writes the rest of the patch and then replaces the INT 3.
+// The threads that reach the site in the meantime trap instead of executing a torn instruction.
+static SelfdeLivePatchResult patchStraddlingCode(uint64_t address, const uint8_t *expected, const uint8_t *replacement, size_t size) {
+    const uint8_t trap = SELFDE_INT3;
+    pthread_mutex_lock(&patchMutex);
+    __atomic_store_n(&siteInProgress, address, __ATOMIC_SEQ_CST);
+    SelfdeLivePatchResult result = SelfdeLivePatchSuccess;
+    if (!compareAndSwapBytes(address, expected, &trap, 1)) {
+        result = SelfdeLivePatchMismatch;
+    } else {
+        selfdeLivePatchSerializeAllThreads();
+        size_t offset = 1;
+        while (offset < size) {
+            uint64_t chunkAddress = address + offset;
+            size_t chunkSize = 8 - (size_t)(chunkAddress & 7);
+            if (chunkSize > size - offset) {
+                chunkSize = size - offset;
+            }
+            if (!compareAndSwapBytes(chunkAddress, expected ? expected + offset : NULL, replacement + offset, chunkSize)) {
+                break;
+            }
+            offset += chunkSize;
+        }
+        if (offset < size) {
+            // The code was modified by someone else, put back what was already written.
+            // NB: A write can only fail when the expected bytes are given.
+            for (size_t undone = 1; undone < offset;) {
+                uint64_t chunkAddress = address + undone;
+                size_t chunkSize = 8 - (size_t)(chunkAddress & 7);
+                if (chunkSize > offset - undone) {
+                    chunkSize = offset - undone;
+                }
+                compareAndSwapBytes(chunkAddress, replacement + undone, expected + undone, chunkSize);
+                undone += chunkSize;
+            }
+            selfdeLivePatchSerializeAllThreads();
+            compareAndSwapBytes(address, &trap, expected, 1);
+            result = SelfdeLivePatchMismatch;
+        } else {
+            selfdeLivePatchSerializeAllThreads();
+            compareAndSwapBytes(address, &trap, replacement, 1);
+        }
+        selfdeLivePatchSerializeAllThreads();
+    }
+    __atomic_store_n(&siteInProgress, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&patchMutex);
+    return result;
+}
+
+SelfdeLivePatchResult selfdeLivePatchCode(uint64_t address, const uint8_t *expected, const uint8_t *replacement, size_t size) {
+    if (size == 0 || size > SELFDE_LIVE_PATCH_MAX_SIZE) {
+        return SelfdeLivePatchInvalidSize;
+    }
+    if ((address & 7) + size <= 8) {
+        if (!compareAndSwapBytes(address, expected, replacement, size)) {
+            return SelfdeLivePatchMismatch;
+        }
+        selfdeLivePatchSerializeAllThreads();
+        return SelfdeLivePatchSuccess;
+    }
+    return patchStraddlingCode(address, expected, replacement, size);
+}
+
+bool selfdeLivePatchHandleTrap(uint64_t address) {
+    if (__atomic_load_n(&siteInProgress, __ATOMIC_SEQ_CST) == address) {
+        while (__atomic_load_n(&siteInProgress, __ATOMIC_SEQ_CST) == address) {
+            sched_yield();
+        }
+        return true;
+    }
+    // The INT 3 was replaced after the thread hit it. The other traps, like the ones of INT3 (CD 03),
+    // single steps and watchpoints, have nothing to do with the patches.
+    return *(volatile const uint8_t *)(uintptr_t)address != SELFDE_INT3 && isRemovedTrap(address);
+}
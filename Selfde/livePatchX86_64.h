@@ -0,0 +1,52 @@
+//
+//  livePatchX86_64.h
+//  Selfde
+//
+
+#ifndef livePatchX86_64_h
+#define livePatchX86_64_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The maximum number of bytes that can be patched at once.
+#define SELFDE_LIVE_PATCH_MAX_SIZE 32
+
+typedef enum SelfdeLivePatchResult {
+    SelfdeLivePatchSuccess = 0,
+    // The code doesn't contain the expected bytes.
+    SelfdeLivePatchMismatch,
+    SelfdeLivePatchInvalidSize
+} SelfdeLivePatchResult;
+
+// Replaces the code at the given address while other threads might be executing it.
+// The memory has to be writable. When 'expected' isn't NULL, the code is only replaced
+// when it still contains the expected bytes.
+//
+// A patch that fits into an aligned 8 byte word is written with a single compare and swap.
+// A patch that straddles the word boundary puts an INT 3 over its first byte while the
+// rest of it is written, and the threads that hit that INT 3 have to be handled with
+// selfdeLivePatchHandleTrap. Every step is followed by selfdeLivePatchSerializeAllThreads.
+SelfdeLivePatchResult selfdeLivePatchCode(uint64_t address, const uint8_t *expected, const uint8_t *replacement, size_t size);
+
+// Makes sure that every thread of this process executes a serializing instruction, so that
+// none of them executes stale code that was modified by another thread.
+void selfdeLivePatchSerializeAllThreads(void);
+
+// Returns true when the INT 3 at the given address that was hit by a thread was removed by a patch,
+// or was put there temporarily by a patch that's in progress. It waits for that patch to finish, after
+// which the thread can continue at the address. The patches remember the last 256 INT 3s that they
+// removed, so the traps that weren't caused by an INT 3 byte aren't taken for removed ones. Can be
+// called from a signal handler.
+bool selfdeLivePatchHandleTrap(uint64_t address);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* livePatchX86_64_h */
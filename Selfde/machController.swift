@@ -5,6 +5,7 @@
 
 import Darwin.Mach
 import Foundation
+import MachO
 
 public struct ControllerInterrupter {
     fileprivate unowned let controller: Controller
@@ -28,21 +29,83 @@ public class Controller {
     }
     private var breakpoints: [Address: BreakpointState] = [:]
     private var breakpointLandingAddresses: [Address: Address] = [:]
-    private struct AllocationState {
-        let address: mach_vm_address_t
-        let size: mach_vm_size_t
+    private let memoryArena: MemoryArena
+    private let scratchCode: ScratchCodePool
+    // Breakpoints that were lifted to let a thread step over them.
+    private struct LiftedBreakpoint {
+        let address: Address
+        // Was the thread already single stepping?
+        let isSingleStepping: Bool
     }
-    private var allocations: [Address: AllocationState] = [:]
+    private var liftedBreakpoints: [ThreadID: LiftedBreakpoint] = [:]
+    private enum SteppingPlan {
+        // Keep stepping while the instruction pointer is in the range.
+        case range(AddressRange)
+        // Run until the temporary breakpoint at the return address is hit after the frame is popped.
+        case stepOut(returnAddressSlot: Address, breakpoint: Breakpoint)
+        // Single step until the function's own return has been executed, when the return address
+        // can't be found. The calls that are stepped into and their returns are counted.
+        case stepToReturn(callDepth: Int, isReturning: Bool)
+    }
+    private var steppingPlans: [ThreadID: SteppingPlan] = [:]
+    // The breakpoints with actions are handled on the exception thread, so they're
+    // protected by the mutex. They're keyed by the landing address.
+    private struct BreakpointActionState {
+        let address: Address
+        let action: (Thread) -> BreakpointActionResult
+        // The scratch code that runs the original instruction.
+        let displacedInstruction: Address
+    }
+    private let breakpointActionsMutex: Mutex
+    private var breakpointActions: [Address: BreakpointActionState] = [:]
+    // The hits of the releasing breakpoints, protected by the condition lock.
+    private var releasedStops: [ThreadStopSnapshot] = []
+    // Events that were caught during a function call and are reported by the next wait.
+    private var pendingEvents: [ControllerEvent] = []
+    private var passSignals: [Int32] = []
+    private var programSignals: [Int32]?
+    private var hasTaskExceptionPort = false
+    // The called functions return to the trap.
+    private var functionCallTrap: Address?
+    private let unwinder = Unwinder()
+    private var samplingInterval: UInt64 = 0
 
     init() throws {
         // Create the synchronisation primitives.
         conditionLock = try Condition()
+        breakpointActionsMutex = try Mutex()
         let thread = mach_thread_self()
         state = SelfdeMachControllerState(task: getMachTaskSelf(), controllerThread: thread, msgServerThread: thread, exceptionPort: 0, synchronisationCondition: conditionLock.cond, synchronisationMutex: conditionLock.mutex, caughtException: SelfdeCaughtMachException(thread: 0, exceptionType: 0, exceptionData: nil, exceptionDataSize: 0), hasCaughtException: false)
         utilityThreadPort = thread
+        scratchCode = ScratchCodePool(task: state.task, slotSize: MachineBreakpointState.displacedInstructionSize)
+        let task = state.task
+        memoryArena = MemoryArena(pageSize: Int(vm_page_size), allocatePages: { size, permissions in
+            var address = mach_vm_address_t()
+            try handleError(mach_vm_allocate(task, &address, mach_vm_size_t(size), VM_FLAGS_ANYWHERE))
+            do {
+                try handleError(mach_vm_protect(task, address, mach_vm_size_t(size), 0, getVMProtection(permissions)))
+            } catch {
+                mach_vm_deallocate(task, address, mach_vm_size_t(size))
+                throw error
+            }
+            return Address(bitPattern: UInt(address))
+        }, deallocatePages: { address, size in
+            try handleError(mach_vm_deallocate(task, mach_vm_address_t(address.bitPattern), mach_vm_size_t(size)))
+        }, protectPages: { address, size, permissions in
+            try handleError(mach_vm_protect(task, mach_vm_address_t(address.bitPattern), mach_vm_size_t(size), 0, getVMProtection(permissions)))
+        })
     }
 
     deinit {
+        selfdeStopProfiling()
+        selfdeCoverageStop()
+        selfdeDirtyPagesStop()
+        selfdeSetExceptionFilter(nil, nil)
+        selfdeSetSignalFilter(nil, 0, nil, -1)
+        if hasTaskExceptionPort {
+            selfdeRestoreExceptionPortsForTask(state.task)
+        }
+        selfdeClearIgnoredThreads()
         if state.msgServerThread != state.controllerThread {
             if thread_terminate(state.msgServerThread) != KERN_SUCCESS {
                 return
@@ -67,11 +130,75 @@ public class Controller {
         for thread in threads {
             try handleError(selfdeSetExceptionPortForThread(thread.thread, state.exceptionPort))
         }
+        try startExceptionThread()
+    }
+
+    /// Starts a thread that listens for exceptions like breakpoints for all
+    /// of the threads in this process, including the ones that are created
+    /// later. The threads of the controller are left out.
+    public func initializeExceptionHandlingForAllThreads() throws {
+        // The task's exception port is used by every thread that doesn't have its own port,
+        // so the threads don't have to be visited.
+        try handleError(selfdeCreateExceptionPort(state.task, &state.exceptionPort))
+        selfdeIgnoreExceptionsForThread(state.controllerThread)
+        try handleError(selfdeSetExceptionPortForTask(state.task, state.exceptionPort))
+        hasTaskExceptionPort = true
+        try startExceptionThread()
+    }
 
+    private func startExceptionThread() throws {
         // Run the thread that will listen for the exceptions.
+        selfdeSetExceptionFilter(controllerExceptionFilter, Unmanaged.passUnretained(self).toOpaque())
         try handleError(selfdeStartExceptionThread(&state))
     }
 
+    /// Sets the signals of the exceptions that are given to the program without a stop (QPassSignals).
+    /// They are filtered on the exception thread, so they never wake up the controller. The signals
+    /// are the BSD signals that the exceptions become, like SIGSEGV or SIGBUS for EXC_BAD_ACCESS.
+    public func setPassSignals(_ signals: [Int32]) {
+        passSignals = signals
+        updateSignalFilter()
+    }
+
+    /// Sets the signals that can be given to the program (QProgramSignals). The other passed signals
+    /// are discarded and their threads continue, but the faults are always given to the program as
+    /// they would be raised again by the faulting instruction.
+    public func setProgramSignals(_ signals: [Int32]) {
+        programSignals = signals
+        updateSignalFilter()
+    }
+
+    private func updateSignalFilter() {
+        let programSignalCount = programSignals.map { Int32($0.count) } ?? -1
+        selfdeSetSignalFilter(passSignals, Int32(passSignals.count), programSignals ?? [], programSignalCount)
+    }
+
+    // Runs the action of a breakpoint on the exception thread. Returns true when the thread continues.
+    fileprivate func runBreakpointAction(_ thread: Thread) -> Bool {
+        guard let IP = try? thread.getInstructionPointer() else {
+            return false
+        }
+        let actionState = breakpointActionsMutex.withLock { breakpointActions[IP] }
+        // The threads that single step are stepping through a plan of the controller.
+        guard let breakpoint = actionState, (try? thread.isInSingleStepMode()) == false else {
+            return false
+        }
+        selfdeCoverageMarkHit(breakpoint.address.bitPattern64)
+        switch breakpoint.action(thread) {
+        case .continue:
+            // The action might have moved the thread somewhere else.
+            guard let newIP = try? thread.getInstructionPointer() else {
+                return false
+            }
+            if newIP == IP {
+                return (try? thread.setInstructionPointer(breakpoint.displacedInstruction)) != nil
+            }
+            return true
+        case .stop:
+            return false
+        }
+    }
+
     fileprivate func interrupt(_ function: () -> ()) {
         conditionLock.lock()
         hasInterrupt = true
@@ -94,6 +221,7 @@ public class Controller {
             override func main() {
                 controller.interrupt {
                     controller.utilityThreadPort = mach_thread_self()
+                    selfdeIgnoreExceptionsForThread(controller.utilityThreadPort)
                 }
                 function(ControllerInterrupter(controller: controller))
             }
@@ -113,10 +241,34 @@ public class Controller {
     }
 
     public func waitForEvent(interruptHandler: (() -> ())? = nil) throws -> ControllerEvent {
+        if !pendingEvents.isEmpty {
+            return pendingEvents.removeFirst()
+        }
+        return try waitForHandledEvent(interruptHandler: interruptHandler)
+    }
+
+    private func waitForHandledEvent(interruptHandler: (() -> ())?) throws -> ControllerEvent {
+        while true {
+            let event = waitForNextEvent(interruptHandler: interruptHandler)
+            guard case .caughtException(let exception) = event else {
+                return event
+            }
+            if try handleException(exception) {
+                return event
+            }
+        }
+    }
+
+    private func waitForNextEvent(interruptHandler: (() -> ())?) -> ControllerEvent {
         conditionLock.lock()
-        while !state.hasCaughtException && !hasInterrupt {
+        while !state.hasCaughtException && !hasInterrupt && releasedStops.isEmpty {
             conditionLock.wait()
         }
+        if !state.hasCaughtException && !releasedStops.isEmpty {
+            let stop = releasedStops.removeFirst()
+            conditionLock.unlock()
+            return .releasedStop(stop)
+        }
         guard state.hasCaughtException else {
             assert(hasInterrupt)
             interruptHandler?()
@@ -130,21 +282,215 @@ public class Controller {
         hasInterrupt = false
         free(state.caughtException.exceptionData)
         conditionLock.unlock()
-        try handleException(result)
         return .caughtException(result)
     }
 
-    private func handleException(_ exception: Exception) throws {
+    // Returns false when the exception was consumed by the controller and the thread was resumed.
+    private func handleException(_ exception: Exception) throws -> Bool {
+        let thread = exception.thread
+        if let lifted = liftedBreakpoints.removeValue(forKey: thread.threadID) {
+            // The thread has moved past a lifted breakpoint, so it can be put back.
+            breakpoints[lifted.address]?.machineState.reinsert(at: lifted.address)
+            if !lifted.isSingleStepping {
+                try thread.endSingleStepMode()
+                if exception.isSingleStep {
+                    try thread.resume()
+                    return false
+                }
+            }
+        }
         guard exception.isBreakpoint else {
-            return
+            return try continueSteppingPlan(exception)
         }
         // We want to move the IP back to the breakpoint's address when we hit a breakpoint.
-        let IP = try exception.thread.getInstructionPointer()
-        guard let address = breakpointLandingAddresses[IP] else {
-            // We could have simply stepped.
+        // A single step can also end right after a breakpoint's address.
+        let IP = try thread.getInstructionPointer()
+        if !exception.isSingleStep {
+            if let address = breakpointLandingAddresses[IP] {
+                try thread.setInstructionPointer(address)
+                selfdeCoverageMarkHit(address.bitPattern64)
+            } else {
+                let address = Address(bitPattern: IP.bitPattern &- 1)
+                if MachineBreakpointState.isTemporaryTrap(at: address) {
+                    // The INT 3 was only there while the code was patched.
+                    try thread.setInstructionPointer(address)
+                    try thread.resume()
+                    return false
+                }
+            }
+        }
+        return try continueSteppingPlan(exception)
+    }
+
+    // Returns false when the thread was resumed to carry on with its stepping plan.
+    private func continueSteppingPlan(_ exception: Exception) throws -> Bool {
+        let thread = exception.thread
+        let threadID = thread.threadID
+        let IP = try thread.getInstructionPointer()
+        let isBreakpointHit = exception.isBreakpoint && !exception.isSingleStep
+        switch steppingPlans[threadID] {
+        case .range(let range)?:
+            if exception.isSingleStep && range.contains(IP) && breakpoints[IP] == nil {
+                try thread.resume()
+                return false
+            }
+            steppingPlans.removeValue(forKey: threadID)
+            try thread.endSingleStepMode()
+        case .stepOut(let returnAddressSlot, let breakpoint)?:
+            if isBreakpointHit && IP == breakpoint.address {
+                let stackPointer = try thread.getStackPointer()
+                if stackPointer.bitPattern <= returnAddressSlot.bitPattern {
+                    // A recursive call has returned to the same address.
+                    try continueFromBreakpoint(thread)
+                    return false
+                }
+            }
+            steppingPlans.removeValue(forKey: threadID)
+            try removeBreakpoint(breakpoint)
+        case .stepToReturn(let callDepth, let isReturning)?:
+            if exception.isSingleStep && !isReturning && breakpoints[IP] == nil {
+                steppingPlans[threadID] = stepToReturnPlan(at: IP, callDepth: callDepth)
+                try thread.resume()
+                return false
+            }
+            steppingPlans.removeValue(forKey: threadID)
+            try thread.endSingleStepMode()
+        case nil:
+            // Other threads that run into a temporary step out breakpoint keep going.
+            if isBreakpointHit, let bp = breakpoints[IP], bp.counter == temporaryBreakpointCount(at: IP) {
+                try continueFromBreakpoint(thread)
+                return false
+            }
+        }
+        return true
+    }
+
+    private func temporaryBreakpointCount(at address: Address) -> Int {
+        return steppingPlans.values.filter {
+            if case .stepOut(_, let breakpoint) = $0 {
+                return breakpoint.address == address
+            }
+            return false
+        }.count
+    }
+
+    /// Single steps the thread until its instruction pointer leaves the given range or it reaches a breakpoint.
+    /// The intermediate steps are handled in-process and only the final stop is reported by `waitForEvent`.
+    public func stepInRange(_ thread: Thread, range: AddressRange) throws {
+        steppingPlans[thread.threadID] = .range(range)
+        try thread.beginSingleStepMode()
+        try continueFromBreakpoint(thread)
+    }
+
+    // The plan for the instruction that the thread is about to execute.
+    private func stepToReturnPlan(at address: Address, callDepth: Int) -> SteppingPlan {
+        let code = readOriginalCode(at: address, count: MachineBreakpointState.maximumInstructionLength)
+        guard let instruction = decodeInstructionX86_64(code) else {
+            return .stepToReturn(callDepth: callDepth, isReturning: false)
+        }
+        if instruction.branchKind == .call || instruction.isIndirectCall {
+            return .stepToReturn(callDepth: callDepth + 1, isReturning: false)
+        }
+        if instruction.isReturn {
+            return callDepth == 0 ? .stepToReturn(callDepth: 0, isReturning: true) : .stepToReturn(callDepth: callDepth - 1, isReturning: false)
+        }
+        return .stepToReturn(callDepth: callDepth, isReturning: false)
+    }
+
+    /// Runs the thread until the current function returns to its caller, and only the final stop is reported
+    /// by `waitForEvent`. The return address is found using the call frame information of the current
+    /// instruction, and a temporary breakpoint is placed at it. The code without call frame information is
+    /// single stepped until it executes its return instead, as its frame pointer can't be trusted in the
+    /// prologue, the epilogue or in a function that doesn't have a frame.
+    public func stepOut(_ thread: Thread) throws {
+        if let libraries = try? getLoadedLibraries() {
+            unwinder.update(libraries: libraries, getSection: getUnwindSection)
+        }
+        let registers = try thread.getUnwindRegisters()
+        guard let slot = unwinder.returnAddressSlot(of: registers) else {
+            steppingPlans[thread.threadID] = stepToReturnPlan(at: Address(bitPattern: registers.instructionPointer), callDepth: 0)
+            try thread.beginSingleStepMode()
+            try continueFromBreakpoint(thread)
+            return
+        }
+        let returnAddressSlot = Address(bitPattern: slot)
+        let slotBytes = readMemorySafely(at: returnAddressSlot, count: MemoryLayout<UInt>.size)
+        guard slotBytes.count == MemoryLayout<UInt>.size else {
+            throw ControllerError.invalidAddress
+        }
+        let returnAddress = Address(bitPattern: slotBytes.reversed().reduce(0) { ($0 << 8) | UInt($1) })
+        let breakpoint = try installBreakpoint(at: returnAddress)
+        steppingPlans[thread.threadID] = .stepOut(returnAddressSlot: returnAddressSlot, breakpoint: breakpoint)
+        try continueFromBreakpoint(thread)
+    }
+
+    /// Resumes a thread that's stopped at a breakpoint without removing the breakpoint.
+    ///
+    /// The original instruction is executed from a scratch slot that belongs to the thread and
+    /// the thread continues after it without stopping again. Instructions that can't be moved are
+    /// stepped over by lifting the breakpoint instead, and the breakpoint is put back by `waitForEvent`.
+    public func continueFromBreakpoint(_ thread: Thread) throws {
+        let address = try thread.getInstructionPointer()
+        guard let bp = breakpoints[address] else {
+            try thread.resume()
             return
         }
-        try exception.thread.setInstructionPointer(address)
+        // A thread that single steps has to stop after the original instruction.
+        if try !thread.isInSingleStepMode() {
+            let code = readOriginalCode(at: address, count: MachineBreakpointState.maximumInstructionLength)
+            if let slot = try? scratchCode.slot(for: thread.threadID, near: address),
+                let displaced = MachineBreakpointState.displacedInstruction(code, from: address, to: slot) {
+                try scratchCode.write(displaced, to: slot)
+                try thread.setInstructionPointer(slot)
+                try thread.resume()
+                return
+            }
+        }
+        bp.machineState.restoreOriginalInstruction(at: address)
+        liftedBreakpoints[thread.threadID] = LiftedBreakpoint(address: address, isSingleStepping: try thread.isInSingleStepMode())
+        try thread.beginSingleStepMode()
+        try thread.resume()
+    }
+
+    // Reads up to the given number of bytes without faulting on unmapped memory.
+    private func readMemorySafely(at address: Address, count: Int) -> [UInt8] {
+        var bytes = [UInt8](repeating: 0, count: count)
+        let task = state.task
+        let pageSize = UInt(vm_page_size)
+        // The data might end right before an unmapped page.
+        let bytesInPage = Int(pageSize - address.bitPattern % pageSize)
+        var readSize = mach_vm_size_t(0)
+        for size in [count, min(count, bytesInPage)] {
+            let error = bytes.withUnsafeMutableBufferPointer { ptr in
+                mach_vm_read_overwrite(task, mach_vm_address_t(address.bitPattern), mach_vm_size_t(size), mach_vm_address_t(UInt(bitPattern: ptr.baseAddress)), &readSize)
+            }
+            if error == KERN_SUCCESS {
+                break
+            }
+            readSize = 0
+        }
+        bytes.removeSubrange(Int(readSize)..<bytes.count)
+        return bytes
+    }
+
+    private func readWordSafely(at address: UInt) -> UInt? {
+        var value: UInt = 0
+        var readSize = mach_vm_size_t(0)
+        let error = withUnsafeMutablePointer(to: &value) { pointer in
+            mach_vm_read_overwrite(state.task, mach_vm_address_t(address), mach_vm_size_t(MemoryLayout<UInt>.size), mach_vm_address_t(UInt(bitPattern: pointer)), &readSize)
+        }
+        return error == KERN_SUCCESS && readSize == mach_vm_size_t(MemoryLayout<UInt>.size) ? value : nil
+    }
+
+    // Reads the code without the installed breakpoints.
+    private func readOriginalCode(at address: Address, count: Int) -> [UInt8] {
+        var code = readMemorySafely(at: address, count: count)
+        for offset in 0..<code.count {
+            if let bp = breakpoints[Address(bitPattern: address.bitPattern + UInt(offset))] {
+                bp.machineState.restoreOriginalInstruction(in: &code, at: offset)
+            }
+        }
+        return code
     }
 
     public func getSharedLibraryInfoAddress() throws -> Address {
@@ -159,6 +505,250 @@ public class Controller {
         return Address(bitPattern: UInt(dyldInfo.all_image_info_addr))
     }
 
+    // Reads dyld's image list and the load commands of the images in-process, so the debug
+    // server doesn't have to walk them with memory reads.
+    public func getLoadedLibraries() throws -> [LoadedLibrary] {
+        let address = try getSharedLibraryInfoAddress()
+        guard let infos = UnsafePointer<dyld_all_image_infos>(bitPattern: address.bitPattern) else {
+            throw ControllerError.invalidAddress
+        }
+        // dyld clears the array pointer while it's modifying the list, and it updates the timestamp
+        // after every change, so the copy is retried when the list changes while it's read.
+        let maxAttempts = 16
+        var result = [LoadedLibrary]()
+        for attempt in 0..<maxAttempts {
+            let timestamp = infos.pointee.version >= 14 ? infos.pointee.infoArrayChangeTimestamp : 0
+            guard let infoArray = infos.pointee.infoArray else {
+                if attempt + 1 == maxAttempts {
+                    throw ControllerError.invalidRunState
+                }
+                sched_yield()
+                continue
+            }
+            result = []
+            for info in Array(UnsafeBufferPointer(start: infoArray, count: Int(infos.pointee.infoArrayCount))) {
+                guard let header = info.imageLoadAddress else {
+                    continue
+                }
+                let path = info.imageFilePath.map { String(cString: $0) } ?? ""
+                result.append(getLoadedImage(header, path: path, modificationDate: UInt64(info.imageFileModDate)))
+            }
+            let isUnchanged = infos.pointee.infoArray == infoArray && (infos.pointee.version < 14 || infos.pointee.infoArrayChangeTimestamp == timestamp)
+            if isUnchanged {
+                break
+            }
+            if attempt + 1 == maxAttempts {
+                throw ControllerError.invalidRunState
+            }
+        }
+        // dyld isn't in its own list.
+        if infos.pointee.version >= 2, let header = infos.pointee.dyldImageLoadAddress {
+            let path = infos.pointee.version >= 15 ? infos.pointee.dyldPath.map { String(cString: $0) } : nil
+            result.append(getLoadedImage(header, path: path ?? "/usr/lib/dyld", modificationDate: 0))
+        }
+        return result
+    }
+
+    // Reads the image's symbol table from its __LINKEDIT segment.
+    public func getSymbols(in library: LoadedLibrary) throws -> [Symbol] {
+        guard let header = UnsafePointer<mach_header_64>(bitPattern: library.loadAddress.bitPattern), header.pointee.magic == MH_MAGIC_64 else {
+            throw ControllerError.invalidAddress
+        }
+        var symbolTable: symtab_command? = nil
+        var textAddress: UInt64? = nil
+        var linkEdit: segment_command_64? = nil
+        // The ends of the sections in the order of their numbers, which start from 1.
+        var sectionEnds = [UInt64]()
+        var command = UnsafeRawPointer(header).advanced(by: MemoryLayout<mach_header_64>.size)
+        for _ in 0..<header.pointee.ncmds {
+            let loadCommand = command.assumingMemoryBound(to: load_command.self).pointee
+            switch loadCommand.cmd {
+            case UInt32(LC_SYMTAB):
+                symbolTable = command.assumingMemoryBound(to: symtab_command.self).pointee
+            case UInt32(LC_SEGMENT_64):
+                let segment = command.assumingMemoryBound(to: segment_command_64.self).pointee
+                let sections = command.advanced(by: MemoryLayout<segment_command_64>.size).assumingMemoryBound(to: section_64.self)
+                for section in UnsafeBufferPointer(start: sections, count: Int(segment.nsects)) {
+                    sectionEnds.append(section.addr &+ section.size)
+                }
+                let segmentName = getSegmentName(segment)
+                if segmentName == SEG_TEXT {
+                    textAddress = segment.vmaddr
+                } else if segmentName == SEG_LINKEDIT {
+                    linkEdit = segment
+                }
+            default:
+                break
+            }
+            command = command.advanced(by: Int(loadCommand.cmdsize))
+        }
+        guard let table = symbolTable, let text = textAddress, let linkEditSegment = linkEdit else {
+            throw ControllerError.invalidAddress
+        }
+        let slide = UInt64(library.loadAddress.bitPattern) &- text
+        // The symbol table's offsets are file offsets.
+        let linkEditBase = UInt(linkEditSegment.vmaddr &+ slide &- linkEditSegment.fileoff)
+        guard let entries = UnsafePointer<nlist_64>(bitPattern: linkEditBase + UInt(table.symoff)),
+            let strings = UnsafePointer<CChar>(bitPattern: linkEditBase + UInt(table.stroff)) else {
+            throw ControllerError.invalidAddress
+        }
+        var definitions = [nlist_64]()
+        for entry in UnsafeBufferPointer(start: entries, count: Int(table.nsyms)) {
+            // Only the symbols that are defined in a section, without the debugging ones.
+            guard Int32(entry.n_type) & N_STAB == 0 && Int32(entry.n_type) & N_TYPE == N_SECT && entry.n_un.n_strx != 0 else {
+                continue
+            }
+            definitions.append(entry)
+        }
+        // The symbol table doesn't have the sizes, so a symbol extends to the next one in its section.
+        definitions.sort { $0.n_value < $1.n_value }
+        var symbols = [Symbol]()
+        symbols.reserveCapacity(definitions.count)
+        var nextIndex = 0
+        for (i, entry) in definitions.enumerated() {
+            if nextIndex <= i {
+                nextIndex = i + 1
+                while nextIndex < definitions.count && definitions[nextIndex].n_value == entry.n_value {
+                    nextIndex += 1
+                }
+            }
+            let sectionIndex = Int(entry.n_sect) - 1
+            guard sectionIndex >= 0 && sectionIndex < sectionEnds.count else {
+                continue
+            }
+            var end = sectionEnds[sectionIndex]
+            if nextIndex < definitions.count {
+                end = min(end, definitions[nextIndex].n_value)
+            }
+            var name = String(cString: strings + Int(entry.n_un.n_strx))
+            // The C symbols have a leading underscore.
+            if name.hasPrefix("_") {
+                name.remove(at: name.startIndex)
+            }
+            symbols.append(Symbol(name: name, address: Address(bitPattern: UInt(entry.n_value &+ slide)), size: end > entry.n_value ? end - entry.n_value : 0))
+        }
+        return symbols
+    }
+
+    /// Returns the instruction pointers of the frames of the suspended threads, innermost first.
+    /// The stacks are unwound in-process using the __eh_frame sections and the frame pointer chain, so
+    /// a backtrace through a frameless function that only has compact unwind information is truncated.
+    public func getBacktraces(_ threads: [Thread], maxFrames: Int = 256) throws -> [[Address]] {
+        // The images that were loaded since the last backtrace are added once for all of the threads.
+        if let libraries = try? getLoadedLibraries() {
+            unwinder.update(libraries: libraries, getSection: getUnwindSection)
+        }
+        return try threads.map { thread -> [Address] in
+            let registers = try thread.getUnwindRegisters()
+            return unwinder.backtrace(from: registers, maxFrames: maxFrames, readWord: readWordSafely)
+        }
+    }
+
+    public func getBacktrace(_ thread: Thread, maxFrames: Int = 256) throws -> [Address] {
+        return try getBacktraces([thread], maxFrames: maxFrames)[0]
+    }
+
+    /// Starts sampling the threads that are running at the given frequency. The profiler's thread suspends
+    /// the threads one at a time and walks their frame pointers into a preallocated stack table, so the
+    /// threads that are stopped by the controller aren't sampled. Starting it again drops the previous profile.
+    public func startProfiling(frequency: Int = 100, maxFrames: Int = 128) throws {
+        let options = try ProfilerOptions(frequency: frequency, maxFrames: maxFrames)
+        let error = selfdeStartProfiling(options.frequency, options.maxFrames, options.stackCapacity, options.frameCapacity)
+        guard error == 0 else {
+            throw ControllerError.systemError(code: Int(error), message: String(cString: strerror(error)))
+        }
+        samplingInterval = options.samplingInterval
+    }
+
+    public func stopProfiling() {
+        selfdeStopProfiling()
+    }
+
+    /// Puts a one-shot INT 3 on every basic block at the given addresses while the threads keep running.
+    /// The first hit of a block is handled by the exception thread, which sets the block's bit in the
+    /// coverage map and puts back its original byte without waking up the controller. The blocks that
+    /// have breakpoints are covered by the hits of the breakpoints. Returns the number of the installed blocks.
+    public func startCoverage(_ addresses: [Address]) throws -> Int {
+        return try installCoverageSites(addresses, breakpoints: Array(breakpoints.keys)) { _, address, size in
+            return vm_protect(getMachTaskSelf(), vm_address_t(address), vm_size_t(size), boolean_t(0), getVMProtAll()) == KERN_SUCCESS ? 0 : EACCES
+        }
+    }
+
+    /// Removes the INT 3s of the blocks that haven't run. The coverage map can still be read.
+    public func stopCoverage() {
+        selfdeCoverageStop()
+    }
+
+    /// The blocks that have run since the coverage was started. Can be read while the threads are running.
+    public func getCoverage() -> CoverageMap {
+        return readCoverageMap()
+    }
+
+    /// Write-protects the pages of the given ranges. The first write to a page in an epoch is handled by the
+    /// exception thread, which makes the page writable again without waking up the controller.
+    public func startDirtyPageTracking(_ ranges: [AddressRange]) throws -> DirtyPageTrackingMethod {
+        return try startTrackingDirtyPages(ranges, allowWriteProtection: true)
+    }
+
+    public func stopDirtyPageTracking() {
+        selfdeDirtyPagesStop()
+    }
+
+    /// Ends the current epoch and returns the number of the new one.
+    public func advanceDirtyPageEpoch() throws -> Int {
+        return try advanceTrackedDirtyPageEpoch()
+    }
+
+    /// The pages of the range that were written since the given epoch began.
+    public func getDirtyPages(_ range: AddressRange, since epoch: Int) throws -> DirtyPageMap {
+        return try readDirtyPageMap(range, since: epoch)
+    }
+
+    /// Returns the lowest addresses in the range at which the pattern occurs. The readable regions are searched
+    /// with a thread for every processor, and the memory is copied a chunk at a time with mach_vm_read_overwrite,
+    /// so a region that goes away during the search is skipped. A byte matches when (byte & mask) == (pattern & mask).
+    public func searchMemory(_ range: AddressRange, pattern: [UInt8], mask: [UInt8]? = nil, maxMatches: Int = 1) throws -> [Address] {
+        var regions: UnsafeMutablePointer<SelfdeMemoryRange>?
+        var regionCount: UInt32 = 0
+        try handleError(selfdeGetReadableRegions(range.start.bitPattern64, range.end.bitPattern64 &- range.start.bitPattern64, &regions, &regionCount))
+        defer {
+            free(regions)
+        }
+        return try searchMemoryRegions(UnsafeBufferPointer(start: regions, count: Int(regionCount)), pattern: pattern, mask: mask, maxMatches: maxMatches, read: readMemoryChunk)
+    }
+
+    /// Computes the CRC-32 of GDB's qCRC packet over the range, with a thread for every processor.
+    public func computeCRC32(_ range: AddressRange) throws -> UInt32 {
+        return try computeMemoryCRC32(range, read: readMemoryChunk)
+    }
+
+    /// Computes the CRC-32C of every block of the range, with a thread for every processor. The digests
+    /// of the blocks that can't be read are nil.
+    public func computeMemoryDigests(_ range: AddressRange, blockSize: Int) throws -> [UInt32?] {
+        return try digestMemoryBlocks(range, blockSize: blockSize, read: readMemoryChunk)
+    }
+
+    /// The stacks that were sampled since the profiler was started. Can be read while it's running.
+    public func getProfile() -> StackProfile {
+        return StackProfile(samplingInterval: samplingInterval) { selfdeEnumerateProfile($0, $1) }
+    }
+
+    /// Writes a Mach-O core of the process. The threads are suspended only while their states are read and
+    /// the readable memory is remapped copy-on-write, and the memory is written after they're resumed.
+    public func writeCore(to path: String, options: CoreDumpOptions = CoreDumpOptions()) throws -> CoreDumpStatistics {
+        let start = currentUptimeNanoseconds()
+        let threads = try getThreads().map { $0.thread }
+        var snapshot = SelfdeMachCoreSnapshot()
+        try handleError(selfdeCreateCoreSnapshot(threads, UInt32(threads.count), &snapshot))
+        defer {
+            selfdeDestroyCoreSnapshot(&snapshot)
+        }
+        let statistics = try writeCoreFile(at: path) { descriptor, statistics in
+            return selfdeWriteCoreSnapshot(descriptor, &snapshot, options.copyThreads, options.elideZeroPages, &statistics)
+        }
+        return CoreDumpStatistics(statistics, totalDuration: currentUptimeNanoseconds() - start)
+    }
+
     public func suspendThreads() throws {
         for thread in try getThreads() {
             try thread.suspend()
@@ -183,7 +773,7 @@ public class Controller {
         var result = [Thread]()
         for i in 0..<count {
             let thread = threads[Int(i)]
-            if thread == state.controllerThread || thread == state.msgServerThread || thread == utilityThreadPort {
+            if thread == state.controllerThread || thread == state.msgServerThread || thread == utilityThreadPort || thread == selfdeGetProfilerThread() {
                 continue;
             }
             result.append(Thread(thread))
@@ -197,6 +787,64 @@ public class Controller {
         try handleError(vm_protect(state.task, addr, size, boolean_t(0), getVMProtAll()))
     }
 
+    /// Installs a breakpoint that runs the given action on the exception thread when it's hit.
+    /// The action can access the registers of the thread that hit the breakpoint, and when it returns
+    /// `.continue` the thread runs the original instruction from a scratch slot and keeps going without
+    /// the involvement of the controller thread. The action must not use the controller, and it's
+    /// kept until all of the breakpoints at the address are removed.
+    public func installBreakpoint(at address: Address, action: @escaping (Thread) -> BreakpointActionResult) throws -> Breakpoint {
+        guard breakpointActionsMutex.withLock({ !breakpointActions.values.contains(where: { $0.address == address }) }) else {
+            throw ControllerError.invalidBreakpoint
+        }
+        let code = readOriginalCode(at: address, count: MachineBreakpointState.maximumInstructionLength)
+        let slot = try scratchCode.slot(forBreakpointAt: address)
+        guard let displaced = MachineBreakpointState.displacedInstruction(code, from: address, to: slot) else {
+            throw ControllerError.invalidBreakpoint
+        }
+        try scratchCode.write(displaced, to: slot)
+        let breakpoint = try installBreakpoint(at: address)
+        guard let landingAddress = breakpoints[address]?.landingAddress else {
+            throw ControllerError.invalidBreakpoint
+        }
+        breakpointActionsMutex.withLock {
+            breakpointActions[landingAddress] = BreakpointActionState(address: address, action: action, displacedInstruction: slot)
+        }
+        return breakpoint
+    }
+
+    /// Installs a breakpoint whose hits are released right away. The exception thread copies the registers
+    /// and the stack window of the thread that has hit it, the thread continues past the breakpoint, and
+    /// the copy is returned by `waitForEvent` as a `releasedStop` event. The thread is only paused while
+    /// it's copied, and the copy can be reported with `DebugServer.sendStopNotificationForReleasedStop`.
+    public func installReleasingBreakpoint(at address: Address, stackWindowSize: Int = 4096) throws -> Breakpoint {
+        return try installBreakpoint(at: address) { [unowned self] thread in
+            guard let stop = self.copyReleasedStop(thread, at: address, stackWindowSize: stackWindowSize) else {
+                return .stop
+            }
+            self.conditionLock.lock()
+            self.releasedStops.append(stop)
+            self.conditionLock.signal()
+            self.conditionLock.unlock()
+            return .continue
+        }
+    }
+
+    // Runs on the exception thread, the thread is at the landing address of the breakpoint.
+    private func copyReleasedStop(_ thread: Thread, at address: Address, stackWindowSize: Int) -> ThreadStopSnapshot? {
+        var context = [UInt8](repeating: 0, count: MachMachineThread.registerContextSize)
+        guard let contextBytes = try? thread.getRegisterContext(&context), let stackPointer = try? thread.getStackPointer() else {
+            return nil
+        }
+        var registerContext = Array(contextBytes)
+        // The thread is reported at the breakpoint, like the stops that go through the controller.
+        ThreadStopSnapshot.setInstructionPointer(address, in: &registerContext)
+        let window = ThreadStopSnapshot.readStackWindow(stackPointer: stackPointer, windowSize: stackWindowSize, pageSize: Int(vm_page_size)) { address, count in
+            return self.readMemorySafely(at: address, count: count)
+        }
+        let stopInfo = ThreadStopInfo(signalNumber: UInt8(SIGTRAP), dispatchQueueAddress: nil, machInfo: ThreadStopInfo.MachInfo(exceptionType: Int(EXC_BREAKPOINT), exceptionData: [UInt(EXC_I386_BPT), 0]))
+        return ThreadStopSnapshot(threadID: thread.threadID, stopInfo: stopInfo, registerContext: registerContext, instructionPointer: address, stackAddress: window.address, stack: window.bytes)
+    }
+
     public func installBreakpoint(at address: Address) throws -> Breakpoint {
         if let index = breakpoints.index(forKey: address) {
             var bp = breakpoints[index].1
@@ -206,6 +854,7 @@ public class Controller {
         }
         // Make sure we can write to the address.
         try memoryProtectAll(address, size: MachineBreakpointState.numberOfBytesToPatch)
+        selfdeCoverageReleaseSite(address.bitPattern64)
         let (machineState, landingAddress) = MachineBreakpointState.create(at: address)
         breakpoints[address] = BreakpointState(machineState: machineState, landingAddress: landingAddress, counter: 1)
         breakpointLandingAddresses[landingAddress] = address
@@ -229,6 +878,10 @@ public class Controller {
         }
         restoreBreakpointsOriginalInstruction(at: keyValue.key, state: keyValue.value)
         breakpoints.remove(at: index)
+        let hadAction = breakpointActionsMutex.withLock { breakpointActions.removeValue(forKey: bp.landingAddress) != nil }
+        if hadAction {
+            scratchCode.releaseSlot(forBreakpointAt: breakpoint.address)
+        }
         guard let address = breakpointLandingAddresses.removeValue(forKey: bp.landingAddress) else {
             assertionFailure()
             return
@@ -236,36 +889,75 @@ public class Controller {
         assert(address == breakpoint.address)
     }
 
+    /// Replaces the code at the given address while the other threads keep running.
+    /// The code is only replaced when it still contains the expected bytes.
+    public func patchCode(at address: Address, expected: [UInt8]?, replacement: [UInt8]) throws {
+        try memoryProtectAll(address, size: vm_size_t(replacement.count))
+        try MachineBreakpointState.patchCode(at: address, expected: expected, replacement: replacement)
+    }
+
+    /// Calls the function at the given address on a stopped thread and returns the result registers.
+    ///
+    /// The arguments are passed in the System V argument registers, so up to 6 integer and 8 vector
+    /// arguments of 16 bytes are supported. The function returns to a trap, after which the thread's
+    /// registers are restored. Only the given thread is resumed. The events of the other threads that are
+    /// caught before the function returns are reported by the next `waitForEvent`. When the given thread
+    /// stops somewhere else, the call fails with `callInterrupted` and the thread is left in the function,
+    /// with its event reported by the next `waitForEvent`.
+    public func callFunction(at address: Address, on thread: Thread, integerArguments: [UInt64] = [], vectorArguments: [[UInt8]] = []) throws -> FunctionCallResult {
+        let trap = try getFunctionCallTrap()
+        var context = [UInt8](repeating: 0, count: getRegisterContextSize())
+        let savedContext = try thread.getRegisterContext(&context)
+        var isReturning = true
+        defer {
+            if isReturning {
+                _ = try? thread.setRegisterContext(savedContext)
+            }
+        }
+        try thread.setUpFunctionCall(address, returnAddress: trap, integerArguments: integerArguments, vectorArguments: vectorArguments)
+        try thread.resume()
+        while true {
+            let event = try waitForHandledEvent(interruptHandler: nil)
+            guard case .caughtException(let exception) = event, exception.thread == thread else {
+                // The other thread stays stopped until its event is reported.
+                pendingEvents.append(event)
+                continue
+            }
+            let returnAddress = Address(bitPattern: trap.bitPattern + UInt(MachineBreakpointState.functionCallTrap.count))
+            guard exception.isBreakpoint, try thread.getInstructionPointer() == returnAddress else {
+                // The function might hold locks, so it isn't unwound.
+                isReturning = false
+                pendingEvents.append(event)
+                throw ControllerError.callInterrupted
+            }
+            return try thread.getFunctionCallResult()
+        }
+    }
+
+    private func getFunctionCallTrap() throws -> Address {
+        if let trap = functionCallTrap {
+            return trap
+        }
+        let trap = try allocate(Int(vm_page_size), permissions: [.read, .write, .execute])
+        try write(bytes: MachineBreakpointState.functionCallTrap, to: trap)
+        functionCallTrap = trap
+        return trap
+    }
+
+    /// Allocates memory from the pooled pages with the same permissions. The freed memory is
+    /// reused, so the repeated allocations of small blocks don't reach the kernel.
     public func allocate(_ size: Int, permissions: MemoryPermissions) throws -> Address {
-        var address = mach_vm_address_t()
-        let allocationSize = mach_vm_size_t(size)
-        try handleError(mach_vm_allocate(state.task, &address, allocationSize, 1))
-        var protection: vm_prot_t = 0
-        if permissions.contains(.read) {
-            protection |= getVMProtRead()
-        }
-        if permissions.contains(.write) {
-            protection |= getVMProtWrite()
-        }
-        if permissions.contains(.execute) {
-            protection |= getVMProtExecute()
-        }
-        do {
-            try handleError(mach_vm_protect(state.task, address, allocationSize, 0, protection))
-        } catch {
-            mach_vm_deallocate(state.task, address, allocationSize)
-            throw error
-        }
-        let result = Address(bitPattern: UInt(address))
-        allocations[result] = AllocationState(address: address, size: allocationSize)
-        return result
+        return try memoryArena.allocate(size, permissions: permissions)
+    }
+
+    /// Returns read-only executable memory with the given code. The memory of an identical blob
+    /// is reused, and it has to be deallocated once for each returned address.
+    public func allocateCode(_ bytes: [UInt8]) throws -> Address {
+        return try memoryArena.allocateCode(bytes)
     }
 
     public func deallocate(_ address: Address) throws {
-        guard let allocation = allocations[address] else {
-            throw ControllerError.invalidAllocation
-        }
-        try handleError(mach_vm_deallocate(state.task, allocation.address, allocation.size))
+        try memoryArena.deallocate(address)
     }
 
     public func read(at address: Address, size: Int) throws -> MemoryReadResult {
@@ -285,3 +977,84 @@ public class Controller {
         }
     }
 }
+
+private let controllerExceptionFilter: SelfdeExceptionFilter = { context, thread, exceptionType, exceptionData, exceptionDataSize in
+    // Only the breakpoint hits are filtered, the single steps are left to the controller.
+    guard exceptionType == EXC_BREAKPOINT, exceptionDataSize > 0, let data = exceptionData,
+        data[0] != mach_exception_data_type_t(EXC_I386_SGL), let context = context else {
+        return false
+    }
+    let controller = Unmanaged<Controller>.fromOpaque(context).takeUnretainedValue()
+    return controller.runBreakpointAction(Thread(thread))
+}
+
+// Copies the memory with mach_vm_read_overwrite, so the memory that goes away while it's read can't fault.
+private let readMemoryChunk: SelfdeMemoryReadFunction = { _, address, buffer, size in
+    var readSize: mach_vm_size_t = 0
+    return mach_vm_read_overwrite(getMachTaskSelf(), mach_vm_address_t(address), mach_vm_size_t(size), mach_vm_address_t(UInt(bitPattern: buffer)), &readSize) == KERN_SUCCESS && readSize == mach_vm_size_t(size)
+}
+
+private func getVMProtection(_ permissions: MemoryPermissions) -> vm_prot_t {
+    var protection: vm_prot_t = 0
+    if permissions.contains(.read) {
+        protection |= getVMProtRead()
+    }
+    if permissions.contains(.write) {
+        protection |= getVMProtWrite()
+    }
+    if permissions.contains(.execute) {
+        protection |= getVMProtExecute()
+    }
+    return protection
+}
+
+private func getSegmentName(_ segment: segment_command_64) -> String {
+    var name = segment.segname
+    return withUnsafeBytes(of: &name) { bytes -> String in
+        let length = bytes.index(of: 0) ?? bytes.count
+        return String(bytes: bytes[0..<length], encoding: .utf8) ?? ""
+    }
+}
+
+// The compact unwind information isn't read. Its frame pointer encodings are covered by the frame
+// pointer chain and the functions that it can't describe have their FDEs in the __eh_frame section,
+// but the frameless STACK_IMMD and STACK_IND functions are only described there. A backtrace through
+// such a function that has no FDE follows the caller's frame pointer, so it skips the function's
+// caller or it ends early.
+private func getUnwindSection(_ library: LoadedLibrary) -> UnwindSection? {
+    guard let text = library.segments.first(where: { $0.name == "__TEXT" }),
+        let header = UnsafePointer<mach_header_64>(bitPattern: library.loadAddress.bitPattern), header.pointee.magic == MH_MAGIC_64 else {
+        return nil
+    }
+    var size: UInt = 0
+    guard let section = getsectiondata(header, "__TEXT", "__eh_frame", &size) else {
+        return nil
+    }
+    let start = library.loadAddress.bitPattern
+    return UnwindSection(codeStart: start, codeEnd: start + UInt(text.size), ehFrameAddress: UInt(bitPattern: section), ehFrameSize: size)
+}
+
+private func getLoadedImage(_ header: UnsafePointer<mach_header>, path: String, modificationDate: UInt64) -> LoadedLibrary {
+    let imageHeader = LoadedImageHeader(magic: header.pointee.magic, cpuType: header.pointee.cputype, cpuSubType: header.pointee.cpusubtype, fileType: header.pointee.filetype, flags: header.pointee.flags)
+    guard header.pointee.magic == MH_MAGIC_64 else {
+        return LoadedLibrary(path: path, loadAddress: Address(bitPattern: UInt(bitPattern: header)), modificationDate: modificationDate, header: imageHeader)
+    }
+    var uuid: [UInt8]? = nil
+    var segments = [LoadedSegment]()
+    var command = UnsafeRawPointer(header).advanced(by: MemoryLayout<mach_header_64>.size)
+    for _ in 0..<header.pointee.ncmds {
+        let loadCommand = command.assumingMemoryBound(to: load_command.self).pointee
+        switch loadCommand.cmd {
+        case UInt32(LC_SEGMENT_64):
+            let segment = command.assumingMemoryBound(to: segment_command_64.self).pointee
+            segments.append(LoadedSegment(name: getSegmentName(segment), address: segment.vmaddr, size: segment.vmsize, fileOffset: segment.fileoff, fileSize: segment.filesize, maxProtection: segment.maxprot))
+        case UInt32(LC_UUID):
+            var bytes = command.assumingMemoryBound(to: uuid_command.self).pointee.uuid
+            uuid = withUnsafeBytes(of: &bytes) { Array($0) }
+        default:
+            break
+        }
+        command = command.advanced(by: Int(loadCommand.cmdsize))
+    }
+    return LoadedLibrary(path: path, loadAddress: Address(bitPattern: UInt(bitPattern: header)), modificationDate: modificationDate, uuid: uuid, header: imageHeader, segments: segments)
+}
@@ -4,18 +4,190 @@
 //
 
 #include "machControllerImpl.h"
+#include <mach/mach_time.h>
+#include <mach/mach_vm.h>
+#include <mach-o/loader.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/ptrace.h>
 #include <dispatch/dispatch.h>
 #include <pthread.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <unistd.h>
 
 // Global state only accessed by the exception handler thread.
 static SelfdeCaughtMachException caughtExceptionState;
 static bool isExceptionCaught;
 
+static pthread_mutex_t exceptionFilterMutex = PTHREAD_MUTEX_INITIALIZER;
+static SelfdeExceptionFilter exceptionFilter;
+static void *exceptionFilterContext;
+
+void selfdeSetExceptionFilter(SelfdeExceptionFilter filter, void *context) {
+    pthread_mutex_lock(&exceptionFilterMutex);
+    exceptionFilter = filter;
+    exceptionFilterContext = context;
+    pthread_mutex_unlock(&exceptionFilterMutex);
+}
+
+#define MAX_IGNORED_THREADS 8
+
+// The debugger's threads are added by the controller and the exception thread.
+static mach_port_t ignoredThreads[MAX_IGNORED_THREADS];
+static int ignoredThreadCount;
+// The profiler's thread outlives the controllers, so it isn't in the list.
+static mach_port_t profilerThread = MACH_PORT_NULL;
+
+void selfdeIgnoreExceptionsForThread(mach_port_t thread) {
+    int count = __atomic_load_n(&ignoredThreadCount, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < count; ++i) {
+        if (__atomic_load_n(&ignoredThreads[i], __ATOMIC_ACQUIRE) == thread) {
+            return;
+        }
+    }
+    int index = __atomic_fetch_add(&ignoredThreadCount, 1, __ATOMIC_ACQ_REL);
+    assert(index < MAX_IGNORED_THREADS);
+    if (index < MAX_IGNORED_THREADS) {
+        __atomic_store_n(&ignoredThreads[index], thread, __ATOMIC_RELEASE);
+    }
+}
+
+void selfdeClearIgnoredThreads(void) {
+    __atomic_store_n(&ignoredThreadCount, 0, __ATOMIC_RELEASE);
+}
+
+static bool isIgnoredThread(mach_port_t thread) {
+    if (thread == __atomic_load_n(&profilerThread, __ATOMIC_ACQUIRE)) {
+        return true;
+    }
+    int count = __atomic_load_n(&ignoredThreadCount, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < count && i < MAX_IGNORED_THREADS; ++i) {
+        if (__atomic_load_n(&ignoredThreads[i], __ATOMIC_ACQUIRE) == thread) {
+            return true;
+        }
+    }
+    return false;
+}
+
+#define SIGNAL_FILTER_WORDS 4
+
+// The filter is set by the controller thread, so the words are accessed atomically.
+static uint64_t passSignalSet[SIGNAL_FILTER_WORDS];
+static uint64_t programSignalSet[SIGNAL_FILTER_WORDS];
+static bool hasProgramSignals;
+
+static void storeSignalSet(uint64_t *set, const int *signals, int count) {
+    uint64_t words[SIGNAL_FILTER_WORDS] = { 0 };
+    for (int i = 0; i < count; ++i) {
+        if (signals[i] > 0 && signals[i] < SIGNAL_FILTER_WORDS * 64) {
+            words[signals[i] / 64] |= (uint64_t)1 << (signals[i] % 64);
+        }
+    }
+    for (int i = 0; i < SIGNAL_FILTER_WORDS; ++i) {
+        __atomic_store_n(&set[i], words[i], __ATOMIC_RELEASE);
+    }
+}
+
+static bool containsSignal(const uint64_t *set, int signalNumber) {
+    if (signalNumber <= 0 || signalNumber >= SIGNAL_FILTER_WORDS * 64) {
+        return false;
+    }
+    return (__atomic_load_n(&set[signalNumber / 64], __ATOMIC_ACQUIRE) >> (signalNumber % 64)) & 1;
+}
+
+void selfdeSetSignalFilter(const int *passSignals, int passCount, const int *programSignals, int programCount) {
+    storeSignalSet(programSignalSet, programSignals, programCount);
+    __atomic_store_n(&hasProgramSignals, programCount >= 0, __ATOMIC_RELEASE);
+    storeSignalSet(passSignalSet, passSignals, passCount);
+}
+
+// The BSD signal that the exception becomes when it's passed to the program, which is what the QPassSignals
+// and QProgramSignals lists refer to. The stop replies use GDB's exception numbers instead. The breakpoints
+// are left out as the controller needs them.
+static int getExceptionSignalNumber(exception_type_t exceptionType, mach_exception_data_t exceptionData, mach_msg_type_number_t exceptionDataSize) {
+    switch (exceptionType) {
+    case EXC_BAD_ACCESS:
+        return exceptionDataSize > 0 && exceptionData[0] == KERN_INVALID_ADDRESS ? SIGSEGV : SIGBUS;
+    case EXC_BAD_INSTRUCTION:
+        return SIGILL;
+    case EXC_ARITHMETIC:
+        return SIGFPE;
+    case EXC_EMULATION:
+        return SIGEMT;
+    case EXC_SOFTWARE:
+        if (exceptionDataSize == 2 && exceptionData[0] == EXC_SOFT_SIGNAL) {
+            return (int)exceptionData[1];
+        }
+        return SIGTRAP;
+    default:
+        return 0;
+    }
+}
+
+// The thread would raise a synchronous exception again if it was discarded, as it continues at the
+// faulting instruction. Only the signals can be discarded.
+static bool isSynchronousException(exception_type_t exceptionType, mach_exception_data_t exceptionData, mach_msg_type_number_t exceptionDataSize) {
+    return !(exceptionType == EXC_SOFTWARE && exceptionDataSize == 2 && exceptionData[0] == EXC_SOFT_SIGNAL);
+}
+
+// Continues a thread that has hit a coverage site at the site, once its byte has been put back.
+static bool handleCoverageTrap(mach_port_t thread, exception_type_t exceptionType, mach_exception_data_t exceptionData, mach_msg_type_number_t exceptionDataSize) {
+    if (exceptionType != EXC_BREAKPOINT || exceptionDataSize == 0 || exceptionData[0] != EXC_I386_BPT) {
+        return false;
+    }
+    x86_thread_state64_t state;
+    mach_msg_type_number_t stateCount = x86_THREAD_STATE64_COUNT;
+    if (thread_get_state(thread, x86_THREAD_STATE64, (thread_state_t)&state, &stateCount) != KERN_SUCCESS) {
+        return false;
+    }
+    // INT 3 leaves the instruction pointer after the breakpoint.
+    uint64_t address = state.__rip - 1;
+    if (!selfdeCoverageHandleTrap(address)) {
+        return false;
+    }
+    state.__rip = address;
+    return thread_set_state(thread, x86_THREAD_STATE64, (thread_state_t)&state, stateCount) == KERN_SUCCESS;
+}
+
+// The first write to a tracked page in this epoch is retried once the page is writable.
+static bool handleDirtyPageFault(exception_type_t exceptionType, mach_exception_data_t exceptionData, mach_msg_type_number_t exceptionDataSize) {
+    if (exceptionType != EXC_BAD_ACCESS || exceptionDataSize < 2 || exceptionData[0] != KERN_PROTECTION_FAILURE) {
+        return false;
+    }
+    return selfdeDirtyPagesHandleFault((uint64_t)exceptionData[1]);
+}
+
 kern_return_t catch_exception_raise(mach_port_t exception_port, mach_port_t thread, mach_port_t task, exception_type_t exceptionType, mach_exception_data_t exceptionData, mach_msg_type_number_t exceptionDataSize) {
+    // The debugger's threads run the covered code and write the tracked pages as well.
+    if (handleCoverageTrap(thread, exceptionType, exceptionData, exceptionDataSize) || handleDirtyPageFault(exceptionType, exceptionData, exceptionDataSize)) {
+        return KERN_SUCCESS;
+    }
+    if (isIgnoredThread(thread)) {
+        return KERN_FAILURE;
+    }
+    int signalNumber = getExceptionSignalNumber(exceptionType, exceptionData, exceptionDataSize);
+    if (containsSignal(passSignalSet, signalNumber)) {
+        if (!__atomic_load_n(&hasProgramSignals, __ATOMIC_ACQUIRE) || containsSignal(programSignalSet, signalNumber) ||
+            isSynchronousException(exceptionType, exceptionData, exceptionDataSize)) {
+            // The next exception handler gets the exception, which ends up as a signal for the program.
+            return KERN_FAILURE;
+        }
+        return KERN_SUCCESS;
+    }
+
+    // Let the filter handle the exception without waking up the controller.
+    pthread_mutex_lock(&exceptionFilterMutex);
+    SelfdeExceptionFilter filter = exceptionFilter;
+    void *filterContext = exceptionFilterContext;
+    pthread_mutex_unlock(&exceptionFilterMutex);
+    if (filter && filter(filterContext, thread, exceptionType, exceptionData, exceptionDataSize)) {
+        return KERN_SUCCESS;
+    }
+
     // Suspend the thread with the exception.
     thread_suspend(thread);
     thread_abort_safely(thread);
@@ -60,6 +232,7 @@ static void *exceptionHandlerThreadMain(void *arg) {
     ExceptionHandlerContext *context = (ExceptionHandlerContext *)arg;
     mach_port_t port = context->state->exceptionPort;
     context->state->msgServerThread = mach_thread_self();
+    selfdeIgnoreExceptionsForThread(context->state->msgServerThread);
     SelfdeMachControllerState *state = context->state;
 
     // Resume the controller thread and invalidate the context..
@@ -93,15 +266,52 @@ kern_return_t selfdeCreateExceptionPort(mach_port_t task, mach_port_t *exception
     return KERN_SUCCESS;
 }
 
+#define SELFDE_EXCEPTION_MASK (EXC_MASK_BAD_ACCESS | \
+                               EXC_MASK_BAD_INSTRUCTION | \
+                               EXC_MASK_ARITHMETIC | \
+                               EXC_MASK_EMULATION | \
+                               EXC_MASK_SOFTWARE | \
+                               EXC_MASK_BREAKPOINT | \
+                               EXC_MASK_RPC_ALERT | \
+                               EXC_MASK_MACHINE)
+
 kern_return_t selfdeSetExceptionPortForThread(mach_port_t thread, mach_port_t exceptionPort) {
-    return thread_set_exception_ports(thread, (EXC_MASK_BAD_ACCESS |
-                                               EXC_MASK_BAD_INSTRUCTION |
-                                               EXC_MASK_ARITHMETIC |
-                                               EXC_MASK_EMULATION |
-                                               EXC_MASK_SOFTWARE |
-                                               EXC_MASK_BREAKPOINT |
-                                               EXC_MASK_RPC_ALERT |
-                                               EXC_MASK_MACHINE), exceptionPort, EXCEPTION_DEFAULT, THREAD_STATE_NONE);
+    return thread_set_exception_ports(thread, SELFDE_EXCEPTION_MASK, exceptionPort, EXCEPTION_DEFAULT, THREAD_STATE_NONE);
+}
+
+// The task exception ports that were replaced by the controller's port.
+static struct {
+    mach_msg_type_number_t count;
+    exception_mask_t masks[EXC_TYPES_COUNT];
+    mach_port_t ports[EXC_TYPES_COUNT];
+    exception_behavior_t behaviors[EXC_TYPES_COUNT];
+    thread_state_flavor_t flavors[EXC_TYPES_COUNT];
+    bool isSaved;
+} savedTaskExceptionPorts;
+
+kern_return_t selfdeSetExceptionPortForTask(mach_port_t task, mach_port_t exceptionPort) {
+    if (!savedTaskExceptionPorts.isSaved) {
+        savedTaskExceptionPorts.count = EXC_TYPES_COUNT;
+        kern_return_t ret = task_get_exception_ports(task, SELFDE_EXCEPTION_MASK, savedTaskExceptionPorts.masks, &savedTaskExceptionPorts.count, savedTaskExceptionPorts.ports, savedTaskExceptionPorts.behaviors, savedTaskExceptionPorts.flavors);
+        if (ret != KERN_SUCCESS) {
+            return ret;
+        }
+        savedTaskExceptionPorts.isSaved = true;
+    }
+    return task_set_exception_ports(task, SELFDE_EXCEPTION_MASK, exceptionPort, EXCEPTION_DEFAULT, THREAD_STATE_NONE);
+}
+
+kern_return_t selfdeRestoreExceptionPortsForTask(mach_port_t task) {
+    if (!savedTaskExceptionPorts.isSaved) {
+        return KERN_SUCCESS;
+    }
+    // The masks that had no handler go back to the null port.
+    kern_return_t ret = task_set_exception_ports(task, SELFDE_EXCEPTION_MASK, MACH_PORT_NULL, EXCEPTION_DEFAULT, THREAD_STATE_NONE);
+    for (mach_msg_type_number_t i = 0; i < savedTaskExceptionPorts.count && ret == KERN_SUCCESS; ++i) {
+        ret = task_set_exception_ports(task, savedTaskExceptionPorts.masks[i], savedTaskExceptionPorts.ports[i], savedTaskExceptionPorts.behaviors[i], savedTaskExceptionPorts.flavors[i]);
+    }
+    savedTaskExceptionPorts.isSaved = false;
+    return ret;
 }
 
 kern_return_t selfdeStartExceptionThread(SelfdeMachControllerState *state) {
@@ -119,6 +329,330 @@ kern_return_t selfdeStartExceptionThread(SelfdeMachControllerState *state) {
     return KERN_SUCCESS;
 }
 
+static SelfdeSamplingProfiler samplingProfiler = SELFDE_SAMPLING_PROFILER_INITIALIZER;
+
+static bool readWordForProfiler(void *context, uint64_t address, uint64_t *value) {
+    (void)context;
+    mach_vm_size_t size = 0;
+    return mach_vm_read_overwrite(mach_task_self(), address, sizeof(*value), (mach_vm_address_t)(uintptr_t)value, &size) == KERN_SUCCESS && size == sizeof(*value);
+}
+
+// A CPU profile only has the threads that are running. The threads that are waiting and the threads
+// that are suspended by the controller aren't sampled.
+static bool isThreadRunning(thread_act_t thread) {
+    thread_basic_info_data_t info;
+    mach_msg_type_number_t count = THREAD_BASIC_INFO_COUNT;
+    return thread_info(thread, THREAD_BASIC_INFO, (thread_info_t)&info, &count) == KERN_SUCCESS && info.run_state == TH_STATE_RUNNING && info.suspend_count == 0;
+}
+
+static void sampleSuspendedThreads(void *context, SelfdeSamplingProfiler *profiler) {
+    (void)context;
+    mach_port_t task = mach_task_self();
+    thread_act_array_t threads;
+    mach_msg_type_number_t threadCount;
+    if (task_threads(task, &threads, &threadCount) != KERN_SUCCESS) {
+        return;
+    }
+    for (mach_msg_type_number_t i = 0; i < threadCount; ++i) {
+        thread_act_t thread = threads[i];
+        if (!isIgnoredThread(thread) && isThreadRunning(thread) && thread_suspend(thread) == KERN_SUCCESS) {
+            // The suspended thread might hold the locks of malloc, so only the kernel is called until it's resumed.
+            uint32_t frameCount = 0;
+            x86_thread_state64_t state;
+            mach_msg_type_number_t stateCount = x86_THREAD_STATE64_COUNT;
+            if (thread_get_state(thread, x86_THREAD_STATE64, (thread_state_t)&state, &stateCount) == KERN_SUCCESS) {
+                frameCount = selfdeWalkFramePointers(state.__rip, state.__rsp, state.__rbp, profiler->frameBuffer, profiler->maxFrames, readWordForProfiler, NULL);
+            }
+            thread_resume(thread);
+            selfdeSamplingProfilerRecord(profiler, frameCount);
+        }
+        mach_port_deallocate(task, thread);
+    }
+    vm_deallocate(task, (vm_address_t)threads, threadCount * sizeof(thread_act_t));
+}
+
+static void profilerThreadStarted(void *context) {
+    (void)context;
+    __atomic_store_n(&profilerThread, mach_thread_self(), __ATOMIC_RELEASE);
+}
+
+int selfdeStartProfiling(uint32_t frequency, uint32_t maxFrames, uint32_t stackCapacity, uint32_t frameCapacity) {
+    return selfdeSamplingProfilerStart(&samplingProfiler, frequency, maxFrames, stackCapacity, frameCapacity, sampleSuspendedThreads, NULL, profilerThreadStarted, NULL);
+}
+
+void selfdeStopProfiling(void) {
+    selfdeSamplingProfilerStop(&samplingProfiler);
+}
+
+uint64_t selfdeEnumerateProfile(SelfdeStackCallback callback, void *context) {
+    return selfdeSamplingProfilerEnumerateStacks(&samplingProfiler, callback, context);
+}
+
+mach_port_t selfdeGetProfilerThread(void) {
+    return __atomic_load_n(&profilerThread, __ATOMIC_ACQUIRE);
+}
+
+// The region list is allocated with the VM calls, as a suspended thread might be holding the locks of malloc.
+static kern_return_t appendCoreRegion(SelfdeMachCoreSnapshot *snapshot, const SelfdeCoreRegion *region) {
+    if (snapshot->regionCount == snapshot->regionCapacity) {
+        uint32_t capacity = snapshot->regionCapacity ? snapshot->regionCapacity * 2 : 1024;
+        mach_vm_address_t address = 0;
+        kern_return_t error = mach_vm_allocate(mach_task_self(), &address, capacity * sizeof(SelfdeCoreRegion), VM_FLAGS_ANYWHERE);
+        if (error != KERN_SUCCESS) {
+            return error;
+        }
+        if (snapshot->regions) {
+            memcpy((void *)(uintptr_t)address, snapshot->regions, snapshot->regionCount * sizeof(SelfdeCoreRegion));
+            mach_vm_deallocate(mach_task_self(), (mach_vm_address_t)(uintptr_t)snapshot->regions, snapshot->regionCapacity * sizeof(SelfdeCoreRegion));
+        }
+        snapshot->regions = (SelfdeCoreRegion *)(uintptr_t)address;
+        snapshot->regionCapacity = capacity;
+    }
+    snapshot->regions[snapshot->regionCount++] = *region;
+    return KERN_SUCCESS;
+}
+
+static kern_return_t getCoreRegions(SelfdeMachCoreSnapshot *snapshot) {
+    mach_port_t task = mach_task_self();
+    mach_vm_address_t address = 0;
+    natural_t depth = 0;
+    while (true) {
+        mach_vm_size_t size = 0;
+        vm_region_submap_info_data_64_t info;
+        mach_msg_type_number_t count = VM_REGION_SUBMAP_INFO_COUNT_64;
+        kern_return_t error = mach_vm_region_recurse(task, &address, &size, &depth, (vm_region_recurse_info_t)&info, &count);
+        if (error == KERN_INVALID_ADDRESS) {
+            return KERN_SUCCESS;
+        }
+        if (error != KERN_SUCCESS) {
+            return error;
+        }
+        if (info.is_submap) {
+            depth++;
+            continue;
+        }
+        if (info.protection & VM_PROT_READ) {
+            SelfdeCoreRegion region = { address, size, 0, 0, (info.protection & VM_PROT_READ ? PROT_READ : 0) | (info.protection & VM_PROT_WRITE ? PROT_WRITE : 0) | (info.protection & VM_PROT_EXECUTE ? PROT_EXEC : 0) };
+            error = appendCoreRegion(snapshot, &region);
+            if (error != KERN_SUCCESS) {
+                return error;
+            }
+        }
+        address += size;
+    }
+}
+
+kern_return_t selfdeGetReadableRegions(uint64_t address, uint64_t size, SelfdeMemoryRange **regions, uint32_t *count) {
+    mach_port_t task = mach_task_self();
+    uint64_t end = address + size < address ? UINT64_MAX : address + size;
+    uint32_t capacity = 0;
+    *regions = NULL;
+    *count = 0;
+    mach_vm_address_t regionAddress = address;
+    natural_t depth = 0;
+    while (regionAddress < end) {
+        mach_vm_size_t regionSize = 0;
+        vm_region_submap_info_data_64_t info;
+        mach_msg_type_number_t infoCount = VM_REGION_SUBMAP_INFO_COUNT_64;
+        kern_return_t error = mach_vm_region_recurse(task, &regionAddress, &regionSize, &depth, (vm_region_recurse_info_t)&info, &infoCount);
+        if (error == KERN_INVALID_ADDRESS) {
+            break;
+        }
+        if (error != KERN_SUCCESS) {
+            free(*regions);
+            return error;
+        }
+        if (info.is_submap) {
+            depth++;
+            continue;
+        }
+        uint64_t start = regionAddress > address ? regionAddress : address;
+        uint64_t regionEnd = regionAddress + regionSize;
+        if ((info.protection & VM_PROT_READ) && start < end && start < regionEnd) {
+            if (*count == capacity) {
+                capacity = capacity ? capacity * 2 : 256;
+                SelfdeMemoryRange *resized = realloc(*regions, capacity * sizeof(SelfdeMemoryRange));
+                if (!resized) {
+                    free(*regions);
+                    return KERN_RESOURCE_SHORTAGE;
+                }
+                *regions = resized;
+            }
+            SelfdeMemoryRange region = { start, (regionEnd < end ? regionEnd : end) - start };
+            (*regions)[(*count)++] = region;
+        }
+        regionAddress = regionEnd;
+    }
+    return KERN_SUCCESS;
+}
+
+kern_return_t selfdeCreateCoreSnapshot(const thread_act_t *threads, uint32_t threadCount, SelfdeMachCoreSnapshot *snapshot) {
+    memset(snapshot, 0, sizeof(*snapshot));
+    snapshot->threads = calloc(threadCount ? threadCount : 1, sizeof(SelfdeMachCoreThread));
+    if (!snapshot->threads) {
+        return KERN_RESOURCE_SHORTAGE;
+    }
+    mach_timebase_info_data_t timebase;
+    mach_timebase_info(&timebase);
+    mach_port_t task = mach_task_self();
+    uint64_t start = mach_absolute_time();
+    uint32_t suspendedCount = 0;
+    kern_return_t error = KERN_SUCCESS;
+    for (; suspendedCount < threadCount; ++suspendedCount) {
+        if ((error = thread_suspend(threads[suspendedCount])) != KERN_SUCCESS) {
+            break;
+        }
+    }
+    for (uint32_t i = 0; error == KERN_SUCCESS && i < threadCount; ++i) {
+        SelfdeMachCoreThread *thread = &snapshot->threads[i];
+        mach_msg_type_number_t count = x86_THREAD_STATE64_COUNT;
+        if ((error = thread_get_state(threads[i], x86_THREAD_STATE64, (thread_state_t)&thread->state, &count)) != KERN_SUCCESS) {
+            break;
+        }
+        count = x86_FLOAT_STATE64_COUNT;
+        if ((error = thread_get_state(threads[i], x86_FLOAT_STATE64, (thread_state_t)&thread->floatState, &count)) != KERN_SUCCESS) {
+            break;
+        }
+        count = x86_EXCEPTION_STATE64_COUNT;
+        error = thread_get_state(threads[i], x86_EXCEPTION_STATE64, (thread_state_t)&thread->exceptionState, &count);
+    }
+    if (error == KERN_SUCCESS) {
+        error = getCoreRegions(snapshot);
+    }
+    // The copies share the pages with the process until either of them writes to a page.
+    for (uint32_t i = 0; error == KERN_SUCCESS && i < snapshot->regionCount; ++i) {
+        SelfdeCoreRegion *region = &snapshot->regions[i];
+        mach_vm_address_t copy = 0;
+        vm_prot_t currentProtection, maximumProtection;
+        if (mach_vm_remap(task, &copy, region->size, 0, VM_FLAGS_ANYWHERE, task, region->address, TRUE, &currentProtection, &maximumProtection, VM_INHERIT_NONE) == KERN_SUCCESS) {
+            region->sourceAddress = copy;
+        }
+    }
+    for (uint32_t i = 0; i < suspendedCount; ++i) {
+        thread_resume(threads[i]);
+    }
+    snapshot->pauseNanoseconds = (mach_absolute_time() - start) * timebase.numer / timebase.denom;
+    snapshot->threadCount = threadCount;
+    if (error != KERN_SUCCESS) {
+        selfdeDestroyCoreSnapshot(snapshot);
+    }
+    return error;
+}
+
+static bool readCoreSnapshot(void *context, uint64_t address, void *buffer, size_t size) {
+    (void)context;
+    memcpy(buffer, (const void *)(uintptr_t)address, size);
+    return true;
+}
+
+typedef struct CoreThreadCommand {
+    struct thread_command command;
+    uint32_t stateFlavor;
+    uint32_t stateCount;
+    x86_thread_state64_t state;
+    uint32_t floatStateFlavor;
+    uint32_t floatStateCount;
+    x86_float_state64_t floatState;
+    uint32_t exceptionStateFlavor;
+    uint32_t exceptionStateCount;
+    x86_exception_state64_t exceptionState;
+} __attribute__((packed)) CoreThreadCommand;
+
+// The load commands of a 64 bit image are 8 byte aligned, the padding reads as the end of the flavor list.
+#define CORE_THREAD_COMMAND_SIZE ((sizeof(CoreThreadCommand) + 7) & ~(size_t)7)
+
+int selfdeWriteCoreSnapshot(int fd, const SelfdeMachCoreSnapshot *snapshot, uint32_t copyThreadCount, bool elideZeroPages, SelfdeCoreDumpStatistics *statistics) {
+    memset(statistics, 0, sizeof(*statistics));
+    size_t commandsSize = snapshot->regionCount * sizeof(struct segment_command_64) + snapshot->threadCount * CORE_THREAD_COMMAND_SIZE;
+    size_t headerSize = sizeof(struct mach_header_64) + commandsSize;
+    uint8_t *header = calloc(1, headerSize);
+    if (!header) {
+        return ENOMEM;
+    }
+    uint64_t fileSize = selfdeCoreLayoutRegions(snapshot->regions, snapshot->regionCount, headerSize);
+
+    struct mach_header_64 *machHeader = (struct mach_header_64 *)header;
+    machHeader->magic = MH_MAGIC_64;
+    machHeader->cputype = CPU_TYPE_X86_64;
+    machHeader->cpusubtype = CPU_SUBTYPE_X86_64_ALL;
+    machHeader->filetype = MH_CORE;
+    machHeader->ncmds = snapshot->regionCount + snapshot->threadCount;
+    machHeader->sizeofcmds = (uint32_t)commandsSize;
+    uint8_t *command = header + sizeof(struct mach_header_64);
+    for (uint32_t i = 0; i < snapshot->regionCount; ++i) {
+        const SelfdeCoreRegion *region = &snapshot->regions[i];
+        struct segment_command_64 *segment = (struct segment_command_64 *)command;
+        vm_prot_t protection = (region->protection & PROT_READ ? VM_PROT_READ : 0) | (region->protection & PROT_WRITE ? VM_PROT_WRITE : 0) | (region->protection & PROT_EXEC ? VM_PROT_EXECUTE : 0);
+        segment->cmd = LC_SEGMENT_64;
+        segment->cmdsize = sizeof(struct segment_command_64);
+        segment->vmaddr = region->address;
+        segment->vmsize = region->size;
+        segment->fileoff = region->fileOffset;
+        segment->filesize = region->size;
+        segment->maxprot = protection;
+        segment->initprot = protection;
+        command += sizeof(struct segment_command_64);
+    }
+    for (uint32_t i = 0; i < snapshot->threadCount; ++i) {
+        const SelfdeMachCoreThread *thread = &snapshot->threads[i];
+        CoreThreadCommand threadCommand;
+        threadCommand.command.cmd = LC_THREAD;
+        threadCommand.command.cmdsize = (uint32_t)CORE_THREAD_COMMAND_SIZE;
+        threadCommand.stateFlavor = x86_THREAD_STATE64;
+        threadCommand.stateCount = x86_THREAD_STATE64_COUNT;
+        threadCommand.state = thread->state;
+        threadCommand.floatStateFlavor = x86_FLOAT_STATE64;
+        threadCommand.floatStateCount = x86_FLOAT_STATE64_COUNT;
+        threadCommand.floatState = thread->floatState;
+        threadCommand.exceptionStateFlavor = x86_EXCEPTION_STATE64;
+        threadCommand.exceptionStateCount = x86_EXCEPTION_STATE64_COUNT;
+        threadCommand.exceptionState = thread->exceptionState;
+        memcpy(command, &threadCommand, sizeof(threadCommand));
+        command += CORE_THREAD_COMMAND_SIZE;
+    }
+
+    // The file has its full size up front, so that the elided pages are holes that read back as zeros.
+    int error = ftruncate(fd, (off_t)fileSize) == 0 ? selfdeCoreWrite(fd, header, headerSize, 0) : errno;
+    free(header);
+    statistics->threadCount = snapshot->threadCount;
+    statistics->regionCount = snapshot->regionCount;
+    statistics->pauseNanoseconds = snapshot->pauseNanoseconds;
+    if (error == 0) {
+        statistics->writtenBytes = headerSize;
+        error = selfdeCoreWriteRegions(fd, snapshot->regions, snapshot->regionCount, copyThreadCount, elideZeroPages, readCoreSnapshot, NULL, statistics);
+    }
+    return error;
+}
+
+void selfdeDestroyCoreSnapshot(SelfdeMachCoreSnapshot *snapshot) {
+    mach_port_t task = mach_task_self();
+    for (uint32_t i = 0; i < snapshot->regionCount; ++i) {
+        if (snapshot->regions[i].sourceAddress != 0) {
+            mach_vm_deallocate(task, snapshot->regions[i].sourceAddress, snapshot->regions[i].size);
+        }
+    }
+    if (snapshot->regions) {
+        mach_vm_deallocate(task, (mach_vm_address_t)(uintptr_t)snapshot->regions, snapshot->regionCapacity * sizeof(SelfdeCoreRegion));
+    }
+    free(snapshot->threads);
+    memset(snapshot, 0, sizeof(*snapshot));
+}
+
+kern_return_t selfdeMapWritableAlias(mach_port_t task, mach_vm_address_t address, mach_vm_size_t size, mach_vm_address_t *alias) {
+    vm_prot_t currentProtection, maximumProtection;
+    *alias = 0;
+    kern_return_t result = mach_vm_remap(task, alias, size, 0, VM_FLAGS_ANYWHERE, task, address, FALSE, &currentProtection, &maximumProtection, VM_INHERIT_NONE);
+    if (result != KERN_SUCCESS) {
+        return result;
+    }
+    result = mach_vm_protect(task, *alias, size, FALSE, VM_PROT_READ | VM_PROT_WRITE);
+    if (result != KERN_SUCCESS) {
+        mach_vm_deallocate(task, *alias, size);
+        *alias = 0;
+    }
+    return result;
+}
+
 mach_port_t getMachTaskSelf() {
     return mach_task_self();
 }
@@ -9,6 +9,12 @@
 #include <mach/mach.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include "samplingProfiler.h"
+#include "coreDump.h"
+#include "coverage.h"
+#include "dirtyPages.h"
+#include "memoryChecksum.h"
+#include "memorySearch.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -32,10 +38,73 @@ typedef struct SelfdeMachControllerState {
     bool hasCaughtException;
 } SelfdeMachControllerState;
 
+// Called on the exception thread before an exception is reported to the controller. The thread
+// that caused the exception is blocked until the filter returns. Returns true when the exception
+// was handled and the thread can continue, in which case the controller isn't woken up.
+typedef bool (*SelfdeExceptionFilter)(void *context, mach_port_t thread, exception_type_t exceptionType, mach_exception_data_t exceptionData, mach_msg_type_number_t exceptionDataSize);
+
+void selfdeSetExceptionFilter(SelfdeExceptionFilter filter, void *context);
+
+// The exceptions with one of the passed signals are given to the next exception handler without
+// waking up the controller, or they're discarded when the signal isn't one of the program signals.
+// A negative program signal count allows all of the passed signals. The signal numbers are the
+// ones from the remote debugging protocol, and the breakpoints are never filtered.
+void selfdeSetSignalFilter(const int *passSignals, int passCount, const int *programSignals, int programCount);
+
 kern_return_t selfdeCreateExceptionPort(mach_port_t task, mach_port_t *exceptionPort);
 kern_return_t selfdeSetExceptionPortForThread(mach_port_t thread, mach_port_t exceptionPort);
 kern_return_t selfdeStartExceptionThread(SelfdeMachControllerState *state);
 
+// Sends the exceptions of every thread in the task to the port, including the threads that are
+// created later. The previous task exception ports are saved and put back by the restore function.
+kern_return_t selfdeSetExceptionPortForTask(mach_port_t task, mach_port_t exceptionPort);
+kern_return_t selfdeRestoreExceptionPortsForTask(mach_port_t task);
+
+// The exceptions of the debugger's own threads are given to the next exception handler.
+void selfdeIgnoreExceptionsForThread(mach_port_t thread);
+void selfdeClearIgnoredThreads(void);
+
+// Samples the threads that are running by suspending them and walking their frame pointers. The
+// debugger's threads aren't sampled, and the profiler's thread is ignored like them.
+int selfdeStartProfiling(uint32_t frequency, uint32_t maxFrames, uint32_t stackCapacity, uint32_t frameCapacity);
+void selfdeStopProfiling(void);
+// Returns the number of the dropped samples.
+uint64_t selfdeEnumerateProfile(SelfdeStackCallback callback, void *context);
+// MACH_PORT_NULL before the profiler is first started.
+mach_port_t selfdeGetProfilerThread(void);
+
+// The thread states that go into the LC_THREAD command of a thread in a Mach-O core.
+typedef struct SelfdeMachCoreThread {
+    x86_thread_state64_t state;
+    x86_float_state64_t floatState;
+    x86_exception_state64_t exceptionState;
+} SelfdeMachCoreThread;
+
+// The process at the moment its threads were suspended. The regions are copy-on-write copies
+// in the task, so they can be written out after the threads have been resumed.
+typedef struct SelfdeMachCoreSnapshot {
+    SelfdeMachCoreThread *threads;
+    uint32_t threadCount;
+    SelfdeCoreRegion *regions;
+    uint32_t regionCount;
+    uint32_t regionCapacity;
+    uint64_t pauseNanoseconds;
+} SelfdeMachCoreSnapshot;
+
+// Suspends the given threads only while their states are read and the readable regions are remapped.
+kern_return_t selfdeCreateCoreSnapshot(const thread_act_t *threads, uint32_t threadCount, SelfdeMachCoreSnapshot *snapshot);
+// Writes the snapshot as an MH_CORE file. Returns the errno of the write that failed.
+int selfdeWriteCoreSnapshot(int fd, const SelfdeMachCoreSnapshot *snapshot, uint32_t copyThreadCount, bool elideZeroPages, SelfdeCoreDumpStatistics *statistics);
+void selfdeDestroyCoreSnapshot(SelfdeMachCoreSnapshot *snapshot);
+
+// The parts of the readable regions of the task that are inside of the given range, which are
+// returned in a malloc'ed array.
+kern_return_t selfdeGetReadableRegions(uint64_t address, uint64_t size, SelfdeMemoryRange **regions, uint32_t *count);
+
+// Maps the pages a second time with read and write access, so that the code in them can be written
+// while they're only readable and executable.
+kern_return_t selfdeMapWritableAlias(mach_port_t task, mach_vm_address_t address, mach_vm_size_t size, mach_vm_address_t *alias);
+
 mach_port_t getMachTaskSelf();
 
 vm_prot_t getVMProtAll();
@@ -24,6 +24,11 @@ public extension Exception {
         return type == EXC_BREAKPOINT
     }
 
+    // Hardware single step completion.
+    public var isSingleStep: Bool {
+        return type == EXC_BREAKPOINT && data.first == UInt(EXC_I386_SGL)
+    }
+
     public var isBadAccess: Bool {
         return type == EXC_BAD_ACCESS
     }
@@ -0,0 +1,161 @@
+//
+//  machScratchCode.swift
+//  Selfde
+//
+
+import Darwin.Mach
+
+/// Executable pages with per-thread slots that are used to run displaced instructions.
+/// The pages are kept within 1GB of the code that uses them so that the RIP-relative
+/// displacements of the copied instructions can be adjusted. The pages are only readable and
+/// executable, and the slots are written through a writable mapping of the same memory, as the
+/// other threads might be running the instructions in the other slots of a page.
+final class ScratchCodePool {
+    // A slot is either reused by one thread, or it has the displaced instruction of
+    // one breakpoint which can be run by any thread.
+    private enum SlotOwner: Hashable {
+        case thread(ThreadID)
+        case breakpoint(Address)
+
+        var hashValue: Int {
+            switch self {
+            case .thread(let threadID):
+                return threadID.hashValue
+            case .breakpoint(let address):
+                return address.hashValue ^ 1
+            }
+        }
+
+        static func ==(lhs: SlotOwner, rhs: SlotOwner) -> Bool {
+            switch (lhs, rhs) {
+            case (.thread(let a), .thread(let b)):
+                return a == b
+            case (.breakpoint(let a), .breakpoint(let b)):
+                return a == b
+            default:
+                return false
+            }
+        }
+    }
+    private struct Page {
+        let address: UInt
+        let writableAddress: UInt
+        var slots: [SlotOwner: Int]
+    }
+    private static let maximumDistance: UInt = 1 << 30
+    private static let searchStep: UInt = 16 << 20
+    private let task: mach_port_t
+    private let slotSize: UInt
+    private var pages: [Page] = []
+
+    init(task: mach_port_t, slotSize: Int) {
+        self.task = task
+        self.slotSize = UInt(slotSize)
+    }
+
+    deinit {
+        for page in pages {
+            mach_vm_deallocate(task, mach_vm_address_t(page.writableAddress), mach_vm_size_t(vm_page_size))
+            mach_vm_deallocate(task, mach_vm_address_t(page.address), mach_vm_size_t(vm_page_size))
+        }
+    }
+
+    private static func distance(_ a: UInt, _ b: UInt) -> UInt {
+        return a > b ? a - b : b - a
+    }
+
+    /// Returns the slot that belongs to the given thread in a page that's near the given address.
+    func slot(for thread: ThreadID, near address: Address) throws -> Address {
+        return try slot(for: .thread(thread), near: address)
+    }
+
+    /// Returns the slot for the displaced instruction of the breakpoint at the given address.
+    func slot(forBreakpointAt address: Address) throws -> Address {
+        return try slot(for: .breakpoint(address), near: address)
+    }
+
+    /// Writes the instruction into a slot that was returned by the pool.
+    func write(_ bytes: [UInt8], to slot: Address) throws {
+        let pageSize = UInt(vm_page_size)
+        guard UInt(bytes.count) <= slotSize, let page = pages.first(where: { slot.bitPattern &- $0.address < pageSize }),
+            let destination = UnsafeMutablePointer<UInt8>(bitPattern: page.writableAddress + (slot.bitPattern - page.address)) else {
+            throw ControllerError.invalidAddress
+        }
+        for (i, byte) in bytes.enumerated() {
+            destination[i] = byte
+        }
+    }
+
+    /// Frees the slot of the breakpoint at the given address, so that it can be used by another one.
+    func releaseSlot(forBreakpointAt address: Address) {
+        if let index = pages.index(where: { $0.slots[.breakpoint(address)] != nil }) {
+            pages[index].slots[.breakpoint(address)] = nil
+        }
+    }
+
+    private func slot(for owner: SlotOwner, near address: Address) throws -> Address {
+        let pageSize = UInt(vm_page_size)
+        let slotCount = Int(pageSize / slotSize)
+        let index = pages.index(where: { page in
+            ScratchCodePool.distance(page.address, address.bitPattern) < ScratchCodePool.maximumDistance - pageSize &&
+                (page.slots[owner] != nil || page.slots.count < slotCount)
+        })
+        var page: Page
+        if let index = index {
+            page = pages[index]
+        } else {
+            let allocation = try allocatePage(near: address)
+            page = Page(address: allocation.address, writableAddress: allocation.writableAddress, slots: [:])
+        }
+        // The slots of the removed breakpoints are reused.
+        let usedSlots = Set(page.slots.values)
+        let slotIndex = page.slots[owner] ?? (0..<slotCount).first(where: { !usedSlots.contains($0) })!
+        page.slots[owner] = slotIndex
+        if let index = index {
+            pages[index] = page
+        } else {
+            pages.append(page)
+        }
+        return Address(bitPattern: page.address + UInt(slotIndex) * slotSize)
+    }
+
+    private func allocatePage(near address: Address) throws -> (address: UInt, writableAddress: UInt) {
+        let pageSize = UInt(vm_page_size)
+        let base = address.bitPattern & ~(pageSize - 1)
+        func isNear(_ candidate: mach_vm_address_t) -> Bool {
+            return ScratchCodePool.distance(UInt(candidate), base) < ScratchCodePool.maximumDistance - pageSize
+        }
+        func protect(_ page: mach_vm_address_t) throws -> (address: UInt, writableAddress: UInt) {
+            var writablePage: mach_vm_address_t = 0
+            do {
+                try handleError(mach_vm_protect(task, page, mach_vm_size_t(pageSize), 0, getVMProtRead() | getVMProtExecute()))
+                try handleError(selfdeMapWritableAlias(task, page, mach_vm_size_t(pageSize), &writablePage))
+            } catch {
+                mach_vm_deallocate(task, page, mach_vm_size_t(pageSize))
+                throw error
+            }
+            return (address: UInt(page), writableAddress: UInt(writablePage))
+        }
+
+        // The kernel starts looking for free space at the hint.
+        var page = mach_vm_address_t(base)
+        if mach_vm_allocate(task, &page, mach_vm_size_t(pageSize), VM_FLAGS_ANYWHERE) == KERN_SUCCESS {
+            if isNear(page) {
+                return try protect(page)
+            }
+            mach_vm_deallocate(task, page, mach_vm_size_t(pageSize))
+        }
+        // Probe the address space around the code.
+        let stepCount = ScratchCodePool.maximumDistance / ScratchCodePool.searchStep
+        for i in 1..<stepCount {
+            let offset = i * ScratchCodePool.searchStep
+            for candidate in [base &- offset, base &+ offset] where isNear(mach_vm_address_t(candidate)) {
+                page = mach_vm_address_t(candidate)
+                if mach_vm_allocate(task, &page, mach_vm_size_t(pageSize), VM_FLAGS_FIXED) == KERN_SUCCESS {
+                    return try protect(page)
+                }
+            }
+        }
+        throw ControllerError.scratchMemoryUnavailable
+    }
+}
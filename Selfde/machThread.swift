@@ -43,6 +43,18 @@ public struct Thread {
         return try impl.getStackPointer()
     }
 
+    func getUnwindRegisters() throws -> UnwindRegisters {
+        return try impl.getUnwindRegisters()
+    }
+
+    func setUpFunctionCall(_ function: Address, returnAddress: Address, integerArguments: [UInt64], vectorArguments: [[UInt8]]) throws {
+        try impl.setUpFunctionCall(function, returnAddress: returnAddress, integerArguments: integerArguments, vectorArguments: vectorArguments)
+    }
+
+    func getFunctionCallResult() throws -> FunctionCallResult {
+        return try impl.getFunctionCallResult()
+    }
+
     public func getRegisterValue(_ id: UInt32, setID: UInt32, dest: inout [UInt8]) throws -> ArraySlice<UInt8> {
         return try impl.getRegisterValue(id, setID: setID, dest: &dest)
     }
@@ -67,6 +79,10 @@ public struct Thread {
         try impl.setHardwareSingleStep(false)
     }
 
+    public func isInSingleStepMode() throws -> Bool {
+        return try impl.isHardwareSingleStepEnabled()
+    }
+
     public func suspend() throws {
         try handleError(thread_suspend(thread))
     }
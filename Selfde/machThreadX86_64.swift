@@ -81,6 +81,10 @@ struct MachThreadX86_64 {
         try setState(&state)
     }
 
+    func isHardwareSingleStepEnabled() throws -> Bool {
+        return (try getGPRState().__rflags & 0x100) != 0
+    }
+
     func getInstructionPointer() throws -> Address {
         return Address(bitPattern64: try getGPRState().__rip)
     }
@@ -95,6 +99,48 @@ struct MachThreadX86_64 {
         return Address(bitPattern64: try getGPRState().__rsp)
     }
 
+    func getUnwindRegisters() throws -> UnwindRegisters {
+        let state = try getGPRState()
+        return UnwindRegisters(instructionPointer: UInt(state.__rip), stackPointer: UInt(state.__rsp), framePointer: UInt(state.__rbp))
+    }
+
+    // Points the thread at the function with the arguments in the System V argument registers.
+    func setUpFunctionCall(_ function: Address, returnAddress: Address, integerArguments: [UInt64], vectorArguments: [[UInt8]]) throws {
+        guard !vectorArguments.contains(where: { $0.count != 16 }) else {
+            throw ControllerError.invalidCallArguments
+        }
+        let vectors = vectorArguments.flatMap { $0 }
+        var state = try getGPRState()
+        if hasAVX {
+            var avxState = try getAVXState()
+            guard setupFunctionCallX86_64(&state, nil, &avxState, function.bitPattern64, returnAddress.bitPattern64, integerArguments, integerArguments.count, vectors, vectorArguments.count) else {
+                throw ControllerError.invalidCallArguments
+            }
+            try setAVXState(&avxState)
+        } else {
+            var fpuState = try getFPUState()
+            guard setupFunctionCallX86_64(&state, &fpuState, nil, function.bitPattern64, returnAddress.bitPattern64, integerArguments, integerArguments.count, vectors, vectorArguments.count) else {
+                throw ControllerError.invalidCallArguments
+            }
+            try setFPUState(&fpuState)
+        }
+        try setGPRState(&state)
+    }
+
+    func getFunctionCallResult() throws -> FunctionCallResult {
+        var state = try getGPRState()
+        var integers = [UInt64](repeating: 0, count: 2)
+        var vectors = [UInt8](repeating: 0, count: 32)
+        if hasAVX {
+            var avxState = try getAVXState()
+            getFunctionCallResultX86_64(&state, nil, &avxState, &integers, &vectors)
+        } else {
+            var fpuState = try getFPUState()
+            getFunctionCallResultX86_64(&state, &fpuState, nil, &integers, &vectors)
+        }
+        return FunctionCallResult(integerValues: integers, vectorValues: [Array(vectors[0..<16]), Array(vectors[16..<32])])
+    }
+
     func getRegisterValue(_ id: UInt32, setID: UInt32, dest: inout [UInt8]) throws -> ArraySlice<UInt8> {
         switch getRegisterSetKindX86_64(setID) {
         case GPRKindX86_64:
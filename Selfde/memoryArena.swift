@@ -0,0 +1,222 @@
+//
+//  memoryArena.swift
+//  Selfde
+//
+
+/// Carves the allocations out of larger blocks of pages that are grouped by their permissions,
+/// so that the small allocations of an expression evaluator are served without kernel calls.
+/// The freed memory stays in the arena and it's reused by the next allocations.
+///
+/// The arena also keeps a cache of code blobs that are hashed by their contents, which lets an
+/// identical blob reuse the executable memory that was written before. Each blob gets its own pages,
+/// which are readable and executable and only writable while the blob is copied in, so no thread can
+/// run the code in them in the meantime. The pages of the freed blobs are reused by the next blobs.
+final class MemoryArena {
+    typealias AllocatePages = (_ size: Int, _ permissions: MemoryPermissions) throws -> Address
+    typealias DeallocatePages = (_ address: Address, _ size: Int) throws -> ()
+    typealias ProtectPages = (_ address: Address, _ size: Int, _ permissions: MemoryPermissions) throws -> ()
+
+    private static let blockSize = 64 * 1024
+    // Allocations that are larger than this get their own pages.
+    private static let largeAllocationSize = blockSize / 4
+    private static let alignment = 16
+    private static let codePermissions: MemoryPermissions = [.read, .execute]
+    // The pages of the freed code blobs that are kept for reuse.
+    private static let maxFreeCodePages = 16
+
+    private struct FreeRange {
+        var offset: Int
+        var size: Int
+    }
+    private struct Block {
+        let address: Address
+        let size: Int
+        let permissions: MemoryPermissions
+        // Sorted by the offset, the neighbouring ranges are merged.
+        var freeRanges: [FreeRange]
+    }
+    private struct Allocation {
+        // The index of the block, or nil when the allocation has its own pages.
+        let blockIndex: Int?
+        let size: Int
+    }
+    private struct CachedCode {
+        let address: Address
+        let bytes: [UInt8]
+        var referenceCount: Int
+    }
+    private let allocatePages: AllocatePages
+    private let deallocatePages: DeallocatePages
+    private let protectPages: ProtectPages
+    private let pageSize: Int
+    private var blocks: [Block] = []
+    private var allocations: [Address: Allocation] = [:]
+    private var codeCache: [Int: [CachedCode]] = [:]
+    private var cachedCodeHashes: [Address: Int] = [:]
+    // The code blobs, which have their own pages.
+    private var codePages = Set<Address>()
+    private var freeCodePages: [(address: Address, size: Int)] = []
+
+    init(pageSize: Int, allocatePages: @escaping AllocatePages, deallocatePages: @escaping DeallocatePages, protectPages: @escaping ProtectPages) {
+        self.pageSize = pageSize
+        self.allocatePages = allocatePages
+        self.deallocatePages = deallocatePages
+        self.protectPages = protectPages
+    }
+
+    deinit {
+        for block in blocks {
+            _ = try? deallocatePages(block.address, block.size)
+        }
+        for (address, allocation) in allocations where allocation.blockIndex == nil {
+            _ = try? deallocatePages(address, allocation.size)
+        }
+        for pages in freeCodePages {
+            _ = try? deallocatePages(pages.address, pages.size)
+        }
+    }
+
+    private static func roundUp(_ value: Int, to alignment: Int) -> Int {
+        return (value + alignment - 1) / alignment * alignment
+    }
+
+    func allocate(_ size: Int, permissions: MemoryPermissions) throws -> Address {
+        let size = MemoryArena.roundUp(max(size, 1), to: MemoryArena.alignment)
+        guard size <= MemoryArena.largeAllocationSize else {
+            let pagesSize = MemoryArena.roundUp(size, to: pageSize)
+            let address = try allocatePages(pagesSize, permissions)
+            allocations[address] = Allocation(blockIndex: nil, size: pagesSize)
+            return address
+        }
+        for blockIndex in blocks.indices where blocks[blockIndex].permissions == permissions {
+            if let address = allocate(size, in: blockIndex) {
+                return address
+            }
+        }
+        let blockSize = MemoryArena.roundUp(MemoryArena.blockSize, to: pageSize)
+        let address = try allocatePages(blockSize, permissions)
+        blocks.append(Block(address: address, size: blockSize, permissions: permissions, freeRanges: [FreeRange(offset: 0, size: blockSize)]))
+        guard let result = allocate(size, in: blocks.count - 1) else {
+            throw ControllerError.invalidAllocation
+        }
+        return result
+    }
+
+    // First fit.
+    private func allocate(_ size: Int, in blockIndex: Int) -> Address? {
+        guard let rangeIndex = blocks[blockIndex].freeRanges.index(where: { $0.size >= size }) else {
+            return nil
+        }
+        let range = blocks[blockIndex].freeRanges[rangeIndex]
+        if range.size == size {
+            blocks[blockIndex].freeRanges.remove(at: rangeIndex)
+        } else {
+            blocks[blockIndex].freeRanges[rangeIndex] = FreeRange(offset: range.offset + size, size: range.size - size)
+        }
+        let address = Address(bitPattern: blocks[blockIndex].address.bitPattern + UInt(range.offset))
+        allocations[address] = Allocation(blockIndex: blockIndex, size: size)
+        return address
+    }
+
+    func deallocate(_ address: Address) throws {
+        guard let allocation = allocations[address] else {
+            throw ControllerError.invalidAllocation
+        }
+        if let hash = cachedCodeHashes[address], let index = codeCache[hash]?.index(where: { $0.address == address }) {
+            codeCache[hash]![index].referenceCount -= 1
+            guard codeCache[hash]![index].referenceCount == 0 else {
+                return
+            }
+            codeCache[hash]!.remove(at: index)
+            cachedCodeHashes[address] = nil
+        }
+        if codePages.remove(address) != nil && freeCodePages.count < MemoryArena.maxFreeCodePages {
+            allocations[address] = nil
+            freeCodePages.append((address: address, size: allocation.size))
+            return
+        }
+        guard let blockIndex = allocation.blockIndex else {
+            try deallocatePages(address, allocation.size)
+            allocations[address] = nil
+            return
+        }
+        allocations[address] = nil
+        let offset = Int(address.bitPattern - blocks[blockIndex].address.bitPattern)
+        var ranges = blocks[blockIndex].freeRanges
+        let insertionIndex = ranges.index(where: { $0.offset > offset }) ?? ranges.count
+        ranges.insert(FreeRange(offset: offset, size: allocation.size), at: insertionIndex)
+        // Merge with the next range and then with the previous one.
+        if insertionIndex + 1 < ranges.count && offset + allocation.size == ranges[insertionIndex + 1].offset {
+            ranges[insertionIndex].size += ranges[insertionIndex + 1].size
+            ranges.remove(at: insertionIndex + 1)
+        }
+        if insertionIndex > 0 && ranges[insertionIndex - 1].offset + ranges[insertionIndex - 1].size == offset {
+            ranges[insertionIndex - 1].size += ranges[insertionIndex].size
+            ranges.remove(at: insertionIndex)
+        }
+        blocks[blockIndex].freeRanges = ranges
+    }
+
+    private static func hash(_ bytes: [UInt8]) -> Int {
+        // FNV-1a.
+        var result: UInt64 = 0xcbf29ce484222325
+        for byte in bytes {
+            result = (result ^ UInt64(byte)) &* 0x100000001b3
+        }
+        return Int(truncatingBitPattern: result)
+    }
+
+    /// Returns executable memory with the given code. A blob that's already in the cache is reused,
+    /// and it has to be deallocated as many times as it was returned.
+    func allocateCode(_ bytes: [UInt8]) throws -> Address {
+        let hash = MemoryArena.hash(bytes)
+        if let index = codeCache[hash]?.index(where: { $0.bytes == bytes }) {
+            codeCache[hash]![index].referenceCount += 1
+            return codeCache[hash]![index].address
+        }
+        let address = try allocateCode(size: bytes.count) { _ in bytes }
+        var entries = codeCache[hash] ?? []
+        entries.append(CachedCode(address: address, bytes: bytes, referenceCount: 1))
+        codeCache[hash] = entries
+        cachedCodeHashes[address] = hash
+        return address
+    }
+
+    /// Returns executable memory with the code that's generated for its address, like an instruction
+    /// that's relocated there. The code isn't shared with the other blobs.
+    func allocateCode(size: Int, generate: (Address) throws -> [UInt8]) throws -> Address {
+        let pagesSize = MemoryArena.roundUp(max(size, 1), to: pageSize)
+        let address: Address
+        if let index = freeCodePages.index(where: { $0.size == pagesSize }) {
+            address = freeCodePages.remove(at: index).address
+            do {
+                try protectPages(address, pagesSize, [.read, .write])
+            } catch {
+                try deallocatePages(address, pagesSize)
+                throw error
+            }
+        } else {
+            address = try allocatePages(pagesSize, [.read, .write])
+        }
+        allocations[address] = Allocation(blockIndex: nil, size: pagesSize)
+        codePages.insert(address)
+        do {
+            try writeCode(try generate(address), to: address, size: size)
+            try protectPages(address, pagesSize, MemoryArena.codePermissions)
+        } catch {
+            try deallocate(address)
+            throw error
+        }
+        return address
+    }
+
+    // The pages of the blob are writable and they're made executable afterwards.
+    private func writeCode(_ bytes: [UInt8], to address: Address, size: Int) throws {
+        guard bytes.count <= size, let destination = UnsafeMutablePointer<UInt8>(bitPattern: address.bitPattern) else {
+            throw ControllerError.invalidAddress
+        }
+        for (i, byte) in bytes.enumerated() {
+            destination[i] = byte
+        }
+    }
+}
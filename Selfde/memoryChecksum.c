@@ -0,0 +1,285 @@
+//
+//  memoryChecksum.c
+//  Selfde
+//
+// Every block of the range is split into units of up to a chunk, which the checksum threads take in
+// turn. A unit's CRC is computed from 0, and the CRCs of the units of a block are combined afterwards,
+// as the CRC of two parts is the CRC of the first one shifted by the length of the second one XOR'ed
+// with the CRC of the second one.
+
+#include "memoryChecksum.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <nmmintrin.h>
+#endif
+
+#define CHUNK_SIZE (1024 * 1024)
+#define MAX_CHECKSUM_THREADS 32
+// GDB's CRC-32 has the most significant bit first, and CRC-32C has it last.
+#define CRC32_POLYNOMIAL 0x04C11DB7u
+#define CRC32C_REFLECTED_POLYNOMIAL 0x82F63B78u
+
+static uint32_t crc32Tables[8][256];
+static uint32_t crc32cTable[256];
+static bool hasCRC32Instruction;
+static pthread_once_t tablesOnce = PTHREAD_ONCE_INIT;
+
+static void initializeTables(void) {
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t crc = i << 24;
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = crc & 0x80000000u ? (crc << 1) ^ CRC32_POLYNOMIAL : crc << 1;
+        }
+        crc32Tables[0][i] = crc;
+        uint32_t reflected = i;
+        for (int bit = 0; bit < 8; ++bit) {
+            reflected = reflected & 1 ? (reflected >> 1) ^ CRC32C_REFLECTED_POLYNOMIAL : reflected >> 1;
+        }
+        crc32cTable[i] = reflected;
+    }
+    // Table k advances a byte by k more bytes of zeros, so 8 bytes are folded with 8 lookups.
+    for (int k = 1; k < 8; ++k) {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t previous = crc32Tables[k - 1][i];
+            crc32Tables[k][i] = (previous << 8) ^ crc32Tables[0][previous >> 24];
+        }
+    }
+#if defined(__x86_64__)
+    unsigned int eax, ebx, ecx, edx;
+    hasCRC32Instruction = __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2);
+#endif
+}
+
+static uint32_t loadBigEndian(const uint8_t *bytes) {
+    return ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | bytes[3];
+}
+
+static uint32_t updateCRC32(uint32_t crc, const uint8_t *bytes, size_t size) {
+    for (; size >= 8; size -= 8, bytes += 8) {
+        uint32_t high = crc ^ loadBigEndian(bytes);
+        uint32_t low = loadBigEndian(bytes + 4);
+        crc = crc32Tables[7][high >> 24] ^ crc32Tables[6][(high >> 16) & 0xFF] ^ crc32Tables[5][(high >> 8) & 0xFF] ^ crc32Tables[4][high & 0xFF] ^
+              crc32Tables[3][low >> 24] ^ crc32Tables[2][(low >> 16) & 0xFF] ^ crc32Tables[1][(low >> 8) & 0xFF] ^ crc32Tables[0][low & 0xFF];
+    }
+    for (; size > 0; --size, ++bytes) {
+        crc = (crc << 8) ^ crc32Tables[0][(crc >> 24) ^ *bytes];
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t updateCRC32CWithInstruction(uint32_t crc, const uint8_t *bytes, size_t size) {
+    uint64_t value = crc;
+    for (; size >= 8; size -= 8, bytes += 8) {
+        uint64_t word;
+        memcpy(&word, bytes, sizeof(word));
+        value = _mm_crc32_u64(value, word);
+    }
+    crc = (uint32_t)value;
+    for (; size > 0; --size, ++bytes) {
+        crc = _mm_crc32_u8(crc, *bytes);
+    }
+    return crc;
+}
+#endif
+
+static uint32_t updateCRC32C(uint32_t crc, const uint8_t *bytes, size_t size) {
+#if defined(__x86_64__)
+    if (hasCRC32Instruction) {
+        return updateCRC32CWithInstruction(crc, bytes, size);
+    }
+#endif
+    for (; size > 0; --size, ++bytes) {
+        crc = (crc >> 8) ^ crc32cTable[(crc ^ *bytes) & 0xFF];
+    }
+    return crc;
+}
+
+// Multiplies two polynomials modulo the CRC polynomial. In the reflected form x^0 is the highest bit.
+static uint32_t multiplyModulo(uint32_t a, uint32_t b, bool isReflected) {
+    uint32_t product = 0;
+    for (int bit = 0; bit < 32; ++bit) {
+        if (isReflected) {
+            if (a & (0x80000000u >> bit)) {
+                product ^= b;
+            }
+            b = b & 1 ? (b >> 1) ^ CRC32C_REFLECTED_POLYNOMIAL : b >> 1;
+        } else {
+            product = product & 0x80000000u ? (product << 1) ^ CRC32_POLYNOMIAL : product << 1;
+            if (a & (0x80000000u >> bit)) {
+                product ^= b;
+            }
+        }
+    }
+    return product;
+}
+
+// Advances the CRC by the given number of zero bytes, which multiplies it by x^(8 * size).
+static uint32_t shiftCRC(uint32_t crc, uint64_t size, bool isReflected) {
+    uint32_t one = isReflected ? 0x80000000u : 1;
+    uint32_t power = isReflected ? 0x80000000u >> 8 : 1u << 8;
+    uint32_t factor = one;
+    for (; size > 0; size >>= 1) {
+        if (size & 1) {
+            factor = multiplyModulo(factor, power, isReflected);
+        }
+        power = multiplyModulo(power, power, isReflected);
+    }
+    return multiplyModulo(crc, factor, isReflected);
+}
+
+typedef struct ChecksumJob {
+    uint64_t address;
+    uint64_t size;
+    uint64_t blockSize;
+    uint64_t unitsPerBlock;
+    uint64_t unitCount;
+    bool isReflected;
+    SelfdeMemoryReadFunction read;
+    void *context;
+    uint64_t nextUnit;
+    // The CRCs of the units from 0.
+    uint32_t *unitCRCs;
+    bool *isUnitReadable;
+    int error;
+} ChecksumJob;
+
+// The sizes can be close to 2^64, so they aren't rounded up before the division.
+static uint64_t divideRoundingUp(uint64_t value, uint64_t divisor) {
+    return value / divisor + (value % divisor != 0);
+}
+
+static void getUnitRange(const ChecksumJob *job, uint64_t unit, uint64_t *address, uint64_t *size) {
+    uint64_t blockStart = (unit / job->unitsPerBlock) * job->blockSize;
+    uint64_t blockEnd = job->size - blockStart < job->blockSize ? job->size : blockStart + job->blockSize;
+    uint64_t start = blockStart + (unit % job->unitsPerBlock) * CHUNK_SIZE;
+    *address = job->address + start;
+    // The units past the end of a shorter last block are empty.
+    *size = start < blockEnd ? (blockEnd - start < CHUNK_SIZE ? blockEnd - start : CHUNK_SIZE) : 0;
+}
+
+static void *checksumThreadMain(void *argument) {
+    ChecksumJob *job = argument;
+    uint8_t *buffer = malloc(CHUNK_SIZE);
+    if (!buffer) {
+        int expected = 0;
+        __atomic_compare_exchange_n(&job->error, &expected, ENOMEM, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    while (__atomic_load_n(&job->error, __ATOMIC_RELAXED) == 0) {
+        uint64_t unit = __atomic_fetch_add(&job->nextUnit, 1, __ATOMIC_RELAXED);
+        if (unit >= job->unitCount) {
+            break;
+        }
+        uint64_t address, size;
+        getUnitRange(job, unit, &address, &size);
+        job->isUnitReadable[unit] = size == 0 || job->read(job->context, address, buffer, (size_t)size);
+        if (job->isUnitReadable[unit]) {
+            job->unitCRCs[unit] = job->isReflected ? updateCRC32C(0, buffer, (size_t)size) : updateCRC32(0, buffer, (size_t)size);
+        }
+    }
+    free(buffer);
+    return NULL;
+}
+
+// Computes the CRCs of all of the units, which are combined by the caller.
+static int runChecksumJob(ChecksumJob *job, uint32_t threadCount) {
+    pthread_once(&tablesOnce, initializeTables);
+    // A block that's larger than the range would only add empty units.
+    if (job->size > 0 && job->blockSize > job->size) {
+        job->blockSize = job->size;
+    }
+    job->unitsPerBlock = divideRoundingUp(job->blockSize, CHUNK_SIZE);
+    uint64_t blockCount = divideRoundingUp(job->size, job->blockSize);
+    if (blockCount > SIZE_MAX / sizeof(uint32_t) / job->unitsPerBlock) {
+        return ENOMEM;
+    }
+    job->unitCount = blockCount * job->unitsPerBlock;
+    job->unitCRCs = calloc(job->unitCount > 0 ? job->unitCount : 1, sizeof(uint32_t));
+    job->isUnitReadable = calloc(job->unitCount > 0 ? job->unitCount : 1, sizeof(bool));
+    if (!job->unitCRCs || !job->isUnitReadable) {
+        return ENOMEM;
+    }
+    if (threadCount == 0) {
+        long processorCount = sysconf(_SC_NPROCESSORS_ONLN);
+        threadCount = processorCount > 0 ? (uint32_t)processorCount : 1;
+    }
+    if (threadCount > MAX_CHECKSUM_THREADS) {
+        threadCount = MAX_CHECKSUM_THREADS;
+    }
+    if (threadCount > job->unitCount) {
+        threadCount = job->unitCount > 0 ? (uint32_t)job->unitCount : 1;
+    }
+    pthread_t threads[MAX_CHECKSUM_THREADS];
+    uint32_t startedThreads = 0;
+    // The calling thread computes the checksums as well.
+    while (startedThreads + 1 < threadCount && pthread_create(&threads[startedThreads], NULL, checksumThreadMain, job) == 0) {
+        startedThreads++;
+    }
+    checksumThreadMain(job);
+    for (uint32_t i = 0; i < startedThreads; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    return job->error;
+}
+
+// Combines the CRCs of the units of a block, returns false when one of them couldn't be read.
+static bool combineBlock(const ChecksumJob *job, uint64_t block, uint32_t *crc) {
+    for (uint64_t unit = block * job->unitsPerBlock; unit < (block + 1) * job->unitsPerBlock; ++unit) {
+        if (!job->isUnitReadable[unit]) {
+            return false;
+        }
+        uint64_t address, size;
+        getUnitRange(job, unit, &address, &size);
+        *crc = shiftCRC(*crc, size, job->isReflected) ^ job->unitCRCs[unit];
+    }
+    return true;
+}
+
+int selfdeChecksumMemory(uint64_t address, uint64_t size, uint32_t threadCount, SelfdeMemoryReadFunction read, void *context, uint32_t *crc) {
+    ChecksumJob job;
+    memset(&job, 0, sizeof(job));
+    job.address = address;
+    job.size = size;
+    job.blockSize = size > 0 ? size : 1;
+    job.read = read;
+    job.context = context;
+    int error = runChecksumJob(&job, threadCount);
+    *crc = 0xFFFFFFFFu;
+    if (error == 0 && size > 0 && !combineBlock(&job, 0, crc)) {
+        error = EFAULT;
+    }
+    free(job.unitCRCs);
+    free(job.isUnitReadable);
+    return error;
+}
+
+int selfdeDigestMemoryBlocks(uint64_t address, uint64_t size, uint64_t blockSize, uint32_t threadCount, SelfdeMemoryReadFunction read, void *context, uint32_t *digests, bool *isReadable) {
+    if (blockSize == 0) {
+        return EINVAL;
+    }
+    ChecksumJob job;
+    memset(&job, 0, sizeof(job));
+    job.address = address;
+    job.size = size;
+    job.blockSize = blockSize;
+    job.isReflected = true;
+    job.read = read;
+    job.context = context;
+    int error = runChecksumJob(&job, threadCount);
+    uint64_t blockCount = divideRoundingUp(size, blockSize);
+    for (uint64_t block = 0; error == 0 && block < blockCount; ++block) {
+        uint32_t crc = 0xFFFFFFFFu;
+        isReadable[block] = combineBlock(&job, block, &crc);
+        digests[block] = isReadable[block] ? ~crc : 0;
+    }
+    free(job.unitCRCs);
+    free(job.isUnitReadable);
+    return error;
+}
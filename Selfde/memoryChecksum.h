@@ -0,0 +1,33 @@
+//
+//  memoryChecksum.h
+//  Selfde
+//
+
+#ifndef memoryChecksum_h
+#define memoryChecksum_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "memorySearch.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Computes the CRC-32 of GDB's qCRC packet over the range: the polynomial 0x04C11DB7 with the most
+// significant bit of every byte first, the initial value 0xFFFFFFFF and no final XOR. The range is
+// split into chunks that 'threadCount' threads checksum in turn, and the checksums of the chunks are
+// combined. Returns EFAULT when a part of the range can't be read.
+int selfdeChecksumMemory(uint64_t address, uint64_t size, uint32_t threadCount, SelfdeMemoryReadFunction read, void *context, uint32_t *crc);
+
+// Computes the CRC-32C (Castagnoli) of every block of the range, the last block can be shorter.
+// The SSE4.2 CRC32 instruction is used when the processor has it. The digest of a block that
+// can't be read is 0, and it isn't readable.
+int selfdeDigestMemoryBlocks(uint64_t address, uint64_t size, uint64_t blockSize, uint32_t threadCount, SelfdeMemoryReadFunction read, void *context, uint32_t *digests, bool *isReadable);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* memoryChecksum_h */
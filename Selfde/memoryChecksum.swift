@@ -0,0 +1,38 @@
+//
+//  memoryChecksum.swift
+//  Selfde
+//
+
+#if os(Linux)
+import Glibc
+import SelfdeLinuxImpl
+#else
+import Darwin
+#endif
+
+/// Computes the CRC-32 of GDB's qCRC packet over the range with a thread for every processor.
+func computeMemoryCRC32(_ range: AddressRange, read: SelfdeMemoryReadFunction) throws -> UInt32 {
+    var crc: UInt32 = 0
+    let error = selfdeChecksumMemory(range.start.bitPattern64, range.end.bitPattern64 &- range.start.bitPattern64, 0, read, nil, &crc)
+    guard error == 0 else {
+        throw ControllerError.systemError(code: Int(error), message: String(cString: strerror(error)))
+    }
+    return crc
+}
+
+/// Computes the CRC-32C of every block of the range with a thread for every processor. The digests
+/// of the blocks that can't be read are nil.
+func digestMemoryBlocks(_ range: AddressRange, blockSize: Int, read: SelfdeMemoryReadFunction) throws -> [UInt32?] {
+    let size = range.end.bitPattern64 &- range.start.bitPattern64
+    guard blockSize > 0, size <= UInt64(Int.max) else {
+        throw ControllerError.systemError(code: Int(EINVAL), message: String(cString: strerror(EINVAL)))
+    }
+    let blockCount = Int(size) / blockSize + (Int(size) % blockSize != 0 ? 1 : 0)
+    var digests = [UInt32](repeating: 0, count: blockCount)
+    var isReadable = [Bool](repeating: false, count: blockCount)
+    let error = selfdeDigestMemoryBlocks(range.start.bitPattern64, size, UInt64(blockSize), 0, read, nil, &digests, &isReadable)
+    guard error == 0 else {
+        throw ControllerError.systemError(code: Int(error), message: String(cString: strerror(error)))
+    }
+    return zip(digests, isReadable).map { $0.1 ? $0.0 : nil }
+}
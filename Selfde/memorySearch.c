@@ -0,0 +1,325 @@
+//
+//  memorySearch.c
+//  Selfde
+//
+// Searches the memory in chunks that the search threads take in turn. Every chunk is copied into a
+// buffer with the read function, so that a page that's unmapped during the search doesn't fault, and
+// the buffer is scanned 16 positions at a time by comparing the first and the last bytes of the pattern.
+// The search runs in the process that it searches, so the matches in its own buffers and in the copies
+// of the pattern are dropped.
+
+#include "memorySearch.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define CHUNK_SIZE (1024 * 1024)
+#define MAX_SEARCH_THREADS 32
+// The unreadable parts of a chunk are skipped a page at a time.
+#define SEARCH_PAGE_SIZE 4096
+// The chunk buffers, the pattern and the mask of the caller and their copies.
+#define MAX_EXCLUDED_RANGES (MAX_SEARCH_THREADS + 4)
+
+typedef struct SearchJob {
+    // The adjacent regions are merged, so that the matches can span them.
+    SelfdeMemoryRange *regions;
+    uint32_t regionCount;
+    // The number of the chunks before every region, and the total at the end.
+    uint64_t *chunkStarts;
+    const uint8_t *pattern;
+    // The mask of every byte of the pattern, 0xFF when there's no mask.
+    uint8_t *mask;
+    uint32_t patternSize;
+    // The bytes of the pattern that the vector filter compares.
+    uint32_t firstFilter;
+    uint32_t lastFilter;
+    SelfdeMemoryReadFunction read;
+    void *context;
+    uint64_t nextChunk;
+    pthread_mutex_t mutex;
+    uint64_t *matches;
+    uint64_t *mergeBuffer;
+    uint32_t matchCapacity;
+    uint32_t matchCount;
+    // Once the capacity is reached, the chunks after the last match don't need to be searched.
+    uint64_t searchLimit;
+    // The memory of the search itself, which is allocated before the threads start.
+    SelfdeMemoryRange excludedRanges[MAX_EXCLUDED_RANGES];
+    uint32_t excludedRangeCount;
+    int error;
+} SearchJob;
+
+typedef struct SearchThread {
+    SearchJob *job;
+    uint8_t *buffer;
+    uint64_t *found;
+} SearchThread;
+
+static void excludeRange(SearchJob *job, const void *address, size_t size) {
+    if (address && size > 0) {
+        job->excludedRanges[job->excludedRangeCount++] = (SelfdeMemoryRange){ (uint64_t)(uintptr_t)address, size };
+    }
+}
+
+static bool isExcluded(const SearchJob *job, uint64_t address) {
+    for (uint32_t i = 0; i < job->excludedRangeCount; ++i) {
+        const SelfdeMemoryRange *range = &job->excludedRanges[i];
+        if (address < range->address + range->size && range->address < address + job->patternSize) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool matchesAt(const SearchJob *job, const uint8_t *bytes) {
+    for (uint32_t i = 0; i < job->patternSize; ++i) {
+        if ((bytes[i] & job->mask[i]) != job->pattern[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Collects the matches that start at the positions before the limit and end inside the buffer.
+static uint32_t scanBuffer(const SearchJob *job, const uint8_t *buffer, size_t size, size_t positionLimit, uint64_t address, uint64_t *found, uint32_t foundCount) {
+    if (size < job->patternSize) {
+        return foundCount;
+    }
+    size_t end = size - job->patternSize + 1;
+    if (end > positionLimit) {
+        end = positionLimit;
+    }
+    size_t position = 0;
+#if defined(__SSE2__)
+    const __m128i firstByte = _mm_set1_epi8((char)job->pattern[job->firstFilter]);
+    const __m128i firstMask = _mm_set1_epi8((char)job->mask[job->firstFilter]);
+    const __m128i lastByte = _mm_set1_epi8((char)job->pattern[job->lastFilter]);
+    const __m128i lastMask = _mm_set1_epi8((char)job->mask[job->lastFilter]);
+    for (; position + 16 <= end; position += 16) {
+        __m128i first = _mm_and_si128(_mm_loadu_si128((const __m128i *)(buffer + position + job->firstFilter)), firstMask);
+        __m128i last = _mm_and_si128(_mm_loadu_si128((const __m128i *)(buffer + position + job->lastFilter)), lastMask);
+        unsigned candidates = (unsigned)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, firstByte), _mm_cmpeq_epi8(last, lastByte)));
+        while (candidates != 0) {
+            size_t candidate = position + (size_t)__builtin_ctz(candidates);
+            candidates &= candidates - 1;
+            if (matchesAt(job, buffer + candidate) && !isExcluded(job, address + candidate)) {
+                found[foundCount++] = address + candidate;
+                if (foundCount == job->matchCapacity) {
+                    return foundCount;
+                }
+            }
+        }
+    }
+#endif
+    for (; position < end; ++position) {
+        if (matchesAt(job, buffer + position) && !isExcluded(job, address + position)) {
+            found[foundCount++] = address + position;
+            if (foundCount == job->matchCapacity) {
+                return foundCount;
+            }
+        }
+    }
+    return foundCount;
+}
+
+// Searches the chunk, and the bytes after it that the matches at its end span. When the chunk can't be
+// read at once, its readable runs of pages are searched on their own.
+static uint32_t searchChunk(SearchJob *job, uint8_t *buffer, uint64_t address, size_t chunkSize, size_t readSize, uint64_t *found) {
+    if (job->read(job->context, address, buffer, readSize)) {
+        return scanBuffer(job, buffer, readSize, chunkSize, address, found, 0);
+    }
+    uint32_t foundCount = 0;
+    size_t runStart = 0;
+    size_t offset = 0;
+    while (offset < readSize && foundCount < job->matchCapacity) {
+        size_t pageEnd = (size_t)(((address + offset) | (SEARCH_PAGE_SIZE - 1)) + 1 - address);
+        if (pageEnd > readSize) {
+            pageEnd = readSize;
+        }
+        bool isReadable = job->read(job->context, address + offset, buffer + offset, pageEnd - offset);
+        if (!isReadable && offset > runStart && runStart < chunkSize) {
+            foundCount = scanBuffer(job, buffer + runStart, offset - runStart, chunkSize - runStart, address + runStart, found, foundCount);
+        }
+        offset = pageEnd;
+        if (!isReadable) {
+            runStart = offset;
+        }
+    }
+    if (offset > runStart && runStart < chunkSize && foundCount < job->matchCapacity) {
+        foundCount = scanBuffer(job, buffer + runStart, offset - runStart, chunkSize - runStart, address + runStart, found, foundCount);
+    }
+    return foundCount;
+}
+
+// Keeps the lowest matches of the ones that were found so far and the ones of a chunk.
+static void mergeMatches(SearchJob *job, const uint64_t *found, uint32_t foundCount) {
+    pthread_mutex_lock(&job->mutex);
+    uint32_t i = 0, j = 0, count = 0;
+    while (count < job->matchCapacity && (i < job->matchCount || j < foundCount)) {
+        if (j == foundCount || (i < job->matchCount && job->matches[i] < found[j])) {
+            job->mergeBuffer[count++] = job->matches[i++];
+        } else {
+            job->mergeBuffer[count++] = found[j++];
+        }
+    }
+    memcpy(job->matches, job->mergeBuffer, count * sizeof(uint64_t));
+    job->matchCount = count;
+    if (count == job->matchCapacity) {
+        __atomic_store_n(&job->searchLimit, job->matches[count - 1], __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&job->mutex);
+}
+
+static void *searchThreadMain(void *argument) {
+    SearchJob *job = ((SearchThread *)argument)->job;
+    uint8_t *buffer = ((SearchThread *)argument)->buffer;
+    uint64_t *found = ((SearchThread *)argument)->found;
+    uint64_t chunkCount = job->chunkStarts[job->regionCount];
+    uint32_t regionIndex = 0;
+    while (__atomic_load_n(&job->error, __ATOMIC_RELAXED) == 0) {
+        uint64_t chunk = __atomic_fetch_add(&job->nextChunk, 1, __ATOMIC_RELAXED);
+        if (chunk >= chunkCount) {
+            break;
+        }
+        // The chunks are taken in order, so the region is found by moving forward.
+        while (job->chunkStarts[regionIndex + 1] <= chunk) {
+            regionIndex++;
+        }
+        const SelfdeMemoryRange *region = &job->regions[regionIndex];
+        uint64_t regionOffset = (chunk - job->chunkStarts[regionIndex]) * CHUNK_SIZE;
+        uint64_t address = region->address + regionOffset;
+        // The later chunks can only have higher matches.
+        if (address > __atomic_load_n(&job->searchLimit, __ATOMIC_RELAXED)) {
+            break;
+        }
+        uint64_t remaining = region->size - regionOffset;
+        size_t chunkSize = remaining < CHUNK_SIZE ? (size_t)remaining : CHUNK_SIZE;
+        size_t readSize = remaining < CHUNK_SIZE + job->patternSize - 1 ? (size_t)remaining : CHUNK_SIZE + job->patternSize - 1;
+        uint32_t foundCount = searchChunk(job, buffer, address, chunkSize, readSize, found);
+        if (foundCount > 0) {
+            mergeMatches(job, found, foundCount);
+        }
+    }
+    return NULL;
+}
+
+// Copies the masked pattern and merges the adjacent regions.
+static int prepareSearchJob(SearchJob *job, const SelfdeMemoryRange *regions, uint32_t regionCount, const uint8_t *pattern, const uint8_t *mask, uint32_t patternSize) {
+    uint8_t *maskedPattern = malloc(patternSize);
+    job->pattern = maskedPattern;
+    job->patternSize = patternSize;
+    job->mask = malloc(patternSize);
+    job->regions = malloc((regionCount > 0 ? regionCount : 1) * sizeof(SelfdeMemoryRange));
+    job->chunkStarts = malloc(((size_t)regionCount + 1) * sizeof(uint64_t));
+    job->mergeBuffer = malloc((job->matchCapacity > 0 ? job->matchCapacity : 1) * sizeof(uint64_t));
+    if (!maskedPattern || !job->mask || !job->regions || !job->chunkStarts || !job->mergeBuffer) {
+        return ENOMEM;
+    }
+    bool hasFilter = false;
+    for (uint32_t i = 0; i < patternSize; ++i) {
+        job->mask[i] = mask ? mask[i] : 0xFF;
+        maskedPattern[i] = pattern[i] & job->mask[i];
+        if (job->mask[i] != 0) {
+            job->firstFilter = hasFilter ? job->firstFilter : i;
+            job->lastFilter = i;
+            hasFilter = true;
+        }
+    }
+    if (!hasFilter) {
+        return EINVAL;
+    }
+    excludeRange(job, pattern, patternSize);
+    excludeRange(job, mask, patternSize);
+    excludeRange(job, job->pattern, patternSize);
+    excludeRange(job, job->mask, patternSize);
+    for (uint32_t i = 0; i < regionCount; ++i) {
+        SelfdeMemoryRange *previous = job->regionCount > 0 ? &job->regions[job->regionCount - 1] : NULL;
+        if (previous && previous->address + previous->size == regions[i].address) {
+            previous->size += regions[i].size;
+        } else if (regions[i].size > 0) {
+            job->regions[job->regionCount++] = regions[i];
+        }
+    }
+    job->chunkStarts[0] = 0;
+    for (uint32_t i = 0; i < job->regionCount; ++i) {
+        job->chunkStarts[i + 1] = job->chunkStarts[i] + (job->regions[i].size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    }
+    return 0;
+}
+
+static int runSearchThreads(SearchJob *job, uint32_t threadCount) {
+    uint64_t chunkCount = job->chunkStarts[job->regionCount];
+    if (threadCount == 0) {
+        long processorCount = sysconf(_SC_NPROCESSORS_ONLN);
+        threadCount = processorCount > 0 ? (uint32_t)processorCount : 1;
+    }
+    if (threadCount > MAX_SEARCH_THREADS) {
+        threadCount = MAX_SEARCH_THREADS;
+    }
+    if (threadCount > chunkCount) {
+        threadCount = (uint32_t)chunkCount;
+    }
+    // The buffers are excluded before any of the threads starts searching.
+    SearchThread searchThreads[MAX_SEARCH_THREADS];
+    int error = 0;
+    for (uint32_t i = 0; i < threadCount; ++i) {
+        searchThreads[i].job = job;
+        searchThreads[i].buffer = malloc(CHUNK_SIZE + job->patternSize - 1);
+        searchThreads[i].found = malloc(job->matchCapacity * sizeof(uint64_t));
+        excludeRange(job, searchThreads[i].buffer, CHUNK_SIZE + job->patternSize - 1);
+        if (!searchThreads[i].buffer || !searchThreads[i].found) {
+            error = ENOMEM;
+        }
+    }
+    if (error == 0) {
+        pthread_t threads[MAX_SEARCH_THREADS];
+        uint32_t startedThreads = 0;
+        // The calling thread searches as well.
+        while (startedThreads + 1 < threadCount && pthread_create(&threads[startedThreads], NULL, searchThreadMain, &searchThreads[startedThreads + 1]) == 0) {
+            startedThreads++;
+        }
+        searchThreadMain(&searchThreads[0]);
+        for (uint32_t i = 0; i < startedThreads; ++i) {
+            pthread_join(threads[i], NULL);
+        }
+        error = job->error;
+    }
+    for (uint32_t i = 0; i < threadCount; ++i) {
+        free(searchThreads[i].buffer);
+        free(searchThreads[i].found);
+    }
+    return error;
+}
+
+int selfdeSearchMemory(const SelfdeMemoryRange *regions, uint32_t regionCount, const uint8_t *pattern, const uint8_t *mask, uint32_t patternSize,
+                       uint32_t threadCount, SelfdeMemoryReadFunction read, void *context, uint64_t *matches, uint32_t matchCapacity, uint32_t *matchCount) {
+    *matchCount = 0;
+    if (patternSize == 0 || patternSize > CHUNK_SIZE) {
+        return EINVAL;
+    }
+    SearchJob job;
+    memset(&job, 0, sizeof(job));
+    job.read = read;
+    job.context = context;
+    job.matches = matches;
+    job.matchCapacity = matchCapacity;
+    job.searchLimit = UINT64_MAX;
+    pthread_mutex_init(&job.mutex, NULL);
+    int error = prepareSearchJob(&job, regions, regionCount, pattern, mask, patternSize);
+    if (error == 0 && matchCapacity > 0 && job.chunkStarts[job.regionCount] > 0) {
+        error = runSearchThreads(&job, threadCount);
+        *matchCount = error == 0 ? job.matchCount : 0;
+    }
+    pthread_mutex_destroy(&job.mutex);
+    free((void *)job.pattern);
+    free(job.mask);
+    free(job.regions);
+    free(job.chunkStarts);
+    free(job.mergeBuffer);
+    return error;
+}
@@ -0,0 +1,38 @@
+//
+//  memorySearch.h
+//  Selfde
+//
+
+#ifndef memorySearch_h
+#define memorySearch_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct SelfdeMemoryRange {
+    uint64_t address;
+    uint64_t size;
+} SelfdeMemoryRange;
+
+// Reads the memory without faulting, returns false when a part of it can't be read.
+typedef bool (*SelfdeMemoryReadFunction)(void *context, uint64_t address, void *buffer, size_t size);
+
+// Finds the addresses at which the pattern occurs in the given regions, which have to be sorted by
+// their addresses and not overlap. A match can span adjacent regions, but not a page that can't be
+// read. The mask is optional, and a byte matches when (byte & mask) == (pattern & mask). The regions
+// are split into chunks that 'threadCount' threads search in turn, and the lowest 'matchCapacity'
+// matches are returned in ascending order. The matches in the memory of the search itself, like its
+// chunk buffers and the pattern and the mask, aren't returned. Returns EINVAL for an empty pattern or one that is all masked out.
+int selfdeSearchMemory(const SelfdeMemoryRange *regions, uint32_t regionCount, const uint8_t *pattern, const uint8_t *mask, uint32_t patternSize,
+                       uint32_t threadCount, SelfdeMemoryReadFunction read, void *context, uint64_t *matches, uint32_t matchCapacity, uint32_t *matchCount);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* memorySearch_h */
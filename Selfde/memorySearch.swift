@@ -0,0 +1,31 @@
+//
+//  memorySearch.swift
+//  Selfde
+//
+
+#if os(Linux)
+import Glibc
+import SelfdeLinuxImpl
+#else
+import Darwin
+#endif
+
+/// Searches the readable regions with a thread for every processor, and returns the lowest 'maxMatches'
+/// addresses at which the pattern occurs. A byte matches when (byte & mask) == (pattern & mask).
+func searchMemoryRegions(_ regions: UnsafeBufferPointer<SelfdeMemoryRange>, pattern: [UInt8], mask: [UInt8]?, maxMatches: Int, read: SelfdeMemoryReadFunction) throws -> [Address] {
+    guard !pattern.isEmpty, mask == nil || mask!.count == pattern.count, let matchCapacity = UInt32(exactly: maxMatches) else {
+        throw ControllerError.systemError(code: Int(EINVAL), message: String(cString: strerror(EINVAL)))
+    }
+    var matches = [UInt64](repeating: 0, count: maxMatches)
+    var matchCount: UInt32 = 0
+    let error: Int32
+    if let mask = mask {
+        error = selfdeSearchMemory(regions.baseAddress, UInt32(regions.count), pattern, mask, UInt32(pattern.count), 0, read, nil, &matches, matchCapacity, &matchCount)
+    } else {
+        error = selfdeSearchMemory(regions.baseAddress, UInt32(regions.count), pattern, nil, UInt32(pattern.count), 0, read, nil, &matches, matchCapacity, &matchCount)
+    }
+    guard error == 0 else {
+        throw ControllerError.systemError(code: Int(error), message: String(cString: strerror(error)))
+    }
+    return matches[0..<Int(matchCount)].map { Address(bitPattern64: $0) }
+}
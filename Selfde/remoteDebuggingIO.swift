@@ -4,6 +4,9 @@
 //
 
 import Foundation
+#if os(Linux)
+import Glibc
+#endif
 
 public enum RemoteDebuggingIOError: Error {
     case invalidHostAndPort
@@ -23,6 +26,8 @@ public protocol RemoteDebuggingWriter: class {
     func close()
 }
 
+#if os(OSX)
+
 private final class RemoteDebuggingSocketReader: RemoteDebuggingReader {
     let readStream: Unmanaged<CFReadStream>
     var buffer: [UInt8] = [UInt8](repeating: 0, count: 1024)
@@ -100,6 +105,83 @@ public func createRemoteDebuggingSocketConnection(_ hostAndPort: String) throws
     return (RemoteDebuggingSocketReader(readStream: read), RemoteDebuggingSocketWriter(writeStream: write))
 }
 
+#else
+
+private final class RemoteDebuggingSocket: RemoteDebuggingReader, RemoteDebuggingWriter {
+    let socket: Int32
+    var buffer: [UInt8] = [UInt8](repeating: 0, count: 1024)
+
+    init(socket: Int32) {
+        self.socket = socket
+    }
+
+    func read() throws -> ArraySlice<UInt8> {
+        let readSize = buffer.withUnsafeMutableBufferPointer { (ptr: inout UnsafeMutableBufferPointer<UInt8>) in
+            Glibc.read(socket, ptr.baseAddress, 1024)
+        }
+        guard readSize > 0 else {
+            throw RemoteDebuggingIOError.readError(message: readSize == 0 ? "Reached stream end" : "Stream disconnected")
+        }
+        return buffer.prefix(readSize)
+    }
+
+    func write(data: ArraySlice<UInt8>) throws {
+        var buffer = data
+        while !buffer.isEmpty {
+            let writtenSize = buffer.withUnsafeBufferPointer {
+                Glibc.write(socket, $0.baseAddress, buffer.count)
+            }
+            guard writtenSize > 0 else {
+                throw RemoteDebuggingIOError.writeError(message: writtenSize == 0 ? "Reached stream capacity" : "Stream disconnected")
+            }
+            guard writtenSize < buffer.count else {
+                return
+            }
+            buffer = buffer[(buffer.startIndex + writtenSize)..<buffer.endIndex]
+        }
+    }
+
+    // Both the reader and the writer close the same socket.
+    func close() {
+        shutdown(socket, Int32(SHUT_RDWR))
+    }
+
+    deinit {
+        Glibc.close(socket)
+    }
+}
+
+public func createRemoteDebuggingSocketConnection(_ hostAndPort: String) throws -> (RemoteDebuggingReader, RemoteDebuggingWriter) {
+    guard let (host, port) = parseHostAndPort(hostAndPort) else {
+        throw RemoteDebuggingIOError.invalidHostAndPort
+    }
+    var hints = addrinfo()
+    hints.ai_family = AF_UNSPEC
+    hints.ai_socktype = Int32(SOCK_STREAM.rawValue)
+    var addresses: UnsafeMutablePointer<addrinfo>?
+    guard getaddrinfo(host, String(port), &hints, &addresses) == 0 else {
+        throw RemoteDebuggingIOError.streamOpenError
+    }
+    defer {
+        freeaddrinfo(addresses)
+    }
+    var address = addresses
+    while let info = address?.pointee {
+        let socket = Glibc.socket(info.ai_family, info.ai_socktype, info.ai_protocol)
+        if socket >= 0 {
+            if connect(socket, info.ai_addr, info.ai_addrlen) == 0 {
+                let connection = RemoteDebuggingSocket(socket: socket)
+                return (connection, connection)
+            }
+            Glibc.close(socket)
+        }
+        address = info.ai_next
+    }
+    throw RemoteDebuggingIOError.streamOpenError
+}
+
+#endif
+
 // Parse the host and port that LLDB passes.
 private func parseHostAndPort(_ hostAndPort: String) -> (String, Int)? {
     guard let colonIndex = hostAndPort.range(of: ":", options: [.backwards]) else {
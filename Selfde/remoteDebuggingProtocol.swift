@@ -57,6 +57,34 @@ extension Collection where Self.Iterator.Element == UInt8, Self.Index == Int, Se
     }
 }
 
+// Register values in the 'g', 'G', 'p' and 'P' packets are encoded as hex unless both sides
+// have 'binary-registers+' in 'qSupported', in which case they use the x/X binary encoding.
+enum RegisterValueEncoding {
+    case hex
+    case binary
+
+    // Encodes the register value for a response or for the value in a 'G' or 'P' packet.
+    func encode<C: Collection>(_ value: C) -> [UInt8] where C.Iterator.Element == UInt8, C.Index == Int, C.IndexDistance == Int {
+        switch self {
+        case .hex:
+            return Array(value.hexString.utf8)
+        case .binary:
+            return value.encodedBinaryData
+        }
+    }
+
+    // Decodes the register value from a 'g' or 'p' response.
+    func decode<C: Collection>(_ payload: C) -> [UInt8]? where C.Iterator.Element == UInt8, C.Index == Int, C.IndexDistance == Int {
+        switch self {
+        case .hex:
+            var parser = PacketParser(payload: String(String.UnicodeScalarView(payload.map { UnicodeScalar($0) })))
+            return parser.readHexBytes()
+        case .binary:
+            return payload.decodedBinaryData
+        }
+    }
+}
+
 enum RemoteDebuggingPacket {
     case payload(String)
     case binaryPayload([UInt8])
@@ -286,4 +314,36 @@ struct PacketParser {
     mutating func readHexBytes(size: Int) -> [UInt8]? {
         return readHexBytes(upTo: payload.index(index, offsetBy: size * 2))
     }
+
+    // Reads the bytes that use the binary encoding of x/X packets. The payload's unicode scalars
+    // are the packet's bytes.
+    mutating func readBinaryBytes(size: Int) -> [UInt8]? {
+        let result = readBinaryBytes(maxSize: size)
+        return result?.count == size ? result : nil
+    }
+
+    // Reads the rest of the payload in the binary encoding.
+    mutating func readBinaryBytes() -> [UInt8]? {
+        return readBinaryBytes(maxSize: Int.max)
+    }
+
+    private mutating func readBinaryBytes(maxSize: Int) -> [UInt8]? {
+        var result = [UInt8]()
+        while result.count < maxSize && index < endIndex {
+            var value = payload[index].value
+            index = payload.index(after: index)
+            if value == UInt32(UInt8(ascii: "}")) {
+                guard index < endIndex else {
+                    return nil
+                }
+                value = payload[index].value ^ 0x20
+                index = payload.index(after: index)
+            }
+            guard value <= UInt32(UInt8.max) else {
+                return nil
+            }
+            result.append(UInt8(value))
+        }
+        return result
+    }
 }
@@ -0,0 +1,216 @@
+//
+//  samplingProfiler.c
+//  Selfde
+//
+// The sampling loop and the stack table of the profiler. The threads are sampled by the platform's
+// function, which stops them, walks their frame pointers and lets them continue.
+
+#include "samplingProfiler.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static uint32_t roundUpToPowerOfTwo(uint32_t value) {
+    uint32_t result = 1;
+    while (result < value && result < (UINT32_C(1) << 31)) {
+        result <<= 1;
+    }
+    return result;
+}
+
+int selfdeStackTableInit(SelfdeStackTable *table, uint32_t stackCapacity, uint32_t frameCapacity) {
+    memset(table, 0, sizeof(*table));
+    // The table is kept at most three quarters full.
+    uint32_t entryCapacity = roundUpToPowerOfTwo(stackCapacity + stackCapacity / 3 + 1);
+    table->entries = calloc(entryCapacity, sizeof(SelfdeStackEntry));
+    table->frames = malloc((size_t)frameCapacity * sizeof(uint64_t));
+    if (!table->entries || !table->frames) {
+        selfdeStackTableDestroy(table);
+        return ENOMEM;
+    }
+    table->entryCapacity = entryCapacity;
+    table->frameCapacity = frameCapacity;
+    return 0;
+}
+
+void selfdeStackTableDestroy(SelfdeStackTable *table) {
+    free(table->entries);
+    free(table->frames);
+    memset(table, 0, sizeof(*table));
+}
+
+// FNV-1a over the frame addresses.
+static uint64_t hashFrames(const uint64_t *frames, uint32_t frameCount) {
+    uint64_t hash = UINT64_C(0xcbf29ce484222325);
+    for (uint32_t i = 0; i < frameCount; ++i) {
+        hash ^= frames[i];
+        hash *= UINT64_C(0x100000001b3);
+    }
+    return hash ^ frameCount;
+}
+
+bool selfdeStackTableAdd(SelfdeStackTable *table, const uint64_t *frames, uint32_t frameCount) {
+    if (frameCount == 0 || table->entryCapacity == 0) {
+        return false;
+    }
+    uint64_t hash = hashFrames(frames, frameCount);
+    uint32_t mask = table->entryCapacity - 1;
+    for (uint32_t index = (uint32_t)hash & mask;; index = (index + 1) & mask) {
+        SelfdeStackEntry *entry = &table->entries[index];
+        // The stored stacks have at least one sample.
+        if (entry->sampleCount == 0) {
+            if ((uint64_t)table->entryCount * 4 >= (uint64_t)table->entryCapacity * 3 || frameCount > table->frameCapacity - table->frameCount) {
+                table->droppedSampleCount++;
+                return false;
+            }
+            memcpy(&table->frames[table->frameCount], frames, frameCount * sizeof(uint64_t));
+            entry->hash = hash;
+            entry->frameOffset = table->frameCount;
+            entry->frameCount = frameCount;
+            entry->sampleCount = 1;
+            table->frameCount += frameCount;
+            table->entryCount++;
+            table->sampleCount++;
+            return true;
+        }
+        if (entry->hash == hash && entry->frameCount == frameCount && memcmp(&table->frames[entry->frameOffset], frames, frameCount * sizeof(uint64_t)) == 0) {
+            entry->sampleCount++;
+            table->sampleCount++;
+            return true;
+        }
+    }
+}
+
+uint32_t selfdeWalkFramePointers(uint64_t instructionPointer, uint64_t stackPointer, uint64_t framePointer, uint64_t *frames, uint32_t maxFrames, SelfdeReadWordFunction readWord, void *context) {
+    if (maxFrames == 0 || instructionPointer == 0) {
+        return 0;
+    }
+    uint32_t count = 0;
+    frames[count++] = instructionPointer;
+    // push rbp; mov rbp, rsp: the caller's RBP is at RBP and the return address is right above it.
+    while (count < maxFrames && framePointer >= stackPointer && framePointer % 8 == 0) {
+        uint64_t savedFramePointer, returnAddress;
+        if (!readWord(context, framePointer, &savedFramePointer) || !readWord(context, framePointer + 8, &returnAddress) || returnAddress == 0) {
+            break;
+        }
+        frames[count++] = returnAddress;
+        stackPointer = framePointer + 16;
+        framePointer = savedFramePointer;
+    }
+    return count;
+}
+
+static void addNanoseconds(struct timespec *time, uint64_t nanoseconds) {
+    uint64_t total = (uint64_t)time->tv_nsec + nanoseconds;
+    time->tv_sec += (time_t)(total / 1000000000);
+    time->tv_nsec = (long)(total % 1000000000);
+}
+
+typedef struct ThreadStart {
+    SelfdeSamplingProfiler *profiler;
+    SelfdeProfilerThreadCallback threadStarted;
+    void *threadContext;
+} ThreadStart;
+
+static void *profilerThreadMain(void *argument) {
+    ThreadStart *start = argument;
+    SelfdeSamplingProfiler *profiler = start->profiler;
+    pthread_mutex_lock(&profiler->mutex);
+    if (start->threadStarted) {
+        start->threadStarted(start->threadContext);
+    }
+    profiler->hasThread = true;
+    pthread_cond_broadcast(&profiler->condition);
+    while (true) {
+        while (!profiler->isRunning) {
+            pthread_cond_wait(&profiler->condition, &profiler->mutex);
+        }
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        while (profiler->isRunning) {
+            addNanoseconds(&deadline, profiler->intervalNanoseconds);
+            // The missed samples aren't made up for, as the threads that read the profile would never
+            // get the mutex when the sampling takes longer than the interval.
+            struct timespec now;
+            clock_gettime(CLOCK_REALTIME, &now);
+            if (deadline.tv_sec < now.tv_sec || (deadline.tv_sec == now.tv_sec && deadline.tv_nsec < now.tv_nsec)) {
+                deadline = now;
+                addNanoseconds(&deadline, profiler->intervalNanoseconds);
+            }
+            int error = 0;
+            while (profiler->isRunning && error != ETIMEDOUT) {
+                error = pthread_cond_timedwait(&profiler->condition, &profiler->mutex, &deadline);
+            }
+            if (profiler->isRunning) {
+                profiler->sampleThreads(profiler->context, profiler);
+            }
+        }
+    }
+    return NULL;
+}
+
+int selfdeSamplingProfilerStart(SelfdeSamplingProfiler *profiler, uint32_t frequency, uint32_t maxFrames, uint32_t stackCapacity, uint32_t frameCapacity, SelfdeSampleThreadsFunction sampleThreads, void *context, SelfdeProfilerThreadCallback threadStarted, void *threadContext) {
+    if (frequency == 0 || frequency > 1000000 || maxFrames == 0 || frameCapacity < maxFrames) {
+        return EINVAL;
+    }
+    pthread_mutex_lock(&profiler->mutex);
+    if (profiler->isRunning) {
+        pthread_mutex_unlock(&profiler->mutex);
+        return EBUSY;
+    }
+    int error = 0;
+    if (!profiler->hasThread) {
+        ThreadStart start = { profiler, threadStarted, threadContext };
+        pthread_t thread;
+        error = pthread_create(&thread, NULL, profilerThreadMain, &start);
+        if (error == 0) {
+            pthread_detach(thread);
+            while (!profiler->hasThread) {
+                pthread_cond_wait(&profiler->condition, &profiler->mutex);
+            }
+        }
+    }
+    if (error == 0) {
+        free(profiler->frameBuffer);
+        selfdeStackTableDestroy(&profiler->table);
+        profiler->frameBuffer = malloc((size_t)maxFrames * sizeof(uint64_t));
+        error = profiler->frameBuffer ? selfdeStackTableInit(&profiler->table, stackCapacity, frameCapacity) : ENOMEM;
+    }
+    if (error == 0) {
+        profiler->intervalNanoseconds = 1000000000 / frequency;
+        profiler->maxFrames = maxFrames;
+        profiler->sampleThreads = sampleThreads;
+        profiler->context = context;
+        profiler->isRunning = true;
+        pthread_cond_broadcast(&profiler->condition);
+    }
+    pthread_mutex_unlock(&profiler->mutex);
+    return error;
+}
+
+void selfdeSamplingProfilerStop(SelfdeSamplingProfiler *profiler) {
+    // The threads are sampled with the mutex held, so a sample can't be in progress.
+    pthread_mutex_lock(&profiler->mutex);
+    profiler->isRunning = false;
+    pthread_cond_broadcast(&profiler->condition);
+    pthread_mutex_unlock(&profiler->mutex);
+}
+
+void selfdeSamplingProfilerRecord(SelfdeSamplingProfiler *profiler, uint32_t frameCount) {
+    selfdeStackTableAdd(&profiler->table, profiler->frameBuffer, frameCount);
+}
+
+uint64_t selfdeSamplingProfilerEnumerateStacks(SelfdeSamplingProfiler *profiler, SelfdeStackCallback callback, void *context) {
+    pthread_mutex_lock(&profiler->mutex);
+    const SelfdeStackTable *table = &profiler->table;
+    for (uint32_t i = 0; i < table->entryCapacity; ++i) {
+        const SelfdeStackEntry *entry = &table->entries[i];
+        if (entry->sampleCount != 0) {
+            callback(context, &table->frames[entry->frameOffset], entry->frameCount, entry->sampleCount);
+        }
+    }
+    uint64_t droppedSampleCount = table->droppedSampleCount;
+    pthread_mutex_unlock(&profiler->mutex);
+    return droppedSampleCount;
+}
@@ -0,0 +1,96 @@
+//
+//  samplingProfiler.h
+//  Selfde
+//
+
+#ifndef samplingProfiler_h
+#define samplingProfiler_h
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A unique stack in the stack table. Its frames are stored in the table's frame pool.
+typedef struct SelfdeStackEntry {
+    uint64_t hash;
+    uint32_t frameOffset;
+    uint32_t frameCount;
+    uint64_t sampleCount;
+} SelfdeStackEntry;
+
+// The sampled stacks are hash-consed: every unique stack is stored once with the number of its samples.
+// The memory is allocated up front, so that the samples can be recorded without calling malloc while
+// the sampled threads might be holding its locks. The samples that don't fit are dropped.
+typedef struct SelfdeStackTable {
+    // Open addressing, the capacity is a power of two.
+    SelfdeStackEntry *entries;
+    uint32_t entryCapacity;
+    uint32_t entryCount;
+    uint64_t *frames;
+    uint32_t frameCapacity;
+    uint32_t frameCount;
+    uint64_t sampleCount;
+    uint64_t droppedSampleCount;
+} SelfdeStackTable;
+
+int selfdeStackTableInit(SelfdeStackTable *table, uint32_t stackCapacity, uint32_t frameCapacity);
+void selfdeStackTableDestroy(SelfdeStackTable *table);
+// Returns false when the sample was dropped.
+bool selfdeStackTableAdd(SelfdeStackTable *table, const uint64_t *frames, uint32_t frameCount);
+
+typedef bool (*SelfdeReadWordFunction)(void *context, uint64_t address, uint64_t *value);
+
+// Follows the frame pointer chain from the given registers, storing the instruction pointer and the
+// return addresses. The walk stops when the stack doesn't grow towards its base anymore.
+uint32_t selfdeWalkFramePointers(uint64_t instructionPointer, uint64_t stackPointer, uint64_t framePointer, uint64_t *frames, uint32_t maxFrames, SelfdeReadWordFunction readWord, void *context);
+
+struct SelfdeSamplingProfiler;
+
+// Samples the threads once, recording their stacks with 'selfdeSamplingProfilerRecord'.
+// It's called on the profiler's thread with the profiler's mutex held.
+typedef void (*SelfdeSampleThreadsFunction)(void *context, struct SelfdeSamplingProfiler *profiler);
+
+// Called on the profiler's thread when it's created, so that the debugger can ignore the thread.
+typedef void (*SelfdeProfilerThreadCallback)(void *context);
+
+typedef struct SelfdeSamplingProfiler {
+    pthread_mutex_t mutex;
+    pthread_cond_t condition;
+    // The thread is created by the first start and it waits for the next start when the profiler is stopped.
+    bool hasThread;
+    bool isRunning;
+    uint64_t intervalNanoseconds;
+    uint32_t maxFrames;
+    // The stack of the thread that's being sampled, at least 'maxFrames' long.
+    uint64_t *frameBuffer;
+    SelfdeStackTable table;
+    SelfdeSampleThreadsFunction sampleThreads;
+    void *context;
+} SelfdeSamplingProfiler;
+
+#define SELFDE_SAMPLING_PROFILER_INITIALIZER { .mutex = PTHREAD_MUTEX_INITIALIZER, .condition = PTHREAD_COND_INITIALIZER }
+
+// Starts sampling the threads at the given frequency. The stacks that were recorded since the
+// profiler was last started are kept until it's started again.
+int selfdeSamplingProfilerStart(SelfdeSamplingProfiler *profiler, uint32_t frequency, uint32_t maxFrames, uint32_t stackCapacity, uint32_t frameCapacity, SelfdeSampleThreadsFunction sampleThreads, void *context, SelfdeProfilerThreadCallback threadStarted, void *threadContext);
+// No samples are taken after this returns.
+void selfdeSamplingProfilerStop(SelfdeSamplingProfiler *profiler);
+// Records the stack that the sampling function has stored in the frame buffer.
+void selfdeSamplingProfilerRecord(SelfdeSamplingProfiler *profiler, uint32_t frameCount);
+
+typedef void (*SelfdeStackCallback)(void *context, const uint64_t *frames, uint32_t frameCount, uint64_t sampleCount);
+
+// Calls the callback for every unique stack with the profiler's mutex held, so the profile can be
+// read while the profiler is running. Returns the number of the dropped samples.
+uint64_t selfdeSamplingProfilerEnumerateStacks(SelfdeSamplingProfiler *profiler, SelfdeStackCallback callback, void *context);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* samplingProfiler_h */
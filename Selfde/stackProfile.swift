@@ -0,0 +1,225 @@
+//
+//  stackProfile.swift
+//  Selfde
+//
+
+#if os(Linux)
+import SelfdeLinuxImpl
+#endif
+
+/// The stacks that were sampled by the profiler. Every unique stack is listed once with the number
+/// of its samples, and its frames start with the innermost one.
+public struct StackProfile {
+    public struct Stack {
+        public let frames: [Address]
+        public let sampleCount: Int
+
+        public init(frames: [Address], sampleCount: Int) {
+            self.frames = frames
+            self.sampleCount = sampleCount
+        }
+    }
+    /// Sorted by the number of samples, the most frequent stack first.
+    public let stacks: [Stack]
+    /// The time between the samples of a thread in nanoseconds.
+    public let samplingInterval: UInt64
+    /// The samples that didn't fit into the profiler's preallocated stack table.
+    public let droppedSampleCount: Int
+
+    public var sampleCount: Int {
+        return stacks.reduce(0) { $0 + $1.sampleCount }
+    }
+
+    public init(stacks: [Stack], samplingInterval: UInt64, droppedSampleCount: Int = 0) {
+        self.stacks = stacks.sorted { lhs, rhs in
+            if lhs.sampleCount != rhs.sampleCount {
+                return lhs.sampleCount > rhs.sampleCount
+            }
+            return lhs.frames.lexicographicallyPrecedes(rhs.frames) { $0.bitPattern < $1.bitPattern }
+        }
+        self.samplingInterval = samplingInterval
+        self.droppedSampleCount = droppedSampleCount
+    }
+
+    /// Copies the stacks out of the profiler's stack table using the given enumeration function.
+    init(samplingInterval: UInt64, enumerateStacks: (SelfdeStackCallback, UnsafeMutableRawPointer) -> UInt64) {
+        final class StackCollector {
+            var stacks: [Stack] = []
+        }
+        let collector = StackCollector()
+        let droppedSampleCount = enumerateStacks({ context, frames, frameCount, sampleCount in
+            let collector = Unmanaged<StackCollector>.fromOpaque(context!).takeUnretainedValue()
+            let addresses = UnsafeBufferPointer(start: frames, count: Int(frameCount)).map { Address(bitPattern64: $0) }
+            collector.stacks.append(Stack(frames: addresses, sampleCount: Int(sampleCount)))
+        }, Unmanaged.passUnretained(collector).toOpaque())
+        self.init(stacks: collector.stacks, samplingInterval: samplingInterval, droppedSampleCount: Int(droppedSampleCount))
+    }
+
+    // The frames of the callers are return addresses, which can be past the end of the calling function.
+    private static func lookupAddress(_ frame: Address, index: Int) -> Address {
+        return index == 0 ? frame : Address(bitPattern: frame.bitPattern &- 1)
+    }
+
+    // The names of the frames, looked up once for every address.
+    private func frameNames(symbolicate: (Address) -> String?) -> [Address: String] {
+        var names: [Address: String] = [:]
+        for stack in stacks {
+            for (i, frame) in stack.frames.enumerated() where names[frame] == nil {
+                names[frame] = symbolicate(StackProfile.lookupAddress(frame, index: i)) ?? "0x" + String(frame.bitPattern, radix: 16, uppercase: false)
+            }
+        }
+        return names
+    }
+
+    /// The stacks in the folded format that the flame graph tools read: the frames from the outermost
+    /// to the innermost one separated by ';', followed by the number of samples. The frames that
+    /// can't be symbolicated are shown as their addresses.
+    public func foldedStacks(symbolicate: (Address) -> String? = { _ in nil }) -> String {
+        let names = frameNames(symbolicate: symbolicate)
+        var result = ""
+        for stack in stacks {
+            result += stack.frames.reversed().map { names[$0]! }.joined(separator: ";")
+            result += " \(stack.sampleCount)\n"
+        }
+        return result
+    }
+
+    /// The profile in pprof's protobuf format. It isn't compressed, which pprof accepts as well.
+    /// The samples have a count and a CPU time, and every symbolicated address has a function.
+    public func pprofData(symbolicate: (Address) -> String? = { _ in nil }) -> [UInt8] {
+        var strings = ["", "samples", "count", "cpu", "nanoseconds"]
+        var stringIndices: [String: UInt64] = [:]
+        for (i, string) in strings.enumerated() {
+            stringIndices[string] = UInt64(i)
+        }
+        func stringIndex(_ string: String) -> UInt64 {
+            if let index = stringIndices[string] {
+                return index
+            }
+            let index = UInt64(strings.count)
+            strings.append(string)
+            stringIndices[string] = index
+            return index
+        }
+
+        var profile = ProtobufWriter()
+        for (type, unit) in [("samples", "count"), ("cpu", "nanoseconds")] {
+            profile.writeMessage(1) { valueType in
+                valueType.writeUInt64(1, stringIndex(type))
+                valueType.writeUInt64(2, stringIndex(unit))
+            }
+        }
+        // The location and function IDs start at 1.
+        var locationIDs: [Address: UInt64] = [:]
+        var locations: [(address: Address, functionID: UInt64?)] = []
+        var functionIDs: [String: UInt64] = [:]
+        for stack in stacks {
+            for (i, frame) in stack.frames.enumerated() where locationIDs[frame] == nil {
+                var functionID: UInt64? = nil
+                if let name = symbolicate(StackProfile.lookupAddress(frame, index: i)) {
+                    functionID = functionIDs[name] ?? UInt64(functionIDs.count + 1)
+                    functionIDs[name] = functionID
+                }
+                locations.append((frame, functionID))
+                locationIDs[frame] = UInt64(locations.count)
+            }
+            profile.writeMessage(2) { sample in
+                sample.writePacked(1, stack.frames.map { locationIDs[$0]! })
+                sample.writePacked(2, [UInt64(stack.sampleCount), UInt64(stack.sampleCount) &* samplingInterval])
+            }
+        }
+        for (i, location) in locations.enumerated() {
+            profile.writeMessage(4) { message in
+                message.writeUInt64(1, UInt64(i + 1))
+                message.writeUInt64(3, location.address.bitPattern64)
+                if let functionID = location.functionID {
+                    message.writeMessage(4) { line in
+                        line.writeUInt64(1, functionID)
+                    }
+                }
+            }
+        }
+        for (name, functionID) in functionIDs.sorted(by: { $0.value < $1.value }) {
+            let nameIndex = stringIndex(name)
+            profile.writeMessage(5) { function in
+                function.writeUInt64(1, functionID)
+                function.writeUInt64(2, nameIndex)
+                function.writeUInt64(3, nameIndex)
+            }
+        }
+        for string in strings {
+            profile.writeBytes(6, Array(string.utf8))
+        }
+        profile.writeMessage(11) { periodType in
+            periodType.writeUInt64(1, stringIndex("cpu"))
+            periodType.writeUInt64(2, stringIndex("nanoseconds"))
+        }
+        profile.writeUInt64(12, samplingInterval)
+        return profile.bytes
+    }
+}
+
+// Writes the varint and the length delimited fields that the pprof format uses.
+struct ProtobufWriter {
+    private(set) var bytes: [UInt8] = []
+
+    private mutating func writeVarint(_ value: UInt64) {
+        var value = value
+        while value >= 0x80 {
+            bytes.append(UInt8(truncatingBitPattern: value) | 0x80)
+            value >>= 7
+        }
+        bytes.append(UInt8(value))
+    }
+
+    private mutating func writeKey(_ field: Int, wireType: UInt64) {
+        writeVarint(UInt64(field) << 3 | wireType)
+    }
+
+    mutating func writeUInt64(_ field: Int, _ value: UInt64) {
+        writeKey(field, wireType: 0)
+        writeVarint(value)
+    }
+
+    mutating func writeBytes(_ field: Int, _ value: [UInt8]) {
+        writeKey(field, wireType: 2)
+        writeVarint(UInt64(value.count))
+        bytes.append(contentsOf: value)
+    }
+
+    mutating func writePacked(_ field: Int, _ values: [UInt64]) {
+        var packed = ProtobufWriter()
+        for value in values {
+            packed.writeVarint(value)
+        }
+        writeBytes(field, packed.bytes)
+    }
+
+    mutating func writeMessage(_ field: Int, _ write: (inout ProtobufWriter) -> ()) {
+        var message = ProtobufWriter()
+        write(&message)
+        writeBytes(field, message.bytes)
+    }
+}
+
+/// The frequency of the profiler and the sizes of its stack table, which is allocated when it's started.
+struct ProfilerOptions {
+    let frequency: UInt32
+    let maxFrames: UInt32
+    let stackCapacity: UInt32 = 8192
+    let frameCapacity: UInt32
+
+    var samplingInterval: UInt64 {
+        return 1_000_000_000 / UInt64(frequency)
+    }
+
+    init(frequency: Int, maxFrames: Int) throws {
+        guard frequency > 0 && frequency <= 10_000, maxFrames > 0 && maxFrames <= 1024 else {
+            throw ControllerError.invalidProfilingOptions
+        }
+        self.frequency = UInt32(frequency)
+        self.maxFrames = UInt32(maxFrames)
+        // The stacks are 32 frames deep on average.
+        frameCapacity = max(stackCapacity * 32, UInt32(maxFrames))
+    }
+}
@@ -0,0 +1,131 @@
+//
+//  symbolIndex.swift
+//  Selfde
+//
+
+import Dispatch
+
+/// An index of the symbols of the loaded libraries that answers the address and the name lookups.
+/// The symbols are kept in one array that's sorted by the address, and the names are hashed.
+final class SymbolIndex {
+    private struct Entry {
+        let address: UInt
+        // The symbols without a size extend to the next symbol of their image, but not past the end of their segment.
+        let end: UInt
+        let nameIndex: Int
+    }
+    // The generation of the library list that the index was built from.
+    let generation: UInt
+    private let entries: [Entry]
+    private let names: [String]
+    private let nameTable: [String: Int]
+
+    var count: Int {
+        return entries.count
+    }
+
+    /// Reads the symbols of the libraries in parallel and builds the index.
+    init(libraries: [LoadedLibrary], generation: UInt, getSymbols: (LoadedLibrary) throws -> [Symbol]) {
+        var images = [[(symbol: Symbol, end: UInt)]](repeating: [], count: libraries.count)
+        images.withUnsafeMutableBufferPointer { buffer in
+            let base = buffer.baseAddress!
+            DispatchQueue.concurrentPerform(iterations: libraries.count) { i in
+                let symbols = (try? getSymbols(libraries[i])) ?? []
+                base[i] = SymbolIndex.getExtents(symbols.sorted { $0.address.bitPattern < $1.address.bitPattern }, in: libraries[i])
+            }
+        }
+        // The libraries don't overlap, so the sorted images can be concatenated in the order of their first symbols.
+        var symbols = images.filter { !$0.isEmpty }.sorted { $0[0].symbol.address.bitPattern < $1[0].symbol.address.bitPattern }.flatMap { $0 }
+        for i in symbols.indices.dropFirst() where symbols[i - 1].symbol.address.bitPattern > symbols[i].symbol.address.bitPattern {
+            symbols.sort { $0.symbol.address.bitPattern < $1.symbol.address.bitPattern }
+            break
+        }
+
+        var entries = [Entry]()
+        entries.reserveCapacity(symbols.count)
+        var names = [String]()
+        names.reserveCapacity(symbols.count)
+        var nameTable = [String: Int](minimumCapacity: symbols.count)
+        for (i, (symbol, end)) in symbols.enumerated() {
+            entries.append(Entry(address: symbol.address.bitPattern, end: end, nameIndex: i))
+            names.append(symbol.name)
+            // The first definition wins.
+            if nameTable[symbol.name] == nil {
+                nameTable[symbol.name] = i
+            }
+        }
+        self.generation = generation
+        self.entries = entries
+        self.names = names
+        self.nameTable = nameTable
+    }
+
+    // The segments of a Mach-O image have the addresses from the file, so they're moved by the image's slide.
+    // The ELF objects don't list their segments.
+    private static func getSegmentRanges(_ library: LoadedLibrary) -> [Range<UInt>] {
+        guard let text = library.segments.first(where: { $0.name == "__TEXT" }) else {
+            return []
+        }
+        let slide = library.loadAddress.bitPattern &- UInt(text.address)
+        return library.segments.filter { $0.maxProtection != 0 && $0.size != 0 }.map { segment -> Range<UInt> in
+            let start = UInt(segment.address) &+ slide
+            return start..<(start &+ UInt(segment.size))
+        }
+    }
+
+    // The symbols are sorted by the address. A symbol without a size that's the last one in its segment
+    // ends with the segment, or it only covers its address when the segment isn't known.
+    private static func getExtents(_ symbols: [Symbol], in library: LoadedLibrary) -> [(symbol: Symbol, end: UInt)] {
+        let segments = getSegmentRanges(library)
+        var result = [(symbol: Symbol, end: UInt)]()
+        result.reserveCapacity(symbols.count)
+        // The address of the symbols that follow the current address.
+        var nextAddress: UInt? = nil
+        var currentAddress: UInt? = nil
+        for symbol in symbols.reversed() {
+            let address = symbol.address.bitPattern
+            if address != currentAddress {
+                nextAddress = currentAddress
+                currentAddress = address
+            }
+            let end: UInt
+            if symbol.size != 0 {
+                end = address &+ UInt(symbol.size)
+            } else if let segment = segments.first(where: { $0.contains(address) }) {
+                end = min(nextAddress ?? segment.upperBound, segment.upperBound)
+            } else {
+                end = nextAddress ?? address &+ 1
+            }
+            result.append((symbol: symbol, end: end))
+        }
+        return result.reversed()
+    }
+
+    func lookup(_ name: String) -> Address? {
+        return nameTable[name].map { Address(bitPattern: entries[$0].address) }
+    }
+
+    /// Returns the symbol that contains the address and the offset into it.
+    func lookup(_ address: Address) -> (name: String, offset: UInt)? {
+        let value = address.bitPattern
+        // Find the last entry that starts at or before the address.
+        var low = 0
+        var high = entries.count
+        while low < high {
+            let middle = low + (high - low) / 2
+            if entries[middle].address <= value {
+                low = middle + 1
+            } else {
+                high = middle
+            }
+        }
+        guard low > 0 else {
+            return nil
+        }
+        let entry = entries[low - 1]
+        guard value < entry.end else {
+            return nil
+        }
+        return (names[entry.nameIndex], value - entry.address)
+    }
+}
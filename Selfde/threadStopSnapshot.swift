@@ -0,0 +1,395 @@
+//
+//  threadStopSnapshot.swift
+//  Selfde
+//
+
+#if os(Linux)
+import SelfdeLinuxImpl
+#endif
+
+/// The state of a thread at a stop that was released: its registers and the top of its stack were
+/// copied when it stopped, and it was resumed right after that. A debug server serves the stop from
+/// the copy, so the thread is only paused for as long as it takes to read it.
+public struct ThreadStopSnapshot {
+    /// The bytes below the stack pointer that are copied with the stack window, the red zone of the System V ABI.
+    public static let redZoneSize = 128
+
+    public let threadID: ThreadID
+    public let stopInfo: ThreadStopInfo
+    /// The register context, laid out like the value of the 'g' packet.
+    public let registerContext: [UInt8]
+    public let instructionPointer: Address
+    /// The address of the first byte of the stack window.
+    public let stackAddress: Address
+    public let stack: [UInt8]
+
+    public init(threadID: ThreadID, stopInfo: ThreadStopInfo, registerContext: [UInt8], instructionPointer: Address, stackAddress: Address, stack: [UInt8]) {
+        self.threadID = threadID
+        self.stopInfo = stopInfo
+        self.registerContext = registerContext
+        self.instructionPointer = instructionPointer
+        self.stackAddress = stackAddress
+        self.stack = stack
+    }
+
+    /// Copies the stack window of a stopped thread: the red zone below the stack pointer and the given
+    /// number of bytes above it. The window is read a page at a time with the given function, which
+    /// returns the bytes that it could read, and it ends before the first page that couldn't be read.
+    public static func readStackWindow(stackPointer: Address, windowSize: Int, pageSize: Int = 4096, read: (Address, Int) -> [UInt8]) -> (address: Address, bytes: [UInt8]) {
+        let start = stackPointer.bitPattern &- UInt(redZoneSize)
+        let size = redZoneSize + max(windowSize, 0)
+        var bytes: [UInt8] = []
+        bytes.reserveCapacity(size)
+        while bytes.count < size {
+            let address = start &+ UInt(bytes.count)
+            let count = min(size - bytes.count, pageSize - Int(address % UInt(pageSize)))
+            let chunk = read(Address(bitPattern: address), count)
+            bytes.append(contentsOf: chunk.prefix(count))
+            guard chunk.count >= count else {
+                break
+            }
+        }
+        return (Address(bitPattern: start), bytes)
+    }
+
+    /// Replaces the instruction pointer in a copy of a register context.
+    static func setInstructionPointer(_ address: Address, in registerContext: inout [UInt8]) {
+        guard let range = getGenericRegisterContextRange(GENERIC_REGNUM_PC), range.upperBound <= registerContext.count else {
+            return
+        }
+        for (i, offset) in range.enumerated() {
+            registerContext[offset] = UInt8(truncatingBitPattern: address.bitPattern >> UInt(i * 8))
+        }
+    }
+
+    /// Returns the bytes of the stack window, or nil when the range isn't entirely inside of it.
+    func stackBytes(at address: Address, count: Int) -> ArraySlice<UInt8>? {
+        let offset = address.bitPattern &- stackAddress.bitPattern
+        guard address.bitPattern >= stackAddress.bitPattern && offset <= UInt(stack.count) && UInt(count) <= UInt(stack.count) - offset else {
+            return nil
+        }
+        return stack[Int(offset)..<(Int(offset) + count)]
+    }
+
+    private func readWord(_ address: UInt) -> UInt? {
+        guard let bytes = stackBytes(at: Address(bitPattern: address), count: MemoryLayout<UInt>.size) else {
+            return nil
+        }
+        return bytes.reversed().reduce(0) { $0 << 8 | UInt($1) }
+    }
+
+    private func getGenericRegisterValue(_ generic: Int32) -> UInt? {
+        guard let range = getGenericRegisterContextRange(generic), range.count == MemoryLayout<UInt>.size, range.upperBound <= registerContext.count else {
+            return nil
+        }
+        return registerContext[range].reversed().reduce(0) { $0 << 8 | UInt($1) }
+    }
+
+    /// Walks the frame pointers that are inside of the stack window.
+    func backtrace(maxFrames: Int) -> [Address] {
+        guard maxFrames > 0 else {
+            return []
+        }
+        var frames = [instructionPointer]
+        guard var framePointer = getGenericRegisterValue(GENERIC_REGNUM_FP) else {
+            return frames
+        }
+        // The caller's frame pointer is at the frame pointer and the return address is right above it.
+        while frames.count < maxFrames, let savedFramePointer = readWord(framePointer),
+            let returnAddress = readWord(framePointer &+ UInt(MemoryLayout<UInt>.size)), returnAddress != 0 {
+            frames.append(Address(bitPattern: returnAddress))
+            guard savedFramePointer > framePointer else {
+                break
+            }
+            framePointer = savedFramePointer
+        }
+        return frames
+    }
+}
+
+/// Serves the released stops to a debug server and forwards everything else to the debugger.
+///
+/// The registers, the stop info and the stack window of a released thread come from its snapshot,
+/// and they can't be modified. The rest of the memory is read from the running process, with the
+/// stack windows laid over it.
+final class ReleasedStopsDebugger: Debugger {
+    let debugger: Debugger
+    private var stops: [ThreadID: ThreadStopSnapshot] = [:]
+    private var lastThreadID: ThreadID
+    // The memory that's returned by 'readMemory' is valid until the next read.
+    private var readBuffer: UnsafeMutablePointer<UInt8>?
+    private var readBufferCapacity = 0
+
+    init(debugger: Debugger, stop: ThreadStopSnapshot) {
+        self.debugger = debugger
+        lastThreadID = stop.threadID
+        stops[stop.threadID] = stop
+    }
+
+    deinit {
+        readBuffer?.deallocate(capacity: readBufferCapacity)
+    }
+
+    func add(_ stop: ThreadStopSnapshot) {
+        stops[stop.threadID] = stop
+        lastThreadID = stop.threadID
+    }
+
+    var registerContextSize: Int {
+        return debugger.registerContextSize
+    }
+
+    var supportsStepOut: Bool {
+        return debugger.supportsStepOut
+    }
+
+    var primaryThreadID: ThreadID {
+        return lastThreadID
+    }
+
+    var threads: [ThreadID] {
+        // A released thread might have exited since.
+        let threads = debugger.threads
+        return threads + stops.keys.filter { !threads.contains($0) }.sorted()
+    }
+
+    func attach(_ processID: Int) throws {
+        try debugger.attach(processID)
+    }
+
+    func getSharedLibraryInfoAddress() throws -> Address {
+        return try debugger.getSharedLibraryInfoAddress()
+    }
+
+    func getLoadedLibraries() throws -> [LoadedLibrary] {
+        return try debugger.getLoadedLibraries()
+    }
+
+    func getSymbols(in library: LoadedLibrary) throws -> [Symbol] {
+        return try debugger.getSymbols(in: library)
+    }
+
+    // The released threads are unwound through the frame pointers in their stack windows.
+    func getBacktraces(_ threadIDs: [ThreadID], maxFrames: Int) throws -> [[Address]] {
+        let liveThreadIDs = threadIDs.filter { stops[$0] == nil }
+        var liveBacktraces: [[Address]] = []
+        if !liveThreadIDs.isEmpty {
+            liveBacktraces = try debugger.getBacktraces(liveThreadIDs, maxFrames: maxFrames)
+        }
+        return threadIDs.map { threadID -> [Address] in
+            if let stop = stops[threadID] {
+                return stop.backtrace(maxFrames: maxFrames)
+            }
+            return liveBacktraces.isEmpty ? [] : liveBacktraces.removeFirst()
+        }
+    }
+
+    func interruptExecution() throws {
+        try debugger.interruptExecution()
+    }
+
+    func detach() {
+        debugger.detach()
+    }
+
+    func getStopInfoForThread(_ threadID: ThreadID) throws -> ThreadStopInfo {
+        if let stop = stops[threadID] {
+            return stop.stopInfo
+        }
+        return try debugger.getStopInfoForThread(threadID)
+    }
+
+    func isThreadAlive(_ threadID: ThreadID) throws -> Bool {
+        return try debugger.isThreadAlive(threadID)
+    }
+
+    func setBreakpoint(_ address: Address, byteSize: Int) throws {
+        try debugger.setBreakpoint(address, byteSize: byteSize)
+    }
+
+    func removeBreakpoint(_ address: Address) throws {
+        try debugger.removeBreakpoint(address)
+    }
+
+    func getIPRegisterValueForThread(_ threadID: ThreadID) throws -> Address {
+        if let stop = stops[threadID] {
+            return stop.instructionPointer
+        }
+        return try debugger.getIPRegisterValueForThread(threadID)
+    }
+
+    func getRegisterValueForThread(_ threadID: ThreadID, registerID: UInt32, registerSetID: UInt32, dest: inout [UInt8]) throws -> ArraySlice<UInt8> {
+        guard let stop = stops[threadID] else {
+            return try debugger.getRegisterValueForThread(threadID, registerID: registerID, registerSetID: registerSetID, dest: &dest)
+        }
+        guard let range = getRegisterContextRange(registerID: registerID, registerSetID: registerSetID), range.upperBound <= stop.registerContext.count else {
+            throw ControllerError.invalidRegisterID
+        }
+        guard dest.count >= range.count else {
+            throw ControllerError.registerBufferIsTooSmall
+        }
+        for (i, byte) in stop.registerContext[range].enumerated() {
+            dest[i] = byte
+        }
+        return dest.prefix(range.count)
+    }
+
+    func setRegisterValueForThread(_ threadID: ThreadID, registerID: UInt32, registerSetID: UInt32, source: ArraySlice<UInt8>) throws {
+        guard stops[threadID] == nil else {
+            throw DebuggerError.unsupported
+        }
+        try debugger.setRegisterValueForThread(threadID, registerID: registerID, registerSetID: registerSetID, source: source)
+    }
+
+    func getRegisterContextForThread(_ threadID: ThreadID, dest: inout [UInt8]) throws -> ArraySlice<UInt8> {
+        guard let stop = stops[threadID] else {
+            return try debugger.getRegisterContextForThread(threadID, dest: &dest)
+        }
+        guard dest.count >= stop.registerContext.count else {
+            throw ControllerError.registerBufferIsTooSmall
+        }
+        for (i, byte) in stop.registerContext.enumerated() {
+            dest[i] = byte
+        }
+        return dest.prefix(stop.registerContext.count)
+    }
+
+    func setRegisterContextForThread(_ threadID: ThreadID, source: ArraySlice<UInt8>) throws {
+        guard stops[threadID] == nil else {
+            throw DebuggerError.unsupported
+        }
+        try debugger.setRegisterContextForThread(threadID, source: source)
+    }
+
+    func allocate(_ size: Int, permissions: MemoryPermissions) throws -> Address {
+        return try debugger.allocate(size, permissions: permissions)
+    }
+
+    func deallocate(_ address: Address) throws {
+        try debugger.deallocate(address)
+    }
+
+    func readMemory(_ address: Address, size: Int) throws -> MemoryReadResult {
+        let windows = stops.values.filter { stop in
+            address.bitPattern &+ UInt(size) > stop.stackAddress.bitPattern && address.bitPattern < stop.stackAddress.bitPattern &+ UInt(stop.stack.count)
+        }
+        guard !windows.isEmpty, size > 0 else {
+            return try debugger.readMemory(address, size: size)
+        }
+        if readBufferCapacity < size {
+            readBuffer?.deallocate(capacity: readBufferCapacity)
+            readBuffer = UnsafeMutablePointer<UInt8>.allocate(capacity: size)
+            readBufferCapacity = size
+        }
+        guard let buffer = readBuffer else {
+            return .bytes(UnsafeBufferPointer(start: nil, count: 0))
+        }
+        // The reads that are inside of a stack window don't touch the process.
+        for window in windows {
+            guard let bytes = window.stackBytes(at: address, count: size) else {
+                continue
+            }
+            for (i, byte) in bytes.enumerated() {
+                buffer[i] = byte
+            }
+            return .bytes(UnsafeBufferPointer(start: buffer, count: size))
+        }
+        guard case .bytes(let liveBytes) = try debugger.readMemory(address, size: size), liveBytes.count == size else {
+            throw ControllerError.invalidAddress
+        }
+        for i in 0..<size {
+            buffer[i] = liveBytes[i]
+        }
+        for window in windows {
+            let start = max(address.bitPattern, window.stackAddress.bitPattern)
+            let end = min(address.bitPattern &+ UInt(size), window.stackAddress.bitPattern &+ UInt(window.stack.count))
+            for current in start..<end {
+                buffer[Int(current - address.bitPattern)] = window.stack[Int(current - window.stackAddress.bitPattern)]
+            }
+        }
+        return .bytes(UnsafeBufferPointer(start: buffer, count: size))
+    }
+
+    func writeMemory(_ address: Address, bytes: [UInt8]) throws {
+        try debugger.writeMemory(address, bytes: bytes)
+    }
+
+    func setNonStopMode(_ enabled: Bool) throws {
+        try debugger.setNonStopMode(enabled)
+    }
+
+    func setPassSignals(_ signals: [Int32]) throws {
+        try debugger.setPassSignals(signals)
+    }
+
+    func setProgramSignals(_ signals: [Int32]) throws {
+        try debugger.setProgramSignals(signals)
+    }
+
+    func callFunction(_ address: Address, threadID: ThreadID, integerArguments: [UInt64], vectorArguments: [[UInt8]]) throws -> FunctionCallResult {
+        guard stops[threadID] == nil else {
+            throw ControllerError.invalidRunState
+        }
+        return try debugger.callFunction(address, threadID: threadID, integerArguments: integerArguments, vectorArguments: vectorArguments)
+    }
+
+    func startProfiling(frequency: Int, maxFrames: Int) throws {
+        try debugger.startProfiling(frequency: frequency, maxFrames: maxFrames)
+    }
+
+    func stopProfiling() throws {
+        try debugger.stopProfiling()
+    }
+
+    func getProfile() throws -> StackProfile {
+        return try debugger.getProfile()
+    }
+
+    func writeCore(to path: String, options: CoreDumpOptions) throws -> CoreDumpStatistics {
+        return try debugger.writeCore(to: path, options: options)
+    }
+
+    func releaseStop(_ threadID: ThreadID, stackWindowSize: Int) throws -> ThreadStopSnapshot {
+        return try debugger.releaseStop(threadID, stackWindowSize: stackWindowSize)
+    }
+
+    func startCoverage(_ addresses: [Address]) throws -> Int {
+        return try debugger.startCoverage(addresses)
+    }
+
+    func stopCoverage() throws {
+        try debugger.stopCoverage()
+    }
+
+    func getCoverage() throws -> CoverageMap {
+        return try debugger.getCoverage()
+    }
+
+    func startDirtyPageTracking(_ ranges: [AddressRange]) throws -> DirtyPageTrackingMethod {
+        return try debugger.startDirtyPageTracking(ranges)
+    }
+
+    func stopDirtyPageTracking() throws {
+        try debugger.stopDirtyPageTracking()
+    }
+
+    func advanceDirtyPageEpoch() throws -> Int {
+        return try debugger.advanceDirtyPageEpoch()
+    }
+
+    func getDirtyPages(_ range: AddressRange, since epoch: Int) throws -> DirtyPageMap {
+        return try debugger.getDirtyPages(range, since: epoch)
+    }
+
+    func searchMemory(_ range: AddressRange, pattern: [UInt8], mask: [UInt8]?, maxMatches: Int) throws -> [Address] {
+        return try debugger.searchMemory(range, pattern: pattern, mask: mask, maxMatches: maxMatches)
+    }
+
+    func computeCRC32(_ range: AddressRange) throws -> UInt32 {
+        return try debugger.computeCRC32(range)
+    }
+
+    func computeMemoryDigests(_ range: AddressRange, blockSize: Int) throws -> [UInt32?] {
+        return try debugger.computeMemoryDigests(range, blockSize: blockSize)
+    }
+}
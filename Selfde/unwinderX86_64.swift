@@ -0,0 +1,195 @@
+//
+//  unwinderX86_64.swift
+//  Selfde
+//
+
+#if arch(x86_64)
+
+#if os(Linux)
+import SelfdeLinuxImpl
+#endif
+
+/// The registers of a stopped thread that the unwinder starts from.
+struct UnwindRegisters {
+    var instructionPointer: UInt
+    var stackPointer: UInt
+    var framePointer: UInt
+}
+
+/// The code of a loaded image and its .eh_frame section.
+struct UnwindSection {
+    let codeStart: UInt
+    let codeEnd: UInt
+    let ehFrameAddress: UInt
+    // Zero when the section is terminated by a zero length entry.
+    let ehFrameSize: UInt
+}
+
+/// Walks the stacks of the stopped threads in-process. The call frame information is used for the code
+/// that has it, and the frame pointer chain is followed through the code that doesn't.
+///
+/// The FDEs of an image are indexed when one of its addresses is first unwound, and the rows are
+/// cached by their address, as the stopped threads tend to be stopped at the same places.
+final class Unwinder {
+    typealias ReadWord = (UInt) -> UInt?
+
+    private final class Image {
+        struct FDE {
+            let start: UInt
+            let end: UInt
+            let address: UInt
+        }
+        let section: UnwindSection
+        private var fdes: [FDE]? = nil
+        private var rows: [UInt: SelfdeUnwindRowX86_64?] = [:]
+
+        init(section: UnwindSection) {
+            self.section = section
+        }
+
+        private func indexFDEs() -> [FDE] {
+            final class FDECollector {
+                var fdes: [FDE] = []
+            }
+            let collector = FDECollector()
+            // The FDEs before a malformed entry are still usable.
+            _ = selfdeUnwindEnumerateFDEsX86_64(UInt64(section.ehFrameAddress), UInt64(section.ehFrameSize), { context, start, end, fde in
+                let collector = Unmanaged<FDECollector>.fromOpaque(context!).takeUnretainedValue()
+                collector.fdes.append(FDE(start: UInt(start), end: UInt(end), address: UInt(fde)))
+            }, Unmanaged.passUnretained(collector).toOpaque())
+            return collector.fdes.sorted { $0.start < $1.start }
+        }
+
+        func row(at address: UInt) -> SelfdeUnwindRowX86_64? {
+            if let row = rows[address] {
+                return row
+            }
+            if fdes == nil {
+                fdes = indexFDEs()
+            }
+            var result: SelfdeUnwindRowX86_64? = nil
+            if let fdes = fdes, let index = Unwinder.lastIndex(in: fdes, notAfter: address, start: { $0.start }), address < fdes[index].end {
+                var row = SelfdeUnwindRowX86_64()
+                if selfdeUnwindGetRowX86_64(UInt64(fdes[index].address), UInt64(address), &row) {
+                    result = row
+                }
+            }
+            rows.updateValue(result, forKey: address)
+            return result
+        }
+    }
+
+    // Keyed by the load address.
+    private var images: [Address: Image] = [:]
+    // Sorted by the start of the code.
+    private var sortedImages: [Image] = []
+
+    /// Replaces the images that were unloaded. The sections of the new images are found using the given function.
+    func update(libraries: [LoadedLibrary], getSection: (LoadedLibrary) -> UnwindSection?) {
+        var images = [Address: Image](minimumCapacity: libraries.count)
+        for library in libraries {
+            if let image = self.images[library.loadAddress] {
+                images[library.loadAddress] = image
+            } else if let section = getSection(library) {
+                images[library.loadAddress] = Image(section: section)
+            }
+        }
+        self.images = images
+        sortedImages = images.values.sorted { $0.section.codeStart < $1.section.codeStart }
+    }
+
+    // Binary search for the last element that starts at or before the address.
+    private static func lastIndex<T>(in elements: [T], notAfter address: UInt, start: (T) -> UInt) -> Int? {
+        var low = 0
+        var high = elements.count
+        while low < high {
+            let middle = low + (high - low) / 2
+            if start(elements[middle]) <= address {
+                low = middle + 1
+            } else {
+                high = middle
+            }
+        }
+        return low > 0 ? low - 1 : nil
+    }
+
+    private func row(at address: UInt) -> SelfdeUnwindRowX86_64? {
+        guard let index = Unwinder.lastIndex(in: sortedImages, notAfter: address, start: { $0.section.codeStart }) else {
+            return nil
+        }
+        let image = sortedImages[index]
+        guard address < image.section.codeEnd else {
+            return nil
+        }
+        return image.row(at: address)
+    }
+
+    private static func canonicalFrameAddress(_ registers: UnwindRegisters, row: SelfdeUnwindRowX86_64) -> UInt {
+        let base = row.cfaRegister == UInt32(SELFDE_DWARF_RSP) ? registers.stackPointer : registers.framePointer
+        return base &+ UInt(bitPattern: Int(row.cfaOffset))
+    }
+
+    private static func unwind(_ registers: UnwindRegisters, row: SelfdeUnwindRowX86_64, readWord: ReadWord) -> UnwindRegisters? {
+        let cfa = canonicalFrameAddress(registers, row: row)
+        guard let returnAddress = readWord(cfa &+ UInt(bitPattern: Int(row.returnAddressOffset))) else {
+            return nil
+        }
+        var framePointer = registers.framePointer
+        if row.isFramePointerSaved {
+            guard let savedFramePointer = readWord(cfa &+ UInt(bitPattern: Int(row.framePointerOffset))) else {
+                return nil
+            }
+            framePointer = savedFramePointer
+        }
+        return UnwindRegisters(instructionPointer: returnAddress, stackPointer: cfa, framePointer: framePointer)
+    }
+
+    // push rbp; mov rbp, rsp: the caller's RBP is at RBP and the return address is right above it.
+    private static func unwindWithFramePointer(_ registers: UnwindRegisters, readWord: ReadWord) -> UnwindRegisters? {
+        let framePointer = registers.framePointer
+        guard framePointer >= registers.stackPointer, framePointer % 8 == 0,
+            let savedFramePointer = readWord(framePointer), let returnAddress = readWord(framePointer &+ 8) else {
+            return nil
+        }
+        return UnwindRegisters(instructionPointer: returnAddress, stackPointer: framePointer &+ 16, framePointer: savedFramePointer)
+    }
+
+    /// Returns the stack slot with the return address of the innermost frame, or nil when its code doesn't
+    /// have call frame information. The rows describe the prologues and the epilogues as well.
+    func returnAddressSlot(of registers: UnwindRegisters) -> UInt? {
+        guard let row = row(at: registers.instructionPointer), !row.isOutermostFrame, !row.isSignalFrame else {
+            return nil
+        }
+        return Unwinder.canonicalFrameAddress(registers, row: row) &+ UInt(bitPattern: Int(row.returnAddressOffset))
+    }
+
+    /// Returns the instruction pointers of the frames, starting with the innermost one.
+    /// The walk stops when the stack doesn't grow towards its base anymore.
+    func backtrace(from registers: UnwindRegisters, maxFrames: Int, readWord: ReadWord) -> [Address] {
+        var registers = registers
+        var frames = [Address]()
+        // The caller's instruction pointer is a return address, which can be past the end of the calling function.
+        var isReturnAddress = false
+        while frames.count < maxFrames && registers.instructionPointer != 0 {
+            frames.append(Address(bitPattern: registers.instructionPointer))
+            let caller: UnwindRegisters?
+            if let row = row(at: isReturnAddress ? registers.instructionPointer - 1 : registers.instructionPointer) {
+                if row.isOutermostFrame {
+                    break
+                }
+                caller = Unwinder.unwind(registers, row: row, readWord: readWord)
+                isReturnAddress = !row.isSignalFrame
+            } else {
+                caller = Unwinder.unwindWithFramePointer(registers, readWord: readWord)
+                isReturnAddress = true
+            }
+            guard let next = caller, next.stackPointer > registers.stackPointer else {
+                break
+            }
+            registers = next
+        }
+        return frames
+    }
+}
+
+#endif
@@ -38,7 +38,7 @@ func runSelfDebuggerTest() {
     runSelfdeController ({ controller in
         print("Reached callback")
         do {
-            try controller.initializeExceptionHandlingForThreads(try controller.getThreads())
+            try controller.initializeExceptionHandlingForAllThreads()
             let sharedLibAddress = try controller.getSharedLibraryInfoAddress()
             print("Got shared lib address \(sharedLibAddress)")
             let threads = try controller.getThreads()
@@ -105,9 +105,20 @@ func runSelfDebuggerTest() {
                 fatalError("Unexpected hit address!")
             }
             print("Caught the breakpoint again, thread = \(exception3.thread.threadID), ip = \(hitIP3), type = \(exception3.type)")
+            // Continue past the breakpoint without removing it.
+            try controller.continueFromBreakpoint(exception3.thread)
+
+            guard case .caughtException(let exception4) = try controller.waitForEvent() else {
+                fatalError("Not an exception")
+            }
+            let hitIP4 = try exception4.thread.getInstructionPointer()
+            guard exception4.isBreakpoint && hitIP4 == breakpoint2.address else {
+                fatalError("Unexpected hit address!")
+            }
+            print("Caught the breakpoint after continuing from it, thread = \(exception4.thread.threadID), ip = \(hitIP4), type = \(exception4.type)")
             // Remove the breakpoint and resume the thread.
             try controller.removeBreakpoint(breakpoint2)
-            try exception3.thread.resume()
+            try exception4.thread.resume()
 
             print("Controller done!")
         } catch {
@@ -124,6 +135,8 @@ func runSelfDebuggerTest() {
     testFunction()
     print("Main thread ran once")
     testFunction()
+    print("Main thread ran twice")
+    testFunction()
     print("Main thread done running!")
 
     let result = output.contains("Reached callback") &&
@@ -132,6 +145,8 @@ func runSelfDebuggerTest() {
         output.contains("Caught the single step past the original instruction") &&
         output.contains("Main thread ran once") &&
         output.contains("Caught the breakpoint again") &&
+        output.contains("Main thread ran twice") &&
+        output.contains("Caught the breakpoint after continuing from it") &&
         output.contains("Controller done") &&
         output.contains("Main thread done running")
     guard result == true else {
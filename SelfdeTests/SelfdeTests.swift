@@ -4,10 +4,14 @@
 //
 
 import XCTest
+#if os(Linux)
+import Dispatch
+#endif
 @testable import Selfde
 
 class SelfdeTests: XCTestCase {
 
+    #if os(OSX)
     func testController() {
         // Main thread info.
         let mainThread: Selfde.Thread
@@ -62,6 +66,29 @@ class SelfdeTests: XCTestCase {
                 return
             }
 
+            // Only one action can be installed at an address.
+            do {
+                let actionAddress = Address(bitPattern: executableMemory.bitPattern + 16)
+                let bp = try controller.installBreakpoint(at: actionAddress) { _ in .continue }
+                XCTAssertNil(try? controller.installBreakpoint(at: actionAddress) { _ in .stop })
+                try controller.removeBreakpoint(bp)
+            } catch {
+                XCTFail()
+                return
+            }
+
+            // The scratch slots of the removed breakpoints are reused.
+            do {
+                let pool = ScratchCodePool(task: mach_task_self_, slotSize: MachineBreakpointState.displacedInstructionSize)
+                let slot = try pool.slot(forBreakpointAt: executableMemory)
+                XCTAssertNotEqual(try pool.slot(forBreakpointAt: Address(bitPattern: executableMemory.bitPattern + 1)), slot)
+                pool.releaseSlot(forBreakpointAt: executableMemory)
+                XCTAssertEqual(try pool.slot(forBreakpointAt: Address(bitPattern: executableMemory.bitPattern + 2)), slot)
+            } catch {
+                XCTFail()
+                return
+            }
+
             do {
                 let address = try mainThread.getDispatchQueueAddress()
                 XCTAssertNotNil(address)
@@ -108,6 +135,13 @@ class SelfdeTests: XCTestCase {
                 XCTAssert(exception.isBreakpoint)
                 XCTAssertEqual(exception.reason, "breakpoint")
                 XCTAssertEqual(exception.data.count, 2)
+                // lea rax, [rdi + rsi]; paddd xmm0, xmm1; ret
+                let functionAddress = Address(bitPattern: executableMemory.bitPattern + 64)
+                try controller.write(bytes: [0x48, 0x8D, 0x04, 0x37, 0x66, 0x0F, 0xFE, 0xC1, 0xC3], to: functionAddress)
+                let callResult = try controller.callFunction(at: functionAddress, on: mainThread, integerArguments: [0x1000, 0x234], vectorArguments: [(1...16).map { UInt8($0) }, [UInt8](repeating: 1, count: 16)])
+                XCTAssertEqual(callResult.integerValues[0], 0x1234)
+                XCTAssertEqual(callResult.vectorValues[0], (2...17).map { UInt8($0) })
+                XCTAssertEqual(try mainThread.getInstructionPointer(), executableMemory)
                 try mainThread.setInstructionPointer(previousIP)
                 count = try mainThread.getSuspendCount()
                 XCTAssertEqual(count, 1)
@@ -136,6 +170,354 @@ class SelfdeTests: XCTestCase {
         XCTAssertEqual(j, 3735883783)
         XCTAssertEqual(f, 5002.0)
     }
+    #endif
+
+    #if os(Linux)
+    func testLinuxDebugger() {
+        checkLinuxDebugger(mode: .signalHandlers)
+    }
+
+    func testLinuxDebuggerTracer() {
+        checkLinuxDebugger(mode: .tracer)
+    }
+
+    func testLinuxSignalDisposition() {
+        var filter = SelfdeLinuxSignalFilter()
+        let passSignals = [SIGSEGV, SIGUSR1]
+        selfdeLinuxStoreSignalFilter(&filter, passSignals, Int32(passSignals.count), nil, 0)
+        // A fault can't be discarded, the same signal from kill can.
+        XCTAssertEqual(selfdeLinuxGetSignalDisposition(&filter, SIGSEGV, Int32(SEGV_MAPERR)), SelfdeLinuxSignalPass)
+        XCTAssertEqual(selfdeLinuxGetSignalDisposition(&filter, SIGSEGV, Int32(SI_USER)), SelfdeLinuxSignalDiscard)
+        XCTAssertEqual(selfdeLinuxGetSignalDisposition(&filter, SIGUSR1, Int32(SI_USER)), SelfdeLinuxSignalDiscard)
+        XCTAssertEqual(selfdeLinuxGetSignalDisposition(&filter, SIGBUS, Int32(BUS_ADRERR)), SelfdeLinuxSignalStop)
+    }
+
+    private func checkLinuxDebugger(mode: LinuxDebuggerMode) {
+        let debugger: LinuxDebugger
+        let executableMemory: Address
+        do {
+            debugger = try LinuxDebugger(mode: mode)
+            executableMemory = try debugger.allocate(1024, permissions: [.read, .write, .execute])
+            // mov rax, 0x1234; ret
+            try debugger.writeMemory(executableMemory, bytes: [0x48, 0xC7, 0xC0, 0x34, 0x12, 0x00, 0x00, 0xC3])
+        } catch {
+            XCTFail()
+            return
+        }
+        defer {
+            do {
+                try debugger.deallocate(executableMemory)
+            } catch {
+                XCTFail()
+            }
+        }
+        let breakpointAddress = Address(bitPattern: executableMemory.bitPattern + 7)
+
+        // Run the code on another thread, the debugger's thread is never stopped.
+        let semaphore = DispatchSemaphore(value: 0)
+        var result = 0
+        let function = unsafeBitCast(UnsafeRawPointer(bitPattern: executableMemory.bitPattern), to: (@convention(c) () -> Int).self)
+        do {
+            try debugger.setBreakpoint(breakpointAddress, byteSize: 1)
+            try debugger.setBreakpoint(breakpointAddress, byteSize: 1)
+            try debugger.removeBreakpoint(breakpointAddress)
+        } catch {
+            XCTFail()
+            return
+        }
+        DispatchQueue.global().async {
+            result = function()
+            semaphore.signal()
+        }
+
+        do {
+            let threadID = try debugger.waitForStop()
+            XCTAssert(debugger.threads.contains(threadID))
+            XCTAssertEqual(debugger.primaryThreadID, threadID)
+            XCTAssertEqual(try debugger.getStopInfoForThread(threadID).signalNumber, UInt8(SIGTRAP))
+            XCTAssertEqual(try debugger.getIPRegisterValueForThread(threadID), breakpointAddress)
+            var registerStorage = [UInt8](repeating: 0, count: debugger.registerContextSize)
+            let rax = try debugger.getRegisterValueForThread(threadID, registerID: 0, registerSetID: 1, dest: &registerStorage)
+            XCTAssertEqual(Array(rax), [0x34, 0x12, 0, 0, 0, 0, 0, 0])
+            let registerContext = try debugger.getRegisterContextForThread(threadID, dest: &registerStorage)
+            XCTAssertEqual(registerContext.count, registerStorage.count)
+            try debugger.setRegisterContextForThread(threadID, source: registerContext)
+            let backtrace = try debugger.getBacktraces([threadID], maxFrames: 64)[0]
+            XCTAssertEqual(backtrace.first, breakpointAddress)
+            XCTAssertGreaterThan(backtrace.count, 1)
+            if mode == .tracer {
+                try debugger.setDebugRegisterForThread(threadID, index: 0, value: executableMemory.bitPattern64)
+                XCTAssertEqual(try debugger.getDebugRegistersForThread(threadID)[0], executableMemory.bitPattern64)
+                try debugger.setDebugRegisterForThread(threadID, index: 0, value: 0)
+            }
+            let corePath = NSTemporaryDirectory() + "selfde-test-core.\(getpid())"
+            let coreStatistics = try debugger.writeCore(to: corePath, options: CoreDumpOptions(copyThreadCount: 2))
+            XCTAssertGreaterThan(coreStatistics.threadCount, 0)
+            XCTAssertGreaterThan(coreStatistics.writtenBytes, 0)
+            // The core has a segment for every region, and a note with the registers of every thread,
+            // where the stopped thread comes first.
+            let coreDescriptor = open(corePath, O_RDONLY)
+            func readCore(_ offset: UInt64, _ size: Int) -> [UInt8] {
+                var bytes = [UInt8](repeating: 0, count: size)
+                return pread(coreDescriptor, &bytes, size, off_t(offset)) == size ? bytes : [UInt8](repeating: 0, count: size)
+            }
+            func integer(_ bytes: [UInt8], _ offset: Int, _ size: Int) -> UInt64 {
+                return (0..<size).reversed().reduce(0) { $0 << 8 | UInt64(bytes[offset + $1]) }
+            }
+            let elfHeader = readCore(0, 64)
+            XCTAssertEqual(Array(elfHeader[0..<4]), [0x7F, 0x45, 0x4C, 0x46])
+            XCTAssertEqual(integer(elfHeader, 16, 2), 4) // ET_CORE
+            XCTAssertEqual(integer(elfHeader, 18, 2), 62) // EM_X86_64
+            let programHeaderCount = Int(integer(elfHeader, 56, 2))
+            let programHeaders = readCore(integer(elfHeader, 32, 8), programHeaderCount * Int(integer(elfHeader, 54, 2)))
+            var loadSegmentCount = 0
+            var statusThreadIDs = [ThreadID]()
+            for i in 0..<programHeaderCount {
+                let programHeader = Array(programHeaders[(i * 56)..<(i * 56 + 56)])
+                if integer(programHeader, 0, 4) == 1 { // PT_LOAD
+                    loadSegmentCount += 1
+                }
+                guard integer(programHeader, 0, 4) == 4 else { // PT_NOTE
+                    continue
+                }
+                let notes = readCore(integer(programHeader, 8, 8), Int(integer(programHeader, 32, 8)))
+                var offset = 0
+                while offset + 12 <= notes.count {
+                    let nameSize = Int(integer(notes, offset, 4))
+                    let descriptionSize = Int(integer(notes, offset + 4, 4))
+                    let description = offset + 12 + ((nameSize + 3) & ~3)
+                    if integer(notes, offset + 8, 4) == 1 { // NT_PRSTATUS
+                        // 'pr_pid' follows the signal info and the signal sets.
+                        statusThreadIDs.append(ThreadID(integer(notes, description + 32, 4)))
+                    }
+                    offset = description + ((descriptionSize + 3) & ~3)
+                }
+            }
+            close(coreDescriptor)
+            unlink(corePath)
+            XCTAssertEqual(loadSegmentCount, coreStatistics.regionCount)
+            XCTAssertEqual(statusThreadIDs.count, coreStatistics.threadCount)
+            XCTAssertEqual(statusThreadIDs.first, threadID)
+            XCTAssertEqual(Set(statusThreadIDs).count, statusThreadIDs.count)
+            // The snapshot keeps the memory from the fork.
+            let snapshot = try debugger.createForkSnapshot()
+            let dataAddress = Address(bitPattern: executableMemory.bitPattern + 512)
+            try debugger.writeMemory(dataAddress, bytes: [0xAB])
+            guard case .bytes(let snapshotBytes) = try snapshot.readMemory(dataAddress, size: 1) else {
+                XCTFail()
+                return
+            }
+            XCTAssertEqual(Array(snapshotBytes), [0])
+            XCTAssert(snapshot.threads.contains(threadID))
+            XCTAssertEqual(snapshot.primaryThreadID, threadID)
+            XCTAssertEqual(try snapshot.getStopInfoForThread(threadID).signalNumber, UInt8(SIGTRAP))
+            XCTAssertEqual(try snapshot.getIPRegisterValueForThread(threadID), breakpointAddress)
+            XCTAssertEqual(Array(try snapshot.getRegisterValueForThread(threadID, registerID: 0, registerSetID: 1, dest: &registerStorage)), [0x34, 0x12, 0, 0, 0, 0, 0, 0])
+            XCTAssertEqual(try snapshot.getBacktraces([threadID], maxFrames: 64)[0], backtrace)
+            XCTAssertThrowsError(try snapshot.writeMemory(dataAddress, bytes: [0]))
+            snapshot.release()
+            XCTAssertThrowsError(try snapshot.readMemory(dataAddress, size: 1))
+            // The released thread runs the displaced 'ret' and the breakpoint stays in place.
+            let releasedStop = try debugger.releaseStop(threadID, stackWindowSize: 256)
+            XCTAssertEqual(releasedStop.instructionPointer, breakpointAddress)
+            XCTAssertEqual(releasedStop.registerContext.count, debugger.registerContextSize)
+            XCTAssertEqual(releasedStop.stack.count, ThreadStopSnapshot.redZoneSize + 256)
+        } catch {
+            XCTFail()
+            return
+        }
+        semaphore.wait(timeout: DispatchTime.distantFuture)
+        XCTAssertEqual(result, 0x1234)
+        do {
+            try debugger.removeBreakpoint(breakpointAddress)
+        } catch {
+            XCTFail()
+        }
+
+        // A patch that straddles the 8 byte boundary is rolled back when a part of the code doesn't match.
+        let immediateAddress = Address(bitPattern: executableMemory.bitPattern + 3)
+        do {
+            try debugger.patchCode(at: immediateAddress, expected: [0x34, 0x12, 0x00, 0x00, 0xC3, 0xCC], replacement: [0x78, 0x56, 0x00, 0x00, 0xC3, 0xCC])
+            XCTFail()
+        } catch {
+        }
+        do {
+            try debugger.patchCode(at: executableMemory, expected: [0x48, 0xC7, 0xC0, 0x34, 0x12, 0x00, 0x00, 0xC3], replacement: [0x48, 0xC7, 0xC0, 0x78, 0x56, 0x00, 0x00, 0xC3])
+        } catch {
+            XCTFail()
+        }
+        XCTAssertEqual(function(), 0x5678)
+
+        XCTAssertThrowsError(try debugger.startProfiling(frequency: 0, maxFrames: 64))
+        do {
+            try debugger.startProfiling(frequency: 1000, maxFrames: 64)
+            try debugger.stopProfiling()
+            XCTAssertEqual(try debugger.getProfile().droppedSampleCount, 0)
+        } catch {
+            XCTFail()
+        }
+
+        // The coverage sites are removed by their first hits, and the block under the breakpoint is covered by its hit.
+        do {
+            let unusedBlock = Address(bitPattern: executableMemory.bitPattern + 16)
+            XCTAssertEqual(try debugger.startCoverage([executableMemory, breakpointAddress, unusedBlock]), 3)
+            try debugger.setBreakpoint(breakpointAddress, byteSize: 1)
+            DispatchQueue.global().async {
+                result = function()
+                semaphore.signal()
+            }
+            let threadID = try debugger.waitForStop()
+            XCTAssertEqual(try debugger.getIPRegisterValueForThread(threadID), breakpointAddress)
+            try debugger.removeBreakpoint(breakpointAddress)
+            try debugger.resume(actions: [], defaultAction: .continue)
+            semaphore.wait(timeout: DispatchTime.distantFuture)
+            XCTAssertEqual(result, 0x5678)
+            try debugger.stopCoverage()
+            let coverage = try debugger.getCoverage()
+            XCTAssertEqual(coverage.siteCount, 3)
+            XCTAssertEqual(coverage.bytes, [0x03])
+            guard case .bytes(let code) = try debugger.readMemory(executableMemory, size: 17) else {
+                XCTFail()
+                return
+            }
+            XCTAssertEqual(code[0], 0x48)
+            XCTAssertEqual(code[16], 0)
+        } catch {
+            XCTFail()
+        }
+
+        // The unmapped page in the middle of the range is skipped.
+        do {
+            let pageSize = Int(getpagesize())
+            guard let memory = mmap(nil, pageSize * 3, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0),
+                memory != UnsafeMutableRawPointer(bitPattern: -1) else {
+                XCTFail()
+                return
+            }
+            defer {
+                munmap(memory, pageSize * 3)
+            }
+            munmap(memory + pageSize, pageSize)
+            let pattern: [UInt8] = [0x53, 0x65, 0x6C, 0x66, 0x64, 0x65, 0xAA, 0x55]
+            for (i, byte) in pattern.enumerated() {
+                memory.storeBytes(of: byte, toByteOffset: 100 + i, as: UInt8.self)
+                memory.storeBytes(of: i == 7 ? 0 : byte, toByteOffset: pageSize * 2 + 5 + i, as: UInt8.self)
+            }
+            let memoryAddress = Address(bitPattern: UInt(bitPattern: memory))
+            let range = AddressRange(start: memoryAddress, end: Address(bitPattern: memoryAddress.bitPattern + UInt(pageSize * 3)))
+            let mask: [UInt8] = [0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00]
+            XCTAssertEqual(try debugger.searchMemory(range, pattern: pattern, mask: nil, maxMatches: 10), [Address(bitPattern: memoryAddress.bitPattern + 100)])
+            XCTAssertEqual(try debugger.searchMemory(range, pattern: pattern, mask: mask, maxMatches: 10), [100, pageSize * 2 + 5].map { Address(bitPattern: memoryAddress.bitPattern + UInt($0)) })
+            XCTAssertEqual(try debugger.searchMemory(range, pattern: pattern, mask: mask, maxMatches: 1), [Address(bitPattern: memoryAddress.bitPattern + 100)])
+            XCTAssertThrowsError(try debugger.searchMemory(range, pattern: [], mask: nil, maxMatches: 1))
+        } catch {
+            XCTFail()
+        }
+
+        // The checksums match the check values of CRC-32/MPEG-2 (GDB) and CRC-32C, and the unmapped page can't be read.
+        do {
+            let pageSize = Int(getpagesize())
+            guard let memory = mmap(nil, pageSize * 3, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0),
+                memory != UnsafeMutableRawPointer(bitPattern: -1) else {
+                XCTFail()
+                return
+            }
+            defer {
+                munmap(memory, pageSize * 3)
+            }
+            munmap(memory + pageSize, pageSize)
+            for (i, byte) in "123456789".utf8.enumerated() {
+                memory.storeBytes(of: byte, toByteOffset: i, as: UInt8.self)
+            }
+            let memoryAddress = Address(bitPattern: UInt(bitPattern: memory))
+            let checkRange = AddressRange(start: memoryAddress, end: Address(bitPattern: memoryAddress.bitPattern + 9))
+            XCTAssertEqual(try debugger.computeCRC32(checkRange), 0x0376E6E7)
+            XCTAssertEqual(try debugger.computeMemoryDigests(checkRange, blockSize: 9).map { $0 ?? 0 }, [0xE3069283])
+            XCTAssertEqual(try debugger.computeMemoryDigests(checkRange, blockSize: 1 << 45).map { $0 ?? 0 }, [0xE3069283])
+            let range = AddressRange(start: memoryAddress, end: Address(bitPattern: memoryAddress.bitPattern + UInt(pageSize * 3)))
+            XCTAssertThrowsError(try debugger.computeCRC32(range))
+            let digests = try debugger.computeMemoryDigests(range, blockSize: pageSize)
+            XCTAssertEqual(digests.count, 3)
+            XCTAssertNotNil(digests[0])
+            XCTAssertNil(digests[1])
+            XCTAssertNotNil(digests[2])
+
+            // A range of several chunks is checksummed in parts, which are combined into the serial CRCs.
+            let bufferSize = 3 * 1024 * 1024 + 12345
+            let blockSize = 1024 * 1024 + 512 * 1024 + 7
+            var buffer = [UInt8](repeating: 0, count: bufferSize)
+            var seed: UInt32 = 1
+            for i in 0..<bufferSize {
+                seed = seed &* 1103515245 &+ 12345
+                buffer[i] = UInt8(truncatingBitPattern: seed >> 16)
+            }
+            let crc32 = { (bytes: ArraySlice<UInt8>) -> UInt32 in
+                var crc: UInt32 = 0xFFFFFFFF
+                for byte in bytes {
+                    crc ^= UInt32(byte) << 24
+                    for _ in 0..<8 {
+                        crc = (crc & 0x80000000) != 0 ? (crc << 1) ^ 0x04C11DB7 : crc << 1
+                    }
+                }
+                return crc
+            }
+            let crc32c = { (bytes: ArraySlice<UInt8>) -> UInt32 in
+                var crc: UInt32 = 0xFFFFFFFF
+                for byte in bytes {
+                    crc ^= UInt32(byte)
+                    for _ in 0..<8 {
+                        crc = (crc & 1) != 0 ? (crc >> 1) ^ 0x82F63B78 : crc >> 1
+                    }
+                }
+                return ~crc
+            }
+            let expectedCRC = crc32(buffer[0..<bufferSize])
+            let expectedDigests = stride(from: 0, to: bufferSize, by: blockSize).map { crc32c(buffer[$0..<min($0 + blockSize, bufferSize)]) }
+            XCTAssertEqual(expectedDigests.count, 3)
+            buffer.withUnsafeBufferPointer { bytes in
+                let bufferAddress = Address(bitPattern: UInt(bitPattern: bytes.baseAddress!))
+                let bufferRange = AddressRange(start: bufferAddress, end: Address(bitPattern: bufferAddress.bitPattern + UInt(bufferSize)))
+                XCTAssertEqual(try debugger.computeCRC32(bufferRange), expectedCRC)
+                XCTAssertEqual(try debugger.computeMemoryDigests(bufferRange, blockSize: blockSize).map { $0 ?? 0 }, expectedDigests)
+            }
+        } catch {
+            XCTFail()
+        }
+
+        // The pages that are written by the program and by the debugger in an epoch are dirty since that epoch.
+        let pageSize = Int(getpagesize())
+        guard let pages = mmap(nil, pageSize * 4, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0),
+            pages != UnsafeMutableRawPointer(bitPattern: -1) else {
+            XCTFail()
+            return
+        }
+        defer {
+            munmap(pages, pageSize * 4)
+        }
+        let pagesAddress = Address(bitPattern: UInt(bitPattern: pages))
+        let trackedRange = AddressRange(start: pagesAddress, end: Address(bitPattern: pagesAddress.bitPattern + UInt(pageSize * 4)))
+        guard (try? debugger.startDirtyPageTracking([trackedRange])) != nil else {
+            // Without the soft-dirty bits the tracer mode can't track the pages.
+            XCTAssertEqual(mode, .tracer)
+            return
+        }
+        do {
+            pages.storeBytes(of: 1, as: UInt8.self)
+            let epoch = try debugger.advanceDirtyPageEpoch()
+            XCTAssertEqual(epoch, 2)
+            pages.storeBytes(of: 1, toByteOffset: pageSize, as: UInt8.self)
+            try debugger.writeMemory(Address(bitPattern: pagesAddress.bitPattern + UInt(pageSize * 3)), bytes: [1, 2])
+            XCTAssertEqual(try debugger.getDirtyPages(trackedRange, since: epoch).bytes, [0x0A])
+            XCTAssertEqual(try debugger.getDirtyPages(trackedRange, since: 1).bytes, [0x0B])
+            XCTAssertEqual(try debugger.getDirtyPages(trackedRange, since: 0).bytes, [0x0F])
+            XCTAssertThrowsError(try debugger.getDirtyPages(trackedRange, since: epoch + 1))
+            try debugger.stopDirtyPageTracking()
+            pages.storeBytes(of: 2, toByteOffset: pageSize * 2, as: UInt8.self)
+        } catch {
+            XCTFail()
+        }
+    }
+    #endif
 
     func testMemoryPermissionBug() {
         do {
@@ -268,6 +650,41 @@ class SelfdeTests: XCTestCase {
             let decodedData = encodedData.decodedBinaryData
             XCTAssertEqual(data, decodedData)
         }
+        do {
+            let value: [UInt8] = [0x23, 0x7d, 0, 0xff, 0x2a, 0x24]
+            XCTAssertEqual(RegisterValueEncoding.hex.encode(value), Array("237d00ff2a24".utf8))
+            XCTAssertEqual(RegisterValueEncoding.binary.encode(value), [0x7d, 0x03, 0x7d, 0x5d, 0, 0xff, 0x7d, 0x0a, 0x7d, 0x04])
+            XCTAssertEqual(RegisterValueEncoding.hex.decode(RegisterValueEncoding.hex.encode(value))!, value)
+            XCTAssertEqual(RegisterValueEncoding.binary.decode(RegisterValueEncoding.binary.encode(value))!, value)
+            XCTAssertNil(RegisterValueEncoding.hex.decode(Array("237".utf8)))
+
+            var parser = PacketParser(payload: "}\u{03}}]\u{0}\u{ff};thread:1;")
+            XCTAssertEqual(parser.readBinaryBytes(size: 4)!, [0x23, 0x7d, 0, 0xff])
+            XCTAssert(parser.consumeIfPresent(";"))
+            var truncatedParser = PacketParser(payload: "\u{0}}")
+            XCTAssertNil(truncatedParser.readBinaryBytes(size: 2))
+        }
+    }
+
+    // A 1 KB AVX register context, as sent by 'g' in the hex and binary encodings.
+    func testHexRegisterContextPerformance() {
+        let context = (0..<1024).map { UInt8(truncatingBitPattern: $0 &* 31) }
+        measure {
+            for _ in 0..<1000 {
+                let encoded = RegisterValueEncoding.hex.encode(context)
+                XCTAssertEqual(RegisterValueEncoding.hex.decode(encoded)?.count, context.count)
+            }
+        }
+    }
+
+    func testBinaryRegisterContextPerformance() {
+        let context = (0..<1024).map { UInt8(truncatingBitPattern: $0 &* 31) }
+        measure {
+            for _ in 0..<1000 {
+                let encoded = RegisterValueEncoding.binary.encode(context)
+                XCTAssertEqual(RegisterValueEncoding.binary.decode(encoded)?.count, context.count)
+            }
+        }
     }
 
     func testDebuggingUtils() {
@@ -318,6 +735,201 @@ class SelfdeTests: XCTestCase {
             XCTAssertEqual(result[1].1, ThreadResumeAction.step)
             XCTAssertEqual(result[1].2, nil)
         }
+        do {
+            let range = AddressRange(start: Address(bitPattern: 0x10), end: Address(bitPattern: 0x20))
+            let entries = [ThreadResumeEntry(thread: .id(400), action: .rangeStep, address: nil, range: range)]
+            let result = extractResumeActionsForThreads([ThreadID(400)], primaryThread: 400, entries: entries, defaultAction: .stop)
+            XCTAssertEqual(result.count, 1)
+            XCTAssertEqual(result[0].1, ThreadResumeAction.rangeStep)
+            XCTAssertEqual(result[0].3, range)
+            XCTAssert(range.contains(Address(bitPattern: 0x10)))
+            XCTAssertFalse(range.contains(Address(bitPattern: 0x20)))
+        }
+    }
+
+    func testMemoryArena() {
+        var pageAllocations = 0
+        var pageDeallocations = 0
+        var protections: [MemoryPermissions] = []
+        var pages: [Address: UnsafeMutablePointer<UInt8>] = [:]
+        do {
+            let arena = MemoryArena(pageSize: 4096, allocatePages: { size, permissions in
+                pageAllocations += 1
+                let pointer = UnsafeMutablePointer<UInt8>.allocate(capacity: size)
+                let address = Address(bitPattern: UInt(bitPattern: pointer))
+                pages[address] = pointer
+                return address
+            }, deallocatePages: { address, size in
+                pageDeallocations += 1
+                pages.removeValue(forKey: address)?.deallocate(capacity: size)
+            }, protectPages: { address, size, permissions in
+                protections.append(permissions)
+            })
+
+            // The small allocations share the pages with the same permissions.
+            let a = try arena.allocate(10, permissions: [.read, .write])
+            let b = try arena.allocate(100, permissions: [.read, .write])
+            XCTAssertEqual(b.bitPattern - a.bitPattern, 16)
+            let c = try arena.allocate(10, permissions: [.read, .write, .execute])
+            XCTAssertEqual(pageAllocations, 2)
+            XCTAssertNotEqual(c.bitPattern & ~UInt(0xFFFF), a.bitPattern & ~UInt(0xFFFF))
+
+            // The freed memory is merged and reused.
+            try arena.deallocate(a)
+            try arena.deallocate(b)
+            XCTAssertEqual(try arena.allocate(112, permissions: [.read, .write]), a)
+            XCTAssertEqual(pageAllocations, 2)
+            XCTAssertNil(try? arena.deallocate(Address(bitPattern: a.bitPattern + 1)))
+
+            // The large allocations get their own pages.
+            let large = try arena.allocate(1 << 20, permissions: [.read, .write])
+            XCTAssertEqual(pageAllocations, 3)
+            try arena.deallocate(large)
+            XCTAssertEqual(pageDeallocations, 1)
+
+            // The identical code blobs share the memory, the others get their own pages.
+            let code: [UInt8] = [0x48, 0x89, 0xF8, 0xC3]
+            let code0 = try arena.allocateCode(code)
+            XCTAssertEqual(protections, [[.read, .execute]])
+            XCTAssertEqual(pageAllocations, 4)
+            XCTAssertEqual(UnsafePointer<UInt8>(bitPattern: code0.bitPattern)![3], 0xC3)
+            XCTAssertEqual(try arena.allocateCode(code), code0)
+            let code1 = try arena.allocateCode([0xC3])
+            XCTAssertNotEqual(code1.bitPattern & ~UInt(0xFFF), code0.bitPattern & ~UInt(0xFFF))
+            XCTAssertEqual(pageAllocations, 5)
+            XCTAssertEqual(protections.count, 2)
+            try arena.deallocate(code0)
+            XCTAssertEqual(try arena.allocateCode(code), code0)
+            // The pages of a freed blob are reused.
+            try arena.deallocate(code0)
+            try arena.deallocate(code0)
+            XCTAssertEqual(try arena.allocateCode([0x90, 0xC3]), code0)
+            XCTAssertEqual(UnsafePointer<UInt8>(bitPattern: code0.bitPattern)![1], 0xC3)
+            XCTAssertEqual(pageAllocations, 5)
+            XCTAssertEqual(protections.count, 4)
+            XCTAssertEqual(Array(protections.suffix(2)), [[.read, .write], [.read, .execute]])
+        } catch {
+            XCTFail()
+        }
+        // The arena gives back all of its pages.
+        XCTAssert(pages.isEmpty)
+    }
+
+    func testInstructionDecoderX86_64() {
+        func length(_ bytes: [UInt8]) -> Int? {
+            return decodeInstructionX86_64(bytes)?.length
+        }
+        XCTAssertEqual(length([0x55]), 1) // push rbp
+        XCTAssertEqual(length([0x48, 0x89, 0xE5]), 3) // mov rbp, rsp
+        XCTAssertEqual(length([0x48, 0x83, 0xEC, 0x10]), 4) // sub rsp, 0x10
+        XCTAssertEqual(length([0x48, 0xB8, 1, 2, 3, 4, 5, 6, 7, 8]), 10) // movabs rax, imm64
+        XCTAssertEqual(length([0x66, 0x0F, 0x1F, 0x44, 0x00, 0x00]), 6) // nop word [rax + rax]
+        XCTAssertEqual(length([0x8B, 0x44, 0x24, 0x08]), 4) // mov eax, [rsp + 8]
+        XCTAssertEqual(length([0xF7, 0xC0, 1, 0, 0, 0]), 6) // test eax, 1
+        XCTAssertEqual(length([0xF7, 0xD0]), 2) // not eax
+        XCTAssertEqual(length([0xC5, 0xF8, 0x77]), 3) // vzeroupper
+        XCTAssertEqual(length([0xC4, 0xE3, 0x7D, 0x18, 0xC1, 0x01]), 6) // vinsertf128 ymm0, ymm0, xmm1, 1
+        XCTAssertEqual(length([0x62, 0xF1, 0x7C, 0x48, 0x10, 0x44, 0x24, 0x01]), 8) // vmovups zmm0, [rsp + 0x40]
+        XCTAssertNil(length([0x48, 0x8B])) // Truncated.
+        XCTAssertNil(length([0x06])) // Invalid in 64 bit mode.
+
+        let address = Address(bitPattern: 0x100000)
+        let scratch = Address(bitPattern: 0x200000)
+        do {
+            // mov rax, [rip + 0x10]
+            let bytes: [UInt8] = [0x48, 0x8B, 0x05, 0x10, 0x00, 0x00, 0x00]
+            guard let instruction = decodeInstructionX86_64(bytes) else {
+                XCTFail()
+                return
+            }
+            XCTAssertEqual(instruction.length, 7)
+            XCTAssertEqual(instruction.ripRelativeDisplacementOffset, 3)
+            let code = relocateInstructionX86_64(bytes, instruction, from: address, to: scratch)
+            XCTAssertEqual(code ?? [], [0x48, 0x8B, 0x05, 0x10, 0x00, 0xF0, 0xFF, 0xFF, 0x25, 0, 0, 0, 0, 0x07, 0x00, 0x10, 0, 0, 0, 0, 0])
+            XCTAssertNil(relocateInstructionX86_64(bytes, instruction, from: address, to: Address(bitPattern: 0x100000000)))
+        }
+        do {
+            // je +5
+            let bytes: [UInt8] = [0x74, 0x05]
+            guard let instruction = decodeInstructionX86_64(bytes) else {
+                XCTFail()
+                return
+            }
+            XCTAssertEqual(instruction.branchKind, RelativeBranchKindX86_64.conditional)
+            let code = relocateInstructionX86_64(bytes, instruction, from: address, to: scratch)
+            XCTAssertEqual(code ?? [], [0x74, 0x0E,
+                                        0xFF, 0x25, 0, 0, 0, 0, 0x02, 0x00, 0x10, 0, 0, 0, 0, 0,
+                                        0xFF, 0x25, 0, 0, 0, 0, 0x07, 0x00, 0x10, 0, 0, 0, 0, 0])
+        }
+        do {
+            // call -0x10
+            let bytes: [UInt8] = [0xE8, 0xF0, 0xFF, 0xFF, 0xFF]
+            guard let instruction = decodeInstructionX86_64(bytes) else {
+                XCTFail()
+                return
+            }
+            XCTAssertEqual(instruction.branchKind, RelativeBranchKindX86_64.call)
+            let code = relocateInstructionX86_64(bytes, instruction, from: address, to: scratch)
+            XCTAssertEqual(code ?? [], [0xFF, 0x35, 0x06, 0, 0, 0, 0xFF, 0x25, 0x08, 0, 0, 0,
+                                        0x05, 0x00, 0x10, 0, 0, 0, 0, 0,
+                                        0xF5, 0xFF, 0x0F, 0, 0, 0, 0, 0])
+        }
+        do {
+            // call [rip + 0x20]
+            let bytes: [UInt8] = [0xFF, 0x15, 0x20, 0x00, 0x00, 0x00]
+            guard let instruction = decodeInstructionX86_64(bytes) else {
+                XCTFail()
+                return
+            }
+            XCTAssert(instruction.isIndirectCall)
+            let code = relocateInstructionX86_64(bytes, instruction, from: address, to: scratch)
+            XCTAssertEqual(code ?? [], [0xFF, 0x35, 0x06, 0, 0, 0, 0xFF, 0x25, 0x1A, 0x00, 0xF0, 0xFF,
+                                        0x06, 0x00, 0x10, 0, 0, 0, 0, 0])
+            // call [rsp + 8]
+            let stackCall: [UInt8] = [0xFF, 0x54, 0x24, 0x08]
+            XCTAssertNil(decodeInstructionX86_64(stackCall).flatMap { relocateInstructionX86_64(stackCall, $0, from: address, to: scratch) })
+            // call [rax + r12 * 8]
+            let r12IndexCall: [UInt8] = [0x42, 0xFF, 0x14, 0xE0]
+            XCTAssertNotNil(decodeInstructionX86_64(r12IndexCall).flatMap { relocateInstructionX86_64(r12IndexCall, $0, from: address, to: scratch) })
+        }
+        // ret, rep ret and ret 8 are returns, a far return isn't.
+        XCTAssertEqual(decodeInstructionX86_64([0xC3])?.isReturn, true)
+        XCTAssertEqual(decodeInstructionX86_64([0xF3, 0xC3])?.isReturn, true)
+        XCTAssertEqual(decodeInstructionX86_64([0xC2, 0x08, 0x00])?.isReturn, true)
+        XCTAssertEqual(decodeInstructionX86_64([0xCB])?.isReturn, false)
+    }
+
+    func testUnwinderX86_64() {
+        // The code doesn't have any call frame information, so the frame pointer chain is followed.
+        let memory: [UInt: UInt] = [
+            0x1000: 0x1010, 0x1008: 0x400100,
+            0x1010: 0x1040, 0x1018: 0x400200,
+            0x1040: 0x1020, 0x1048: 0x400300,
+            0x1020: 0, 0x1028: 0x400400
+        ]
+        let unwinder = Unwinder()
+        unwinder.update(libraries: [LoadedLibrary(path: "/bin/a", loadAddress: Address(bitPattern: 0x400000))], getSection: { _ in nil })
+        let registers = UnwindRegisters(instructionPointer: 0x400000, stackPointer: 0xFF0, framePointer: 0x1000)
+        let frames = unwinder.backtrace(from: registers, maxFrames: 16) { memory[$0] }
+        // The chain that goes back down the stack is cut off.
+        XCTAssertEqual(frames.map { $0.bitPattern }, [0x400000, 0x400100, 0x400200, 0x400300])
+        XCTAssertEqual(unwinder.backtrace(from: registers, maxFrames: 2) { memory[$0] }.count, 2)
+        // The walk stops at a frame pointer that can't be read.
+        XCTAssertEqual(unwinder.backtrace(from: UnwindRegisters(instructionPointer: 0x400000, stackPointer: 0xFF0, framePointer: 0x2000), maxFrames: 16) { memory[$0] }.map { $0.bitPattern }, [0x400000])
+    }
+
+    func testStackProfile() {
+        let profile = StackProfile(stacks: [
+            StackProfile.Stack(frames: [Address(bitPattern: 0x1010), Address(bitPattern: 0x2005)], sampleCount: 3),
+            StackProfile.Stack(frames: [Address(bitPattern: 0x3000)], sampleCount: 5)
+        ], samplingInterval: 10_000_000, droppedSampleCount: 1)
+        XCTAssertEqual(profile.sampleCount, 8)
+        XCTAssertEqual(profile.stacks.map { $0.sampleCount }, [5, 3])
+        // The outermost frame comes first, and the callers are symbolicated at the address before the return address.
+        XCTAssertEqual(profile.foldedStacks { $0.bitPattern == 0x2004 ? "main" : nil }, "0x3000 5\nmain;0x1010 3\n")
+        // The sample types (samples, count) and (cpu, nanoseconds), then the first sample with the locations 1 and values 5, 50000000.
+        XCTAssertEqual(Array(profile.pprofData().prefix(24)), [0x0A, 0x04, 0x08, 0x01, 0x10, 0x02, 0x0A, 0x04, 0x08, 0x03, 0x10, 0x04,
+                                                               0x12, 0x0A, 0x0A, 0x01, 0x01, 0x12, 0x05, 0x05, 0x80, 0xE1, 0xEB, 0x17])
     }
 
     func testRemoteDebuggingPacketHandling() {
@@ -334,6 +946,7 @@ class SelfdeTests: XCTestCase {
         }
 
         class MockDebugger: Debugger {
+            var supportsStepOut = true
             var expectedSetBreakpoints: [(UInt, Int)] = []
             var removeBreakpoint: [UInt] = []
             var expectedAllocates: [(Int, MemoryPermissions)]
@@ -345,6 +958,23 @@ class SelfdeTests: XCTestCase {
             var expectedRegisterContextReads: [(ThreadID, [UInt8])]
             var expectedRegisterContextWrites: [(ThreadID, [UInt8])]
             var interruptCounter = 0
+            var nonStopMode = false
+            var passSignals: [Int32] = []
+            var programSignals: [Int32]?
+            var loadedLibraries: [LoadedLibrary] = []
+            var librarySymbols: [Address: [Symbol]] = [:]
+            var backtraces: [ThreadID: [Address]] = [:]
+            var profilingOptions: (frequency: Int, maxFrames: Int)?
+            var profile = StackProfile(stacks: [], samplingInterval: 0)
+            var coreDumps: [(path: String, options: CoreDumpOptions)] = []
+            var coverageSites: [Address]?
+            var coverage = CoverageMap(siteCount: 0, words: [])
+            var dirtyPageRanges: [AddressRange]?
+            var dirtyPageEpoch = 1
+            var dirtyPages: (range: AddressRange, epoch: Int)?
+            var memorySearches: [(range: AddressRange, pattern: [UInt8], mask: [UInt8]?, maxMatches: Int)] = []
+            var searchMatches: [Address] = []
+            var checksumRanges: [AddressRange] = []
             
             init(expectedSetBreakpoints: [(UInt, Int)] = [], expectedAllocates: [(Int, MemoryPermissions)] = [], expectedDeallocates: [Address] = [], expectedMemoryReads: [(UInt, Int)] = [], expectedMemoryWrites: [(UInt, [UInt8])] = [], expectedRegisterReads: [(ThreadID, UInt32, UInt32, UInt64)] = [], expectedRegisterWrites: [(ThreadID, UInt32, UInt32, UInt64)] = [], expectedRegisterContextReads: [(ThreadID, [UInt8])] = [], expectedRegisterContextWrites: [(ThreadID, [UInt8])] = []) {
                 self.expectedSetBreakpoints = expectedSetBreakpoints
@@ -379,6 +1009,26 @@ class SelfdeTests: XCTestCase {
                 interruptCounter += 1
             }
 
+            func setNonStopMode(_ enabled: Bool) throws {
+                nonStopMode = enabled
+            }
+
+            func setPassSignals(_ signals: [Int32]) throws {
+                passSignals = signals
+            }
+
+            func setProgramSignals(_ signals: [Int32]) throws {
+                programSignals = signals
+            }
+
+            func callFunction(_ address: Address, threadID: ThreadID, integerArguments: [UInt64], vectorArguments: [[UInt8]]) throws -> FunctionCallResult {
+                guard address == Address(bitPattern: 0x1000) else {
+                    throw MockError.notExpected
+                }
+                XCTAssertEqual(threadID, primaryThreadID)
+                return FunctionCallResult(integerValues: [integerArguments.reduce(0, +), UInt64(vectorArguments.count)], vectorValues: [vectorArguments.first ?? [UInt8](repeating: 0, count: 16), [UInt8](repeating: 0xFF, count: 16)])
+            }
+
             func detach() {
             }
 
@@ -403,6 +1053,86 @@ class SelfdeTests: XCTestCase {
                 return Address(bitPattern: 0x1013)
             }
 
+            func getLoadedLibraries() throws -> [LoadedLibrary] {
+                return loadedLibraries
+            }
+
+            func getSymbols(in library: LoadedLibrary) throws -> [Symbol] {
+                return librarySymbols[library.loadAddress] ?? []
+            }
+
+            func getBacktraces(_ threadIDs: [ThreadID], maxFrames: Int) throws -> [[Address]] {
+                return threadIDs.map { Array((backtraces[$0] ?? []).prefix(maxFrames)) }
+            }
+
+            func startProfiling(frequency: Int, maxFrames: Int) throws {
+                profilingOptions = (frequency, maxFrames)
+            }
+
+            func stopProfiling() throws {
+                profilingOptions = nil
+            }
+
+            func getProfile() throws -> StackProfile {
+                return profile
+            }
+
+            func writeCore(to path: String, options: CoreDumpOptions) throws -> CoreDumpStatistics {
+                coreDumps.append((path, options))
+                return CoreDumpStatistics(threadCount: 2, regionCount: 3, pauseDuration: 0x1234, totalDuration: 0x5678, writtenBytes: 0x3000, elidedBytes: 0x1000)
+            }
+
+            func startCoverage(_ addresses: [Address]) throws -> Int {
+                coverageSites = addresses
+                return addresses.count
+            }
+
+            func stopCoverage() throws {
+                coverageSites = nil
+            }
+
+            func getCoverage() throws -> CoverageMap {
+                return coverage
+            }
+
+            func startDirtyPageTracking(_ ranges: [AddressRange]) throws -> DirtyPageTrackingMethod {
+                dirtyPageRanges = ranges
+                dirtyPageEpoch = 1
+                return .writeProtection
+            }
+
+            func stopDirtyPageTracking() throws {
+                dirtyPageRanges = nil
+            }
+
+            func advanceDirtyPageEpoch() throws -> Int {
+                dirtyPageEpoch += 1
+                return dirtyPageEpoch
+            }
+
+            func getDirtyPages(_ range: AddressRange, since epoch: Int) throws -> DirtyPageMap {
+                guard epoch <= dirtyPageEpoch else {
+                    throw MockError.notExpected
+                }
+                dirtyPages = (range, epoch)
+                return DirtyPageMap(address: range.start, pageSize: 0x1000, pageCount: 10, bytes: [0x23, 0x02])
+            }
+
+            func searchMemory(_ range: AddressRange, pattern: [UInt8], mask: [UInt8]?, maxMatches: Int) throws -> [Address] {
+                memorySearches.append((range, pattern, mask, maxMatches))
+                return Array(searchMatches.filter { range.contains($0) }.prefix(maxMatches))
+            }
+
+            func computeCRC32(_ range: AddressRange) throws -> UInt32 {
+                checksumRanges.append(range)
+                return 0x0376E6E7
+            }
+
+            func computeMemoryDigests(_ range: AddressRange, blockSize: Int) throws -> [UInt32?] {
+                checksumRanges.append(range)
+                return [0xE3069283, nil, 0x1A]
+            }
+
             func allocate(_ size: Int, permissions: MemoryPermissions) throws -> Address {
                 guard let value = expectedAllocates.first else {
                     throw MockError.notExpected
@@ -422,8 +1152,8 @@ class SelfdeTests: XCTestCase {
             }
             
             let bytes: UnsafeMutablePointer<UInt8> = {
-                let result = UnsafeMutablePointer<UInt8>.allocate(capacity: 256)
-                result.initialize(from: (0..<256).map { UInt8($0) })
+                let result = UnsafeMutablePointer<UInt8>.allocate(capacity: 4096)
+                result.initialize(from: (0..<4096).map { UInt8(truncatingBitPattern: $0) })
                 return result
             }()
 
@@ -526,15 +1256,17 @@ class SelfdeTests: XCTestCase {
             return result
         }
 
-        let server = DebugServer(debugger: MockDebugger(expectedSetBreakpoints: [(0xABA, 1), (0xBAA, 255)], expectedAllocates: [(0x104, [MemoryPermissions.read, MemoryPermissions.write]), (0x1234567812345678, [MemoryPermissions.read, MemoryPermissions.write, MemoryPermissions.execute])], expectedDeallocates: [Address(bitPattern: 0xadbeef)], expectedMemoryReads: [(0xA0B, 4), (0x123456789, 0x11), (0xA0B, 4), (0x4040, 256)], expectedMemoryWrites: [(0xBeef, [0,7,0xAA,0xBB,0xCC,0xEE,0x12,0x34]), (0xBeef, [0,7,0xAA,0xBB,1,2,3,4])], expectedRegisterReads: [(0xc, 0, 1, 0), (0xa2a, 0, 1, 2), (0xa2a, 0x10, 1, 0x4091), (0, 0xf, 1, UInt64.max)], expectedRegisterWrites: [(0x808, 0, 1, 0xefcdab78563412), (0x808, 0xa, 1, 0x1000000000000000), (0x71f, 3, 1, UInt64.max), (0x808, 0x11, 1, 2)],
+        let server = DebugServer(debugger: MockDebugger(expectedSetBreakpoints: [(0xABA, 1), (0xBAA, 255)], expectedAllocates: [(0x104, [MemoryPermissions.read, MemoryPermissions.write]), (0x1234567812345678, [MemoryPermissions.read, MemoryPermissions.write, MemoryPermissions.execute])], expectedDeallocates: [Address(bitPattern: 0xadbeef)], expectedMemoryReads: [(0xA0B, 4), (0x123456789, 0x11), (0xA0B, 4), (0x4040, 256)], expectedMemoryWrites: [(0xBeef, [0,7,0xAA,0xBB,0xCC,0xEE,0x12,0x34]), (0xBeef, [0,7,0xAA,0xBB,1,2,3,4])], expectedRegisterReads: [(0xc, 0, 1, 0), (0xa2a, 0, 1, 2), (0xa2a, 0x10, 1, 0x4091), (0, 0xf, 1, UInt64.max), (0xa2a, 0, 1, 0x23)], expectedRegisterWrites: [(0x808, 0, 1, 0xefcdab78563412), (0x808, 0xa, 1, 0x1000000000000000), (0x71f, 3, 1, UInt64.max), (0x808, 0x11, 1, 2), (0x808, 0, 1, 0x242a)],
             expectedRegisterContextReads: [
                 (0x42, registerContext([2, UInt64.max, 0x4091])),
                 (0x42, registerContext([2, UInt64.max, 0x4091])),
-                (0x42, registerContext([0,5,11]))
+                (0x42, registerContext([0,5,11])),
+                (0x42, registerContext([0x7d, 0x2a, 0x4091]))
             ], expectedRegisterContextWrites: [
                 (0x42, registerContext([0xF1Fa, UInt64(Int64.max), 0])),
                 (0x42, registerContext([2, UInt64.max, 0x4091])),
-                (0x42, registerContext([0,5,11]))
+                (0x42, registerContext([0,5,11])),
+                (0x42, registerContext([0x23, 0, UInt64.max]))
             ]), writer: MockConnection()
         )
 
@@ -632,6 +1364,27 @@ class SelfdeTests: XCTestCase {
         XCTAssert(server.handlePacketPayload("QRestoreRegisterState:;thread:42").isInvalid)
         XCTAssert(server.handlePacketPayload("QRestoreRegisterState:348237480297082374820734082;thread:42").isInvalid)
 
+        // Binary register values
+        func binaryPacket(_ prefix: String, _ value: [UInt8], _ suffix: String) -> String {
+            return prefix + String(String.UnicodeScalarView(value.encodedBinaryData.map { UnicodeScalar($0) })) + suffix
+        }
+        if case .response(let features) = server.handlePacketPayload("qSupported:xmlRegisters=i386;binary-registers+") {
+            XCTAssert(features.contains(";binary-registers+"))
+        } else {
+            XCTFail()
+        }
+        #if arch(x86_64)
+            XCTAssertEqual(server.handlePacketPayload("p0;thread:a2a;"), ResponseResult.binaryResponse([0x7d, 0x03, 0, 0, 0, 0, 0, 0, 0]))
+            XCTAssertEqual(server.handlePacketPayload(binaryPacket("P0=", [0x2a, 0x24, 0, 0, 0, 0, 0, 0], ";thread:808;")), ResponseResult.ok)
+            XCTAssert(server.handlePacketPayload(binaryPacket("P0=", [0x2a, 0x24, 0, 0, 0, 0, 0], ";thread:808;")).isInvalid)
+        #endif
+        XCTAssertEqual(server.handlePacketPayload("g;thread:42;"), ResponseResult.binaryResponse(registerContext([0x7d, 0x2a, 0x4091]).encodedBinaryData))
+        XCTAssertEqual(server.handlePacketPayload(binaryPacket("G", registerContext([0x23, 0, UInt64.max]), ";thread:42;")), ResponseResult.ok)
+        XCTAssert(server.handlePacketPayload(binaryPacket("G", registerContext([0x23, 0, UInt64.max]), "")).isInvalid)
+        XCTAssert(server.handlePacketPayload("G}").isInvalid)
+        server.handlePacketPayload("qSupported")
+        XCTAssert(server.handlePacketPayload("G" + String(repeating: "\u{0}", count: 24) + ";thread:42;").isInvalid)
+
         // Thread commands
         XCTAssertEqual(server.handlePacketPayload("qC"), ResponseResult.response("QCc"))
         XCTAssertEqual(server.handlePacketPayload("Hg0"), ResponseResult.ok)
@@ -678,6 +1431,33 @@ class SelfdeTests: XCTestCase {
         XCTAssert(server.handlePacketPayload("vCont;").isInvalid)
         XCTAssert(server.handlePacketPayload("vCont;a").isInvalid)
         XCTAssert(server.handlePacketPayload("vCont;c:").isInvalid)
+        // The stop action is only allowed in the non-stop mode.
+        XCTAssert(server.handlePacketPayload("vCont;t:20").isInvalid)
+        // Range stepping and step out.
+        XCTAssertEqual(server.handlePacketPayload("vCont?"), ResponseResult.response("vCont;c;s;r;f"))
+        if case .resume(let actions, let defaultAction) = server.handlePacketPayload("vCont;r1000,1010:20;c") {
+            XCTAssertEqual(actions, [ThreadResumeEntry(thread: .id(0x20), action: .rangeStep, address: nil, range: AddressRange(start: Address(bitPattern: 0x1000), end: Address(bitPattern: 0x1010)))])
+            XCTAssertEqual(defaultAction, ThreadResumeAction.`continue`)
+        } else {
+            XCTFail()
+        }
+        if case .resume(let actions, let defaultAction) = server.handlePacketPayload("vCont;f:20") {
+            XCTAssertEqual(actions, [ThreadResumeEntry(thread: .id(0x20), action: .stepOut, address: nil)])
+            XCTAssertEqual(defaultAction, ThreadResumeAction.stop)
+        } else {
+            XCTFail()
+        }
+        XCTAssert(server.handlePacketPayload("vCont;r1000:20").isInvalid)
+        XCTAssert(server.handlePacketPayload("vCont;r1000,1010").isInvalid)
+        XCTAssert(server.handlePacketPayload("vCont;f").isInvalid)
+        // A debugger that can't step out doesn't advertise it.
+        do {
+            let debugger = MockDebugger()
+            debugger.supportsStepOut = false
+            let server = DebugServer(debugger: debugger, writer: MockConnection())
+            XCTAssertEqual(server.handlePacketPayload("vCont?"), ResponseResult.response("vCont;c;s;r"))
+            XCTAssert(server.handlePacketPayload("vCont;f:20").isInvalid)
+        }
 
         // vAttach
         XCTAssertEqual(server.handlePacketPayload("vAttach;12345"), ResponseResult.threadStopReply)
@@ -778,6 +1558,454 @@ class SelfdeTests: XCTestCase {
             } catch {
                 XCTFail()
             }
+
+            // Signal filtering.
+            do {
+                let debugger = MockDebugger()
+                let server = DebugServer(debugger: debugger, writer: MockConnection())
+                XCTAssertEqual(server.handlePacketPayload("QPassSignals:0e;1e;1f"), ResponseResult.ok)
+                XCTAssertEqual(debugger.passSignals, [0x0e, 0x1e, 0x1f])
+                XCTAssertEqual(server.handlePacketPayload("QPassSignals:"), ResponseResult.ok)
+                XCTAssertEqual(debugger.passSignals, [])
+                XCTAssertEqual(server.handlePacketPayload("QProgramSignals:b"), ResponseResult.ok)
+                XCTAssertEqual(debugger.programSignals ?? [], [0xb])
+                XCTAssert(server.handlePacketPayload("QPassSignals:1;;2").isInvalid)
+                XCTAssert(server.handlePacketPayload("QProgramSignals:100").isInvalid)
+            }
+
+            // Function calls.
+            do {
+                let debugger = MockDebugger()
+                let server = DebugServer(debugger: debugger, writer: MockConnection())
+                XCTAssertEqual(server.handlePacketPayload("qCallFunction:1000;2,3;"), ResponseResult.response("rax:5;rdx:0;xmm0:00000000000000000000000000000000;xmm1:ffffffffffffffffffffffffffffffff;"))
+                XCTAssertEqual(server.handlePacketPayload("qCallFunction:1000;;000102030405060708090a0b0c0d0e0f"), ResponseResult.response("rax:0;rdx:1;xmm0:000102030405060708090a0b0c0d0e0f;xmm1:ffffffffffffffffffffffffffffffff;"))
+                XCTAssertEqual(server.handlePacketPayload("qCallFunction:2000;;"), ResponseResult.error(.e01))
+                XCTAssert(server.handlePacketPayload("qCallFunction:1000;2").isInvalid)
+                XCTAssert(server.handlePacketPayload("qCallFunction:1000;x;").isInvalid)
+                XCTAssert(server.handlePacketPayload("qCallFunction:1000;;0001").isInvalid)
+            }
+
+            // Loaded libraries.
+            do {
+                func jsonPacket(_ json: String) -> String {
+                    return "jGetLoadedDynamicLibrariesInfos:" + String(String.UnicodeScalarView(Array(json.utf8).encodedBinaryData.map { UnicodeScalar($0) }))
+                }
+                func text(_ result: ResponseResult) -> String {
+                    guard case .binaryResponse(let bytes) = result else {
+                        XCTFail()
+                        return ""
+                    }
+                    return String(bytes: bytes.decodedBinaryData, encoding: .utf8) ?? ""
+                }
+                let debugger = MockDebugger()
+                let server = DebugServer(debugger: debugger, writer: MockConnection())
+                let executable = LoadedLibrary(path: "/bin/a", loadAddress: Address(bitPattern: 0x1000), uuid: (0..<16).map { UInt8($0) }, header: LoadedImageHeader(magic: 0xfeedfacf, cpuType: 0x1000007, cpuSubType: 3, fileType: 2, flags: 0x85), segments: [LoadedSegment(name: "__TEXT", address: 0x1000, size: 0x2000, fileOffset: 0, fileSize: 0x2000, maxProtection: 5)])
+                let library = LoadedLibrary(path: "/usr/lib/\"b\".dylib", loadAddress: Address(bitPattern: 0x8000))
+                debugger.loadedLibraries = [executable, library]
+                XCTAssertEqual(text(server.handlePacketPayload(jsonPacket("{\"fetch_all_solibs\":true}"))), "{\"images\":[{\"load_address\":4096,\"mod_date\":0,\"pathname\":\"/bin/a\",\"uuid\":\"00010203-0405-0607-0809-0A0B0C0D0E0F\",\"mach_header\":{\"magic\":4277009103,\"cputype\":16777223,\"cpusubtype\":3,\"filetype\":2,\"flags\":133},\"segments\":[{\"name\":\"__TEXT\",\"vmaddr\":4096,\"vmsize\":8192,\"fileoff\":0,\"filesize\":8192,\"maxprot\":5}]},{\"load_address\":32768,\"mod_date\":0,\"pathname\":\"/usr/lib/\\\"b\\\".dylib\"}],\"generation\":1}")
+                XCTAssertEqual(text(server.handlePacketPayload(jsonPacket("{\"solib_addresses\":[32768]}"))), "{\"images\":[{\"load_address\":32768,\"mod_date\":0,\"pathname\":\"/usr/lib/\\\"b\\\".dylib\"}],\"generation\":1}")
+                debugger.loadedLibraries = [executable, LoadedLibrary(path: "/usr/lib/c.dylib", loadAddress: Address(bitPattern: 0x9000))]
+                XCTAssertEqual(text(server.handlePacketPayload(jsonPacket("{\"fetch_all_solibs\":true,\"changed_since_generation\":1}"))), "{\"images\":[{\"load_address\":36864,\"mod_date\":0,\"pathname\":\"/usr/lib/c.dylib\"}],\"generation\":2,\"unloaded_images\":[32768]}")
+                XCTAssertEqual(text(server.handlePacketPayload(jsonPacket("{\"fetch_all_solibs\":true,\"changed_since_generation\":2}"))), "{\"images\":[],\"generation\":2,\"unloaded_images\":[]}")
+                XCTAssert(server.handlePacketPayload("jGetLoadedDynamicLibrariesInfos:").isInvalid)
+
+                debugger.loadedLibraries = [
+                    LoadedLibrary(path: "", loadAddress: Address(bitPattern: 0x555000), linkMapAddress: Address(bitPattern: 0x100), dynamicSectionAddress: Address(bitPattern: 0x555100)),
+                    LoadedLibrary(path: "/lib/libc.so.6", loadAddress: Address(bitPattern: 0x7f0000), linkMapAddress: Address(bitPattern: 0x200), dynamicSectionAddress: Address(bitPattern: 0x7f0100))
+                ]
+                let document = "<library-list-svr4 version=\"1.0\" main-lm=\"0x100\"><library name=\"/lib/libc.so.6\" lm=\"0x200\" l_addr=\"0x7f0000\" l_ld=\"0x7f0100\"/></library-list-svr4>"
+                XCTAssertEqual(text(server.handlePacketPayload("qXfer:libraries-svr4:read::0,1000")), "l" + document)
+                XCTAssertEqual(text(server.handlePacketPayload("qXfer:libraries-svr4:read::0,10")), "m" + String(document.characters.prefix(16)))
+                XCTAssertEqual(text(server.handlePacketPayload("qXfer:libraries-svr4:read::10,1000")), "l" + String(document.characters.dropFirst(16)))
+                XCTAssertEqual(text(server.handlePacketPayload("qXfer:libraries-svr4:read::1000,10")), "l")
+                XCTAssertEqual(text(server.handlePacketPayload("qXfer:libraries-svr4:read:changed-since-generation=3:0,1000")), "l<library-list-svr4 version=\"1.0\" main-lm=\"0x100\" generation=\"3\"></library-list-svr4>")
+                debugger.loadedLibraries.removeLast()
+                XCTAssertEqual(text(server.handlePacketPayload("qXfer:libraries-svr4:read:changed-since-generation=3:0,1000")), "l<library-list-svr4 version=\"1.0\" main-lm=\"0x100\" generation=\"4\"><unloaded lm=\"0x200\"/></library-list-svr4>")
+                XCTAssert(server.handlePacketPayload("qXfer:libraries-svr4:read::0").isInvalid)
+                XCTAssertEqual(server.handlePacketPayload("qXfer:libraries-svr4:read:start=0:0,10"), ResponseResult.error(.e01))
+            }
+
+            // Symbol lookups.
+            do {
+                let debugger = MockDebugger()
+                let server = DebugServer(debugger: debugger, writer: MockConnection())
+                func hex(_ name: String) -> String {
+                    return Array(name.utf8).hexString
+                }
+                let textSegment = LoadedSegment(name: "__TEXT", address: 0x1000, size: 0x2000, fileOffset: 0, fileSize: 0x2000, maxProtection: 5)
+                debugger.loadedLibraries = [LoadedLibrary(path: "/bin/a", loadAddress: Address(bitPattern: 0x1000), segments: [textSegment]), LoadedLibrary(path: "/lib/b", loadAddress: Address(bitPattern: 0x8000))]
+                debugger.librarySymbols = [
+                    Address(bitPattern: 0x1000): [Symbol(name: "main", address: Address(bitPattern: 0x1100)), Symbol(name: "start", address: Address(bitPattern: 0x1000))],
+                    Address(bitPattern: 0x8000): [Symbol(name: "malloc", address: Address(bitPattern: 0x8100), size: 0x20), Symbol(name: "free", address: Address(bitPattern: 0x8200), size: 0x10)]
+                ]
+                XCTAssertEqual(server.handlePacketPayload("qSymbolLookup:\(hex("main"));\(hex("free"));\(hex("nothing"))"), ResponseResult.response("1100;8200;"))
+                XCTAssertEqual(server.handlePacketPayload("qAddressLookup:fff,1000,10ff,1100,2fff,3000,8000,8110,8120,8200,820f,8210"), ResponseResult.response(";\(hex("start")):0;\(hex("start")):ff;\(hex("main")):0;\(hex("main")):1eff;;;\(hex("malloc")):10;;\(hex("free")):0;\(hex("free")):f;"))
+                XCTAssert(server.handlePacketPayload("qSymbolLookup:").isInvalid)
+                XCTAssert(server.handlePacketPayload("qSymbolLookup:6d6;").isInvalid)
+                XCTAssert(server.handlePacketPayload("qAddressLookup:").isInvalid)
+                XCTAssert(server.handlePacketPayload("qAddressLookup:10,").isInvalid)
+                XCTAssert(server.handlePacketPayload("qAddressLookup:10;").isInvalid)
+                // The index is rebuilt after the libraries change.
+                debugger.loadedLibraries.removeLast()
+                XCTAssertEqual(server.handlePacketPayload("qSymbolLookup:\(hex("main"));\(hex("free"))"), ResponseResult.response("1100;"))
+            }
+
+            // Backtraces.
+            do {
+                func jsonPacket(_ json: String) -> String {
+                    return "jBacktrace:" + String(String.UnicodeScalarView(Array(json.utf8).encodedBinaryData.map { UnicodeScalar($0) }))
+                }
+                func text(_ result: ResponseResult) -> String {
+                    guard case .binaryResponse(let bytes) = result else {
+                        XCTFail()
+                        return ""
+                    }
+                    return String(bytes: bytes.decodedBinaryData, encoding: .utf8) ?? ""
+                }
+                let debugger = MockDebugger()
+                let server = DebugServer(debugger: debugger, writer: MockConnection())
+                debugger.backtraces = [
+                    12: [Address(bitPattern: 0x1000), Address(bitPattern: 0x2000), Address(bitPattern: 0x3000)],
+                    13: [Address(bitPattern: 0x4000)]
+                ]
+                XCTAssertEqual(text(server.handlePacketPayload(jsonPacket("{}"))), "[{\"tid\":12,\"frames\":[4096,8192,12288]}]")
+                XCTAssertEqual(text(server.handlePacketPayload(jsonPacket("{\"threads\":[13,12,14],\"max_frames\":2}"))), "[{\"tid\":13,\"frames\":[16384]},{\"tid\":12,\"frames\":[4096,8192]},{\"tid\":14,\"frames\":[]}]")
+                XCTAssert(server.handlePacketPayload("jBacktrace:").isInvalid)
+                XCTAssert(server.handlePacketPayload(jsonPacket("[]")).isInvalid)
+            }
+
+            // Profiling.
+            do {
+                func text(_ result: ResponseResult) -> String {
+                    guard case .binaryResponse(let bytes) = result else {
+                        XCTFail()
+                        return ""
+                    }
+                    return String(bytes: bytes.decodedBinaryData, encoding: .utf8) ?? ""
+                }
+                let debugger = MockDebugger()
+                let server = DebugServer(debugger: debugger, writer: MockConnection())
+                XCTAssertEqual(server.handlePacketPayload("QStartProfiling:frequency:3e8;max-frames:20;"), ResponseResult.ok)
+                XCTAssertEqual(debugger.profilingOptions?.frequency, 1000)
+                XCTAssertEqual(debugger.profilingOptions?.maxFrames, 32)
+                XCTAssertEqual(server.handlePacketPayload("QStartProfiling:"), ResponseResult.ok)
+                XCTAssertEqual(debugger.profilingOptions?.frequency, 100)
+                XCTAssertEqual(debugger.profilingOptions?.maxFrames, 128)
+                XCTAssert(server.handlePacketPayload("QStartProfiling:rate:10;").isInvalid)
+                XCTAssert(server.handlePacketPayload("QStartProfiling:frequency;").isInvalid)
+                XCTAssertEqual(server.handlePacketPayload("QStopProfiling"), ResponseResult.ok)
+                XCTAssertNil(debugger.profilingOptions)
+
+                debugger.loadedLibraries = [LoadedLibrary(path: "/bin/a", loadAddress: Address(bitPattern: 0x1000))]
+                debugger.librarySymbols = [Address(bitPattern: 0x1000): [Symbol(name: "main", address: Address(bitPattern: 0x1100), size: 0x20), Symbol(name: "start", address: Address(bitPattern: 0x1000))]]
+                debugger.profile = StackProfile(stacks: [
+                    StackProfile.Stack(frames: [Address(bitPattern: 0x9000), Address(bitPattern: 0x1108)], sampleCount: 1),
+                    StackProfile.Stack(frames: [Address(bitPattern: 0x1104), Address(bitPattern: 0x1010)], sampleCount: 2)
+                ], samplingInterval: 10_000_000)
+                // The return addresses are looked up in the calling function.
+                let folded = "start;main 2\nmain;0x9000 1\n"
+                XCTAssertEqual(text(server.handlePacketPayload("qXfer:profile:read:folded:0,1000")), "l" + folded)
+                XCTAssertEqual(text(server.handlePacketPayload("qXfer:profile:read:folded:0,5")), "m" + String(folded.characters.prefix(5)))
+                XCTAssertEqual(text(server.handlePacketPayload("qXfer:profile:read:folded:5,1000")), "l" + String(folded.characters.dropFirst(5)))
+                guard case .binaryResponse(let pprof) = server.handlePacketPayload("qXfer:profile:read:pprof:0,1000") else {
+                    XCTFail()
+                    return
+                }
+                let document = pprof.decodedBinaryData
+                XCTAssertEqual(document.first, UInt8(ascii: "l"))
+                // The function names are in the string table.
+                for name in ["main", "start"] {
+                    let field = [0x32, UInt8(name.utf8.count)] + Array(name.utf8)
+                    XCTAssert((0...document.count - field.count).contains { Array(document[$0..<$0 + field.count]) == field })
+                }
+                XCTAssertEqual(server.handlePacketPayload("qXfer:profile:read:perf:0,10"), ResponseResult.error(.e01))
+                XCTAssert(server.handlePacketPayload("qXfer:profile:read:folded:0").isInvalid)
+            }
+
+            // Core files.
+            do {
+                let debugger = MockDebugger()
+                let server = DebugServer(debugger: debugger, writer: MockConnection())
+                let path = "/tmp/core.1"
+                XCTAssertEqual(server.handlePacketPayload("qSaveCore;path-hint:\(Array(path.utf8).hexString);elide-zero-pages:0;copy-threads:8;"), ResponseResult.response("core-path:\(Array(path.utf8).hexString);pause-ns:1234;written:3000;elided:1000;unreadable:0;"))
+                XCTAssertEqual(debugger.coreDumps.last?.path, path)
+                XCTAssertEqual(debugger.coreDumps.last?.options.elideZeroPages, false)
+                XCTAssertEqual(debugger.coreDumps.last?.options.copyThreadCount, 8)
+                guard case .response = server.handlePacketPayload("qSaveCore") else {
+                    XCTFail()
+                    return
+                }
+                XCTAssertEqual(debugger.coreDumps.last?.options.elideZeroPages, true)
+                XCTAssertEqual(debugger.coreDumps.count, 2)
+                XCTAssert(server.handlePacketPayload("qSaveCore;elide-zero-pages:2").isInvalid)
+                XCTAssert(server.handlePacketPayload("qSaveCore;copy-threads:0").isInvalid)
+                XCTAssert(server.handlePacketPayload("qSaveCore;path-hint:2f7").isInvalid)
+                XCTAssert(server.handlePacketPayload("qSaveCore;format:elf").isInvalid)
+                XCTAssertEqual(debugger.coreDumps.count, 2)
+            }
+
+            // Coverage.
+            do {
+                let debugger = MockDebugger()
+                let server = DebugServer(debugger: debugger, writer: MockConnection())
+                XCTAssertEqual(server.handlePacketPayload("QStartCoverage"), ResponseResult.error(.e01))
+                XCTAssertEqual(server.handlePacketPayload("QCoverageSites:1000,1010"), ResponseResult.ok)
+                XCTAssertEqual(server.handlePacketPayload("QCoverageSites:1020"), ResponseResult.ok)
+                XCTAssert(server.handlePacketPayload("QCoverageSites:1030,").isInvalid)
+                XCTAssert(server.handlePacketPayload("QCoverageSites:").isInvalid)
+                XCTAssertEqual(server.handlePacketPayload("QStartCoverage"), ResponseResult.ok)
+                XCTAssertEqual(debugger.coverageSites ?? [], [0x1000, 0x1010, 0x1020].map { Address(bitPattern: $0) })
+                // The sites are cleared by the start.
+                XCTAssertEqual(server.handlePacketPayload("QStartCoverage"), ResponseResult.error(.e01))
+                debugger.coverage = CoverageMap(siteCount: 12, words: [0x0A05])
+                XCTAssertEqual(server.handlePacketPayload("qXfer:coverage:read::0,1"), ResponseResult.binaryResponse(Array("m".utf8) + [0x05]))
+                XCTAssertEqual(server.handlePacketPayload("qXfer:coverage:read::1,10"), ResponseResult.binaryResponse(Array("l".utf8) + [0x0A]))
+                XCTAssertEqual(server.handlePacketPayload("qXfer:coverage:read::2,10"), ResponseResult.binaryResponse(Array("l".utf8)))
+                XCTAssert(server.handlePacketPayload("qXfer:coverage:read:0,1").isInvalid)
+                XCTAssertEqual(server.handlePacketPayload("QStopCoverage"), ResponseResult.ok)
+                XCTAssertNil(debugger.coverageSites)
+                XCTAssertEqual(debugger.coverage.coveredCount, 4)
+                XCTAssert(debugger.coverage.isCovered(2))
+                XCTAssertFalse(debugger.coverage.isCovered(4))
+            }
+
+            // Dirty pages.
+            do {
+                let debugger = MockDebugger()
+                let server = DebugServer(debugger: debugger, writer: MockConnection())
+                XCTAssertEqual(server.handlePacketPayload("QStartDirtyPageTracking:1000,4000;10000,1000"), ResponseResult.ok)
+                XCTAssertEqual(debugger.dirtyPageRanges ?? [], [AddressRange(start: Address(bitPattern: 0x1000), end: Address(bitPattern: 0x5000)), AddressRange(start: Address(bitPattern: 0x10000), end: Address(bitPattern: 0x11000))])
+                XCTAssert(server.handlePacketPayload("QStartDirtyPageTracking:1000,0").isInvalid)
+                XCTAssert(server.handlePacketPayload("QStartDirtyPageTracking:1000,4000;").isInvalid)
+                XCTAssertEqual(server.handlePacketPayload("qDirtyPageEpoch"), ResponseResult.response("2"))
+                XCTAssertEqual(server.handlePacketPayload("qDirtyPages:1000,a000,2"), ResponseResult.binaryResponse([0x7d, 0x03, 0x02]))
+                XCTAssert(debugger.dirtyPages?.range == AddressRange(start: Address(bitPattern: 0x1000), end: Address(bitPattern: 0xB000)))
+                XCTAssertEqual(debugger.dirtyPages?.epoch, 2)
+                XCTAssertEqual(server.handlePacketPayload("qDirtyPages:1000,a000,3"), ResponseResult.error(.e01))
+                XCTAssert(server.handlePacketPayload("qDirtyPages:1000,a000").isInvalid)
+                XCTAssert(server.handlePacketPayload("qDirtyPages:1000,0,1").isInvalid)
+                XCTAssertEqual(server.handlePacketPayload("QStopDirtyPageTracking"), ResponseResult.ok)
+                XCTAssertNil(debugger.dirtyPageRanges)
+                let map = DirtyPageMap(address: Address(bitPattern: 0x1000), pageSize: 0x1000, pageCount: 10, bytes: [0x23, 0x02])
+                XCTAssertEqual(map.dirtyPages, [0x1000, 0x2000, 0x6000, 0xA000].map { Address(bitPattern: $0) })
+            }
+
+            // Memory search.
+            do {
+                let debugger = MockDebugger()
+                let server = DebugServer(debugger: debugger, writer: MockConnection())
+                XCTAssertEqual(server.handlePacketPayload("qSearchMemory:1000,2000:0102"), ResponseResult.response("0"))
+                XCTAssert(debugger.memorySearches.last?.range == AddressRange(start: Address(bitPattern: 0x1000), end: Address(bitPattern: 0x3000)))
+                XCTAssertEqual(debugger.memorySearches.last?.pattern ?? [], [0x01, 0x02])
+                XCTAssertNil(debugger.memorySearches.last?.mask)
+                XCTAssertEqual(debugger.memorySearches.last?.maxMatches, 1)
+                debugger.searchMatches = [0x1010, 0x1800].map { Address(bitPattern: $0) }
+                XCTAssertEqual(server.handlePacketPayload("qSearchMemory:1000,2000,10:0102:ff0f"), ResponseResult.response("1,1010,1800"))
+                XCTAssertEqual(debugger.memorySearches.last?.mask ?? [], [0xFF, 0x0F])
+                XCTAssertEqual(debugger.memorySearches.last?.maxMatches, 16)
+                XCTAssertEqual(server.handlePacketPayload("qSearchMemory:1000,2000:0102"), ResponseResult.response("1,1010"))
+                XCTAssert(server.handlePacketPayload("qSearchMemory:1000,2000:010").isInvalid)
+                XCTAssert(server.handlePacketPayload("qSearchMemory:1000,2000:").isInvalid)
+                XCTAssert(server.handlePacketPayload("qSearchMemory:1000,2000:0102:ff").isInvalid)
+                XCTAssert(server.handlePacketPayload("qSearchMemory:1000,2000,0:0102").isInvalid)
+                XCTAssert(server.handlePacketPayload("qSearchMemory:1000:0102").isInvalid)
+                XCTAssertEqual(server.handlePacketPayload("qSearch:memory:1000;2000;\u{AB}}]"), ResponseResult.response("1,1010"))
+                XCTAssertEqual(debugger.memorySearches.last?.pattern ?? [], [0xAB, 0x7D])
+                XCTAssertEqual(debugger.memorySearches.last?.maxMatches, 1)
+                XCTAssert(server.handlePacketPayload("qSearch:memory:1000;2000;").isInvalid)
+                XCTAssertEqual(debugger.memorySearches.count, 4)
+                // The copy of the packet that follows its header is skipped.
+                let header = [UInt8]("qSearch:memory:1000;2000;".utf8)
+                for (i, byte) in header.enumerated() {
+                    debugger.bytes[i] = byte
+                }
+                debugger.expectedMemoryReads = [(0x1010 - UInt(header.count), header.count)]
+                XCTAssertEqual(server.handlePacketPayload("qSearch:memory:1000;2000;\u{AB}}]"), ResponseResult.response("1,1800"))
+                XCTAssert(debugger.memorySearches.last?.range == AddressRange(start: Address(bitPattern: 0x1011), end: Address(bitPattern: 0x3000)))
+                XCTAssert(debugger.expectedMemoryReads.isEmpty)
+                // The ranges that wrap around the end of the address space are rejected.
+                XCTAssert(server.handlePacketPayload("qSearch:memory:1000;ffffffffffffffff;\u{AB}").isInvalid)
+                XCTAssert(server.handlePacketPayload("qSearchMemory:ffffffffffff0000,20000:0102").isInvalid)
+                XCTAssertEqual(debugger.memorySearches.count, 6)
+            }
+
+            // Checksums.
+            do {
+                let debugger = MockDebugger()
+                let server = DebugServer(debugger: debugger, writer: MockConnection())
+                XCTAssertEqual(server.handlePacketPayload("qCRC:1000,9"), ResponseResult.response("C376e6e7"))
+                XCTAssert(debugger.checksumRanges.last == AddressRange(start: Address(bitPattern: 0x1000), end: Address(bitPattern: 0x1009)))
+                XCTAssert(server.handlePacketPayload("qCRC:1000").isInvalid)
+                XCTAssertEqual(server.handlePacketPayload("qMemoryDigests:1000,2800,1000"), ResponseResult.response("e3069283,x,0000001a"))
+                XCTAssert(debugger.checksumRanges.last == AddressRange(start: Address(bitPattern: 0x1000), end: Address(bitPattern: 0x3800)))
+                XCTAssert(server.handlePacketPayload("qMemoryDigests:1000,2800,0").isInvalid)
+                XCTAssert(server.handlePacketPayload("qMemoryDigests:1000,2800").isInvalid)
+                XCTAssert(server.handlePacketPayload("qMemoryDigests:0,100000000,1000").isInvalid)
+                // The ranges that wrap around the end of the address space are rejected.
+                XCTAssert(server.handlePacketPayload("qCRC:1000,ffffffffffffffff").isInvalid)
+                XCTAssert(server.handlePacketPayload("qCRC:0,ffffffffffffffff").isInvalid)
+                XCTAssert(server.handlePacketPayload("qMemoryDigests:ffffffffffff0000,20000,1000").isInvalid)
+                XCTAssertEqual(debugger.checksumRanges.count, 2)
+            }
+
+            // Released stops.
+            do {
+                let debugger = MockDebugger()
+                let server = DebugServer(debugger: debugger, writer: MockConnection())
+                let stack = (0..<0x100).map { UInt8(0xff - $0) }
+                let stop = ThreadStopSnapshot(threadID: 0x31, stopInfo: ThreadStopInfo(signalNumber: 5, dispatchQueueAddress: nil, machInfo: nil), registerContext: registerContext([0x11, 0x22, 0x33]), instructionPointer: Address(bitPattern: 0x4000), stackAddress: Address(bitPattern: 0x7f00), stack: stack)
+                // An all-stop client would resume the running threads, so the stop isn't reported.
+                try server.sendStopNotificationForReleasedStop(stop)
+                debugger.expectedMemoryReads = [(0x7f10, 4)]
+                XCTAssertEqual(server.handlePacketPayload("m7f10,4"), ResponseResult.response("00010203"))
+                XCTAssert(debugger.expectedMemoryReads.isEmpty)
+                XCTAssertEqual(server.handlePacketPayload("QNonStop:1"), ResponseResult.ok)
+                try server.sendStopNotificationForReleasedStop(stop)
+                XCTAssertEqual(server.handlePacketPayload("qC"), ResponseResult.response("QC31"))
+                // The registers and the stack window are served from the snapshot.
+                XCTAssertEqual(server.handlePacketPayload("p0"), ResponseResult.response("1100000000000000"))
+                XCTAssertEqual(server.handlePacketPayload("p2"), ResponseResult.response("3300000000000000"))
+                XCTAssertEqual(server.handlePacketPayload("p3"), ResponseResult.error(.e32))
+                XCTAssertEqual(server.handlePacketPayload("g"), ResponseResult.response("110000000000000022000000000000003300000000000000"))
+                XCTAssertEqual(server.handlePacketPayload("P0=0000000000000000"), ResponseResult.error(.e32))
+                XCTAssertEqual(server.handlePacketPayload("m7f10,4"), ResponseResult.response("efeeedec"))
+                // The rest of the memory is read from the process, with the stack window laid over it.
+                debugger.expectedMemoryReads = [(0x1004, 4), (0x7ffe, 4)]
+                XCTAssertEqual(server.handlePacketPayload("m1004,4"), ResponseResult.response("00010203"))
+                XCTAssertEqual(server.handlePacketPayload("m7ffe,4"), ResponseResult.response("01000203"))
+                XCTAssert(debugger.expectedMemoryReads.isEmpty)
+                // The stop is dropped when the process is resumed.
+                let packet = [UInt8]("$c#63".utf8)
+                guard case .resumeThreads? = try server.processPacketsUntilResumeOrExit(packet[0..<packet.count]) else {
+                    XCTFail()
+                    return
+                }
+                debugger.expectedMemoryReads = [(0x7f10, 4)]
+                XCTAssertEqual(server.handlePacketPayload("m7f10,4"), ResponseResult.response("00010203"))
+                XCTAssert(debugger.expectedMemoryReads.isEmpty)
+            } catch {
+                XCTFail()
+            }
+
+            // Observer sessions.
+            do {
+                let debugger = MockDebugger(expectedMemoryReads: [(0x1000, 4096)], expectedRegisterReads: [(0xc, 0, 1, 0x1234)])
+                let sessions = DebugServerSessions(debugger: debugger)
+                guard let controller = sessions.addControllingSession(writer: MockConnection()) else {
+                    XCTFail()
+                    return
+                }
+                XCTAssertNil(sessions.addControllingSession(writer: MockConnection()))
+                let observer = sessions.addObserverSession(writer: MockConnection())
+                // The memory and the registers are read once for all of the sessions after the process stops.
+                do {
+                    try sessions.sendStopNotificationForThread(0xc)
+                } catch {
+                    XCTFail()
+                }
+                XCTAssertEqual(controller.handlePacketPayload("m1004,4"), ResponseResult.response("04050607"))
+                XCTAssertEqual(observer.handlePacketPayload("m1004,4"), ResponseResult.response("04050607"))
+                XCTAssertEqual(observer.handlePacketPayload("x1ffe,2"), ResponseResult.binaryResponse([0xFE, 0xFF]))
+                XCTAssertEqual(controller.handlePacketPayload("p0"), ResponseResult.response("3412000000000000"))
+                XCTAssertEqual(observer.handlePacketPayload("p0"), ResponseResult.response("3412000000000000"))
+                XCTAssert(debugger.expectedMemoryReads.isEmpty)
+                XCTAssert(debugger.expectedRegisterReads.isEmpty)
+                // The observers can't modify or resume the process.
+                XCTAssertEqual(observer.handlePacketPayload("M1004,1:00"), ResponseResult.error(.e01))
+                XCTAssertEqual(observer.handleBinaryPacketPayload(Array("X1004,1:".utf8) + [0]), ResponseResult.error(.e01))
+                XCTAssertEqual(observer.handlePacketPayload("P0=0000000000000000"), ResponseResult.error(.e01))
+                XCTAssertEqual(observer.handlePacketPayload("c"), ResponseResult.error(.e01))
+                XCTAssertEqual(observer.handlePacketPayload("QNonStop:1"), ResponseResult.error(.e01))
+                XCTAssertEqual(observer.handlePacketPayload("k"), ResponseResult.error(.e01))
+                do {
+                    let packet = [UInt8(0x03)]
+                    guard case .none = try observer.processPacketsUntilResumeOrExit(packet[0..<1]) else {
+                        XCTFail()
+                        return
+                    }
+                    XCTAssertEqual(debugger.interruptCounter, 0)
+                } catch {
+                    XCTFail()
+                }
+                // The settings belong to the sessions.
+                XCTAssertEqual(observer.handlePacketPayload("QThreadSuffixSupported"), ResponseResult.ok)
+                XCTAssert(observer.handlePacketPayload("p0").isInvalid)
+                XCTAssertEqual(observer.handlePacketPayload("p0;thread:c;"), ResponseResult.response("3412000000000000"))
+                XCTAssertEqual(controller.handlePacketPayload("p0"), ResponseResult.response("3412000000000000"))
+                // The snapshot is dropped when the process is resumed, and nothing is cached while it runs.
+                do {
+                    let packet = [UInt8]("$c#63".utf8)
+                    guard case .resumeThreads? = try controller.processPacketsUntilResumeOrExit(packet[0..<packet.count]) else {
+                        XCTFail()
+                        return
+                    }
+                } catch {
+                    XCTFail()
+                }
+                // The mock returns its bytes from the start of the read.
+                debugger.expectedMemoryReads = [(0x1004, 4), (0x1004, 4)]
+                XCTAssertEqual(observer.handlePacketPayload("m1004,4"), ResponseResult.response("00010203"))
+                XCTAssertEqual(observer.handlePacketPayload("m1004,4"), ResponseResult.response("00010203"))
+                XCTAssert(debugger.expectedMemoryReads.isEmpty)
+                sessions.removeSession(controller)
+                XCTAssertNil(sessions.controllingSession)
+                XCTAssertNotNil(sessions.addControllingSession(writer: MockConnection()))
+            }
+
+            // Non-stop mode
+            do {
+                class RecordingConnection: MockConnection {
+                    var output = ""
+                    override func write(data: ArraySlice<UInt8>) throws {
+                        for byte in data {
+                            UnicodeScalar(byte).write(to: &output)
+                        }
+                    }
+                }
+                let connection = RecordingConnection()
+                let debugger = StopMockDebugger(expectedThreadStopInfos: [
+                    (0x20, ThreadStopInfo(signalNumber: 5, dispatchQueueAddress: nil, machInfo: nil))
+                ])
+                let server = DebugServer(debugger: debugger, writer: connection)
+                XCTAssertFalse(server.isNonStopMode)
+                XCTAssertEqual(server.handlePacketPayload("QNonStop:1"), ResponseResult.ok)
+                XCTAssert(server.isNonStopMode)
+                XCTAssert(debugger.nonStopMode)
+                XCTAssert(server.handlePacketPayload("QNonStop:2").isInvalid)
+                XCTAssertEqual(server.handlePacketPayload("?"), ResponseResult.ok)
+
+                try server.sendStopNotificationForThread(0x20)
+                XCTAssert(connection.output.hasPrefix("%Stop:T05thread:20;00:"))
+                XCTAssertEqual(connection.output.characters.filter { $0 == "#" }.count, 1)
+                // The second stop is queued until the first one is acknowledged.
+                connection.output = ""
+                try server.sendStopNotificationForThread(0x21)
+                XCTAssertEqual(connection.output, "")
+                XCTAssertEqual(server.handlePacketPayload("vStopped"), ResponseResult.stopReplyForThread(0x21))
+                XCTAssertEqual(server.handlePacketPayload("vStopped"), ResponseResult.ok)
+                XCTAssertEqual(server.handlePacketPayload("?"), ResponseResult.stopReplyForThread(0x20))
+                XCTAssertEqual(server.handlePacketPayload("vStopped"), ResponseResult.stopReplyForThread(0x21))
+                XCTAssertEqual(server.handlePacketPayload("vStopped"), ResponseResult.ok)
+
+                XCTAssertEqual(server.handlePacketPayload("vCont?"), ResponseResult.response("vCont;c;s;t;r;f"))
+                // vCont is acknowledged with OK and only resumes the given threads.
+                if case .resume(let actions, let defaultAction) = server.handlePacketPayload("vCont;t:21") {
+                    XCTAssertEqual(actions, [ThreadResumeEntry(thread: .id(0x21), action: .stop, address: nil)])
+                    XCTAssertEqual(defaultAction, ThreadResumeAction.none)
+                } else {
+                    XCTFail()
+                }
+                let packet = [UInt8]("$vCont;c:20#44".utf8)
+                guard case .resumeThreads(_, let defaultAction)? = try server.processPacketsUntilResumeOrExit(packet[0..<packet.count]) else {
+                    XCTFail()
+                    return
+                }
+                XCTAssertEqual(defaultAction, ThreadResumeAction.none)
+                XCTAssertEqual(connection.output, "+$OK#9a")
+                XCTAssertEqual(server.handlePacketPayload("?"), ResponseResult.stopReplyForThread(0x21))
+            } catch {
+                XCTFail()
+            }
             #endif
         }
     }
@@ -799,7 +2027,7 @@ public func == (lhs: ThreadReference, rhs: ThreadReference) -> Bool {
 extension ThreadResumeEntry: Equatable { }
 
 public func == (lhs: ThreadResumeEntry, rhs: ThreadResumeEntry) -> Bool {
-    return lhs.thread == rhs.thread && lhs.action == rhs.action && lhs.address == rhs.address
+    return lhs.thread == rhs.thread && lhs.action == rhs.action && lhs.address == rhs.address && lhs.range == rhs.range
 }
 
 extension RemoteDebuggingPacket: Equatable { }
@@ -841,3 +2069,26 @@ extension ResponseResult {
     }
 }
 
+#if os(Linux)
+extension SelfdeTests {
+    static var allTests: [(String, (SelfdeTests) -> () throws -> Void)] {
+        return [
+            ("testLinuxDebugger", testLinuxDebugger),
+            ("testLinuxDebuggerTracer", testLinuxDebuggerTracer),
+            ("testLinuxSignalDisposition", testLinuxSignalDisposition),
+            ("testMemoryPermissionBug", testMemoryPermissionBug),
+            ("testRemoteDebuggingProtocol", testRemoteDebuggingProtocol),
+            ("testRemoteDebuggingPacketExtraction", testRemoteDebuggingPacketExtraction),
+            ("testRemoteDebuggingProtocolBinaryEncoding", testRemoteDebuggingProtocolBinaryEncoding),
+            ("testHexRegisterContextPerformance", testHexRegisterContextPerformance),
+            ("testBinaryRegisterContextPerformance", testBinaryRegisterContextPerformance),
+            ("testDebuggingUtils", testDebuggingUtils),
+            ("testMemoryArena", testMemoryArena),
+            ("testInstructionDecoderX86_64", testInstructionDecoderX86_64),
+            ("testUnwinderX86_64", testUnwinderX86_64),
+            ("testStackProfile", testStackProfile),
+            ("testRemoteDebuggingPacketHandling", testRemoteDebuggingPacketHandling),
+        ]
+    }
+}
+#endif